@@ -0,0 +1,131 @@
+// Times BTAaverageChannels on 640x480 UInt16 distance channels (with invalidation codes) against the previous implementation,
+// which kept a separately allocated histogram per pixel and summed in double
+
+#include <bta.h>
+#include <bta_ext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define X_RES       640
+#define Y_RES       480
+#define REPEATS     10
+
+
+static double getMillis() {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+
+static BTA_Status averagePrevious(BTA_Channel **channels, int channelsLen, float minValidPixelPercentage, BTA_Channel **result) {
+    int res = X_RES * Y_RES;
+    double *sums = (double *)calloc(res, sizeof(double));
+    uint16_t **invalidsCounts = (uint16_t **)malloc(res * sizeof(uint16_t *));
+    if (!sums || !invalidsCounts) {
+        free(sums);
+        free(invalidsCounts);
+        return BTA_StatusOutOfMemory;
+    }
+    for (int xy = 0; xy < res; xy++) {
+        invalidsCounts[xy] = (uint16_t *)calloc(11, sizeof(uint16_t));
+    }
+    BTA_Status status = BTAcloneChannelEmpty(channels[0], result);
+    if (status == BTA_StatusOk) {
+        for (int chInd = 0; chInd < channelsLen; chInd++) {
+            for (int xy = 0; xy < res; xy++) {
+                uint16_t v = ((uint16_t *)channels[chInd]->data)[xy];
+                if (v < 10) {
+                    invalidsCounts[xy][v]++;
+                    invalidsCounts[xy][10]++;
+                }
+                else {
+                    sums[xy] += v;
+                }
+            }
+        }
+        uint16_t *dst = (uint16_t *)(*result)->data;
+        for (int xy = 0; xy < res; xy++) {
+            if (invalidsCounts[xy][10] >= channelsLen * minValidPixelPercentage / 100) {
+                uint16_t max = 0;
+                for (uint8_t i = 0; i < 10; i++) {
+                    if (invalidsCounts[xy][i] > max) {
+                        dst[xy] = i;
+                        max = invalidsCounts[xy][i];
+                    }
+                }
+            }
+            else {
+                dst[xy] = (uint16_t)(sums[xy] / (channelsLen - invalidsCounts[xy][10]) + 0.5);
+            }
+        }
+    }
+    for (int xy = 0; xy < res; xy++) {
+        free(invalidsCounts[xy]);
+    }
+    free(invalidsCounts);
+    free(sums);
+    return status;
+}
+
+
+static BTA_Channel *createChannel(unsigned seed) {
+    BTA_Channel *channel = (BTA_Channel *)calloc(1, sizeof(BTA_Channel));
+    uint16_t *data = (uint16_t *)malloc(X_RES * Y_RES * sizeof(uint16_t));
+    if (!channel || !data) {
+        exit(1);
+    }
+    srand(seed);
+    for (int xy = 0; xy < X_RES * Y_RES; xy++) {
+        // About 5% invalid
+        data[xy] = rand() % 20 ? (uint16_t)(500 + rand() % 5000) : (uint16_t)(rand() % 10);
+    }
+    channel->id = BTA_ChannelIdDistance;
+    channel->xRes = X_RES;
+    channel->yRes = Y_RES;
+    channel->dataFormat = BTA_DataFormatUInt16;
+    channel->unit = BTA_UnitMillimeter;
+    channel->data = (uint8_t *)data;
+    channel->dataLen = X_RES * Y_RES * sizeof(uint16_t);
+    return channel;
+}
+
+
+static double timeAverage(BTA_Status (*average)(BTA_Channel **, int, float, BTA_Channel **), BTA_Channel **channels, int channelsLen) {
+    double best = 1e9;
+    for (int i = 0; i < REPEATS; i++) {
+        BTA_Channel *result = 0;
+        double start = getMillis();
+        if (average(channels, channelsLen, 50, &result) != BTA_StatusOk) {
+            printf("averaging failed\n");
+            exit(1);
+        }
+        double duration = getMillis() - start;
+        best = duration < best ? duration : best;
+        BTAfreeChannel(&result);
+    }
+    return best;
+}
+
+
+int main() {
+    BTA_Channel *channels[64];
+    for (int i = 0; i < 64; i++) {
+        channels[i] = createChannel(i + 1);
+    }
+    printf("%dx%d UInt16 distance, best of %d [ms]\n", X_RES, Y_RES, REPEATS);
+    printf("frames   previous   BTAaverageChannels\n");
+    int channelsLens[3] = { 4, 16, 64 };
+    for (int i = 0; i < 3; i++) {
+        double previous = timeAverage(averagePrevious, channels, channelsLens[i]);
+        double current = timeAverage(BTAaverageChannels, channels, channelsLens[i]);
+        printf("%6d %10.2f %20.2f\n", channelsLens[i], previous, current);
+    }
+    for (int i = 0; i < 64; i++) {
+        BTAfreeChannel(&channels[i]);
+    }
+    return 0;
+}
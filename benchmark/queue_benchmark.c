@@ -0,0 +1,208 @@
+// Times BVQ with 1, 2 and 8 producers and as many consumers against the previous implementation,
+// a ring guarded by one mutex with a semaphore counting the items
+
+#include <bta.h>
+#include <bvq_queue.h>
+#include <bta_atomic.h>
+#include <pthread_helper.h>
+#include <timing_helper.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+#define QUEUE_LENGTH    50
+#define ITEMS_LEN       400000
+#define REPEATS         3
+
+
+static double getMillis() {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+
+typedef struct PreviousQueue {
+    uint32_t queueLength;
+    void **queue;
+    uint32_t queuePos;
+    uint32_t queueCount;
+    void *semQueueCount;
+    void *queueMutex;
+} PreviousQueue;
+
+
+static void *previousInit(void) {
+    PreviousQueue *inst = (PreviousQueue *)calloc(1, sizeof(PreviousQueue));
+    if (!inst) {
+        exit(1);
+    }
+    inst->queueLength = QUEUE_LENGTH;
+    inst->queue = (void **)malloc(QUEUE_LENGTH * sizeof(void *));
+    if (!inst->queue || BTAinitSemaphore(&inst->semQueueCount, 0, 0) != BTA_StatusOk || BTAinitMutex(&inst->queueMutex) != BTA_StatusOk) {
+        exit(1);
+    }
+    return inst;
+}
+
+
+static void previousClose(void *handle) {
+    PreviousQueue *inst = (PreviousQueue *)handle;
+    BTAcloseMutex(inst->queueMutex);
+    BTAcloseSemaphore(inst->semQueueCount);
+    free(inst->queue);
+    free(inst);
+}
+
+
+// BTA_QueueModeAvoidDrop
+static BTA_Status previousEnqueue(void *handle, void *item) {
+    PreviousQueue *inst = (PreviousQueue *)handle;
+    BTAlockMutex(inst->queueMutex);
+    if (inst->queueCount < inst->queueLength) {
+        inst->queuePos++;
+        if (inst->queuePos == inst->queueLength) {
+            inst->queuePos = 0;
+        }
+        inst->queue[inst->queuePos] = item;
+        BTApostSemaphore(inst->semQueueCount);
+        inst->queueCount++;
+        BTAunlockMutex(inst->queueMutex);
+        return BTA_StatusOk;
+    }
+    BTAunlockMutex(inst->queueMutex);
+    return BTA_StatusOutOfMemory;
+}
+
+
+static BTA_Status previousDequeue(void *handle, void **item, uint32_t msecsTimeout) {
+    PreviousQueue *inst = (PreviousQueue *)handle;
+    BTA_Status status = BTAwaitSemaphoreTimed(inst->semQueueCount, msecsTimeout);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    BTAlockMutex(inst->queueMutex);
+    int32_t index = inst->queuePos - inst->queueCount + 1;
+    if (index < 0) {
+        index += inst->queueLength;
+    }
+    *item = inst->queue[index];
+    inst->queueCount--;
+    BTAunlockMutex(inst->queueMutex);
+    return BTA_StatusOk;
+}
+
+
+static void *currentInit(void) {
+    BVQ_QueueHandle handle;
+    if (BVQinit(QUEUE_LENGTH, BTA_QueueModeAvoidDrop, 0, 0, &handle) != BTA_StatusOk) {
+        exit(1);
+    }
+    return handle;
+}
+
+
+static void currentClose(void *handle) {
+    BVQclose(&handle);
+}
+
+
+static BTA_Status currentEnqueue(void *handle, void *item) {
+    return BVQenqueue(handle, item);
+}
+
+
+static BTA_Status currentDequeue(void *handle, void **item, uint32_t msecsTimeout) {
+    return BVQdequeue(handle, item, msecsTimeout);
+}
+
+
+typedef struct QueueImpl {
+    void *(*init)(void);
+    void (*close)(void *handle);
+    BTA_Status (*enqueue)(void *handle, void *item);
+    BTA_Status (*dequeue)(void *handle, void **item, uint32_t msecsTimeout);
+} QueueImpl;
+
+
+typedef struct Run {
+    const QueueImpl *impl;
+    void *handle;
+    int itemsPerProducer;
+    BTA_Atomic32 consumedCount;
+    BTA_Atomic32 checksum;
+} Run;
+
+
+static void *produce(void *arg) {
+    Run *run = (Run *)arg;
+    for (int i = 1; i <= run->itemsPerProducer; i++) {
+        // The queue is full, let a consumer catch up
+        while (run->impl->enqueue(run->handle, (void *)(uintptr_t)i) != BTA_StatusOk) {
+            BTAmsleep(0);
+        }
+    }
+    return 0;
+}
+
+
+static void *consume(void *arg) {
+    Run *run = (Run *)arg;
+    while (BTAatomicLoad(&run->consumedCount) < ITEMS_LEN) {
+        void *item;
+        if (run->impl->dequeue(run->handle, &item, 10) == BTA_StatusOk) {
+            BTAatomicFetchAdd(&run->checksum, (uint32_t)(uintptr_t)item);
+            BTAatomicFetchAdd(&run->consumedCount, 1);
+        }
+    }
+    return 0;
+}
+
+
+static double timeQueue(const QueueImpl *impl, int threadsLen) {
+    double best = 1e9;
+    for (int r = 0; r < REPEATS; r++) {
+        Run run;
+        run.impl = impl;
+        run.handle = impl->init();
+        run.itemsPerProducer = ITEMS_LEN / threadsLen;
+        run.consumedCount = 0;
+        run.checksum = 0;
+        void *threads[16];
+        double start = getMillis();
+        for (int i = 0; i < threadsLen; i++) {
+            if (BTAcreateThread(&threads[2 * i], consume, &run) != BTA_StatusOk || BTAcreateThread(&threads[2 * i + 1], produce, &run) != BTA_StatusOk) {
+                printf("creating threads failed\n");
+                exit(1);
+            }
+        }
+        for (int i = 0; i < 2 * threadsLen; i++) {
+            BTAjoinThread(threads[i]);
+        }
+        double duration = getMillis() - start;
+        uint64_t n = (uint64_t)run.itemsPerProducer;
+        if (run.checksum != (uint32_t)(threadsLen * (n * (n + 1) / 2))) {
+            printf("items lost\n");
+            exit(1);
+        }
+        impl->close(run.handle);
+        best = duration < best ? duration : best;
+    }
+    return best;
+}
+
+
+int main() {
+    const QueueImpl previous = { previousInit, previousClose, previousEnqueue, previousDequeue };
+    const QueueImpl current = { currentInit, currentClose, currentEnqueue, currentDequeue };
+    printf("%d items through a queue of length %d, best of %d [ms]\n", ITEMS_LEN, QUEUE_LENGTH, REPEATS);
+    printf("producers/consumers   previous   BVQ\n");
+    int threadsLens[3] = { 1, 2, 8 };
+    for (int i = 0; i < 3; i++) {
+        double previousMillis = timeQueue(&previous, threadsLens[i]);
+        double currentMillis = timeQueue(&current, threadsLens[i]);
+        printf("%19d %10.2f %5.2f\n", threadsLens[i], previousMillis, currentMillis);
+    }
+    return 0;
+}
@@ -5,6 +5,7 @@
 
 #include <bta_status.h>
 #include <pthread_helper.h>
+#include <timing_helper.h>
 #include "bcb_circular_buffer.h"
 
 
@@ -15,6 +16,9 @@ struct BCB_CircularBuffer {
     uint32_t max;
     uint8_t volatile full;
     void *mutex;
+    void *condItemAdded;
+    int waitersCount;           // threads in BCBgetTimed. Guarded by mutex like interrupted
+    uint8_t interrupted;
 };
 
 
@@ -46,6 +50,13 @@ BTA_Status BCBinit(uint32_t size, BCB_Handle *handle) {
         free(inst);
         return status;
     }
+    status = BTAinitCondition(&inst->condItemAdded);
+    if (status != BTA_StatusOk) {
+        BTAcloseMutex(inst->mutex);
+        free(inst->buffer);
+        free(inst);
+        return status;
+    }
     *handle = inst;
     return BTA_StatusOk;
 }
@@ -56,6 +67,7 @@ BTA_Status BCBfree(BCB_Handle handle, BTA_Status(*freeItem)(void **)) {
         return BTA_StatusOk;
     }
     void *mutex = handle->mutex;
+    void *condItemAdded = handle->condItemAdded;
     BTAlockMutex(mutex);
     BTA_Status status = reset(handle, freeItem);
     if (status != BTA_StatusOk) {
@@ -67,6 +79,7 @@ BTA_Status BCBfree(BCB_Handle handle, BTA_Status(*freeItem)(void **)) {
     free(handle);
     handle = 0;
     BTAunlockMutex(mutex);
+    BTAcloseCondition(condItemAdded);
     status = BTAcloseMutex(mutex);
     if (status != BTA_StatusOk) {
         return status;
@@ -180,6 +193,9 @@ BTA_Status BCBput(BCB_Handle handle, void *data) {
     handle->head = (handle->head + 1) % handle->max;
     // We mark full because we will advance tail on the next time
     handle->full = (handle->head == handle->tail);
+    if (handle->waitersCount) {
+        BTAsignalCondition(handle->condItemAdded);
+    }
     BTAunlockMutex(handle->mutex);
     return BTA_StatusOk;
 }
@@ -212,3 +228,45 @@ BTA_Status BCBget(BCB_Handle handle, void **data) {
     BTAunlockMutex(handle->mutex);
     return BTA_StatusOk;
 }
+
+
+BTA_Status BCBgetTimed(BCB_Handle handle, void **data, uint32_t msecsTimeout) {
+    if (!handle) return BTA_StatusInvalidParameter;
+    uint64_t endTime = BTAgetTickCount64() + msecsTimeout;
+    BTA_Status status = BTA_StatusOk;
+    BTAlockMutex(handle->mutex);
+    while (get(handle, data) != BTA_StatusOk) {
+        if (handle->interrupted) {
+            status = BTA_StatusTimeOut;
+            break;
+        }
+        uint32_t msecsRemaining = 0;
+        if (msecsTimeout) {
+            uint64_t now = BTAgetTickCount64();
+            if (now >= endTime) {
+                status = BTA_StatusTimeOut;
+                break;
+            }
+            msecsRemaining = endTime - now > INT32_MAX ? INT32_MAX : (uint32_t)(endTime - now);
+        }
+        handle->waitersCount++;
+        status = BTAwaitConditionTimed(handle->condItemAdded, handle->mutex, (int)msecsRemaining);
+        handle->waitersCount--;
+        if (status != BTA_StatusOk && status != BTA_StatusTimeOut) {
+            break;
+        }
+        status = BTA_StatusOk;
+    }
+    BTAunlockMutex(handle->mutex);
+    return status;
+}
+
+
+BTA_Status BCBinterrupt(BCB_Handle handle) {
+    if (!handle) return BTA_StatusInvalidParameter;
+    BTAlockMutex(handle->mutex);
+    handle->interrupted = 1;
+    BTAbroadcastCondition(handle->condItemAdded);
+    BTAunlockMutex(handle->mutex);
+    return BTA_StatusOk;
+}
@@ -52,4 +52,11 @@ BTA_Status BCBput(BCB_Handle handle, void *data);
 /// Returns 0 on success, -1 if the buffer is empty
 BTA_Status BCBget(BCB_Handle handle, void **data);
 
+/// Like BCBget, but waits up to msecsTimeout (0: endlessly) for a value to be put
+/// Returns BTA_StatusTimeOut if the buffer stayed empty or BCBinterrupt was called
+BTA_Status BCBgetTimed(BCB_Handle handle, void **data, uint32_t msecsTimeout);
+
+/// Wakes the threads waiting in BCBgetTimed, and from now on BCBgetTimed doesn't wait anymore. For shutting down
+BTA_Status BCBinterrupt(BCB_Handle handle);
+
 #endif
@@ -0,0 +1,421 @@
+#include "binning.h"
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+
+#define BTA_BINNING_FACTOR_MAX      4
+
+#define ROUND_INT(a)    ((a) >= 0 ? (a) + 0.5 : (a) - 0.5)
+#define ROUND_NONE(a)   (a)
+
+
+typedef enum BinningKind {
+    BinningKindDecimate,
+    BinningKindMean,
+    BinningKindMedian,
+    BinningKindMin,
+} BinningKind;
+
+
+// Valid values are within [validMin, validMax], NaN is always invalid.
+// The invalidation conventions are the same as in BTAaverageChannels. Returns 0 if the data format is not supported
+static uint8_t getValidRange(BTA_ChannelId id, BTA_DataFormat dataFormat, double *validMin, double *validMax) {
+    switch (dataFormat) {
+    case BTA_DataFormatUInt8:
+        *validMin = 0;
+        *validMax = UINT8_MAX;
+        break;
+    case BTA_DataFormatUInt16:
+        *validMin = 0;
+        *validMax = UINT16_MAX;
+        break;
+    case BTA_DataFormatUInt32:
+        *validMin = 0;
+        *validMax = UINT32_MAX;
+        break;
+    case BTA_DataFormatSInt16:
+        *validMin = INT16_MIN;
+        *validMax = INT16_MAX;
+        break;
+    case BTA_DataFormatSInt32:
+        *validMin = INT32_MIN;
+        *validMax = INT32_MAX;
+        break;
+    case BTA_DataFormatFloat32:
+        *validMin = -DBL_MAX;
+        *validMax = DBL_MAX;
+        return 1;
+    case BTA_DataFormatSInt16Mlx1C11S:
+    case BTA_DataFormatSInt16Mlx12S:
+    case BTA_DataFormatUInt16Mlx1C11U:
+    case BTA_DataFormatUInt16Mlx12U:
+        // Packed raw values, only decimated (see isPacked)
+        *validMin = 0;
+        *validMax = UINT16_MAX;
+        return 1;
+    default:
+        return 0;
+    }
+    if (id == BTA_ChannelIdDistance || id == BTA_ChannelIdZ) {
+        // The lowest 10 values are invalidation codes
+        *validMin += 10;
+    }
+    else if (id == BTA_ChannelIdAmplitude) {
+        *validMax -= 1;
+    }
+    return 1;
+}
+
+
+static BinningKind getBinningKind(BTA_ChannelId id, BTA_BinningMode depthMode) {
+    switch (id) {
+    case BTA_ChannelIdDistance:
+    case BTA_ChannelIdZ:
+        switch (depthMode) {
+        case BTA_BinningModeMedian:
+            return BinningKindMedian;
+        case BTA_BinningModeMin:
+            return BinningKindMin;
+        default:
+            return BinningKindMean;
+        }
+    case BTA_ChannelIdAmplitude:
+    case BTA_ChannelIdX:
+    case BTA_ChannelIdY:
+        return BinningKindMean;
+    case BTA_ChannelIdConfidence:
+        return BinningKindMin;
+    default:
+        return BinningKindDecimate;
+    }
+}
+
+
+// Writes the result of block (xd, yd) to data[yd * xResDst + xd]. That is never behind a pixel of a block still to be read, so this works in place
+#define BINNING_KERNEL(name, T, ROUND)                                                                                          \
+static void name(T *data, int xRes, int xResDst, int yResDst, int factor, BinningKind kind, double validMin, double validMax) { \
+    double values[BTA_BINNING_FACTOR_MAX * BTA_BINNING_FACTOR_MAX];                                                             \
+    for (int yd = 0; yd < yResDst; yd++) {                                                                                      \
+        for (int xd = 0; xd < xResDst; xd++) {                                                                                  \
+            T *block = data + yd * factor * xRes + xd * factor;                                                                 \
+            T result = block[0];                                                                                                \
+            if (kind != BinningKindDecimate) {                                                                                  \
+                int count = 0;                                                                                                  \
+                for (int by = 0; by < factor; by++) {                                                                           \
+                    for (int bx = 0; bx < factor; bx++) {                                                                       \
+                        T v = block[by * xRes + bx];                                                                            \
+                        if (v >= validMin && v <= validMax) {                                                                   \
+                            values[count++] = (double)v;                                                                        \
+                        }                                                                                                       \
+                    }                                                                                                           \
+                }                                                                                                               \
+                if (count) {                                                                                                    \
+                    result = (T)ROUND(reduce(values, count, kind));                                                             \
+                }                                                                                                               \
+            }                                                                                                                   \
+            data[yd * xResDst + xd] = result;                                                                                   \
+        }                                                                                                                       \
+    }                                                                                                                           \
+}
+
+
+static double reduce(double *values, int count, BinningKind kind) {
+    double result = values[0];
+    switch (kind) {
+    case BinningKindMean:
+        for (int i = 1; i < count; i++) {
+            result += values[i];
+        }
+        return result / count;
+    case BinningKindMin:
+        for (int i = 1; i < count; i++) {
+            if (values[i] < result) {
+                result = values[i];
+            }
+        }
+        return result;
+    case BinningKindMedian:
+        // At most 16 values, insertion sort
+        for (int i = 1; i < count; i++) {
+            double v = values[i];
+            int j = i;
+            for (; j > 0 && values[j - 1] > v; j--) {
+                values[j] = values[j - 1];
+            }
+            values[j] = v;
+        }
+        return values[(count - 1) / 2];
+    default:
+        return result;
+    }
+}
+
+
+BINNING_KERNEL(binUInt8, uint8_t, ROUND_INT)
+BINNING_KERNEL(binUInt16, uint16_t, ROUND_INT)
+BINNING_KERNEL(binUInt32, uint32_t, ROUND_INT)
+BINNING_KERNEL(binSInt16, int16_t, ROUND_INT)
+BINNING_KERNEL(binSInt32, int32_t, ROUND_INT)
+BINNING_KERNEL(binFloat32, float, ROUND_NONE)
+
+
+// For min and median: the position within the block of the pixel selected by its value (the lower median for an even count)
+static int selectOffset(double *values, int *offsets, int count, BinningKind kind) {
+    int selected = 0;
+    if (kind == BinningKindMin) {
+        for (int i = 1; i < count; i++) {
+            if (values[i] < values[selected]) {
+                selected = i;
+            }
+        }
+        return offsets[selected];
+    }
+    for (int i = 1; i < count; i++) {
+        double v = values[i];
+        int offset = offsets[i];
+        int j = i;
+        for (; j > 0 && values[j - 1] > v; j--) {
+            values[j] = values[j - 1];
+            offsets[j] = offsets[j - 1];
+        }
+        values[j] = v;
+        offsets[j] = offset;
+    }
+    return offsets[(count - 1) / 2];
+}
+
+
+// X, Y and Z of a block are taken from the same pixels: those with a valid Z. With min and median, X and Y are those of the pixel selected by Z,
+// so that a binned point is a point of the block and not pulled towards the origin by invalid pixels
+#define BINNING_XYZ_KERNEL(name, T, ROUND)                                                                                      \
+static void name(T *dataX, T *dataY, T *dataZ, int xRes, int xResDst, int yResDst, int factor, BinningKind kind, double validMin, double validMax) { \
+    double values[BTA_BINNING_FACTOR_MAX * BTA_BINNING_FACTOR_MAX];                                                             \
+    int offsets[BTA_BINNING_FACTOR_MAX * BTA_BINNING_FACTOR_MAX];                                                               \
+    for (int yd = 0; yd < yResDst; yd++) {                                                                                      \
+        for (int xd = 0; xd < xResDst; xd++) {                                                                                  \
+            int blockStart = yd * factor * xRes + xd * factor;                                                                  \
+            T x = dataX[blockStart];                                                                                            \
+            T y = dataY[blockStart];                                                                                            \
+            T z = dataZ[blockStart];                                                                                            \
+            double sumX = 0, sumY = 0, sumZ = 0;                                                                                \
+            int count = 0;                                                                                                      \
+            for (int by = 0; by < factor; by++) {                                                                               \
+                for (int bx = 0; bx < factor; bx++) {                                                                           \
+                    int offset = blockStart + by * xRes + bx;                                                                   \
+                    T v = dataZ[offset];                                                                                        \
+                    if (v >= validMin && v <= validMax) {                                                                       \
+                        sumX += dataX[offset];                                                                                  \
+                        sumY += dataY[offset];                                                                                  \
+                        sumZ += v;                                                                                              \
+                        values[count] = (double)v;                                                                              \
+                        offsets[count++] = offset;                                                                              \
+                    }                                                                                                           \
+                }                                                                                                               \
+            }                                                                                                                   \
+            if (count && kind == BinningKindMean) {                                                                             \
+                x = (T)ROUND(sumX / count);                                                                                     \
+                y = (T)ROUND(sumY / count);                                                                                     \
+                z = (T)ROUND(sumZ / count);                                                                                     \
+            }                                                                                                                   \
+            else if (count) {                                                                                                   \
+                int offset = selectOffset(values, offsets, count, kind);                                                        \
+                x = dataX[offset];                                                                                              \
+                y = dataY[offset];                                                                                              \
+                z = dataZ[offset];                                                                                              \
+            }                                                                                                                   \
+            int xyDst = yd * xResDst + xd;                                                                                      \
+            dataX[xyDst] = x;                                                                                                   \
+            dataY[xyDst] = y;                                                                                                   \
+            dataZ[xyDst] = z;                                                                                                   \
+        }                                                                                                                       \
+    }                                                                                                                           \
+}
+
+
+BINNING_XYZ_KERNEL(binXYZSInt16, int16_t, ROUND_INT)
+BINNING_XYZ_KERNEL(binXYZSInt32, int32_t, ROUND_INT)
+BINNING_XYZ_KERNEL(binXYZFloat32, float, ROUND_NONE)
+
+
+// Returns 1 if channel holds one value per pixel and is large enough for factor
+static uint8_t isPacked(BTA_DataFormat dataFormat) {
+    return dataFormat == BTA_DataFormatSInt16Mlx1C11S || dataFormat == BTA_DataFormatSInt16Mlx12S || dataFormat == BTA_DataFormatUInt16Mlx1C11U || dataFormat == BTA_DataFormatUInt16Mlx12U;
+}
+
+
+static uint8_t isBinnable(BTA_Channel *channel, uint8_t factor) {
+    uint32_t bytesPerPixel = channel->dataFormat & 0xf;
+    return channel->data && channel->xRes >= factor && channel->yRes >= factor && channel->dataLen == (uint32_t)channel->xRes * channel->yRes * bytesPerPixel;
+}
+
+
+static void shrinkChannel(BTA_Channel *channel, uint8_t factor) {
+    uint32_t bytesPerPixel = channel->dataFormat & 0xf;
+    channel->xRes = channel->xRes / factor;
+    channel->yRes = channel->yRes / factor;
+    channel->dataLen = channel->xRes * channel->yRes * bytesPerPixel;
+    uint8_t *dataShrunk = (uint8_t *)realloc(channel->data, channel->dataLen);
+    if (dataShrunk) {
+        channel->data = dataShrunk;
+    }
+}
+
+
+// Bins the first X, Y and Z channels of frame together if they match. Returns 1 if it did
+static uint8_t binCartesianChannels(BTA_Frame *frame, uint8_t factor, BTA_BinningMode depthMode, BTA_Channel **binned) {
+    BTA_Channel *channelX = 0, *channelY = 0, *channelZ = 0;
+    for (int chInd = 0; chInd < frame->channelsLen; chInd++) {
+        BTA_Channel *channel = frame->channels[chInd];
+        if (channel->id == BTA_ChannelIdX && !channelX) channelX = channel;
+        if (channel->id == BTA_ChannelIdY && !channelY) channelY = channel;
+        if (channel->id == BTA_ChannelIdZ && !channelZ) channelZ = channel;
+    }
+    if (!channelX || !channelY || !channelZ || !isBinnable(channelX, factor) || !isBinnable(channelY, factor) || !isBinnable(channelZ, factor)) {
+        return 0;
+    }
+    if (channelX->xRes != channelZ->xRes || channelX->yRes != channelZ->yRes || channelX->dataFormat != channelZ->dataFormat ||
+        channelY->xRes != channelZ->xRes || channelY->yRes != channelZ->yRes || channelY->dataFormat != channelZ->dataFormat ||
+        channelX->lensIndex != channelZ->lensIndex || channelY->lensIndex != channelZ->lensIndex) {
+        return 0;
+    }
+    double validMin, validMax;
+    if (!getValidRange(BTA_ChannelIdZ, channelZ->dataFormat, &validMin, &validMax)) {
+        return 0;
+    }
+    int xRes = channelZ->xRes;
+    int xResDst = channelZ->xRes / factor;
+    int yResDst = channelZ->yRes / factor;
+    BinningKind kind = getBinningKind(BTA_ChannelIdZ, depthMode);
+    switch (channelZ->dataFormat) {
+    case BTA_DataFormatSInt16:
+        binXYZSInt16((int16_t *)channelX->data, (int16_t *)channelY->data, (int16_t *)channelZ->data, xRes, xResDst, yResDst, factor, kind, validMin, validMax);
+        break;
+    case BTA_DataFormatSInt32:
+        binXYZSInt32((int32_t *)channelX->data, (int32_t *)channelY->data, (int32_t *)channelZ->data, xRes, xResDst, yResDst, factor, kind, validMin, validMax);
+        break;
+    case BTA_DataFormatFloat32:
+        binXYZFloat32((float *)channelX->data, (float *)channelY->data, (float *)channelZ->data, xRes, xResDst, yResDst, factor, kind, validMin, validMax);
+        break;
+    default:
+        return 0;
+    }
+    shrinkChannel(channelX, factor);
+    shrinkChannel(channelY, factor);
+    shrinkChannel(channelZ, factor);
+    binned[0] = channelX;
+    binned[1] = channelY;
+    binned[2] = channelZ;
+    return 1;
+}
+
+
+BTA_Status BTAbinningApply(BTA_Frame *frame, uint8_t factor, BTA_BinningMode depthMode) {
+    if (!frame || (factor != 1 && factor != 2 && factor != 4)) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (factor == 1) {
+        return BTA_StatusOk;
+    }
+    BTA_Channel *binned[3] = { 0 };
+    binCartesianChannels(frame, factor, depthMode, binned);
+    for (int chInd = 0; chInd < frame->channelsLen; chInd++) {
+        BTA_Channel *channel = frame->channels[chInd];
+        double validMin, validMax;
+        if (channel == binned[0] || channel == binned[1] || channel == binned[2]) {
+            continue;
+        }
+        if (!channel->data || channel->id == BTA_ChannelIdColor || !getValidRange(channel->id, channel->dataFormat, &validMin, &validMax)) {
+            continue;
+        }
+        if (!isBinnable(channel, factor)) {
+            // Too small, or not one value per pixel (interleaved)
+            continue;
+        }
+        int xResDst = channel->xRes / factor;
+        int yResDst = channel->yRes / factor;
+        BinningKind kind = getBinningKind(channel->id, depthMode);
+        BTA_DataFormat dataFormat = channel->dataFormat;
+        if (isPacked(dataFormat)) {
+            // A mean of packed values means nothing, but keeping the full resolution would leave the frame with channels of two resolutions
+            kind = BinningKindDecimate;
+            dataFormat = BTA_DataFormatUInt16;
+        }
+        switch (dataFormat) {
+        case BTA_DataFormatUInt8:
+            binUInt8((uint8_t *)channel->data, channel->xRes, xResDst, yResDst, factor, kind, validMin, validMax);
+            break;
+        case BTA_DataFormatUInt16:
+            binUInt16((uint16_t *)channel->data, channel->xRes, xResDst, yResDst, factor, kind, validMin, validMax);
+            break;
+        case BTA_DataFormatUInt32:
+            binUInt32((uint32_t *)channel->data, channel->xRes, xResDst, yResDst, factor, kind, validMin, validMax);
+            break;
+        case BTA_DataFormatSInt16:
+            binSInt16((int16_t *)channel->data, channel->xRes, xResDst, yResDst, factor, kind, validMin, validMax);
+            break;
+        case BTA_DataFormatSInt32:
+            binSInt32((int32_t *)channel->data, channel->xRes, xResDst, yResDst, factor, kind, validMin, validMax);
+            break;
+        case BTA_DataFormatFloat32:
+            binFloat32((float *)channel->data, channel->xRes, xResDst, yResDst, factor, kind, validMin, validMax);
+            break;
+        default:
+            continue;
+        }
+        shrinkChannel(channel, factor);
+    }
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAbinningLensVectors(const BTA_LensVectors *lensVectors, uint8_t factor, BTA_LensVectors **lensVectorsBinned) {
+    if (!lensVectors || !lensVectorsBinned || (factor != 2 && factor != 4) || !lensVectors->vectorsX || !lensVectors->vectorsY || !lensVectors->vectorsZ) {
+        return BTA_StatusInvalidParameter;
+    }
+    int xRes = lensVectors->xRes;
+    int xResDst = lensVectors->xRes / factor;
+    int yResDst = lensVectors->yRes / factor;
+    if (!xResDst || !yResDst) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTA_LensVectors *lv = (BTA_LensVectors *)calloc(1, sizeof(BTA_LensVectors));
+    if (!lv) {
+        return BTA_StatusOutOfMemory;
+    }
+    lv->lensIndex = lensVectors->lensIndex;
+    lv->lensId = lensVectors->lensId;
+    lv->xRes = (uint16_t)xResDst;
+    lv->yRes = (uint16_t)yResDst;
+    lv->vectorsX = (float *)malloc(xResDst * yResDst * sizeof(float));
+    lv->vectorsY = (float *)malloc(xResDst * yResDst * sizeof(float));
+    lv->vectorsZ = (float *)malloc(xResDst * yResDst * sizeof(float));
+    if (!lv->vectorsX || !lv->vectorsY || !lv->vectorsZ) {
+        BTAfreeLensVectors(lv);
+        return BTA_StatusOutOfMemory;
+    }
+    for (int yd = 0; yd < yResDst; yd++) {
+        for (int xd = 0; xd < xResDst; xd++) {
+            double x = 0, y = 0, z = 0, length = 0;
+            for (int by = 0; by < factor; by++) {
+                for (int bx = 0; bx < factor; bx++) {
+                    int xy = (yd * factor + by) * xRes + xd * factor + bx;
+                    x += lensVectors->vectorsX[xy];
+                    y += lensVectors->vectorsY[xy];
+                    z += lensVectors->vectorsZ[xy];
+                    length += sqrt((double)lensVectors->vectorsX[xy] * lensVectors->vectorsX[xy] + (double)lensVectors->vectorsY[xy] * lensVectors->vectorsY[xy] + (double)lensVectors->vectorsZ[xy] * lensVectors->vectorsZ[xy]);
+                }
+            }
+            // The mean of directions is shorter than they are, restore the length
+            double lengthMean = sqrt(x * x + y * y + z * z);
+            double scale = lengthMean > 0 ? length / (factor * factor) / lengthMean : 0;
+            int xyDst = yd * xResDst + xd;
+            lv->vectorsX[xyDst] = (float)(x * scale);
+            lv->vectorsY[xyDst] = (float)(y * scale);
+            lv->vectorsZ[xyDst] = (float)(z * scale);
+        }
+    }
+    *lensVectorsBinned = lv;
+    return BTA_StatusOk;
+}
@@ -0,0 +1,25 @@
+#ifndef BINNING_H_INCLUDED
+#define BINNING_H_INCLUDED
+
+#include <bta.h>
+
+
+typedef enum BTA_BinningMode {
+    BTA_BinningModeMean = 0,        ///< Mean of the valid pixels of a block
+    BTA_BinningModeMedian = 1,      ///< Median of the valid pixels of a block (the lower one for an even count)
+    BTA_BinningModeMin = 2,         ///< Nearest valid pixel of a block
+} BTA_BinningMode;
+
+
+// Reduces the resolution of the ToF channels in frame by factor (2 or 4) in both directions, in place.
+// Distance and Z are binned with depthMode, amplitude with the mean, confidence with the minimum, other ToF channels (including the packed Mlx raw formats) are decimated.
+// Only valid pixels contribute to a block, a block without valid pixels keeps the invalidation code of its upper left pixel.
+// X, Y and Z (SInt16, SInt32 or Float32, same resolution) are binned together: X and Y use the pixels with a valid Z and, for median and min,
+// are those of the pixel Z selects. X and Y without a matching Z are binned with the mean.
+// Rows and columns that don't fill a whole block are dropped. Color channels are left untouched
+BTA_Status BTAbinningApply(BTA_Frame *frame, uint8_t factor, BTA_BinningMode depthMode);
+// Lens vectors for the binned resolution: the mean direction of each block, with the mean length of the block's vectors
+BTA_Status BTAbinningLensVectors(const BTA_LensVectors *lensVectors, uint8_t factor, BTA_LensVectors **lensVectorsBinned);
+
+
+#endif
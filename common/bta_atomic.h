@@ -0,0 +1,54 @@
+#ifndef BTA_ATOMIC_H_INCLUDED
+#define BTA_ATOMIC_H_INCLUDED
+
+#include <stdint.h>
+
+// Minimal 32 bit and pointer atomics for the lock-free structures, plus 64 bit counters. Loads have acquire, stores release semantics.
+// Exchange, compare-exchange, fetch-add and the fence are sequentially consistent
+
+#ifdef _MSC_VER
+#   include <intrin.h>
+    typedef volatile long BTA_Atomic32;
+    typedef volatile __int64 BTA_Atomic64;
+#   define BTAatomicLoad(p)                         ((uint32_t)_InterlockedOr((BTA_Atomic32 *)(p), 0))
+#   define BTAatomicStore(p, v)                     ((void)_InterlockedExchange((p), (long)(v)))
+#   define BTAatomicExchange(p, v)                  ((uint32_t)_InterlockedExchange((p), (long)(v)))
+#   define BTAatomicCompareExchange(p, expected, desired)  (_InterlockedCompareExchange((p), (long)(desired), (long)(expected)) == (long)(expected))
+#   define BTAatomicFetchAdd(p, v)                  ((uint32_t)_InterlockedExchangeAdd((p), (long)(v)))
+#   define BTAatomicExchange64(p, v)                ((uint64_t)_InterlockedExchange64((p), (__int64)(v)))
+#   define BTAatomicFetchAdd64(p, v)                ((uint64_t)_InterlockedExchangeAdd64((p), (__int64)(v)))
+#   define BTAatomicLoadPointer(p)                  _InterlockedCompareExchangePointer((void *volatile *)(p), 0, 0)
+#   define BTAatomicExchangePointer(p, v)           _InterlockedExchangePointer((void *volatile *)(p), (v))
+#   define BTAatomicCompareExchangePointer(p, expected, desired)  (_InterlockedCompareExchangePointer((void *volatile *)(p), (desired), (expected)) == (expected))
+    // Interlocked operations are full barriers
+    static __inline void BTAatomicFence(void) {
+        long dummy = 0;
+        _InterlockedOr(&dummy, 0);
+    }
+#else
+    typedef volatile uint32_t BTA_Atomic32;
+    typedef volatile uint64_t BTA_Atomic64;
+#   define BTAatomicLoad(p)                         __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#   define BTAatomicStore(p, v)                     __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#   define BTAatomicExchange(p, v)                  __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#   define BTAatomicCompareExchange(p, expected, desired)  __sync_bool_compare_and_swap((p), (expected), (desired))
+#   define BTAatomicFetchAdd(p, v)                  __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#   define BTAatomicExchange64(p, v)                __atomic_exchange_n((p), (uint64_t)(v), __ATOMIC_SEQ_CST)
+#   define BTAatomicFetchAdd64(p, v)                __atomic_fetch_add((p), (uint64_t)(v), __ATOMIC_SEQ_CST)
+#   define BTAatomicLoadPointer(p)                  __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#   define BTAatomicExchangePointer(p, v)           __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#   define BTAatomicCompareExchangePointer(p, expected, desired)  __sync_bool_compare_and_swap((p), (expected), (desired))
+#   define BTAatomicFence()                         __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+
+// Raises *p to value if it is lower (for high-water marks)
+static __inline void BTAatomicMax(BTA_Atomic32 *p, uint32_t value) {
+    uint32_t current = BTAatomicLoad(p);
+    while (value > current && !BTAatomicCompareExchange(p, current, value)) {
+        current = BTAatomicLoad(p);
+    }
+}
+
+
+#endif
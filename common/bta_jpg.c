@@ -1,4 +1,5 @@
 #include "bta_jpg.h"
+#include <bta_helper.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,111 +7,186 @@
 #include <assert.h>
 
 #ifndef BTA_WO_LIBJPEG
+#include <setjmp.h>
 #include <jpeglib.h>
 
+
+// libjpeg's default error handler calls exit(). This one jumps back into the decoder instead
+typedef struct BTA_JpgErrorMgr {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmpBuffer;
+} BTA_JpgErrorMgr;
+
+
+typedef struct BTA_JpgDecoder {
+    struct jpeg_decompress_struct cinfo;
+    BTA_JpgErrorMgr err;
+} BTA_JpgDecoder;
+
+
 static void jpgOutputMessage(j_common_ptr cinfo)
 {
-    /* cinfo->err really points to a my_error_mgr struct, so coerce pointer */
-    //my_error_ptr myerr = (my_error_ptr)cinfo->err;
-    /* Always display the message. */
-    /* We could postpone this until after returning, if we chose. */
-    //(*cinfo->err->output_message) (cinfo);
-    /* Return control to the setjmp point */
-    //longjmp(myerr->setjmp_buffer, 1);
+    // Warnings from corrupt data are not reported, the decoder fails in jpgErrorExit instead
+}
+
+
+static void jpgErrorExit(j_common_ptr cinfo)
+{
+    BTA_JpgErrorMgr *err = (BTA_JpgErrorMgr *)cinfo->err;
+    longjmp(err->setjmpBuffer, 1);
 }
 #endif
 
 
-static BTA_Status BTAdecodeJpgToRgb24(uint8_t *dataIn, uint32_t dataInLen, uint8_t *dataOut, uint32_t *dataOutLen, BTA_DataFormat *dataFormat) {
+BTA_Status BTAjpegInit(BTA_JpgInst **inst, BTA_InfoEventInst *infoEventInst) {
+    if (!inst) {
+        return BTA_StatusInvalidParameter;
+    }
 #   ifndef BTA_WO_LIBJPEG
-    int err;
-    if (!dataIn || !dataOut) {
+    *inst = (BTA_JpgInst *)calloc(1, sizeof(BTA_JpgInst));
+    if (!*inst) {
+        return BTA_StatusOutOfMemory;
+    }
+    (*inst)->infoEventInst = infoEventInst;
+    BTA_JpgDecoder *decoder = (BTA_JpgDecoder *)calloc(1, sizeof(BTA_JpgDecoder));
+    if (!decoder) {
+        free(*inst);
+        *inst = 0;
+        return BTA_StatusOutOfMemory;
+    }
+    decoder->cinfo.err = jpeg_std_error(&decoder->err.pub);
+    decoder->err.pub.output_message = jpgOutputMessage;
+    decoder->err.pub.error_exit = jpgErrorExit;
+    if (setjmp(decoder->err.setjmpBuffer)) {
+        // jpeg_create_decompress only fails if out of memory
+        free(decoder);
+        free(*inst);
+        *inst = 0;
+        return BTA_StatusOutOfMemory;
+    }
+    jpeg_create_decompress(&decoder->cinfo);
+    (*inst)->decoder = decoder;
+    return BTA_StatusOk;
+#   else
+    return BTA_StatusNotSupported;
+#   endif
+}
+
+
+BTA_Status BTAjpegClose(BTA_JpgInst **inst) {
+    if (!inst) {
         return BTA_StatusInvalidParameter;
     }
-    if (!dataInLen) {
-        // Empty image, nothing to decode
+    if (!*inst) {
+        // not even opened
         return BTA_StatusOk;
     }
-    struct jpeg_decompress_struct cinfo;
-    memset(&cinfo, 0, sizeof(struct jpeg_decompress_struct));
-    struct jpeg_error_mgr jerr;
-    cinfo.err = jpeg_std_error(&jerr);
-    cinfo.err->output_message = jpgOutputMessage;
-    jpeg_create_decompress(&cinfo);
-    jpeg_mem_src(&cinfo, (unsigned char *)dataIn, (unsigned long)dataInLen);
-    err = jpeg_read_header(&cinfo, 1);
-    if (err != JPEG_HEADER_OK) {
+#   ifndef BTA_WO_LIBJPEG
+    BTA_JpgDecoder *decoder = (BTA_JpgDecoder *)(*inst)->decoder;
+    if (decoder) {
+        jpeg_destroy_decompress(&decoder->cinfo);
+        free(decoder);
+    }
+#   endif
+    free((*inst)->rowPointers);
+    free(*inst);
+    *inst = 0;
+    return BTA_StatusOk;
+}
+
+
+#ifndef BTA_WO_LIBJPEG
+// Decodes the jpeg data of the channel and replaces it by the Rgb24 image. The scanlines are written directly into the new
+// channel buffer, as many rows per call as libjpeg is able to deliver
+static BTA_Status decodeJpgToRgb24(BTA_JpgInst *inst, BTA_Channel *channel, uint8_t scaleDenom) {
+    BTA_JpgDecoder *decoder = (BTA_JpgDecoder *)inst->decoder;
+    struct jpeg_decompress_struct *cinfo = &decoder->cinfo;
+    // Modified after setjmp and needed after longjmp
+    uint8_t * volatile dataOut = 0;
+    if (setjmp(decoder->err.setjmpBuffer)) {
+        // Resets the decompressor so that it is ready for the next image
+        jpeg_abort_decompress(cinfo);
+        free(dataOut);
         return BTA_StatusRuntimeError;
     }
-    err = jpeg_start_decompress(&cinfo);
-    if (!err) {
+    jpeg_mem_src(cinfo, (unsigned char *)channel->data, (unsigned long)channel->dataLen);
+    if (jpeg_read_header(cinfo, TRUE) != JPEG_HEADER_OK) {
+        jpeg_abort_decompress(cinfo);
         return BTA_StatusRuntimeError;
     }
-    int rowStride = cinfo.output_width * cinfo.output_components;
-    if (!rowStride) {
+    cinfo->out_color_space = JCS_RGB;
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = scaleDenom;
+    if (!jpeg_start_decompress(cinfo)) {
+        jpeg_abort_decompress(cinfo);
         return BTA_StatusRuntimeError;
     }
-    JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, rowStride, 1);
-    if (!buffer) {
+    uint32_t rowStride = cinfo->output_width * cinfo->output_components;
+    if (cinfo->output_components != 3 || !rowStride || !cinfo->output_height) {
+        jpeg_abort_decompress(cinfo);
         return BTA_StatusRuntimeError;
     }
-    int bytesCopied = 0;
-    while (cinfo.output_scanline < cinfo.output_height) {
-        err = jpeg_read_scanlines(&cinfo, buffer, 1);
-        if (!err) {
-            return BTA_StatusRuntimeError;
-        }
-        int bytesToCopy = MTHmin(rowStride, (int)(*dataOutLen - bytesCopied));
-        memcpy(dataOut + bytesCopied, buffer[0], bytesToCopy);
-        bytesCopied += bytesToCopy;
+    uint32_t dataOutLen = rowStride * cinfo->output_height;
+    dataOut = (uint8_t *)malloc(dataOutLen);
+    if (!dataOut) {
+        jpeg_abort_decompress(cinfo);
+        return BTA_StatusOutOfMemory;
     }
-    err = jpeg_finish_decompress(&cinfo);
-    if (!err) {
-        return BTA_StatusRuntimeError;
+    if (inst->rowPointersLen < cinfo->output_height) {
+        uint8_t **rowPointers = (uint8_t **)realloc(inst->rowPointers, cinfo->output_height * sizeof(uint8_t *));
+        if (!rowPointers) {
+            jpeg_abort_decompress(cinfo);
+            free(dataOut);
+            return BTA_StatusOutOfMemory;
+        }
+        inst->rowPointers = rowPointers;
+        inst->rowPointersLen = cinfo->output_height;
     }
-    *dataOutLen = bytesCopied;
-    if (cinfo.output_components == 3 && cinfo.out_color_space == JCS_RGB) {
-        *dataFormat = BTA_DataFormatRgb24;
+    for (uint32_t y = 0; y < cinfo->output_height; y++) {
+        inst->rowPointers[y] = dataOut + y * rowStride;
     }
-    else {
-        assert(0);
-        *dataFormat = BTA_DataFormatUnknown;
+    while (cinfo->output_scanline < cinfo->output_height) {
+        JDIMENSION linesRead = jpeg_read_scanlines(cinfo, (JSAMPARRAY)(inst->rowPointers + cinfo->output_scanline), cinfo->output_height - cinfo->output_scanline);
+        if (!linesRead) {
+            jpeg_abort_decompress(cinfo);
+            free(dataOut);
+            return BTA_StatusRuntimeError;
+        }
     }
-    jpeg_destroy_decompress(&cinfo);
+    uint16_t xRes = (uint16_t)cinfo->output_width;
+    uint16_t yRes = (uint16_t)cinfo->output_height;
+    jpeg_finish_decompress(cinfo);
+    free(channel->data);
+    channel->data = dataOut;
+    channel->dataLen = dataOutLen;
+    channel->dataFormat = BTA_DataFormatRgb24;
+    channel->xRes = xRes;
+    channel->yRes = yRes;
     return BTA_StatusOk;
-#   else
-    //memset(dataOut, 0, dataOutLen);
-    //memcpy(dataOut, dataIn, dataInLen);
-    //return BTA_StatusOk;
-    return BTA_StatusNotSupported;
-#   endif
 }
+#endif
 
 
-BTA_Status BTAjpegFrameToRgb24(BTA_Frame *frame) {
-    if (!frame) {
+BTA_Status BTAjpegFrameToRgb24(BTA_JpgInst *inst, BTA_Frame *frame, uint8_t scaleDenom) {
+    if (!inst || !frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (scaleDenom != 1 && scaleDenom != 2 && scaleDenom != 4 && scaleDenom != 8) {
         return BTA_StatusInvalidParameter;
     }
 #   ifndef BTA_WO_LIBJPEG
     for (int chInd = 0; chInd < frame->channelsLen; chInd++) {
         BTA_Channel *channel = frame->channels[chInd];
         if (channel->dataFormat == BTA_DataFormatJpeg) {
-            uint32_t dataOutLen = channel->xRes * channel->yRes * 3;
-            uint8_t *dataOut = (uint8_t *)malloc(dataOutLen);
-            if (!dataOut) {
-                return BTA_StatusOutOfMemory;
+            if (!channel->data || !channel->dataLen) {
+                // Empty image, nothing to decode
+                continue;
             }
-            BTA_DataFormat dataFormat;
-            BTA_Status status = BTAdecodeJpgToRgb24((uint8_t *)channel->data, channel->dataLen, dataOut, &dataOutLen, &dataFormat);
+            BTA_Status status = decodeJpgToRgb24(inst, channel, scaleDenom);
             if (status != BTA_StatusOk) {
-                free(dataOut);
-                dataOut = 0;
+                BTAinfoEventHelper(inst->infoEventInst, VERBOSE_DEBUG, status, "BTAjpegFrameToRgb24: Failed to decode channel %d", chInd);
                 continue;
             }
-            free(channel->data);
-            channel->dataLen = dataOutLen;
-            channel->data = dataOut;
-            channel->dataFormat = dataFormat;
         }
     }
     return BTA_StatusOk;
@@ -118,4 +194,3 @@ BTA_Status BTAjpegFrameToRgb24(BTA_Frame *frame) {
     return BTA_StatusNotSupported;
 #   endif
 }
-
@@ -28,8 +28,23 @@
 //#include <bta_helper.h>
 
 struct BTA_Frame;
+struct BTA_InfoEventInst;
 
-BTA_Status BTAjpegFrameToRgb24(BTA_Frame *frame);
+
+// Holds one libjpeg decompressor which is reused for every channel of every frame (created once per handle).
+// An instance must not be used by more than one thread at a time, threads decoding in parallel need an instance each
+typedef struct BTA_JpgInst {
+    void *decoder;                  ///< BTA_JpgDecoder, opaque here in order not to expose jpeglib.h
+    uint8_t **rowPointers;          ///< Pointers into the destination buffer, so that libjpeg writes directly into the channel
+    uint32_t rowPointersLen;
+    struct BTA_InfoEventInst *infoEventInst;
+} BTA_JpgInst;
+
+
+BTA_Status BTAjpegInit(BTA_JpgInst **inst, struct BTA_InfoEventInst *infoEventInst);
+BTA_Status BTAjpegClose(BTA_JpgInst **inst);
+// scaleDenom 1, 2, 4 or 8: decodes at full or reduced resolution using libjpeg's DCT domain scaling. xRes and yRes of the channel are updated
+BTA_Status BTAjpegFrameToRgb24(BTA_JpgInst *inst, BTA_Frame *frame, uint8_t scaleDenom);
 
 #endif
 
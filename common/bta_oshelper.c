@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
 
 #include "bta_oshelper.h"
 #include "timing_helper.h"
@@ -19,6 +20,7 @@
 #   include <iostream>
 #else
 #   include <sys/ioctl.h>
+#   include <sys/stat.h>
 #   include <unistd.h>
 #   include <time.h>
 #   include <unistd.h>
@@ -362,6 +364,49 @@ BTA_Status BTAgetCwd(uint8_t *cwd, int cwdLen) {
 }
 
 
+BTA_Status BTAmkdir(const char *path) {
+    if (!path) {
+        return BTA_StatusInvalidParameter;
+    }
+    #ifdef PLAT_WINDOWS
+        int result = _mkdir(path);
+    #else
+        int result = mkdir(path, 0755);
+    #endif
+    if (result && errno != EEXIST) {
+        return BTA_StatusRuntimeError;
+    }
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTArenameReplace(const char *oldPath, const char *newPath) {
+    if (!oldPath || !newPath) {
+        return BTA_StatusInvalidParameter;
+    }
+    #ifdef PLAT_WINDOWS
+        // rename fails on Windows if newPath exists
+        if (!MoveFileExA(oldPath, newPath, MOVEFILE_REPLACE_EXISTING)) {
+            return BTA_StatusRuntimeError;
+        }
+    #else
+        if (rename(oldPath, newPath)) {
+            return BTA_StatusRuntimeError;
+        }
+    #endif
+    return BTA_StatusOk;
+}
+
+
+uint32_t BTAgetProcessId() {
+    #ifdef PLAT_WINDOWS
+        return (uint32_t)GetCurrentProcessId();
+    #else
+        return (uint32_t)getpid();
+    #endif
+}
+
+
 BTA_Status BTAfwriteCsv(const char* filename, const char **headersX, const char **headersY, int *data, int xRes, int yRes) {
     void *file;
     BTA_Status status = BTAfopen(filename, "w+", &file);
@@ -54,6 +54,10 @@ BTA_Status BTAfwrite(void *file, void *buffer, uint32_t bufferLen, uint32_t *byt
 BTA_Status BTAfreadLine(void *file, char *line, uint32_t lineLen);
 
 BTA_Status BTAgetCwd(uint8_t *cwd, int cwdLen);
+BTA_Status BTAmkdir(const char *path);
+// Renames oldPath to newPath, replacing an existing newPath in one step: readers find either the old or the new file, never none
+BTA_Status BTArenameReplace(const char *oldPath, const char *newPath);
+uint32_t BTAgetProcessId();
 
 BTA_Status BTAfwriteCsv(const char* filename, const char **headersX, const char **headersY, int *data, int xRes, int yRes);
 
@@ -17,6 +17,7 @@
 */
 
 #include "bvq_queue.h"
+#include "bta_atomic.h"
 #include "bta_oshelper.h"
 #include "pthread_helper.h"
 #include "timing_helper.h"
@@ -24,61 +25,250 @@
 #include <assert.h>
 
 
+#define BVQ_CACHE_LINE      64
+
+
+// Bounded lock-free MPMC ring with sequence numbered slots (D. Vyukov). A slot's sequence tells whose turn it is:
+// sequence == pos: free for the producer at enqueue position pos, sequence == pos + 1: filled for the consumer at dequeue position pos.
+// The consumer hands the slot to the producer of the next round by setting sequence = pos + slots count.
+// Positions and sequences are compared as signed differences, so they may wrap around. The slots count is a power of two, so slot = pos & mask
+// stays continuous when a position wraps around. The queue holds no more than queueLength items, the spare slots are never filled
+typedef struct BVQ_Slot {
+    BTA_Atomic32 sequence;
+    void *item;
+} BVQ_Slot;
+
 
 typedef struct BVQ_QueueInst {
     uint32_t queueLength;      ///< length of queue
+    uint32_t mask;             ///< slots count - 1
     BTA_QueueMode queueMode;
-    void **queue;
-    uint32_t queuePos;         ///< index of newest valid item (0 >= queuePos < queueLength)
-    uint32_t queueCount;       ///< count of valid items in  queue (from index queuePos backwards) (0 >= queueCount <= queueLength)
-    void *semQueueCount;
-    void *queueMutex;
+    BVQ_Slot *slots;
     FN_FreeItem freeItem;
+    FN_RetainItem retainItem;
+    void *dropMutex;           ///< With retainItem: taken by every dequeue, so a peeking thread retains the oldest item before anyone can take and free it
+    uint8_t pad0[BVQ_CACHE_LINE];
+    BTA_Atomic32 enqueuePos;   ///< producers and consumers on different cache lines
+    uint8_t pad1[BVQ_CACHE_LINE];
+    BTA_Atomic32 dequeuePos;
+    uint8_t pad2[BVQ_CACHE_LINE];
+    BTA_Atomic32 waitersCount; ///< threads blocked in dequeue or peek. Only if there are any, enqueue takes waitMutex to wake them
+    void *waitMutex;
+    void *condItemAdded;
+    uint8_t volatile interrupted; ///< see BVQsetInterrupted, guarded by waitMutex
+    BTA_Atomic32 droppedCount; ///< items dropped by enqueue since BVQgetStatistics
+    BTA_Atomic32 countMax;     ///< high-water mark since BVQgetStatistics
 } BVQ_QueueInst;
 
 
+static uint8_t tryEnqueue(BVQ_QueueInst *inst, void *item) {
+    uint32_t pos = BTAatomicLoad(&inst->enqueuePos);
+    while (1) {
+        if ((int32_t)(pos - BTAatomicLoad(&inst->dequeuePos)) >= (int32_t)inst->queueLength) {
+            // full
+            return 0;
+        }
+        BVQ_Slot *slot = &inst->slots[pos & inst->mask];
+        int32_t diff = (int32_t)(BTAatomicLoad(&slot->sequence) - pos);
+        if (diff == 0) {
+            if (BTAatomicCompareExchange(&inst->enqueuePos, pos, pos + 1)) {
+                slot->item = item;
+                BTAatomicStore(&slot->sequence, pos + 1);
+                return 1;
+            }
+            pos = BTAatomicLoad(&inst->enqueuePos);
+        }
+        else if (diff < 0) {
+            // The slot's consumer of the previous round has advanced dequeuePos, but not yet handed the slot over. The queue isn't full,
+            // so wait for it rather than have the caller drop an item or fail. Yielding in case it was preempted just in between
+            BTAmsleep(0);
+            pos = BTAatomicLoad(&inst->enqueuePos);
+        }
+        else {
+            // another producer was faster
+            pos = BTAatomicLoad(&inst->enqueuePos);
+        }
+    }
+}
+
 
-BTA_Status BTA_CALLCONV BVQinit(uint32_t queueLength, BTA_QueueMode queueMode, FN_FreeItem freeItem, BVQ_QueueHandle *handle) {
-    if (!handle) {
+static uint8_t tryDequeue(BVQ_QueueInst *inst, void **item) {
+    uint32_t pos = BTAatomicLoad(&inst->dequeuePos);
+    while (1) {
+        BVQ_Slot *slot = &inst->slots[pos & inst->mask];
+        int32_t diff = (int32_t)(BTAatomicLoad(&slot->sequence) - (pos + 1));
+        if (diff == 0) {
+            if (BTAatomicCompareExchange(&inst->dequeuePos, pos, pos + 1)) {
+                *item = slot->item;
+                BTAatomicStore(&slot->sequence, pos + inst->mask + 1);
+                return 1;
+            }
+            pos = BTAatomicLoad(&inst->dequeuePos);
+        }
+        else if (diff < 0) {
+            // empty
+            return 0;
+        }
+        else {
+            // another consumer was faster
+            pos = BTAatomicLoad(&inst->dequeuePos);
+        }
+    }
+}
+
+
+// Reads the oldest item without taking it. The sequence and position are read again afterwards, in case a consumer took the item meanwhile
+static uint8_t tryPeek(BVQ_QueueInst *inst, void **item) {
+    while (1) {
+        uint32_t pos = BTAatomicLoad(&inst->dequeuePos);
+        BVQ_Slot *slot = &inst->slots[pos & inst->mask];
+        if (BTAatomicLoad(&slot->sequence) != pos + 1) {
+            return 0;
+        }
+        void *itemTemp = slot->item;
+        BTAatomicFence();
+        if (BTAatomicLoad(&slot->sequence) == pos + 1 && BTAatomicLoad(&inst->dequeuePos) == pos) {
+            *item = itemTemp;
+            return 1;
+        }
+    }
+}
+
+
+static void wakeWaiters(BVQ_QueueInst *inst) {
+    // Pairs with the fence in waitForItem: either the waiter sees the new item or we see the waiter
+    BTAatomicFence();
+    if (BTAatomicLoad(&inst->waitersCount)) {
+        BTAlockMutex(inst->waitMutex);
+        BTAbroadcastCondition(inst->condItemAdded);
+        BTAunlockMutex(inst->waitMutex);
+    }
+}
+
+
+// With retainItem, dequeue must not take the item a peeking thread is about to retain (the taker may free it right away)
+static uint8_t tryDequeueExclusive(BVQ_QueueInst *inst, void **item) {
+    if (!inst->dropMutex) {
+        return tryDequeue(inst, item);
+    }
+    BTAlockMutex(inst->dropMutex);
+    uint8_t result = tryDequeue(inst, item);
+    BTAunlockMutex(inst->dropMutex);
+    return result;
+}
+
+
+// Peeks and takes a reference while dropMutex keeps dequeue and the drops of enqueue from taking the item
+static uint8_t tryPeekRetained(BVQ_QueueInst *inst, void **item) {
+    BTAlockMutex(inst->dropMutex);
+    uint8_t result = tryPeek(inst, item);
+    if (result) {
+        (*inst->retainItem)(*item);
+    }
+    BTAunlockMutex(inst->dropMutex);
+    return result;
+}
+
+
+// Blocks until tryTake succeeds or the timeout (0: infinite) elapses. The remaining time is recalculated because of spurious wakeups
+static BTA_Status waitForItem(BVQ_QueueInst *inst, uint8_t (*tryTake)(BVQ_QueueInst *inst, void **item), void **item, uint32_t msecsTimeout) {
+    if (tryTake(inst, item)) {
+        return BTA_StatusOk;
+    }
+    uint64_t endTime = BTAgetTickCount64() + msecsTimeout;
+    BTA_Status status = BTA_StatusOk;
+    BTAlockMutex(inst->waitMutex);
+    BTAatomicFetchAdd(&inst->waitersCount, 1);
+    BTAatomicFence();
+    while (!tryTake(inst, item)) {
+        if (inst->interrupted) {
+            status = BTA_StatusTimeOut;
+            break;
+        }
+        uint32_t msecsRemaining = 0;
+        if (msecsTimeout) {
+            uint64_t now = BTAgetTickCount64();
+            if (now >= endTime) {
+                status = BTA_StatusTimeOut;
+                break;
+            }
+            msecsRemaining = endTime - now > INT32_MAX ? INT32_MAX : (uint32_t)(endTime - now);
+        }
+        status = BTAwaitConditionTimed(inst->condItemAdded, inst->waitMutex, (int)msecsRemaining);
+        if (status != BTA_StatusOk && status != BTA_StatusTimeOut) {
+            break;
+        }
+        status = BTA_StatusOk;
+    }
+    BTAatomicFetchAdd(&inst->waitersCount, (uint32_t)-1);
+    BTAunlockMutex(inst->waitMutex);
+    return status;
+}
+
+
+BTA_Status BTA_CALLCONV BVQinit(uint32_t queueLength, BTA_QueueMode queueMode, FN_FreeItem freeItem, FN_RetainItem retainItem, BVQ_QueueHandle *handle) {
+    if (!handle || queueLength > INT32_MAX) {
         return BTA_StatusInvalidParameter;
     }
     if (queueLength == 0 || queueMode == BTA_QueueModeDoNotQueue) {
         *handle = 0;
         return BTA_StatusOk;
     }
+    if (queueMode == BTA_QueueModeLatest) {
+        // Needs to copy items, only BFQ can do that
+        return BTA_StatusNotSupported;
+    }
     BVQ_QueueInst *inst = (BVQ_QueueInst *)calloc(1, sizeof(BVQ_QueueInst));
     if (!inst) {
         return BTA_StatusOutOfMemory;
     }
-    BTA_Status status = BTAinitSemaphore(&inst->semQueueCount, 0, 0);
-    if (status != BTA_StatusOk) {
-        return status;
-    }
-    inst->queuePos = 0;
-    inst->queueCount = 0;
     inst->queueLength = queueLength;
     inst->queueMode = queueMode;
-    inst->queue = (void **)malloc(inst->queueLength * sizeof(void *));
-    if (!inst->queue) {
+    uint32_t slotsLen = 1;
+    while (slotsLen < queueLength) {
+        slotsLen <<= 1;
+    }
+    inst->mask = slotsLen - 1;
+    inst->slots = (BVQ_Slot *)malloc(slotsLen * sizeof(BVQ_Slot));
+    if (!inst->slots) {
         free(inst);
         return BTA_StatusOutOfMemory;
     }
-    int result = BTAinitMutex(&inst->queueMutex);
-    if (result < 0 || !inst->queueMutex) {
-        free(inst->queue);
-        inst->queue = 0;
+    for (uint32_t i = 0; i < slotsLen; i++) {
+        inst->slots[i].sequence = i;
+        inst->slots[i].item = 0;
+    }
+    BTA_Status status = BTAinitMutex(&inst->waitMutex);
+    if (status != BTA_StatusOk) {
+        free(inst->slots);
         free(inst);
-        inst = 0;
-        return BTA_StatusRuntimeError;
+        return status;
+    }
+    status = BTAinitCondition(&inst->condItemAdded);
+    if (status != BTA_StatusOk) {
+        BTAcloseMutex(inst->waitMutex);
+        free(inst->slots);
+        free(inst);
+        return status;
+    }
+    if (retainItem) {
+        status = BTAinitMutex(&inst->dropMutex);
+        if (status != BTA_StatusOk) {
+            BTAcloseCondition(inst->condItemAdded);
+            BTAcloseMutex(inst->waitMutex);
+            free(inst->slots);
+            free(inst);
+            return status;
+        }
     }
     inst->freeItem = freeItem;
+    inst->retainItem = retainItem;
     *handle = inst;
     return BTA_StatusOk;
 }
 
 
 BTA_Status BTA_CALLCONV BVQclose(BVQ_QueueHandle *handle) {
-    int err;
     if (!handle) {
         return BTA_StatusInvalidParameter;
     }
@@ -90,15 +280,18 @@ BTA_Status BTA_CALLCONV BVQclose(BVQ_QueueHandle *handle) {
     if (status != BTA_StatusOk) {
         return status;
     }
-    err = BTAcloseMutex(inst->queueMutex);
-    if (err != 0) {
-        return BTA_StatusRuntimeError;
+    status = BTAcloseCondition(inst->condItemAdded);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    status = BTAcloseMutex(inst->waitMutex);
+    if (status != BTA_StatusOk) {
+        return status;
     }
-    err = BTAcloseSemaphore(inst->semQueueCount);
-    if (err != 0) {
-        return BTA_StatusRuntimeError;
+    if (inst->dropMutex) {
+        BTAcloseMutex(inst->dropMutex);
     }
-    free(inst->queue);
+    free(inst->slots);
     free(inst);
     *handle = 0;
     return BTA_StatusOk;
@@ -110,19 +303,12 @@ BTA_Status BTA_CALLCONV BVQclear(BVQ_QueueHandle handle) {
     if (!inst) {
         return BTA_StatusInvalidParameter;
     }
-    BTAlockMutex(inst->queueMutex);
-    if (inst->freeItem) {
-        while (inst->queueCount) {
-            int32_t index = inst->queuePos - inst->queueCount + 1;
-            if (index < 0) {
-                index += inst->queueLength;
-            }
-            (*inst->freeItem)(&inst->queue[index]);
-            BTAwaitSemaphore(inst->semQueueCount);
-            inst->queueCount--;
+    void *item;
+    while (tryDequeueExclusive(inst, &item)) {
+        if (inst->freeItem) {
+            (*inst->freeItem)(&item);
         }
     }
-    BTAunlockMutex(inst->queueMutex);
     return BTA_StatusOk;
 }
 
@@ -136,112 +322,78 @@ uint32_t BTA_CALLCONV BVQgetLength(BVQ_QueueHandle handle) {
 }
 
 
+// A snapshot, producers and consumers in progress are counted as done
 uint32_t BTA_CALLCONV BVQgetCount(BVQ_QueueHandle handle) {
     BVQ_QueueInst *inst = (BVQ_QueueInst *)handle;
     if (!inst) {
         return 0;
     }
-    return inst->queueCount;
+    uint32_t dequeuePos = BTAatomicLoad(&inst->dequeuePos);
+    int32_t count = (int32_t)(BTAatomicLoad(&inst->enqueuePos) - dequeuePos);
+    if (count < 0) {
+        return 0;
+    }
+    return (uint32_t)count > inst->queueLength ? inst->queueLength : (uint32_t)count;
 }
 
 
+// Items are dropped (freed) by the thread that displaced them, outside of any critical section, so consumers are never blocked by a free
 BTA_Status BTA_CALLCONV BVQenqueue(BVQ_QueueHandle handle, void *item) {
     BVQ_QueueInst *inst = (BVQ_QueueInst *)handle;
     if (!inst || !item) {
         return BTA_StatusInvalidParameter;
     }
-    if (inst->queueMode == BTA_QueueModeDropOldest) {
-        BTAlockMutex(inst->queueMutex);
-        inst->queuePos++;
-        if (inst->queuePos == inst->queueLength) {
-            inst->queuePos = 0;
-        }
-        if (inst->queueCount == inst->queueLength) {
-            if (inst->freeItem) {
-                (*inst->freeItem)(&inst->queue[inst->queuePos]);
+    switch (inst->queueMode) {
+    case BTA_QueueModeDropOldest:
+        while (!tryEnqueue(inst, item)) {
+            void *itemOldest;
+            if (tryDequeueExclusive(inst, &itemOldest)) {
+                BTAatomicFetchAdd(&inst->droppedCount, 1);
+                if (inst->freeItem) {
+                    (*inst->freeItem)(&itemOldest);
+                }
             }
-            inst->queue[inst->queuePos] = item;
-        }
-        else {
-            inst->queue[inst->queuePos] = item;
-            BTApostSemaphore(inst->semQueueCount);
-            inst->queueCount++;
         }
-        BTAunlockMutex(inst->queueMutex);
-        return BTA_StatusOk;
-    }
-
-    if (inst->queueMode == BTA_QueueModeDropCurrent) {
-        BTAlockMutex(inst->queueMutex);
-        if (inst->queueCount < inst->queueLength) {
-            // there is enough space
-            inst->queuePos++;
-            if (inst->queuePos == inst->queueLength) {
-                inst->queuePos = 0;
-            }
-            inst->queue[inst->queuePos] = item;
-            BTApostSemaphore(inst->semQueueCount);
-            inst->queueCount++;
-        }
-        else {
+        break;
+    case BTA_QueueModeDropCurrent:
+        if (!tryEnqueue(inst, item)) {
+            BTAatomicFetchAdd(&inst->droppedCount, 1);
+            BTAatomicMax(&inst->countMax, inst->queueLength);
             if (inst->freeItem) {
                 (*inst->freeItem)(&item);
             }
-        }
-        BTAunlockMutex(inst->queueMutex);
-        return BTA_StatusOk;
-    }
-
-    if (inst->queueMode == BTA_QueueModeAvoidDrop) {
-        BTAlockMutex(inst->queueMutex);
-        if (inst->queueCount < inst->queueLength) {
-            // there is enough space
-            inst->queuePos++;
-            if (inst->queuePos == inst->queueLength) {
-                inst->queuePos = 0;
-            }
-            inst->queue[inst->queuePos] = item;
-            BTApostSemaphore(inst->semQueueCount);
-            inst->queueCount++;
-            BTAunlockMutex(inst->queueMutex);
             return BTA_StatusOk;
         }
-        BTAunlockMutex(inst->queueMutex);
-        return BTA_StatusOutOfMemory;
+        break;
+    case BTA_QueueModeAvoidDrop:
+        if (!tryEnqueue(inst, item)) {
+            return BTA_StatusOutOfMemory;
+        }
+        break;
+    default:
+        // unreachable
+        return BTA_StatusNotSupported;
     }
-
-    // unreachable
-    return BTA_StatusNotSupported;
+    BTAatomicMax(&inst->countMax, BVQgetCount(inst));
+    wakeWaiters(inst);
+    return BTA_StatusOk;
 }
 
 
 BTA_Status BTA_CALLCONV BVQpeek(BVQ_QueueHandle handle, void **item, uint32_t msecsTimeout) {
-    // todo: use timed semaphore
     BVQ_QueueInst *inst = (BVQ_QueueInst *)handle;
     if (!item || !inst) {
         return BTA_StatusInvalidParameter;
     }
-    if (inst->queueMode == BTA_QueueModeDropOldest && inst->freeItem) {
+    if (inst->queueMode == BTA_QueueModeDropOldest && inst->freeItem && !inst->retainItem) {
         // Peek is not allowed if the void pointer could be dropped at any time
         return BTA_StatusIllegalOperation;
     }
-    uint64_t endTime = BTAgetTickCount64() + msecsTimeout;
-    do {
-        BTAlockMutex(inst->queueMutex);
-        if (inst->queueCount) {
-            int32_t index = inst->queuePos - inst->queueCount + 1;
-            if (index < 0) {
-                index += inst->queueLength;
-            }
-            *item = inst->queue[index];
-            BTAunlockMutex(inst->queueMutex);
-            return BTA_StatusOk;
-        }
-        BTAunlockMutex(inst->queueMutex);
-        BTAmsleep(10);
-    } while (msecsTimeout == 0 || (uint64_t)BTAgetTickCount64() <= endTime);
-    *item = 0;
-    return BTA_StatusTimeOut;
+    BTA_Status status = waitForItem(inst, inst->retainItem ? &tryPeekRetained : &tryPeek, item, msecsTimeout);
+    if (status != BTA_StatusOk) {
+        *item = 0;
+    }
+    return status;
 }
 
 
@@ -251,23 +403,34 @@ BTA_Status BTA_CALLCONV BVQdequeue(BVQ_QueueHandle handle, void **item, uint32_t
         if (item) *item = 0;
         return BTA_StatusInvalidParameter;
     }
-    BTA_Status status = BTAwaitSemaphoreTimed(inst->semQueueCount, msecsTimeout);
+    void *itemTemp = 0;
+    BTA_Status status = waitForItem(inst, &tryDequeueExclusive, &itemTemp, msecsTimeout);
+    if (item) *item = status == BTA_StatusOk ? itemTemp : 0;
+    return status;
+}
+
+
+BTA_Status BTA_CALLCONV BVQdequeueMany(BVQ_QueueHandle handle, void **items, uint32_t maxCount, uint32_t *count, uint32_t msecsTimeout) {
+    BVQ_QueueInst *inst = (BVQ_QueueInst *)handle;
+    if (count) *count = 0;
+    if (!inst || !items || !maxCount || !count) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTA_Status status = waitForItem(inst, &tryDequeueExclusive, &items[0], msecsTimeout);
     if (status != BTA_StatusOk) {
-        if (item) *item = 0;
+        items[0] = 0;
         return status;
     }
-    BTAlockMutex(inst->queueMutex);
-    int32_t index = inst->queuePos - inst->queueCount + 1;
-    if (index < 0) {
-        index += inst->queueLength;
+    uint32_t itemsLen = 1;
+    while (itemsLen < maxCount && tryDequeueExclusive(inst, &items[itemsLen])) {
+        itemsLen++;
     }
-    if (item) *item = inst->queue[index];
-    inst->queueCount--;
-    BTAunlockMutex(inst->queueMutex);
+    *count = itemsLen;
     return BTA_StatusOk;
 }
 
 
+// A snapshot: the items filled at the time of the call, oldest first
 BTA_Status BTA_CALLCONV BVQgetList(BVQ_QueueHandle handle, void ***list, uint32_t *listLen) {
     BVQ_QueueInst *inst = (BVQ_QueueInst *)handle;
     if (!inst || !list || !listLen) {
@@ -277,19 +440,42 @@ BTA_Status BTA_CALLCONV BVQgetList(BVQ_QueueHandle handle, void ***list, uint32_
         // getList is not allowed if the void pointer could be dropped at any time
         return BTA_StatusIllegalOperation;
     }
-    BTAlockMutex(inst->queueMutex);
-    *listLen = inst->queueCount;
-    *list = (void **)malloc(*listLen * sizeof(void *));
-    uint32_t index = inst->queuePos - inst->queueCount + 1 + inst->queueLength;
-    if (index >= inst->queueLength) {
-        index -= inst->queueLength;
-    }
-    for (uint32_t i = 0; i < inst->queueCount; i++) {
-        (*list)[i] = inst->queue[index++];
-        if (index == inst->queueLength) {
-            index = 0;
+    *list = (void **)malloc(inst->queueLength * sizeof(void *));
+    *listLen = 0;
+    if (!*list) {
+        return BTA_StatusOutOfMemory;
+    }
+    uint32_t pos = BTAatomicLoad(&inst->dequeuePos);
+    uint32_t enqueuePos = BTAatomicLoad(&inst->enqueuePos);
+    for (; (int32_t)(enqueuePos - pos) > 0 && *listLen < inst->queueLength; pos++) {
+        BVQ_Slot *slot = &inst->slots[pos & inst->mask];
+        if (BTAatomicLoad(&slot->sequence) == pos + 1) {
+            (*list)[(*listLen)++] = slot->item;
         }
     }
-    BTAunlockMutex(inst->queueMutex);
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTA_CALLCONV BVQgetStatistics(BVQ_QueueHandle handle, uint32_t *droppedCount, uint32_t *countMax) {
+    BVQ_QueueInst *inst = (BVQ_QueueInst *)handle;
+    if (!inst || !droppedCount || !countMax) {
+        return BTA_StatusInvalidParameter;
+    }
+    *droppedCount = BTAatomicExchange(&inst->droppedCount, 0);
+    *countMax = BTAatomicExchange(&inst->countMax, 0);
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTA_CALLCONV BVQsetInterrupted(BVQ_QueueHandle handle, uint8_t interrupted) {
+    BVQ_QueueInst *inst = (BVQ_QueueInst *)handle;
+    if (!inst) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTAlockMutex(inst->waitMutex);
+    inst->interrupted = interrupted;
+    BTAbroadcastCondition(inst->condItemAdded);
+    BTAunlockMutex(inst->waitMutex);
     return BTA_StatusOk;
 }
@@ -25,8 +25,11 @@
 typedef void* BVQ_QueueHandle;
 
 typedef BTA_Status(BTA_CALLCONV *FN_FreeItem)(void** item);
+typedef BTA_Status(BTA_CALLCONV *FN_RetainItem)(void* item);
 
-BTA_Status BTA_CALLCONV BVQinit(uint32_t queueLength, BTA_QueueMode queueMode, FN_FreeItem freeItem, BVQ_QueueHandle *handle);
+// retainItem (optional) adds a reference to an item, freeItem drops one. With both, peek hands out a reference of its own (to be freed by the caller),
+// so it is allowed in mode BTA_QueueModeDropOldest too. Peek and dequeue may then run concurrently, at the cost of a mutex in every dequeue
+BTA_Status BTA_CALLCONV BVQinit(uint32_t queueLength, BTA_QueueMode queueMode, FN_FreeItem freeItem, FN_RetainItem retainItem, BVQ_QueueHandle *handle);
 BTA_Status BTA_CALLCONV BVQclose(BVQ_QueueHandle *handle);
 BTA_Status BTA_CALLCONV BVQclear(BVQ_QueueHandle handle);
 uint32_t BTA_CALLCONV BVQgetCount(BVQ_QueueHandle handle);
@@ -35,6 +38,13 @@ uint32_t BTA_CALLCONV BVQgetLength(BVQ_QueueHandle handle);
 BTA_Status BTA_CALLCONV BVQenqueue(BVQ_QueueHandle handle, void *item);
 BTA_Status BTA_CALLCONV BVQpeek(BVQ_QueueHandle handle, void **item, uint32_t timeout);
 BTA_Status BTA_CALLCONV BVQdequeue(BVQ_QueueHandle handle, void **item, uint32_t timeout);
+// Waits for the first item only, then takes as many of the queued items as fit into items (oldest first)
+BTA_Status BTA_CALLCONV BVQdequeueMany(BVQ_QueueHandle handle, void **items, uint32_t maxCount, uint32_t *count, uint32_t timeout);
 BTA_Status BTA_CALLCONV BVQgetList(BVQ_QueueHandle handle, void ***list, uint32_t *listLen);
+// Items dropped by BVQenqueue (modes DropOldest and DropCurrent) and the highest count reached, both since the last call (read to clear)
+BTA_Status BTA_CALLCONV BVQgetStatistics(BVQ_QueueHandle handle, uint32_t *droppedCount, uint32_t *countMax);
+// While interrupted, dequeue and peek return BTA_StatusTimeOut right away instead of waiting for an empty queue to be filled. Threads waiting are woken up.
+// Lets the consumer thread notice a state change (e.g. it should stop) without a short timeout
+BTA_Status BTA_CALLCONV BVQsetInterrupted(BVQ_QueueHandle handle, uint8_t interrupted);
 
 #endif
\ No newline at end of file
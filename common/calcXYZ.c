@@ -3,12 +3,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 #include <bta_oshelper.h>
+#include <lens_cache.h>
+#include <binning.h>
 //#include <direct.h>
 
 static BTA_Status addLensVectors(BTA_CalcXYZInst *inst, BTA_LensVectors *calcXYZVectors);
 static BTA_LensVectors *emptyLensVectors(BTA_CalcXYZInst *inst, uint16_t xRes, uint16_t yRes);
 static BTA_LensVectors *getLenscalib(BTA_CalcXYZInst *inst, BTA_WrapperInst *winst, uint16_t xRes, uint16_t yRes);
+static BTA_LensVectors *loadLenscalib(BTA_CalcXYZInst *inst, BTA_WrapperInst *winst, uint16_t xRes, uint16_t yRes);
 
 
 BTA_Status BTAcalcXYZInit(BTA_CalcXYZInst **inst, BTA_InfoEventInst *infoEventInst) {
@@ -45,77 +49,227 @@ BTA_Status BTAcalcXYZClose(BTA_CalcXYZInst **inst) {
 }
 
 
-BTA_Status BTAcalcXYZApply(BTA_CalcXYZInst *inst, BTA_WrapperInst *winst, BTA_Frame *frame, float offset) {
-    if (!inst || !winst) {
+// The kernels below are written without branches in the loop body (invalid pixels are handled by a select), so that the compiler can vectorize them.
+// offset is in the unit of the distances. stride is 1 for planar output (X, Y and Z in separate buffers) and 3 for interleaved output (dataX, dataY and dataZ point into the same buffer)
+static void calcXYZUInt16ToSInt16(const uint16_t *data, const float *vectorsX, const float *vectorsY, const float *vectorsZ, int pxCount, float offset,
+                                  int16_t *dataX, int16_t *dataY, int16_t *dataZ, int stride) {
+    for (int xy = 0; xy < pxCount; xy++) {
+        float d = data[xy] + offset;
+        int16_t z = (int16_t)(d * vectorsZ[xy] + 0.5f);
+        dataX[xy * stride] = (int16_t)(d * vectorsX[xy] + 0.5f);
+        dataY[xy * stride] = (int16_t)(d * vectorsY[xy] + 0.5f);
+        dataZ[xy * stride] = data[xy] < 10 ? (int16_t)(INT16_MIN + data[xy]) : z;
+    }
+}
+
+
+static void calcXYZUInt16ToFloat32(const uint16_t *data, const float *vectorsX, const float *vectorsY, const float *vectorsZ, int pxCount, float offset,
+                                   float *dataX, float *dataY, float *dataZ, int stride) {
+    for (int xy = 0; xy < pxCount; xy++) {
+        float d = data[xy] < 10 ? NAN : data[xy] + offset;
+        dataX[xy * stride] = d * vectorsX[xy];
+        dataY[xy * stride] = d * vectorsY[xy];
+        dataZ[xy * stride] = d * vectorsZ[xy];
+    }
+}
+
+
+// UInt32 distances come from phase unwrapping, their range exceeds the SInt16 coordinates, which are clamped
+static void calcXYZUInt32ToSInt16(const uint32_t *data, const float *vectorsX, const float *vectorsY, const float *vectorsZ, int pxCount, float offset,
+                                  int16_t *dataX, int16_t *dataY, int16_t *dataZ, int stride) {
+    for (int xy = 0; xy < pxCount; xy++) {
+        float d = data[xy] + offset;
+        float x = d * vectorsX[xy];
+        float y = d * vectorsY[xy];
+        float z = d * vectorsZ[xy];
+        x = x < -INT16_MAX ? -INT16_MAX : (x > INT16_MAX ? INT16_MAX : x);
+        y = y < -INT16_MAX ? -INT16_MAX : (y > INT16_MAX ? INT16_MAX : y);
+        z = z < -INT16_MAX ? -INT16_MAX : (z > INT16_MAX ? INT16_MAX : z);
+        dataX[xy * stride] = (int16_t)(x + 0.5f);
+        dataY[xy * stride] = (int16_t)(y + 0.5f);
+        dataZ[xy * stride] = data[xy] < 10 ? (int16_t)(INT16_MIN + data[xy]) : (int16_t)(z + 0.5f);
+    }
+}
+
+
+static void calcXYZUInt32ToFloat32(const uint32_t *data, const float *vectorsX, const float *vectorsY, const float *vectorsZ, int pxCount, float offset,
+                                   float *dataX, float *dataY, float *dataZ, int stride) {
+    for (int xy = 0; xy < pxCount; xy++) {
+        float d = data[xy] < 10 ? NAN : data[xy] + offset;
+        dataX[xy * stride] = d * vectorsX[xy];
+        dataY[xy * stride] = d * vectorsY[xy];
+        dataZ[xy * stride] = d * vectorsZ[xy];
+    }
+}
+
+
+static void calcXYZFloat32ToSInt16(const float *data, const float *vectorsX, const float *vectorsY, const float *vectorsZ, int pxCount, float offset, float scale,
+                                   int16_t *dataX, int16_t *dataY, int16_t *dataZ, int stride) {
+    for (int xy = 0; xy < pxCount; xy++) {
+        // !(x > 0) is also true for NaN
+        int invalid = !(data[xy] > 0);
+        float d = invalid ? 0 : (data[xy] + offset) * scale;
+        int16_t z = (int16_t)(d * vectorsZ[xy] + 0.5f);
+        dataX[xy * stride] = (int16_t)(d * vectorsX[xy] + 0.5f);
+        dataY[xy * stride] = (int16_t)(d * vectorsY[xy] + 0.5f);
+        dataZ[xy * stride] = invalid ? INT16_MIN : z;
+    }
+}
+
+
+static void calcXYZFloat32ToFloat32(const float *data, const float *vectorsX, const float *vectorsY, const float *vectorsZ, int pxCount, float offset,
+                                    float *dataX, float *dataY, float *dataZ, int stride) {
+    for (int xy = 0; xy < pxCount; xy++) {
+        float d = data[xy] > 0 ? data[xy] + offset : NAN;
+        dataX[xy * stride] = d * vectorsX[xy];
+        dataY[xy * stride] = d * vectorsY[xy];
+        dataZ[xy * stride] = d * vectorsZ[xy];
+    }
+}
+
+
+BTA_Status BTAcalcXYZPrepareFrame(BTA_CalcXYZInst *inst, BTA_WrapperInst *winst, BTA_Frame *frame) {
+    if (!inst || !winst || !frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    for (int chIn = 0; chIn < frame->channelsLen; chIn++) {
+        BTA_Channel *channel = frame->channels[chIn];
+        if (channel->id == BTA_ChannelIdDistance && channel->xRes > 0 && channel->yRes > 0) {
+            getLenscalib(inst, winst, channel->xRes, channel->yRes);
+        }
+    }
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAcalcXYZApply(BTA_CalcXYZInst *inst, BTA_WrapperInst *winst, BTA_Frame *frame, float offset, uint8_t float32Output, uint8_t interleaved) {
+    if (!inst) {
         return BTA_StatusInvalidParameter;
     }
     if (!frame) {
         return BTA_StatusInvalidParameter;
     }
-    for (int chIn = 0; chIn < frame->channelsLen; chIn++) {
+    // only look at the channels present before we start adding
+    int channelsLen = frame->channelsLen;
+    for (int chIn = 0; chIn < channelsLen; chIn++) {
         BTA_Channel *channel = frame->channels[chIn];
         if (channel->id == BTA_ChannelIdDistance && channel->xRes > 0 && channel->yRes > 0) {
-            BTA_LensVectors * lensVectors = getLenscalib(inst, winst, channel->xRes, channel->yRes);
-            if (lensVectors->lensIndex != channel->lensIndex || lensVectors->xRes != channel->xRes || lensVectors->yRes != channel->yRes) {
+            if (channel->dataFormat != BTA_DataFormatUInt16 && channel->dataFormat != BTA_DataFormatUInt32 && channel->dataFormat != BTA_DataFormatFloat32) {
+                BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, BTA_StatusNotSupported, "BTAcalcXYZApply: dataFormat %d not supported!", channel->dataFormat);
+                return BTA_StatusNotSupported;
+            }
+            BTA_LensVectors *lensVectors = getLenscalib(inst, winst, channel->xRes, channel->yRes);
+            if (!lensVectors || lensVectors->lensIndex != channel->lensIndex || lensVectors->xRes != channel->xRes || lensVectors->yRes != channel->yRes) {
                 continue;
             }
             if (!lensVectors->vectorsX || !lensVectors->vectorsY || !lensVectors->vectorsZ) {
                 return BTA_StatusInvalidParameter;
             }
             int pxCount = channel->xRes * channel->yRes;
-            if (channel->dataFormat == BTA_DataFormatUInt16) {
-                uint16_t *data = (uint16_t *)channel->data;
-                int16_t *dataX = (int16_t *)malloc(pxCount * sizeof(int16_t));
-                int16_t *dataY = (int16_t *)malloc(pxCount * sizeof(int16_t));
-                int16_t *dataZ = (int16_t *)malloc(pxCount * sizeof(int16_t));
+
+            // UInt16 and UInt32 distances are always in millimeters, SInt16 coordinates as well. Float32 coordinates keep the unit of the distances
+            BTA_DataFormat dataFormatOut = float32Output ? BTA_DataFormatFloat32 : BTA_DataFormatSInt16;
+            BTA_Unit unitOut = BTA_UnitMillimeter;
+            float scale = 1;
+            // The offset is given in millimeters
+            float offsetInUnit = offset;
+            if (channel->dataFormat == BTA_DataFormatFloat32 && channel->unit == BTA_UnitMeter) {
+                offsetInUnit = offset / 1000;
+            }
+            if (channel->dataFormat == BTA_DataFormatFloat32) {
+                if (float32Output) {
+                    unitOut = channel->unit;
+                }
+                else if (channel->unit == BTA_UnitMeter) {
+                    scale = 1000;
+                }
+            }
+            uint32_t bytesPerCoord = float32Output ? sizeof(float) : sizeof(int16_t);
+            uint32_t dataLen = pxCount * bytesPerCoord;
+            int stride = interleaved ? 3 : 1;
+
+            uint8_t *dataX, *dataY = 0, *dataZ = 0;
+            if (interleaved) {
+                dataX = (uint8_t *)malloc(3 * dataLen);
+                if (!dataX) {
+                    BTAinfoEventHelper(inst->infoEventInst, VERBOSE_WARNING, BTA_StatusOutOfMemory, "BTAcalcXYZApply: out of memory");
+                    continue;
+                }
+            }
+            else {
+                dataX = (uint8_t *)malloc(dataLen);
+                dataY = (uint8_t *)malloc(dataLen);
+                dataZ = (uint8_t *)malloc(dataLen);
                 if (!dataX || !dataY || !dataZ) {
+                    free(dataX);
+                    free(dataY);
+                    free(dataZ);
                     BTAinfoEventHelper(inst->infoEventInst, VERBOSE_WARNING, BTA_StatusOutOfMemory, "BTAcalcXYZApply: out of memory");
                     continue;
                 }
-                int16_t *dataXp = dataX;
-                int16_t *dataYp = dataY;
-                int16_t *dataZp = dataZ;
-                float *vectorsX = lensVectors->vectorsX;
-                float *vectorsY = lensVectors->vectorsY;
-                float *vectorsZ = lensVectors->vectorsZ;
-                for (int xy = 0; xy < pxCount; xy++) {
-                    *dataXp++ = (int16_t)((*data + offset) * *vectorsX++ + 0.5f);
-                    *dataYp++ = (int16_t)((*data + offset) * *vectorsY++ + 0.5f);
-                    if (*data < 10) {
-                        *dataZp++ = INT16_MIN + *data;
-                        vectorsZ++;
-                    }
-                    else {
-                        *dataZp++ = (int16_t)((*data + offset) * *vectorsZ++ + 0.5f);
-                    }
-                    data++;
+            }
+            uint8_t *outX = dataX;
+            uint8_t *outY = interleaved ? dataX + bytesPerCoord : dataY;
+            uint8_t *outZ = interleaved ? dataX + 2 * bytesPerCoord : dataZ;
+
+            float *vectorsX = lensVectors->vectorsX;
+            float *vectorsY = lensVectors->vectorsY;
+            float *vectorsZ = lensVectors->vectorsZ;
+            if (channel->dataFormat == BTA_DataFormatUInt16) {
+                if (float32Output) {
+                    calcXYZUInt16ToFloat32((uint16_t *)channel->data, vectorsX, vectorsY, vectorsZ, pxCount, offset, (float *)outX, (float *)outY, (float *)outZ, stride);
+                }
+                else {
+                    calcXYZUInt16ToSInt16((uint16_t *)channel->data, vectorsX, vectorsY, vectorsZ, pxCount, offset, (int16_t *)outX, (int16_t *)outY, (int16_t *)outZ, stride);
+                }
+            }
+            else if (channel->dataFormat == BTA_DataFormatUInt32) {
+                if (float32Output) {
+                    calcXYZUInt32ToFloat32((uint32_t *)channel->data, vectorsX, vectorsY, vectorsZ, pxCount, offset, (float *)outX, (float *)outY, (float *)outZ, stride);
+                }
+                else {
+                    calcXYZUInt32ToSInt16((uint32_t *)channel->data, vectorsX, vectorsY, vectorsZ, pxCount, offset, (int16_t *)outX, (int16_t *)outY, (int16_t *)outZ, stride);
+                }
+            }
+            else {
+                if (float32Output) {
+                    calcXYZFloat32ToFloat32((float *)channel->data, vectorsX, vectorsY, vectorsZ, pxCount, offsetInUnit, (float *)outX, (float *)outY, (float *)outZ, stride);
+                }
+                else {
+                    calcXYZFloat32ToSInt16((float *)channel->data, vectorsX, vectorsY, vectorsZ, pxCount, offsetInUnit, scale, (int16_t *)outX, (int16_t *)outY, (int16_t *)outZ, stride);
                 }
-                BTA_Status status = BTAinsertChannelIntoFrame2(frame, BTA_ChannelIdX, channel->xRes, channel->yRes, BTA_DataFormatSInt16, BTA_UnitMillimeter, channel->integrationTime, channel->modulationFrequency, (uint8_t *)dataX, pxCount * sizeof(int16_t),
+            }
+
+            if (interleaved) {
+                BTA_Status status = BTAinsertChannelIntoFrame2(frame, BTA_ChannelIdXYZ, channel->xRes, channel->yRes, dataFormatOut, unitOut, channel->integrationTime, channel->modulationFrequency, dataX, 3 * dataLen,
                                                                0, 0, channel->lensIndex, channel->flags, channel->sequenceCounter, channel->gain);
                 if (status != BTA_StatusOk) {
                     free(dataX);
                     dataX = 0;
-                    BTAinfoEventHelper(inst->infoEventInst, 5, status, "BTAcalcXYZApply: Error adding channel X");
-                }
-                status = BTAinsertChannelIntoFrame2(frame, BTA_ChannelIdY, channel->xRes, channel->yRes, BTA_DataFormatSInt16, BTA_UnitMillimeter, channel->integrationTime, channel->modulationFrequency, (uint8_t *)dataY, pxCount * sizeof(int16_t),
-                                                    0, 0, channel->lensIndex, channel->flags, channel->sequenceCounter, channel->gain);
-                if (status != BTA_StatusOk) {
-                    free(dataY);
-                    dataY = 0;
-                    BTAinfoEventHelper(inst->infoEventInst, 5, status, "BTAcalcXYZApply: Error adding channel Y");
-                }
-                status = BTAinsertChannelIntoFrame2(frame, BTA_ChannelIdZ, channel->xRes, channel->yRes, BTA_DataFormatSInt16, BTA_UnitMillimeter, channel->integrationTime, channel->modulationFrequency, (uint8_t *)dataZ, pxCount * sizeof(int16_t),
-                                                    0, 0, channel->lensIndex, channel->flags, channel->sequenceCounter, channel->gain);
-                if (status != BTA_StatusOk) {
-                    free(dataZ);
-                    dataZ = 0;
-                    BTAinfoEventHelper(inst->infoEventInst, 5, status, "BTAcalcXYZApply: Error adding channel Z");
+                    BTAinfoEventHelper(inst->infoEventInst, 5, status, "BTAcalcXYZApply: Error adding channel XYZ");
                 }
                 continue;
             }
-            else {
-                BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, BTA_StatusNotSupported, "BTAcalcXYZApply: dataFormat %d not supported!", channel->dataFormat);
-                return BTA_StatusNotSupported;
+            BTA_Status status = BTAinsertChannelIntoFrame2(frame, BTA_ChannelIdX, channel->xRes, channel->yRes, dataFormatOut, unitOut, channel->integrationTime, channel->modulationFrequency, dataX, dataLen,
+                                                           0, 0, channel->lensIndex, channel->flags, channel->sequenceCounter, channel->gain);
+            if (status != BTA_StatusOk) {
+                free(dataX);
+                dataX = 0;
+                BTAinfoEventHelper(inst->infoEventInst, 5, status, "BTAcalcXYZApply: Error adding channel X");
+            }
+            status = BTAinsertChannelIntoFrame2(frame, BTA_ChannelIdY, channel->xRes, channel->yRes, dataFormatOut, unitOut, channel->integrationTime, channel->modulationFrequency, dataY, dataLen,
+                                                0, 0, channel->lensIndex, channel->flags, channel->sequenceCounter, channel->gain);
+            if (status != BTA_StatusOk) {
+                free(dataY);
+                dataY = 0;
+                BTAinfoEventHelper(inst->infoEventInst, 5, status, "BTAcalcXYZApply: Error adding channel Y");
+            }
+            status = BTAinsertChannelIntoFrame2(frame, BTA_ChannelIdZ, channel->xRes, channel->yRes, dataFormatOut, unitOut, channel->integrationTime, channel->modulationFrequency, dataZ, dataLen,
+                                                0, 0, channel->lensIndex, channel->flags, channel->sequenceCounter, channel->gain);
+            if (status != BTA_StatusOk) {
+                free(dataZ);
+                dataZ = 0;
+                BTAinfoEventHelper(inst->infoEventInst, 5, status, "BTAcalcXYZApply: Error adding channel Z");
             }
         }
     }
@@ -166,14 +320,61 @@ static BTA_LensVectors *emptyLensVectors(BTA_CalcXYZInst *inst, uint16_t xRes, u
 
 
 // TODO: use getLensVectors instead
-static BTA_LensVectors *getLenscalib(BTA_CalcXYZInst *inst, BTA_WrapperInst *winst, uint16_t xRes, uint16_t yRes) {
-    // go through list and find
+static BTA_LensVectors *findLensVectors(BTA_CalcXYZInst *inst, uint16_t xRes, uint16_t yRes) {
     for (int i = 0; i < inst->lensVectorsListLen; i++) {
         BTA_LensVectors *calcXYZVectors = inst->lensVectorsList[i];
         if (xRes == calcXYZVectors->xRes && yRes == calcXYZVectors->yRes) {
             return calcXYZVectors;
         }
     }
+    return 0;
+}
+
+
+static BTA_LensVectors *getLenscalib(BTA_CalcXYZInst *inst, BTA_WrapperInst *winst, uint16_t xRes, uint16_t yRes) {
+    // go through list and find
+    BTA_LensVectors *lensVectorsFound = findLensVectors(inst, xRes, yRes);
+    if (lensVectorsFound) {
+        return lensVectorsFound;
+    }
+    if (!winst) {
+        // Not connected to a device (deferred postprocessing), only what is loaded already can be used
+        return 0;
+    }
+    if (winst->lpBinningFactor > 1) {
+        // The channels were binned, derive the lens vectors from those of the full resolution
+        uint8_t factor = winst->lpBinningFactor;
+        BTA_LensVectors *lensVectorsFull = findLensVectors(inst, xRes * factor, yRes * factor);
+        if (!lensVectorsFull) {
+            lensVectorsFull = loadLenscalib(inst, winst, xRes * factor, yRes * factor);
+        }
+        BTA_LensVectors *lensVectorsBinned = 0;
+        if (lensVectorsFull && BTAbinningLensVectors(lensVectorsFull, factor, &lensVectorsBinned) == BTA_StatusOk) {
+            if ((lensVectorsBinned->xRes != xRes || lensVectorsBinned->yRes != yRes) || addLensVectors(inst, lensVectorsBinned) != BTA_StatusOk) {
+                // Full resolution lens vectors of another size, or out of memory
+                BTAfreeLensVectors(lensVectorsBinned);
+                return 0;
+            }
+            BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "getLenscalib: Binned lenscalib data for %dx%d from %dx%d", xRes, yRes, xRes * factor, yRes * factor);
+            return lensVectorsBinned;
+        }
+    }
+    return loadLenscalib(inst, winst, xRes, yRes);
+}
+
+
+// Loads from cache, file or device, in that order
+static BTA_LensVectors *loadLenscalib(BTA_CalcXYZInst *inst, BTA_WrapperInst *winst, uint16_t xRes, uint16_t yRes) {
+
+    if (winst->lpLensCacheEnabled) {
+        BTA_LensVectors *lensVectorsCached = 0;
+        BTA_Status status = BTAlensCacheLoadLensVectors(winst, xRes, yRes, &lensVectorsCached);
+        if (status == BTA_StatusOk) {
+            addLensVectors(inst, lensVectorsCached);
+            BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "getLenscalib: Loaded lenscalib data for %dx%d from cache", xRes, yRes);
+            return lensVectorsCached;
+        }
+    }
 
 
     // HACK
@@ -257,6 +458,12 @@ static BTA_LensVectors *getLenscalib(BTA_CalcXYZInst *inst, BTA_WrapperInst *win
     }
     free(flashUpdateConfig.data);
     addLensVectors(inst, lensVectors);
+    if (winst->lpLensCacheEnabled) {
+        status = BTAlensCacheStoreLensVectors(winst, lensVectors);
+        if (status != BTA_StatusOk) {
+            BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, status, "getLenscalib: Could not store lenscalib data in cache");
+        }
+    }
     BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "Loaded lenscalib data for %dx%d", xRes, yRes);
     return lensVectors;
 }
\ No newline at end of file
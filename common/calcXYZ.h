@@ -19,7 +19,10 @@ typedef struct BTA_CalcXYZInst {
 
 BTA_Status BTAcalcXYZInit(BTA_CalcXYZInst **inst, BTA_InfoEventInst *infoEventInst);
 BTA_Status BTAcalcXYZClose(BTA_CalcXYZInst **winst);
-BTA_Status BTAcalcXYZApply(BTA_CalcXYZInst *inst, BTA_WrapperInst *winst, BTA_Frame *frame, float offset);
+// Loads the lens vectors needed for the frame, so that BTAcalcXYZApply can be called without winst later
+BTA_Status BTAcalcXYZPrepareFrame(BTA_CalcXYZInst *inst, BTA_WrapperInst *winst, BTA_Frame *frame);
+// winst may be null, then only lens vectors already loaded are used
+BTA_Status BTAcalcXYZApply(BTA_CalcXYZInst *inst, BTA_WrapperInst *winst, BTA_Frame *frame, float offset, uint8_t float32Output, uint8_t interleaved);
 
 
 #endif
\ No newline at end of file
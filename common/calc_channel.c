@@ -0,0 +1,455 @@
+#include "calc_channel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+
+#define SATURATE(v, lo, hi)     ((v) < (lo) ? (lo) : ((v) > (hi) ? (hi) : (v)))
+// Values loaded from float formats into the integer working buffer are limited to this, so that add and subtract can't overflow
+#define I64_FROM_FLOAT_LIMIT    1099511627776.0
+// Products are calculated in double and limited to this before converting back to int64
+#define I64_PRODUCT_LIMIT       4.0e18
+
+
+uint8_t BTAcalcChannelIsSupported(BTA_DataFormat dataFormat) {
+    switch (dataFormat) {
+    case BTA_DataFormatUInt8:
+    case BTA_DataFormatUInt16:
+    case BTA_DataFormatUInt32:
+    case BTA_DataFormatSInt16:
+    case BTA_DataFormatSInt32:
+    case BTA_DataFormatFloat32:
+    case BTA_DataFormatFloat64:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+
+static uint8_t isFloatFormat(BTA_DataFormat dataFormat) {
+    return dataFormat == BTA_DataFormatFloat32 || dataFormat == BTA_DataFormatFloat64;
+}
+
+
+static uint32_t getBytesPerPixel(BTA_DataFormat dataFormat) {
+    return dataFormat & 0xf;
+}
+
+
+static BTA_Status checkChannel(BTA_Channel *channel, uint32_t *count) {
+    if (!channel || !channel->data) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (!BTAcalcChannelIsSupported(channel->dataFormat)) {
+        return BTA_StatusNotSupported;
+    }
+    *count = channel->xRes * channel->yRes;
+    if (channel->dataLen < *count * getBytesPerPixel(channel->dataFormat)) {
+        return BTA_StatusInvalidData;
+    }
+    return BTA_StatusOk;
+}
+
+
+// --- Load into and store from the working buffers --------------------------------------------------------------------------
+
+#define LOAD_LOOP(T)                                    \
+    {                                                   \
+        const T *s = (const T *)src;                    \
+        for (i = 0; i < n; i++) {                       \
+            w[i] = s[i];                                \
+        }                                               \
+        break;                                          \
+    }
+
+#define LOAD_I64_FROM_FLOAT_LOOP(T)                                                                                             \
+    {                                                                                                                           \
+        const T *s = (const T *)src;                                                                                            \
+        for (i = 0; i < n; i++) {                                                                                               \
+            double v = s[i] == s[i] ? SATURATE((double)s[i], -I64_FROM_FLOAT_LIMIT, I64_FROM_FLOAT_LIMIT) : 0;                  \
+            w[i] = (int64_t)(v + (v >= 0 ? 0.5 : -0.5));                                                                        \
+        }                                                                                                                       \
+        break;                                                                                                                  \
+    }
+
+#define STORE_I64_LOOP(T, lo, hi)                       \
+    {                                                   \
+        T *d = (T *)dst;                                \
+        for (i = 0; i < n; i++) {                       \
+            d[i] = (T)SATURATE(w[i], lo, hi);           \
+        }                                               \
+        break;                                          \
+    }
+
+#define STORE_F64_LOOP(T, lo, hi)                                                                                               \
+    {                                                                                                                           \
+        T *d = (T *)dst;                                                                                                        \
+        for (i = 0; i < n; i++) {                                                                                               \
+            double v = w[i] == w[i] ? SATURATE(w[i], lo, hi) : 0;                                                               \
+            d[i] = (T)(v + (v >= 0 ? 0.5 : -0.5));                                                                              \
+        }                                                                                                                       \
+        break;                                                                                                                  \
+    }
+
+#define STORE_FLOAT_LOOP(T)                             \
+    {                                                   \
+        T *d = (T *)dst;                                \
+        for (i = 0; i < n; i++) {                       \
+            d[i] = (T)w[i];                             \
+        }                                               \
+        break;                                          \
+    }
+
+
+static void loadI64(const void *src, BTA_DataFormat dataFormat, int64_t *w, int n) {
+    int i;
+    switch (dataFormat) {
+    case BTA_DataFormatUInt8: LOAD_LOOP(uint8_t)
+    case BTA_DataFormatUInt16: LOAD_LOOP(uint16_t)
+    case BTA_DataFormatUInt32: LOAD_LOOP(uint32_t)
+    case BTA_DataFormatSInt16: LOAD_LOOP(int16_t)
+    case BTA_DataFormatSInt32: LOAD_LOOP(int32_t)
+    case BTA_DataFormatFloat32: LOAD_I64_FROM_FLOAT_LOOP(float)
+    case BTA_DataFormatFloat64: LOAD_I64_FROM_FLOAT_LOOP(double)
+    default:
+        break;
+    }
+}
+
+
+static void storeI64(const int64_t *w, void *dst, BTA_DataFormat dataFormat, int n) {
+    int i;
+    switch (dataFormat) {
+    case BTA_DataFormatUInt8: STORE_I64_LOOP(uint8_t, 0, UINT8_MAX)
+    case BTA_DataFormatUInt16: STORE_I64_LOOP(uint16_t, 0, UINT16_MAX)
+    case BTA_DataFormatUInt32: STORE_I64_LOOP(uint32_t, 0, UINT32_MAX)
+    case BTA_DataFormatSInt16: STORE_I64_LOOP(int16_t, INT16_MIN, INT16_MAX)
+    case BTA_DataFormatSInt32: STORE_I64_LOOP(int32_t, INT32_MIN, INT32_MAX)
+    case BTA_DataFormatFloat32: STORE_FLOAT_LOOP(float)
+    case BTA_DataFormatFloat64: STORE_FLOAT_LOOP(double)
+    default:
+        break;
+    }
+}
+
+
+static void loadF64(const void *src, BTA_DataFormat dataFormat, double *w, int n) {
+    int i;
+    switch (dataFormat) {
+    case BTA_DataFormatUInt8: LOAD_LOOP(uint8_t)
+    case BTA_DataFormatUInt16: LOAD_LOOP(uint16_t)
+    case BTA_DataFormatUInt32: LOAD_LOOP(uint32_t)
+    case BTA_DataFormatSInt16: LOAD_LOOP(int16_t)
+    case BTA_DataFormatSInt32: LOAD_LOOP(int32_t)
+    case BTA_DataFormatFloat32: LOAD_LOOP(float)
+    case BTA_DataFormatFloat64: LOAD_LOOP(double)
+    default:
+        break;
+    }
+}
+
+
+static void storeF64(const double *w, void *dst, BTA_DataFormat dataFormat, int n) {
+    int i;
+    switch (dataFormat) {
+    case BTA_DataFormatUInt8: STORE_F64_LOOP(uint8_t, 0.0, (double)UINT8_MAX)
+    case BTA_DataFormatUInt16: STORE_F64_LOOP(uint16_t, 0.0, (double)UINT16_MAX)
+    case BTA_DataFormatUInt32: STORE_F64_LOOP(uint32_t, 0.0, (double)UINT32_MAX)
+    case BTA_DataFormatSInt16: STORE_F64_LOOP(int16_t, (double)INT16_MIN, (double)INT16_MAX)
+    case BTA_DataFormatSInt32: STORE_F64_LOOP(int32_t, (double)INT32_MIN, (double)INT32_MAX)
+    case BTA_DataFormatFloat32: STORE_FLOAT_LOOP(float)
+    case BTA_DataFormatFloat64: STORE_FLOAT_LOOP(double)
+    default:
+        break;
+    }
+}
+
+
+// --- Operations on the working buffers --------------------------------------------------------------------------------------
+
+static void opI64(int64_t *a, const int64_t *b, int n, BTA_CalcChannelOp op) {
+    int i;
+    switch (op) {
+    case BTA_CalcChannelOpAdd:
+        for (i = 0; i < n; i++) {
+            a[i] += b[i];
+        }
+        break;
+    case BTA_CalcChannelOpSubtract:
+        for (i = 0; i < n; i++) {
+            a[i] -= b[i];
+        }
+        break;
+    case BTA_CalcChannelOpMultiply:
+        for (i = 0; i < n; i++) {
+            double p = (double)a[i] * (double)b[i];
+            a[i] = (int64_t)SATURATE(p, -I64_PRODUCT_LIMIT, I64_PRODUCT_LIMIT);
+        }
+        break;
+    case BTA_CalcChannelOpDivide:
+        for (i = 0; i < n; i++) {
+            a[i] = b[i] ? a[i] / b[i] : 0;
+        }
+        break;
+    case BTA_CalcChannelOpMin:
+        for (i = 0; i < n; i++) {
+            a[i] = b[i] < a[i] ? b[i] : a[i];
+        }
+        break;
+    case BTA_CalcChannelOpMax:
+        for (i = 0; i < n; i++) {
+            a[i] = b[i] > a[i] ? b[i] : a[i];
+        }
+        break;
+    }
+}
+
+
+static void opF64(double *a, const double *b, int n, BTA_CalcChannelOp op) {
+    int i;
+    switch (op) {
+    case BTA_CalcChannelOpAdd:
+        for (i = 0; i < n; i++) {
+            a[i] += b[i];
+        }
+        break;
+    case BTA_CalcChannelOpSubtract:
+        for (i = 0; i < n; i++) {
+            a[i] -= b[i];
+        }
+        break;
+    case BTA_CalcChannelOpMultiply:
+        for (i = 0; i < n; i++) {
+            a[i] *= b[i];
+        }
+        break;
+    case BTA_CalcChannelOpDivide:
+        for (i = 0; i < n; i++) {
+            a[i] /= b[i];
+        }
+        break;
+    case BTA_CalcChannelOpMin:
+        for (i = 0; i < n; i++) {
+            a[i] = b[i] < a[i] ? b[i] : a[i];
+        }
+        break;
+    case BTA_CalcChannelOpMax:
+        for (i = 0; i < n; i++) {
+            a[i] = b[i] > a[i] ? b[i] : a[i];
+        }
+        break;
+    }
+}
+
+
+// Division for integer destinations calculated in double: truncated toward zero and division by zero yields 0, like in integer arithmetic
+static void divideOrZeroF64(double *a, const double *b, int n) {
+    for (int i = 0; i < n; i++) {
+        a[i] = b[i] != 0 ? trunc(a[i] / b[i]) : 0;
+    }
+}
+
+
+static void scaleOffsetF64(double *a, int n, const double *params) {
+    const double scale = params[0];
+    const double offset = params[1];
+    for (int i = 0; i < n; i++) {
+        a[i] = a[i] * scale + offset;
+    }
+}
+
+
+static void clampF64(double *a, int n, const double *params) {
+    const double min = params[0];
+    const double max = params[1];
+    for (int i = 0; i < n; i++) {
+        a[i] = SATURATE(a[i], min, max);
+    }
+}
+
+
+static void thresholdF64(double *a, int n, const double *params) {
+    const double threshold = params[0];
+    for (int i = 0; i < n; i++) {
+        a[i] = a[i] > threshold;
+    }
+}
+
+
+static void thresholdAbsF64(double *a, int n, const double *params) {
+    const double threshold = params[0];
+    for (int i = 0; i < n; i++) {
+        a[i] = (a[i] > threshold) | (a[i] < -threshold);
+    }
+}
+
+
+// Applies a unary operation to all pixels of the channel in double precision
+static BTA_Status applyUnaryF64(BTA_Channel *channel, void (*opFunction)(double *a, int n, const double *params), const double *params) {
+    uint32_t count;
+    BTA_Status status = checkChannel(channel, &count);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    uint8_t *data = (uint8_t *)channel->data;
+    uint32_t bytesPerPixel = getBytesPerPixel(channel->dataFormat);
+    double a[BTA_CALC_CHANNEL_CHUNK];
+    for (uint32_t xy = 0; xy < count; xy += BTA_CALC_CHANNEL_CHUNK) {
+        int n = (int)(count - xy < BTA_CALC_CHANNEL_CHUNK ? count - xy : BTA_CALC_CHANNEL_CHUNK);
+        loadF64(data + xy * bytesPerPixel, channel->dataFormat, a, n);
+        opFunction(a, n, params);
+        storeF64(a, data + xy * bytesPerPixel, channel->dataFormat, n);
+    }
+    return BTA_StatusOk;
+}
+
+
+// --- Public functions -------------------------------------------------------------------------------------------------------
+
+BTA_Status BTAcalcChannelBinary(BTA_Channel *dst, BTA_Channel *src, BTA_CalcChannelOp op) {
+    uint32_t count, countSrc;
+    BTA_Status status = checkChannel(dst, &count);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    status = checkChannel(src, &countSrc);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    if (dst->xRes != src->xRes || dst->yRes != src->yRes) {
+        return BTA_StatusInvalidParameter;
+    }
+    uint8_t *dataDst = (uint8_t *)dst->data;
+    const uint8_t *dataSrc = (const uint8_t *)src->data;
+    uint32_t bytesPerPixelDst = getBytesPerPixel(dst->dataFormat);
+    uint32_t bytesPerPixelSrc = getBytesPerPixel(src->dataFormat);
+    // Integer arithmetic only if both are integers, a float src must not be rounded before the operation (a gain of 0.3)
+    if (isFloatFormat(dst->dataFormat) || isFloatFormat(src->dataFormat)) {
+        uint8_t divideOrZero = op == BTA_CalcChannelOpDivide && !isFloatFormat(dst->dataFormat);
+        double a[BTA_CALC_CHANNEL_CHUNK], b[BTA_CALC_CHANNEL_CHUNK];
+        for (uint32_t xy = 0; xy < count; xy += BTA_CALC_CHANNEL_CHUNK) {
+            int n = (int)(count - xy < BTA_CALC_CHANNEL_CHUNK ? count - xy : BTA_CALC_CHANNEL_CHUNK);
+            loadF64(dataDst + xy * bytesPerPixelDst, dst->dataFormat, a, n);
+            loadF64(dataSrc + xy * bytesPerPixelSrc, src->dataFormat, b, n);
+            if (divideOrZero) {
+                divideOrZeroF64(a, b, n);
+            }
+            else {
+                opF64(a, b, n, op);
+            }
+            storeF64(a, dataDst + xy * bytesPerPixelDst, dst->dataFormat, n);
+        }
+    }
+    else {
+        int64_t a[BTA_CALC_CHANNEL_CHUNK], b[BTA_CALC_CHANNEL_CHUNK];
+        for (uint32_t xy = 0; xy < count; xy += BTA_CALC_CHANNEL_CHUNK) {
+            int n = (int)(count - xy < BTA_CALC_CHANNEL_CHUNK ? count - xy : BTA_CALC_CHANNEL_CHUNK);
+            loadI64(dataDst + xy * bytesPerPixelDst, dst->dataFormat, a, n);
+            loadI64(dataSrc + xy * bytesPerPixelSrc, src->dataFormat, b, n);
+            opI64(a, b, n, op);
+            storeI64(a, dataDst + xy * bytesPerPixelDst, dst->dataFormat, n);
+        }
+    }
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAcalcChannelScalar(BTA_Channel *channel, BTA_CalcChannelOp op, double value) {
+    uint32_t count;
+    BTA_Status status = checkChannel(channel, &count);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    uint8_t *data = (uint8_t *)channel->data;
+    uint32_t bytesPerPixel = getBytesPerPixel(channel->dataFormat);
+    // Integer channels are processed in integer arithmetic unless the value has a fractional part
+    uint8_t valueIsInteger = value > -I64_FROM_FLOAT_LIMIT && value < I64_FROM_FLOAT_LIMIT && (double)(int64_t)value == value;
+    if (isFloatFormat(channel->dataFormat) || !valueIsInteger) {
+        uint8_t divideOrZero = op == BTA_CalcChannelOpDivide && !isFloatFormat(channel->dataFormat);
+        double a[BTA_CALC_CHANNEL_CHUNK], b[BTA_CALC_CHANNEL_CHUNK];
+        for (int i = 0; i < BTA_CALC_CHANNEL_CHUNK; i++) {
+            b[i] = value;
+        }
+        for (uint32_t xy = 0; xy < count; xy += BTA_CALC_CHANNEL_CHUNK) {
+            int n = (int)(count - xy < BTA_CALC_CHANNEL_CHUNK ? count - xy : BTA_CALC_CHANNEL_CHUNK);
+            loadF64(data + xy * bytesPerPixel, channel->dataFormat, a, n);
+            if (divideOrZero) {
+                divideOrZeroF64(a, b, n);
+            }
+            else {
+                opF64(a, b, n, op);
+            }
+            storeF64(a, data + xy * bytesPerPixel, channel->dataFormat, n);
+        }
+    }
+    else {
+        int64_t a[BTA_CALC_CHANNEL_CHUNK], b[BTA_CALC_CHANNEL_CHUNK];
+        for (int i = 0; i < BTA_CALC_CHANNEL_CHUNK; i++) {
+            b[i] = (int64_t)value;
+        }
+        for (uint32_t xy = 0; xy < count; xy += BTA_CALC_CHANNEL_CHUNK) {
+            int n = (int)(count - xy < BTA_CALC_CHANNEL_CHUNK ? count - xy : BTA_CALC_CHANNEL_CHUNK);
+            loadI64(data + xy * bytesPerPixel, channel->dataFormat, a, n);
+            opI64(a, b, n, op);
+            storeI64(a, data + xy * bytesPerPixel, channel->dataFormat, n);
+        }
+    }
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAcalcChannelScaleOffset(BTA_Channel *channel, double scale, double offset) {
+    double params[2] = { scale, offset };
+    return applyUnaryF64(channel, scaleOffsetF64, params);
+}
+
+
+BTA_Status BTAcalcChannelClamp(BTA_Channel *channel, double min, double max) {
+    if (min > max) {
+        return BTA_StatusInvalidParameter;
+    }
+    double params[2] = { min, max };
+    return applyUnaryF64(channel, clampF64, params);
+}
+
+
+BTA_Status BTAcalcChannelThreshold(BTA_Channel *channel, double threshold, uint8_t alsoNegative) {
+    double params[1] = { threshold };
+    return applyUnaryF64(channel, alsoNegative ? thresholdAbsF64 : thresholdF64, params);
+}
+
+
+BTA_Status BTAcalcChannelConvert(const void *src, BTA_DataFormat srcFormat, void *dst, BTA_DataFormat dstFormat, uint32_t count) {
+    if (!src || !dst) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (!BTAcalcChannelIsSupported(srcFormat) || !BTAcalcChannelIsSupported(dstFormat)) {
+        return BTA_StatusNotSupported;
+    }
+    uint32_t bytesPerPixelSrc = getBytesPerPixel(srcFormat);
+    uint32_t bytesPerPixelDst = getBytesPerPixel(dstFormat);
+    if (srcFormat == dstFormat) {
+        memmove(dst, src, count * bytesPerPixelSrc);
+        return BTA_StatusOk;
+    }
+    const uint8_t *dataSrc = (const uint8_t *)src;
+    uint8_t *dataDst = (uint8_t *)dst;
+    if (isFloatFormat(srcFormat)) {
+        double w[BTA_CALC_CHANNEL_CHUNK];
+        for (uint32_t xy = 0; xy < count; xy += BTA_CALC_CHANNEL_CHUNK) {
+            int n = (int)(count - xy < BTA_CALC_CHANNEL_CHUNK ? count - xy : BTA_CALC_CHANNEL_CHUNK);
+            loadF64(dataSrc + xy * bytesPerPixelSrc, srcFormat, w, n);
+            storeF64(w, dataDst + xy * bytesPerPixelDst, dstFormat, n);
+        }
+    }
+    else {
+        int64_t w[BTA_CALC_CHANNEL_CHUNK];
+        for (uint32_t xy = 0; xy < count; xy += BTA_CALC_CHANNEL_CHUNK) {
+            int n = (int)(count - xy < BTA_CALC_CHANNEL_CHUNK ? count - xy : BTA_CALC_CHANNEL_CHUNK);
+            loadI64(dataSrc + xy * bytesPerPixelSrc, srcFormat, w, n);
+            storeI64(w, dataDst + xy * bytesPerPixelDst, dstFormat, n);
+        }
+    }
+    return BTA_StatusOk;
+}
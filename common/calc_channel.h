@@ -0,0 +1,36 @@
+#ifndef CALCCHANNEL_H_INCLUDED
+#define CALCCHANNEL_H_INCLUDED
+
+#include <bta.h>
+
+// Pixels are processed in chunks of this many: loaded into a working buffer, combined and stored back with saturation.
+// The loops over one chunk are free of branches and type dispatch, so that the compiler can vectorize them
+#define BTA_CALC_CHANNEL_CHUNK      256
+
+
+typedef enum BTA_CalcChannelOp {
+    BTA_CalcChannelOpAdd,
+    BTA_CalcChannelOpSubtract,
+    BTA_CalcChannelOpMultiply,
+    BTA_CalcChannelOpDivide,        ///< Integer dst: truncated toward zero (also by a float src or value), division by zero yields 0. Float dst: IEEE
+    BTA_CalcChannelOpMin,
+    BTA_CalcChannelOpMax,
+} BTA_CalcChannelOp;
+
+
+// UInt8, UInt16, UInt32, SInt16, SInt32, Float32 and Float64 are supported
+uint8_t BTAcalcChannelIsSupported(BTA_DataFormat dataFormat);
+// dst = dst op src per pixel, saturated to the data format of dst. The data formats may differ, the resolutions must match.
+// If either is a float format, the operation is calculated in double and rounded to nearest for an integer dst (division is truncated)
+BTA_Status BTAcalcChannelBinary(BTA_Channel *dst, BTA_Channel *src, BTA_CalcChannelOp op);
+// channel = channel op value per pixel, saturated to the data format of the channel
+BTA_Status BTAcalcChannelScalar(BTA_Channel *channel, BTA_CalcChannelOp op, double value);
+// channel = channel * scale + offset, rounded to nearest and saturated for integer formats
+BTA_Status BTAcalcChannelScaleOffset(BTA_Channel *channel, double scale, double offset);
+BTA_Status BTAcalcChannelClamp(BTA_Channel *channel, double min, double max);
+// channel = 1 where channel > threshold (or < -threshold if alsoNegative), 0 elsewhere
+BTA_Status BTAcalcChannelThreshold(BTA_Channel *channel, double threshold, uint8_t alsoNegative);
+// Converts count pixels, saturating and rounding to nearest when converting to a narrower or integer format. NaN becomes 0
+BTA_Status BTAcalcChannelConvert(const void *src, BTA_DataFormat srcFormat, void *dst, BTA_DataFormat dstFormat, uint32_t count);
+
+#endif
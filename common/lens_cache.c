@@ -0,0 +1,268 @@
+#include "lens_cache.h"
+#include <bta_oshelper.h>
+#include <bta_atomic.h>
+#include <pthread_helper.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+
+static void *cacheKeyMutex;
+static BTA_Atomic32 tempFileCounter;
+
+
+// The device type, serial number and firmware version of the device. Determined once per handle, the device info is not read for every lookup
+static BTA_Status getCacheKey(BTA_WrapperInst *winst, char *key, int keyLen) {
+    BTA_Status status = BTAinitMutexOnce(&cacheKeyMutex);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    BTAlockMutex(cacheKeyMutex);
+    if (!winst->lensCacheKey[0]) {
+        BTA_DeviceInfo *deviceInfo = 0;
+        status = winst->getDeviceInfo(winst, &deviceInfo);
+        if (status != BTA_StatusOk) {
+            BTAunlockMutex(cacheKeyMutex);
+            return status;
+        }
+        if (!deviceInfo->serialNumber) {
+            // Can't tell devices apart
+            BTAfreeDeviceInfo(deviceInfo);
+            BTAunlockMutex(cacheKeyMutex);
+            return BTA_StatusNotSupported;
+        }
+        snprintf(winst->lensCacheKey, sizeof(winst->lensCacheKey), "%04x_%u_fw%u.%u.%u", deviceInfo->deviceType, deviceInfo->serialNumber,
+                 deviceInfo->firmwareVersionMajor, deviceInfo->firmwareVersionMinor, deviceInfo->firmwareVersionNonFunc);
+        BTAfreeDeviceInfo(deviceInfo);
+    }
+    int len = snprintf(key, keyLen, "%s", winst->lensCacheKey);
+    BTAunlockMutex(cacheKeyMutex);
+    if (len < 0 || len >= keyLen) {
+        return BTA_StatusOutOfMemory;
+    }
+    return BTA_StatusOk;
+}
+
+
+// Builds the path of the cache file. The file name contains device type, serial number and firmware version of the device,
+// so that a changed calibration (which comes with a firmware update) never hits an outdated cache entry
+static BTA_Status getCacheFilename(BTA_WrapperInst *winst, const char *name, uint16_t lensIndex, uint16_t xRes, uint16_t yRes, char *filename, int filenameLen, uint8_t createDir) {
+    if (!winst || !winst->getDeviceInfo) {
+        return BTA_StatusInvalidParameter;
+    }
+    char key[sizeof(winst->lensCacheKey)];
+    BTA_Status status = getCacheKey(winst, key, sizeof(key));
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    const char *dir = getenv(BTA_LENS_CACHE_DIR_ENV);
+    if (!dir || !*dir) {
+        dir = BTA_LENS_CACHE_DIR_DEFAULT;
+    }
+    if (createDir) {
+        status = BTAmkdir(dir);
+        if (status != BTA_StatusOk) {
+            return status;
+        }
+    }
+    int len = snprintf(filename, filenameLen, "%s/%s_%s_%u_%ux%u.bin", dir, key, name, lensIndex, xRes, yRes);
+    if (len < 0 || len >= filenameLen) {
+        return BTA_StatusOutOfMemory;
+    }
+    return BTA_StatusOk;
+}
+
+
+// The payload is read straight into the payloads, one after the other
+static BTA_Status readCacheFile(const char *filename, BTA_LensCacheType type, uint16_t xRes, uint16_t yRes, BTA_LensCacheHeader *header, void **payloads, uint32_t *payloadLens, int payloadsLen) {
+    uint32_t payloadLen = 0;
+    for (int i = 0; i < payloadsLen; i++) {
+        payloadLen += payloadLens[i];
+    }
+    void *file;
+    BTA_Status status = BTAfopen(filename, "rb", &file);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    uint32_t bytesRead;
+    status = BTAfread(file, header, sizeof(BTA_LensCacheHeader), &bytesRead);
+    if (status != BTA_StatusOk || bytesRead != sizeof(BTA_LensCacheHeader)) {
+        BTAfclose(file);
+        return BTA_StatusInvalidData;
+    }
+    if (header->preamble != BTA_LENS_CACHE_PREAMBLE || header->version != BTA_LENS_CACHE_VERSION || header->type != (uint32_t)type ||
+        header->xRes != xRes || header->yRes != yRes || header->payloadLen != payloadLen) {
+        BTAfclose(file);
+        return BTA_StatusInvalidVersion;
+    }
+    for (int i = 0; i < payloadsLen; i++) {
+        status = BTAfread(file, payloads[i], payloadLens[i], &bytesRead);
+        if (status != BTA_StatusOk || bytesRead != payloadLens[i]) {
+            BTAfclose(file);
+            return BTA_StatusInvalidData;
+        }
+    }
+    BTAfclose(file);
+    return BTA_StatusOk;
+}
+
+
+// The file is written under a temporary name unique to this process and write, then renamed over the cache file in one step.
+// Concurrent readers find either the previous or the new complete file, concurrent writers don't share a temporary file
+static BTA_Status writeCacheFile(const char *filename, BTA_LensCacheHeader *header, void **payloads, uint32_t *payloadLens, int payloadsLen) {
+    char filenameTemp[300];
+    int len = snprintf(filenameTemp, sizeof(filenameTemp), "%s.%u_%u.tmp", filename, BTAgetProcessId(), BTAatomicFetchAdd(&tempFileCounter, 1));
+    if (len < 0 || len >= (int)sizeof(filenameTemp)) {
+        return BTA_StatusOutOfMemory;
+    }
+    void *file;
+    BTA_Status status = BTAfopen(filenameTemp, "wb", &file);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    status = BTAfwrite(file, header, sizeof(BTA_LensCacheHeader), 0);
+    for (int i = 0; i < payloadsLen && status == BTA_StatusOk; i++) {
+        status = BTAfwrite(file, payloads[i], payloadLens[i], 0);
+    }
+    BTAfclose(file);
+    if (status != BTA_StatusOk) {
+        remove(filenameTemp);
+        return status;
+    }
+    status = BTArenameReplace(filenameTemp, filename);
+    if (status != BTA_StatusOk) {
+        remove(filenameTemp);
+        return status;
+    }
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAlensCacheLoadLensVectors(BTA_WrapperInst *winst, uint16_t xRes, uint16_t yRes, BTA_LensVectors **lensVectors) {
+    if (!winst || !lensVectors || !xRes || !yRes) {
+        return BTA_StatusInvalidParameter;
+    }
+    char filename[256];
+    BTA_Status status = getCacheFilename(winst, "lensvectors", 0, xRes, yRes, filename, sizeof(filename), 0);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    uint32_t vectorsLen = xRes * yRes * sizeof(float);
+    BTA_LensVectors *vectors = (BTA_LensVectors *)calloc(1, sizeof(BTA_LensVectors));
+    if (!vectors) {
+        return BTA_StatusOutOfMemory;
+    }
+    vectors->vectorsX = (float *)malloc(vectorsLen);
+    vectors->vectorsY = (float *)malloc(vectorsLen);
+    vectors->vectorsZ = (float *)malloc(vectorsLen);
+    if (!vectors->vectorsX || !vectors->vectorsY || !vectors->vectorsZ) {
+        BTAfreeLensVectors(vectors);
+        return BTA_StatusOutOfMemory;
+    }
+    BTA_LensCacheHeader header;
+    void *payloads[3] = { vectors->vectorsX, vectors->vectorsY, vectors->vectorsZ };
+    uint32_t payloadLens[3] = { vectorsLen, vectorsLen, vectorsLen };
+    status = readCacheFile(filename, BTA_LensCacheTypeLensVectors, xRes, yRes, &header, payloads, payloadLens, 3);
+    if (status != BTA_StatusOk) {
+        BTAfreeLensVectors(vectors);
+        return status;
+    }
+    vectors->lensIndex = (uint16_t)header.lensIndex;
+    vectors->lensId = (uint16_t)header.lensId;
+    vectors->xRes = xRes;
+    vectors->yRes = yRes;
+    *lensVectors = vectors;
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAlensCacheStoreLensVectors(BTA_WrapperInst *winst, BTA_LensVectors *lensVectors) {
+    if (!winst || !lensVectors || !lensVectors->vectorsX || !lensVectors->vectorsY || !lensVectors->vectorsZ) {
+        return BTA_StatusInvalidParameter;
+    }
+    char filename[256];
+    BTA_Status status = getCacheFilename(winst, "lensvectors", 0, lensVectors->xRes, lensVectors->yRes, filename, sizeof(filename), 1);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    uint32_t vectorsLen = lensVectors->xRes * lensVectors->yRes * sizeof(float);
+    BTA_LensCacheHeader header = { BTA_LENS_CACHE_PREAMBLE, BTA_LENS_CACHE_VERSION, BTA_LensCacheTypeLensVectors, lensVectors->lensIndex, lensVectors->lensId, lensVectors->xRes, lensVectors->yRes, 3 * vectorsLen };
+    void *payloads[3] = { lensVectors->vectorsX, lensVectors->vectorsY, lensVectors->vectorsZ };
+    uint32_t payloadLens[3] = { vectorsLen, vectorsLen, vectorsLen };
+    return writeCacheFile(filename, &header, payloads, payloadLens, 3);
+}
+
+
+// data is filled in place, dataLen must match the length of the cached map exactly
+BTA_Status BTAlensCacheLoadUndistortionMap(BTA_WrapperInst *winst, uint16_t lensIndex, uint16_t xRes, uint16_t yRes, void *data, uint32_t dataLen) {
+    if (!winst || !data || !xRes || !yRes) {
+        return BTA_StatusInvalidParameter;
+    }
+    char filename[256];
+    BTA_Status status = getCacheFilename(winst, "undistortionmap", lensIndex, xRes, yRes, filename, sizeof(filename), 0);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    BTA_LensCacheHeader header;
+    status = readCacheFile(filename, BTA_LensCacheTypeUndistortionMap, xRes, yRes, &header, &data, &dataLen, 1);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    if (header.lensIndex != lensIndex) {
+        return BTA_StatusInvalidData;
+    }
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAlensCacheStoreUndistortionMap(BTA_WrapperInst *winst, uint16_t lensIndex, uint16_t xRes, uint16_t yRes, void *data, uint32_t dataLen) {
+    if (!winst || !data) {
+        return BTA_StatusInvalidParameter;
+    }
+    char filename[256];
+    BTA_Status status = getCacheFilename(winst, "undistortionmap", lensIndex, xRes, yRes, filename, sizeof(filename), 1);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    BTA_LensCacheHeader header = { BTA_LENS_CACHE_PREAMBLE, BTA_LENS_CACHE_VERSION, BTA_LensCacheTypeUndistortionMap, lensIndex, 0, xRes, yRes, dataLen };
+    void *payloads[1] = { data };
+    return writeCacheFile(filename, &header, payloads, &dataLen, 1);
+}
+
+
+BTA_Status BTAlensCacheLoadUndistortionIndex(BTA_WrapperInst *winst, BTA_LensCacheIndex *index) {
+    if (!winst || !index) {
+        return BTA_StatusInvalidParameter;
+    }
+    char filename[256];
+    BTA_Status status = getCacheFilename(winst, "undistortionindex", 0, 0, 0, filename, sizeof(filename), 0);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    BTA_LensCacheHeader header;
+    void *payload = index;
+    uint32_t payloadLen = sizeof(BTA_LensCacheIndex);
+    status = readCacheFile(filename, BTA_LensCacheTypeUndistortionIndex, 0, 0, &header, &payload, &payloadLen, 1);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    if (index->entriesLen > BTA_LENS_CACHE_INDEX_LEN_MAX) {
+        return BTA_StatusInvalidData;
+    }
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAlensCacheStoreUndistortionIndex(BTA_WrapperInst *winst, BTA_LensCacheIndex *index) {
+    if (!winst || !index || index->entriesLen > BTA_LENS_CACHE_INDEX_LEN_MAX) {
+        return BTA_StatusInvalidParameter;
+    }
+    char filename[256];
+    BTA_Status status = getCacheFilename(winst, "undistortionindex", 0, 0, 0, filename, sizeof(filename), 1);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    uint32_t payloadLen = sizeof(BTA_LensCacheIndex);
+    BTA_LensCacheHeader header = { BTA_LENS_CACHE_PREAMBLE, BTA_LENS_CACHE_VERSION, BTA_LensCacheTypeUndistortionIndex, 0, 0, 0, 0, payloadLen };
+    void *payloads[1] = { index };
+    return writeCacheFile(filename, &header, payloads, &payloadLen, 1);
+}
@@ -0,0 +1,57 @@
+#ifndef LENS_CACHE_H_INCLUDED
+#define LENS_CACHE_H_INCLUDED
+
+#include <bta.h>
+#include <bta_helper.h>
+
+// The cache directory can be overridden by this environment variable, otherwise it is created in the working directory
+#define BTA_LENS_CACHE_DIR_ENV      "BTA_CACHE_DIR"
+#define BTA_LENS_CACHE_DIR_DEFAULT  "bta_cache"
+
+#define BTA_LENS_CACHE_PREAMBLE     0xb1ac0de5
+#define BTA_LENS_CACHE_VERSION      2
+
+
+typedef enum BTA_LensCacheType {
+    BTA_LensCacheTypeLensVectors = 1,       ///< Payload: vectorsX, vectorsY, vectorsZ, each xRes*yRes floats
+    BTA_LensCacheTypeUndistortionMap = 2,   ///< Payload: BTA_UndistortionMap data (nearest indices, bilinear indices, weights)
+    BTA_LensCacheTypeUndistortionIndex = 3, ///< Payload: BTA_LensCacheIndex
+} BTA_LensCacheType;
+
+
+#define BTA_LENS_CACHE_INDEX_LEN_MAX    32
+
+// The lenses and resolutions the device has intrinsics for, so that all maps can be loaded from the cache without reading flash
+typedef struct BTA_LensCacheIndex {
+    uint32_t entriesLen;
+    struct {
+        uint32_t lensIndex;
+        uint32_t xRes;
+        uint32_t yRes;
+    } entries[BTA_LENS_CACHE_INDEX_LEN_MAX];
+} BTA_LensCacheIndex;
+
+
+// Every cache file starts with this header. All fields are 32 bit, so the payload directly following it is 4-byte aligned.
+// The payload is read straight into the destination arrays (e.g. the three lens vector planes), without an intermediate buffer
+typedef struct BTA_LensCacheHeader {
+    uint32_t preamble;
+    uint32_t version;
+    uint32_t type;
+    uint32_t lensIndex;
+    uint32_t lensId;
+    uint32_t xRes;
+    uint32_t yRes;
+    uint32_t payloadLen;
+} BTA_LensCacheHeader;
+
+
+BTA_Status BTAlensCacheLoadLensVectors(BTA_WrapperInst *winst, uint16_t xRes, uint16_t yRes, BTA_LensVectors **lensVectors);
+BTA_Status BTAlensCacheStoreLensVectors(BTA_WrapperInst *winst, BTA_LensVectors *lensVectors);
+BTA_Status BTAlensCacheLoadUndistortionMap(BTA_WrapperInst *winst, uint16_t lensIndex, uint16_t xRes, uint16_t yRes, void *data, uint32_t dataLen);
+BTA_Status BTAlensCacheStoreUndistortionMap(BTA_WrapperInst *winst, uint16_t lensIndex, uint16_t xRes, uint16_t yRes, void *data, uint32_t dataLen);
+BTA_Status BTAlensCacheLoadUndistortionIndex(BTA_WrapperInst *winst, BTA_LensCacheIndex *index);
+BTA_Status BTAlensCacheStoreUndistortionIndex(BTA_WrapperInst *winst, BTA_LensCacheIndex *index);
+
+
+#endif
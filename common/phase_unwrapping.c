@@ -0,0 +1,227 @@
+#include "phase_unwrapping.h"
+#include <pthread_helper.h>
+#include <mth_math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+
+#define SPEED_OF_LIGHT_MM           299792458000.0
+// Below this many pixels per thread, starting threads costs more than it saves
+#define UNWRAPPING_PARALLEL_MIN     16384
+
+
+typedef struct UnwrappingArgs {
+    BTA_Channel *first;             // Receives the result
+    BTA_Channel *second;
+    uint8_t firstIsShort;           // The channel with the higher frequency (shorter range) provides the candidates
+    float rangeShort;
+    float rangeLong;
+    float range;                    // Unambiguous range of the result
+    int candidatesLen;
+    uint32_t *dstUInt32;            // UInt16 input with a range beyond UINT16_MAX: the result goes here instead of in place
+} UnwrappingArgs;
+
+
+static uint32_t greatestCommonDivisor(uint32_t a, uint32_t b) {
+    while (b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+
+// UInt16: the lowest 10 values are invalidation codes. Float32: NaN and values <= 0 are invalid
+static void load(const BTA_Channel *channel, int start, int n, float *w, uint8_t *invalid) {
+    if (channel->dataFormat == BTA_DataFormatUInt16) {
+        const uint16_t *src = (const uint16_t *)channel->data + start;
+        for (int i = 0; i < n; i++) {
+            w[i] = src[i];
+            invalid[i] = src[i] < 10;
+        }
+    }
+    else {
+        const float *src = (const float *)channel->data + start;
+        for (int i = 0; i < n; i++) {
+            uint8_t inv = !(src[i] > 0);
+            w[i] = inv ? 0 : src[i];
+            invalid[i] = inv;
+        }
+    }
+}
+
+
+// Tries all candidates dShort + k * rangeShort, unwraps dLong to each of them and keeps the mean of the best matching pair
+static void unwrapChunk(const UnwrappingArgs *args, const float *dShort, const float *dLong, float *result, int n) {
+    float bestError[BTA_PHASE_UNWRAPPING_CHUNK];
+    float rangeLongInv = 1 / args->rangeLong;
+    for (int xy = 0; xy < n; xy++) {
+        bestError[xy] = FLT_MAX;
+        result[xy] = 0;
+    }
+    for (int k = 0; k < args->candidatesLen; k++) {
+        float offset = k * args->rangeShort;
+        for (int xy = 0; xy < n; xy++) {
+            float d = dShort[xy] + offset;
+            float wraps = floorf((d - dLong[xy]) * rangeLongInv + 0.5f);
+            float dLongUnwrapped = dLong[xy] + wraps * args->rangeLong;
+            float error = fabsf(d - dLongUnwrapped);
+            uint8_t better = error < bestError[xy];
+            bestError[xy] = better ? error : bestError[xy];
+            result[xy] = better ? 0.5f * (d + dLongUnwrapped) : result[xy];
+        }
+    }
+    for (int xy = 0; xy < n; xy++) {
+        float r = result[xy];
+        r = r < 0 ? r + args->range : r;
+        result[xy] = r >= args->range ? r - args->range : r;
+    }
+}
+
+
+static void unwrapRows(void *arg, int rowStart, int rowEnd) {
+    UnwrappingArgs *args = (UnwrappingArgs *)arg;
+    int xRes = args->first->xRes;
+    int end = rowEnd * xRes;
+    float dFirst[BTA_PHASE_UNWRAPPING_CHUNK];
+    float dSecond[BTA_PHASE_UNWRAPPING_CHUNK];
+    float result[BTA_PHASE_UNWRAPPING_CHUNK];
+    uint8_t invalidFirst[BTA_PHASE_UNWRAPPING_CHUNK];
+    uint8_t invalidSecond[BTA_PHASE_UNWRAPPING_CHUNK];
+    for (int chunkStart = rowStart * xRes; chunkStart < end; chunkStart += BTA_PHASE_UNWRAPPING_CHUNK) {
+        int n = MTHmin(BTA_PHASE_UNWRAPPING_CHUNK, end - chunkStart);
+        load(args->first, chunkStart, n, dFirst, invalidFirst);
+        load(args->second, chunkStart, n, dSecond, invalidSecond);
+        if (args->firstIsShort) {
+            unwrapChunk(args, dFirst, dSecond, result, n);
+        }
+        else {
+            unwrapChunk(args, dSecond, dFirst, result, n);
+        }
+        // In place, the chunk has been read already
+        if (args->dstUInt32) {
+            uint32_t *dst = args->dstUInt32 + chunkStart;
+            const uint16_t *codesFirst = (const uint16_t *)args->first->data + chunkStart;
+            const uint16_t *codesSecond = (const uint16_t *)args->second->data + chunkStart;
+            for (int xy = 0; xy < n; xy++) {
+                float r = result[xy] + 0.5f;
+                r = r < 10 ? 10 : r;
+                uint16_t code = invalidFirst[xy] ? codesFirst[xy] : codesSecond[xy];
+                dst[xy] = (invalidFirst[xy] | invalidSecond[xy]) ? code : (uint32_t)r;
+            }
+        }
+        else if (args->first->dataFormat == BTA_DataFormatUInt16) {
+            uint16_t *dst = (uint16_t *)args->first->data + chunkStart;
+            const uint16_t *codesSecond = (const uint16_t *)args->second->data + chunkStart;
+            for (int xy = 0; xy < n; xy++) {
+                float r = result[xy] + 0.5f;
+                r = r < 10 ? 10 : (r > UINT16_MAX ? UINT16_MAX : r);
+                uint16_t code = invalidFirst[xy] ? dst[xy] : codesSecond[xy];
+                dst[xy] = (invalidFirst[xy] | invalidSecond[xy]) ? code : (uint16_t)r;
+            }
+        }
+        else {
+            float *dst = (float *)args->first->data + chunkStart;
+            for (int xy = 0; xy < n; xy++) {
+                dst[xy] = (invalidFirst[xy] | invalidSecond[xy]) ? NAN : result[xy];
+            }
+        }
+    }
+}
+
+
+static uint8_t isUnwrappable(const BTA_Channel *channel) {
+    if (channel->id != BTA_ChannelIdDistance || !channel->data || !channel->modulationFrequency) {
+        return 0;
+    }
+    uint32_t pxCount = channel->xRes * channel->yRes;
+    if (channel->dataFormat == BTA_DataFormatUInt16) {
+        return channel->dataLen == pxCount * sizeof(uint16_t);
+    }
+    if (channel->dataFormat == BTA_DataFormatFloat32) {
+        return channel->dataLen == pxCount * sizeof(float) && (channel->unit == BTA_UnitMillimeter || channel->unit == BTA_UnitMeter);
+    }
+    return 0;
+}
+
+
+static uint8_t isPair(const BTA_Channel *first, const BTA_Channel *second) {
+    return isUnwrappable(second) && first->lensIndex == second->lensIndex && first->xRes == second->xRes && first->yRes == second->yRes &&
+           first->dataFormat == second->dataFormat && first->unit == second->unit &&
+           first->sequenceCounter != second->sequenceCounter && first->modulationFrequency != second->modulationFrequency;
+}
+
+
+static BTA_Status unwrapPair(BTA_Channel *first, BTA_Channel *second) {
+    uint32_t gcd = greatestCommonDivisor(first->modulationFrequency, second->modulationFrequency);
+    uint32_t freqShort = MTHmax(first->modulationFrequency, second->modulationFrequency);
+    uint32_t freqLong = MTHmin(first->modulationFrequency, second->modulationFrequency);
+    if (freqShort / gcd > BTA_PHASE_UNWRAPPING_CANDIDATES_MAX) {
+        return BTA_StatusNotSupported;
+    }
+    double rangeScale = first->unit == BTA_UnitMeter ? 0.001 : 1;
+    UnwrappingArgs args;
+    args.first = first;
+    args.second = second;
+    args.firstIsShort = first->modulationFrequency == freqShort;
+    args.rangeShort = (float)(SPEED_OF_LIGHT_MM / (2.0 * freqShort) * rangeScale);
+    args.rangeLong = (float)(SPEED_OF_LIGHT_MM / (2.0 * freqLong) * rangeScale);
+    args.range = (float)(SPEED_OF_LIGHT_MM / (2.0 * gcd) * rangeScale);
+    args.candidatesLen = freqShort / gcd;
+    args.dstUInt32 = 0;
+    uint32_t pxCount = first->xRes * first->yRes;
+    if (first->dataFormat == BTA_DataFormatUInt16 && args.range > UINT16_MAX) {
+        // e.g. 20 and 18 MHz combine to 75 m, which doesn't fit UInt16 millimeters
+        args.dstUInt32 = (uint32_t *)malloc(pxCount * sizeof(uint32_t));
+        if (!args.dstUInt32) {
+            return BTA_StatusOutOfMemory;
+        }
+    }
+    BTAparallelFor(first->yRes, MTHmax(1, UNWRAPPING_PARALLEL_MIN / MTHmax(1, first->xRes)), unwrapRows, &args);
+    if (args.dstUInt32) {
+        free(first->data);
+        first->data = (uint8_t *)args.dstUInt32;
+        first->dataFormat = BTA_DataFormatUInt32;
+        first->dataLen = pxCount * sizeof(uint32_t);
+    }
+    first->modulationFrequency = gcd;
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAphaseUnwrappingApply(BTA_Frame *frame) {
+    if (!frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTA_Status result = BTA_StatusOk;
+    BTA_Channel *consumed[UINT8_MAX] = { 0 };
+    int consumedLen = 0;
+    uint8_t used[UINT8_MAX] = { 0 };
+    for (int chInd = 0; chInd < frame->channelsLen; chInd++) {
+        BTA_Channel *first = frame->channels[chInd];
+        if (used[chInd] || !isUnwrappable(first)) {
+            continue;
+        }
+        for (int chInd2 = chInd + 1; chInd2 < frame->channelsLen; chInd2++) {
+            BTA_Channel *second = frame->channels[chInd2];
+            if (used[chInd2] || !isPair(first, second)) {
+                continue;
+            }
+            BTA_Status status = unwrapPair(first, second);
+            if (status != BTA_StatusOk) {
+                result = status;
+                continue;
+            }
+            used[chInd2] = 1;
+            consumed[consumedLen++] = second;
+            break;
+        }
+    }
+    for (int i = 0; i < consumedLen; i++) {
+        BTAremoveChannelFromFrame(frame, consumed[i]);
+    }
+    return result;
+}
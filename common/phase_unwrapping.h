@@ -0,0 +1,20 @@
+#ifndef PHASE_UNWRAPPING_H_INCLUDED
+#define PHASE_UNWRAPPING_H_INCLUDED
+
+#include <bta.h>
+
+// Pixels are processed in chunks of this many, so that the loop over the candidates runs over whole working buffers and the compiler can vectorize it
+#define BTA_PHASE_UNWRAPPING_CHUNK          256
+// Pairs needing more candidates than this (frequencies with a very small common divisor) are not unwrapped
+#define BTA_PHASE_UNWRAPPING_CANDIDATES_MAX 64
+
+
+// Combines pairs of distance channels captured in different sequences with different modulation frequencies into one distance channel with the
+// unambiguous range of the greatest common divisor of the frequencies. Channels of a pair have the same lens, resolution, data format (UInt16 or Float32) and unit.
+// The result replaces the data of the first channel of a pair (its modulation frequency becomes the common divisor), the second channel is removed from frame.
+// A UInt16 pair whose combined range exceeds UINT16_MAX millimeters (e.g. 20 and 18 MHz: 75 m) yields a UInt32 channel, so far pixels don't saturate.
+// A pixel invalid in either channel is invalid in the result
+BTA_Status BTAphaseUnwrappingApply(BTA_Frame *frame);
+
+
+#endif
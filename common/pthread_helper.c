@@ -1,5 +1,6 @@
 #include "pthread_helper.h"
 #include "timing_helper.h"
+#include "bta_atomic.h"
 //#include <string.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -7,9 +8,11 @@
 
 #ifdef PLAT_WINDOWS
 #   include <semaphore.h>
+#   include <Windows.h>
 #else
 #   include <semaphore.h>
 #   include <errno.h>
+#   include <unistd.h>
 #endif
 #if defined PLAT_APPLE
 #   include <dispatch/dispatch.h>
@@ -71,6 +74,26 @@ BTA_Status BTAcloseMutex(void *mutex) {
 }
 
 
+BTA_Status BTAinitMutexOnce(void **mutex) {
+    if (!mutex) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (BTAatomicLoadPointer(mutex)) {
+        return BTA_StatusOk;
+    }
+    void *mutexNew;
+    BTA_Status status = BTAinitMutex(&mutexNew);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    if (!BTAatomicCompareExchangePointer(mutex, (void *)0, mutexNew)) {
+        // Another thread was faster
+        BTAcloseMutex(mutexNew);
+    }
+    return BTA_StatusOk;
+}
+
+
 BTA_Status BTAcreateThread(void **tid, void *(*runFunction) (void *), void *arg) {
     if (!tid) {
         return BTA_StatusRuntimeError;
@@ -214,4 +237,282 @@ BTA_Status BTAcloseSemaphore(void *semaphore) {
 #   endif
     semaphore = 0;
     return BTA_StatusOk;
-}
\ No newline at end of file
+}
+
+
+BTA_Status BTAinitCondition(void **condition) {
+    pthread_cond_t *conditionPosix = (pthread_cond_t *)calloc(1, sizeof(pthread_cond_t));
+    if (!conditionPosix) {
+        *condition = 0;
+        return BTA_StatusOutOfMemory;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#   ifdef PLAT_LINUX
+    // Timeouts must not depend on changes of the wall clock
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#   endif
+    int result = pthread_cond_init(conditionPosix, &attr);
+    pthread_condattr_destroy(&attr);
+    if (result) {
+        free(conditionPosix);
+        *condition = 0;
+        return BTA_StatusRuntimeError;
+    }
+    *condition = conditionPosix;
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAwaitConditionTimed(void *condition, void *mutex, int msecsTimeout) {
+    assert(condition && mutex);
+    int result;
+    if (!msecsTimeout) {
+        result = pthread_cond_wait((pthread_cond_t *)condition, (pthread_mutex_t *)mutex);
+    }
+    else {
+        struct timespec timeout = { 0 };
+#       ifdef PLAT_LINUX
+        clock_gettime(CLOCK_MONOTONIC, &timeout);
+#       else
+        BTAgetTimeSpec(&timeout);
+#       endif
+        timeout.tv_sec += msecsTimeout / 1000;
+        timeout.tv_nsec += (msecsTimeout % 1000) * 1000000;
+        timeout.tv_sec += timeout.tv_nsec / 1000000000;
+        timeout.tv_nsec %= 1000000000;
+        result = pthread_cond_timedwait((pthread_cond_t *)condition, (pthread_mutex_t *)mutex, &timeout);
+    }
+    if (result == ETIMEDOUT) {
+        return BTA_StatusTimeOut;
+    }
+    return result ? BTA_StatusRuntimeError : BTA_StatusOk;
+}
+
+
+void BTAbroadcastCondition(void *condition) {
+    assert(condition);
+    int result = pthread_cond_broadcast((pthread_cond_t *)condition);
+    assert(!result);
+    MARK_USED(result);
+}
+
+
+void BTAsignalCondition(void *condition) {
+    assert(condition);
+    int result = pthread_cond_signal((pthread_cond_t *)condition);
+    assert(!result);
+    MARK_USED(result);
+}
+
+
+BTA_Status BTAcloseCondition(void *condition) {
+    if (!condition) {
+        return BTA_StatusOk;
+    }
+    int result = pthread_cond_destroy((pthread_cond_t *)condition);
+    if (result) {
+        return BTA_StatusRuntimeError;
+    }
+    free(condition);
+    return BTA_StatusOk;
+}
+
+
+int BTAgetProcessorCount() {
+#   ifdef PLAT_WINDOWS
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
+        int count = (int)systemInfo.dwNumberOfProcessors;
+#   else
+        int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#   endif
+    return count > 0 ? count : 1;
+}
+
+
+// One call of BTAparallelFor. Lives on the stack of the caller, which doesn't return before chunksDone reaches chunksLen
+typedef struct BTA_ParallelForJob {
+    void (*runFunction)(void *arg, int start, int end);
+    void *arg;
+    int count;
+    int chunksLen;
+    int chunkNext;                      // Next chunk to be taken
+    int chunksDone;
+    struct BTA_ParallelForJob *next;    // In the list of jobs with chunks left
+} BTA_ParallelForJob;
+
+
+// mutex guards everything, the threads are started on first use and stopped by BTAparallelForShutdown
+static struct {
+    void *mutex;
+    void *condWork;                     // A job was added or the threads are to stop
+    void *condDone;                     // A chunk is done
+    BTA_ParallelForJob *head;
+    BTA_ParallelForJob *tail;
+    void *threads[BTA_PARALLEL_FOR_THREADS_MAX];
+    int threadsLen;
+    uint8_t started;
+    uint8_t stopping;
+} parallelForPool;
+
+
+// Called with parallelForPool.mutex locked. The job leaves the list with its last chunk
+static void parallelForTakeChunk(BTA_ParallelForJob *job, int *start, int *end) {
+    int chunk = job->chunkNext++;
+    *start = (int)((int64_t)job->count * chunk / job->chunksLen);
+    *end = (int)((int64_t)job->count * (chunk + 1) / job->chunksLen);
+    if (job->chunkNext < job->chunksLen) {
+        return;
+    }
+    BTA_ParallelForJob **link = &parallelForPool.head;
+    BTA_ParallelForJob *prev = 0;
+    while (*link != job) {
+        prev = *link;
+        link = &((*link)->next);
+    }
+    *link = job->next;
+    if (parallelForPool.tail == job) {
+        parallelForPool.tail = prev;
+    }
+}
+
+
+// Called with parallelForPool.mutex locked, unlocks it while running
+static void parallelForRunChunk(BTA_ParallelForJob *job) {
+    int start, end;
+    parallelForTakeChunk(job, &start, &end);
+    BTAunlockMutex(parallelForPool.mutex);
+    job->runFunction(job->arg, start, end);
+    BTAlockMutex(parallelForPool.mutex);
+    if (++job->chunksDone == job->chunksLen) {
+        BTAbroadcastCondition(parallelForPool.condDone);
+    }
+}
+
+
+static void *parallelForRunFunction(void *handle) {
+    (void)handle;
+    BTAlockMutex(parallelForPool.mutex);
+    while (1) {
+        while (!parallelForPool.head && !parallelForPool.stopping) {
+            BTAwaitConditionTimed(parallelForPool.condWork, parallelForPool.mutex, 0);
+        }
+        if (parallelForPool.stopping) {
+            // The callers run the chunks left of their jobs themselves
+            break;
+        }
+        parallelForRunChunk(parallelForPool.head);
+    }
+    BTAunlockMutex(parallelForPool.mutex);
+    return 0;
+}
+
+
+// Returns the number of pool threads (without the caller)
+static int parallelForStart() {
+    if (BTAinitMutexOnce(&parallelForPool.mutex) != BTA_StatusOk) {
+        return 0;
+    }
+    BTAlockMutex(parallelForPool.mutex);
+    if (!parallelForPool.started) {
+        parallelForPool.started = 1;
+        // The conditions are kept over a shutdown
+        if ((parallelForPool.condWork || BTAinitCondition(&parallelForPool.condWork) == BTA_StatusOk) && (parallelForPool.condDone || BTAinitCondition(&parallelForPool.condDone) == BTA_StatusOk)) {
+            int threadsLen = BTAgetProcessorCount();
+            if (threadsLen > BTA_PARALLEL_FOR_THREADS_MAX) {
+                threadsLen = BTA_PARALLEL_FOR_THREADS_MAX;
+            }
+            // The calling thread takes part
+            for (int i = 0; i < threadsLen - 1; i++) {
+                if (BTAcreateThread(&parallelForPool.threads[parallelForPool.threadsLen], &parallelForRunFunction, 0) == BTA_StatusOk) {
+                    parallelForPool.threadsLen++;
+                }
+            }
+        }
+    }
+    int threadsLen = parallelForPool.threadsLen;
+    BTAunlockMutex(parallelForPool.mutex);
+    return threadsLen;
+}
+
+
+BTA_Status BTAparallelFor(int count, int minChunk, void (*runFunction)(void *arg, int start, int end), void *arg) {
+    if (!runFunction || count < 0) {
+        return BTA_StatusInvalidParameter;
+    }
+    int chunksLen = BTAgetProcessorCount();
+    if (chunksLen > BTA_PARALLEL_FOR_THREADS_MAX) {
+        chunksLen = BTA_PARALLEL_FOR_THREADS_MAX;
+    }
+    if (minChunk > 0 && chunksLen > count / minChunk) {
+        chunksLen = count / minChunk;
+    }
+    if (chunksLen > 1) {
+        int poolThreadsLen = parallelForStart();
+        if (chunksLen > poolThreadsLen + 1) {
+            chunksLen = poolThreadsLen + 1;
+        }
+    }
+    if (chunksLen <= 1) {
+        runFunction(arg, 0, count);
+        return BTA_StatusOk;
+    }
+    BTA_ParallelForJob job = { 0 };
+    job.runFunction = runFunction;
+    job.arg = arg;
+    job.count = count;
+    job.chunksLen = chunksLen;
+    BTAlockMutex(parallelForPool.mutex);
+    if (parallelForPool.tail) {
+        parallelForPool.tail->next = &job;
+    }
+    else {
+        parallelForPool.head = &job;
+    }
+    parallelForPool.tail = &job;
+    BTAbroadcastCondition(parallelForPool.condWork);
+    // The calling thread works on its own job until no chunks are left, so nested and concurrent calls always make progress
+    while (job.chunkNext < job.chunksLen) {
+        parallelForRunChunk(&job);
+    }
+    while (job.chunksDone < job.chunksLen) {
+        BTAwaitConditionTimed(parallelForPool.condDone, parallelForPool.mutex, 0);
+    }
+    BTAunlockMutex(parallelForPool.mutex);
+    return BTA_StatusOk;
+}
+
+
+void BTAparallelForShutdown() {
+    if (BTAinitMutexOnce(&parallelForPool.mutex) != BTA_StatusOk) {
+        return;
+    }
+    BTAlockMutex(parallelForPool.mutex);
+    if (!parallelForPool.started || parallelForPool.stopping) {
+        BTAunlockMutex(parallelForPool.mutex);
+        return;
+    }
+    parallelForPool.stopping = 1;
+    BTAbroadcastCondition(parallelForPool.condWork);
+    BTAunlockMutex(parallelForPool.mutex);
+    // Meanwhile BTAparallelFor still counts on the threads, but its callers run the chunks nobody took
+    for (int i = 0; i < parallelForPool.threadsLen; i++) {
+        BTAjoinThread(parallelForPool.threads[i]);
+        parallelForPool.threads[i] = 0;
+    }
+    BTAlockMutex(parallelForPool.mutex);
+    parallelForPool.threadsLen = 0;
+    parallelForPool.started = 0;
+    parallelForPool.stopping = 0;
+    BTAunlockMutex(parallelForPool.mutex);
+}
+
+
+#if !defined PLAT_WINDOWS && defined __GNUC__
+// Unloading the library with the threads still waiting would leave them in unmapped code. Not possible on Windows,
+// where DllMain must not wait for threads. There the threads are stopped when the last handle is closed
+__attribute__((destructor)) static void parallelForUnload() {
+    BTAparallelForShutdown();
+}
+#endif
@@ -11,6 +11,9 @@ BTA_Status BTAinitMutex(void **mutex);
 void BTAlockMutex(void *mutex);
 void BTAunlockMutex(void *mutex);
 BTA_Status BTAcloseMutex(void *mutex);
+/*  Initialises *mutex unless another thread did so already. For process wide state created on first use: *mutex must be a zero
+    initialised static and is never closed. Safe to call concurrently   */
+BTA_Status BTAinitMutexOnce(void **mutex);
 
 /*  @post must be joined with BTAjoinThread         */
 BTA_Status BTAcreateThread(void **tid, void *(*runFunction) (void *), void *arg);
@@ -20,4 +23,24 @@ BTA_Status BTAinitSemaphore(void **semaphore, int shared, int initValue);
 void BTAwaitSemaphore(void *semaphore);
 BTA_Status BTAwaitSemaphoreTimed(void *semaphore, int msecsTimeout);
 void BTApostSemaphore(void *semaphore);
-BTA_Status BTAcloseSemaphore(void *semaphore);
\ No newline at end of file
+BTA_Status BTAcloseSemaphore(void *semaphore);
+
+BTA_Status BTAinitCondition(void **condition);
+/*  The mutex must be locked by the caller. It is unlocked while waiting and locked again on return.
+    Spurious wakeups are possible, so the caller must check its predicate in a loop. msecsTimeout 0 waits endlessly    */
+BTA_Status BTAwaitConditionTimed(void *condition, void *mutex, int msecsTimeout);
+void BTAbroadcastCondition(void *condition);
+/*  Wakes one waiting thread    */
+void BTAsignalCondition(void *condition);
+BTA_Status BTAcloseCondition(void *condition);
+
+#define BTA_PARALLEL_FOR_THREADS_MAX 16
+
+int BTAgetProcessorCount();
+/*  Splits [0, count) into chunks of at least minChunk and calls runFunction(arg, start, end) for each chunk.
+    The chunks are run by a pool of threads started on first use and kept until BTAparallelForShutdown.
+    The calling thread takes part and the call returns when all chunks are done. Calls may be concurrent and nested   */
+BTA_Status BTAparallelFor(int count, int minChunk, void (*runFunction)(void *arg, int start, int end), void *arg);
+/*  Stops and joins the pool threads. Calls of BTAparallelFor meanwhile still complete, the next one starts the pool again.
+    Called when the last handle is closed and, where supported, when the library is unloaded   */
+void BTAparallelForShutdown();
\ No newline at end of file
@@ -0,0 +1,264 @@
+#include "raw_phases.h"
+#include <pthread_helper.h>
+#include <mth_math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+
+#define SPEED_OF_LIGHT_MM       299792458000.0
+#define PI_F                    3.14159265f
+#define TWO_PI_F                6.28318531f
+// Below this many pixels per thread, starting threads costs more than it saves
+#define RAW_PHASES_PARALLEL_MIN 16384
+
+
+typedef struct RawPhasesArgs {
+    BTA_Channel *inputs[4];         // 4 phases 0, 90, 180, 270 or I and Q
+    int inputsLen;
+    int xRes;
+    float distancePerRad;
+    float minAmplitude;
+    float confidencePerAmplitude;
+    uint16_t *distances;
+    uint16_t *amplitudes;
+    uint8_t *confidences;
+} RawPhasesArgs;
+
+
+// All raw formats carry 16 bits per pixel. Returns 0 if the format is not a raw format
+static uint8_t getRawRange(BTA_DataFormat dataFormat, int *lo, int *hi) {
+    switch (dataFormat) {
+    case BTA_DataFormatSInt16:
+        *lo = INT16_MIN;
+        *hi = INT16_MAX;
+        return 1;
+    case BTA_DataFormatSInt16Mlx12S:
+        *lo = -2048;
+        *hi = 2047;
+        return 1;
+    case BTA_DataFormatSInt16Mlx1C11S:
+        *lo = -1024;
+        *hi = 1023;
+        return 1;
+    case BTA_DataFormatUInt16Mlx1C11U:
+        *lo = 0;
+        *hi = 2047;
+        return 1;
+    case BTA_DataFormatUInt16Mlx12U:
+        *lo = 0;
+        *hi = 4095;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+
+// Decoding is idempotent, so it doesn't matter whether the parser already sign extended the data or not (shared memory frames)
+#define DECODE_LOOP(DECODE, lo, hi)                                 \
+    {                                                               \
+        for (i = 0; i < n; i++) {                                   \
+            int v = DECODE(src[i]);                                 \
+            w[i] = (float)v;                                        \
+            saturated[i] |= (uint8_t)((v <= (lo)) | (v >= (hi)));  \
+        }                                                           \
+        break;                                                      \
+    }
+
+#define DECODE_SINT16(s)        ((int16_t)(s))
+#define DECODE_MLX12S(s)        ((((s) & 0x0fff) ^ 0x0800) - 0x0800)
+#define DECODE_MLX1C11S(s)      ((((s) & 0x07ff) ^ 0x0400) - 0x0400)
+#define DECODE_MLX1C11U(s)      ((s) & 0x07ff)
+#define DECODE_MLX12U(s)        ((s) & 0x0fff)
+
+
+static void decode(const uint16_t *src, BTA_DataFormat dataFormat, float *w, uint8_t *saturated, int n) {
+    int i;
+    switch (dataFormat) {
+    case BTA_DataFormatSInt16: DECODE_LOOP(DECODE_SINT16, INT16_MIN, INT16_MAX)
+    case BTA_DataFormatSInt16Mlx12S: DECODE_LOOP(DECODE_MLX12S, -2048, 2047)
+    case BTA_DataFormatSInt16Mlx1C11S: DECODE_LOOP(DECODE_MLX1C11S, -1024, 1023)
+    case BTA_DataFormatUInt16Mlx1C11U: DECODE_LOOP(DECODE_MLX1C11U, -1, 2047)
+    case BTA_DataFormatUInt16Mlx12U: DECODE_LOOP(DECODE_MLX12U, -1, 4095)
+    default:
+        break;
+    }
+}
+
+
+// atan2(q, i) in [0, 2 pi). Polynomial for atan on [0, 1] (Abramowitz and Stegun 4.4.49, error below 1e-5 rad), the octant is restored by selects
+static inline float phaseAngle(float q, float i) {
+    float ai = fabsf(i);
+    float aq = fabsf(q);
+    float mx = ai > aq ? ai : aq;
+    float mn = ai > aq ? aq : ai;
+    float t = mx > 0 ? mn / mx : 0;
+    float t2 = t * t;
+    float r = t * (0.9998660f + t2 * (-0.3302995f + t2 * (0.1801410f + t2 * (-0.0851330f + t2 * 0.0208351f))));
+    r = aq > ai ? 0.5f * PI_F - r : r;
+    r = i < 0 ? PI_F - r : r;
+    r = q < 0 ? TWO_PI_F - r : r;
+    return r >= TWO_PI_F ? r - TWO_PI_F : r;
+}
+
+
+static void calcChunk(const RawPhasesArgs *args, const float *i, const float *q, const uint8_t *saturated, int n, int offset) {
+    uint16_t *distances = args->distances + offset;
+    uint16_t *amplitudes = args->amplitudes + offset;
+    uint8_t *confidences = args->confidences + offset;
+    for (int xy = 0; xy < n; xy++) {
+        float amplitude = 0.5f * sqrtf(i[xy] * i[xy] + q[xy] * q[xy]);
+        float distance = phaseAngle(q[xy], i[xy]) * args->distancePerRad + 0.5f;
+        float confidence = amplitude * args->confidencePerAmplitude + 0.5f;
+        distance = distance < 10 ? 10 : (distance > UINT16_MAX ? UINT16_MAX : distance);
+        amplitude = amplitude > UINT16_MAX ? UINT16_MAX : amplitude;
+        confidence = confidence > 100 ? 100 : confidence;
+        uint8_t lowAmplitude = amplitude < args->minAmplitude;
+        uint16_t code = saturated[xy] ? BTA_RAW_PHASES_CODE_SATURATED : BTA_RAW_PHASES_CODE_LOW_AMPLITUDE;
+        uint8_t invalid = saturated[xy] | lowAmplitude;
+        distances[xy] = invalid ? code : (uint16_t)distance;
+        amplitudes[xy] = (uint16_t)(amplitude + 0.5f);
+        confidences[xy] = invalid ? 0 : (uint8_t)confidence;
+    }
+}
+
+
+static void calcRows(void *arg, int rowStart, int rowEnd) {
+    RawPhasesArgs *args = (RawPhasesArgs *)arg;
+    int end = rowEnd * args->xRes;
+    float w[4][BTA_RAW_PHASES_CHUNK];
+    uint8_t saturated[BTA_RAW_PHASES_CHUNK];
+    for (int chunkStart = rowStart * args->xRes; chunkStart < end; chunkStart += BTA_RAW_PHASES_CHUNK) {
+        int n = MTHmin(BTA_RAW_PHASES_CHUNK, end - chunkStart);
+        memset(saturated, 0, n);
+        for (int inInd = 0; inInd < args->inputsLen; inInd++) {
+            BTA_Channel *input = args->inputs[inInd];
+            decode((const uint16_t *)input->data + chunkStart, input->dataFormat, w[inInd], saturated, n);
+        }
+        if (args->inputsLen == 4) {
+            // I = phase 0 - phase 180, Q = phase 90 - phase 270
+            for (int xy = 0; xy < n; xy++) {
+                w[0][xy] -= w[2][xy];
+                w[1][xy] -= w[3][xy];
+            }
+        }
+        calcChunk(args, w[0], w[1], saturated, n, chunkStart);
+    }
+}
+
+
+// The phases of one measurement share sequence, lens, resolution, format and frequency. Multi-sequence frames may repeat a frequency in another sequence
+static uint8_t isMatchingRawChannel(BTA_Channel *channel, BTA_ChannelId id, BTA_Channel *reference) {
+    return channel->id == id && channel->sequenceCounter == reference->sequenceCounter && channel->lensIndex == reference->lensIndex &&
+           channel->xRes == reference->xRes && channel->yRes == reference->yRes &&
+           channel->dataFormat == reference->dataFormat && channel->modulationFrequency == reference->modulationFrequency &&
+           channel->data && channel->dataLen == (uint32_t)channel->xRes * channel->yRes * sizeof(uint16_t);
+}
+
+
+static BTA_Channel *findRawChannel(BTA_Frame *frame, int channelsLen, BTA_ChannelId id, BTA_Channel *reference) {
+    for (int chInd = 0; chInd < channelsLen; chInd++) {
+        if (isMatchingRawChannel(frame->channels[chInd], id, reference)) {
+            return frame->channels[chInd];
+        }
+    }
+    return 0;
+}
+
+
+static BTA_Status insertOutputChannels(BTA_Frame *frame, RawPhasesArgs *args) {
+    BTA_Channel *ref = args->inputs[0];
+    uint32_t pxCount = ref->xRes * ref->yRes;
+    BTA_Status status = BTAinsertChannelIntoFrame2(frame, BTA_ChannelIdDistance, ref->xRes, ref->yRes, BTA_DataFormatUInt16, BTA_UnitMillimeter, ref->integrationTime, ref->modulationFrequency,
+                                                   (uint8_t *)args->distances, pxCount * sizeof(uint16_t), 0, 0, ref->lensIndex, ref->flags, ref->sequenceCounter, ref->gain);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    args->distances = 0;
+    status = BTAinsertChannelIntoFrame2(frame, BTA_ChannelIdAmplitude, ref->xRes, ref->yRes, BTA_DataFormatUInt16, BTA_UnitUnitLess, ref->integrationTime, ref->modulationFrequency,
+                                        (uint8_t *)args->amplitudes, pxCount * sizeof(uint16_t), 0, 0, ref->lensIndex, ref->flags, ref->sequenceCounter, ref->gain);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    args->amplitudes = 0;
+    status = BTAinsertChannelIntoFrame2(frame, BTA_ChannelIdConfidence, ref->xRes, ref->yRes, BTA_DataFormatUInt8, BTA_UnitUnitLess, ref->integrationTime, ref->modulationFrequency,
+                                        args->confidences, pxCount * sizeof(uint8_t), 0, 0, ref->lensIndex, ref->flags, ref->sequenceCounter, ref->gain);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    args->confidences = 0;
+    return BTA_StatusOk;
+}
+
+
+static BTA_Status calcSet(BTA_Frame *frame, RawPhasesArgs *args) {
+    BTA_Channel *ref = args->inputs[0];
+    int lo, hi;
+    if (!ref->modulationFrequency || !getRawRange(ref->dataFormat, &lo, &hi)) {
+        return BTA_StatusNotSupported;
+    }
+    int pxCount = ref->xRes * ref->yRes;
+    // The amplitude of the strongest signal the format can carry
+    float fullScale = args->inputsLen == 4 ? 0.5f * (hi - lo) : 0.5f * MTHmax(hi, -lo);
+    args->xRes = ref->xRes;
+    args->distancePerRad = (float)(SPEED_OF_LIGHT_MM / (2.0 * ref->modulationFrequency) / TWO_PI_F);
+    args->confidencePerAmplitude = 100 / fullScale;
+    args->distances = (uint16_t *)malloc(pxCount * sizeof(uint16_t));
+    args->amplitudes = (uint16_t *)malloc(pxCount * sizeof(uint16_t));
+    args->confidences = (uint8_t *)malloc(pxCount * sizeof(uint8_t));
+    BTA_Status status = BTA_StatusOutOfMemory;
+    if (args->distances && args->amplitudes && args->confidences) {
+        BTAparallelFor(ref->yRes, MTHmax(1, RAW_PHASES_PARALLEL_MIN / MTHmax(1, ref->xRes)), calcRows, args);
+        status = insertOutputChannels(frame, args);
+    }
+    free(args->distances);
+    free(args->amplitudes);
+    free(args->confidences);
+    return status;
+}
+
+
+BTA_Status BTArawPhasesApply(BTA_Frame *frame, float minAmplitude) {
+    if (!frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTA_Status result = BTA_StatusOk;
+    // Only look at the channels present before we start adding
+    int channelsLen = frame->channelsLen;
+    for (int chInd = 0; chInd < channelsLen; chInd++) {
+        BTA_Channel *channel = frame->channels[chInd];
+        RawPhasesArgs args = { 0 };
+        args.minAmplitude = minAmplitude;
+        args.inputs[0] = channel;
+        if (channel->id == BTA_ChannelIdPhase0 && isMatchingRawChannel(channel, BTA_ChannelIdPhase0, channel)) {
+            args.inputs[1] = findRawChannel(frame, channelsLen, BTA_ChannelIdPhase90, channel);
+            args.inputs[2] = findRawChannel(frame, channelsLen, BTA_ChannelIdPhase180, channel);
+            args.inputs[3] = findRawChannel(frame, channelsLen, BTA_ChannelIdPhase270, channel);
+            args.inputsLen = 4;
+        }
+        else if (channel->id == BTA_ChannelIdRawPhase && isMatchingRawChannel(channel, BTA_ChannelIdRawPhase, channel) && chInd + 3 < channelsLen) {
+            for (int i = 1; i < 4; i++) {
+                BTA_Channel *next = frame->channels[chInd + i];
+                args.inputs[i] = isMatchingRawChannel(next, BTA_ChannelIdRawPhase, channel) ? next : 0;
+            }
+            args.inputsLen = 4;
+        }
+        else if (channel->id == BTA_ChannelIdRawI && isMatchingRawChannel(channel, BTA_ChannelIdRawI, channel)) {
+            args.inputs[1] = findRawChannel(frame, channelsLen, BTA_ChannelIdRawQ, channel);
+            args.inputsLen = 2;
+        }
+        if (!args.inputsLen || !args.inputs[1] || (args.inputsLen == 4 && (!args.inputs[2] || !args.inputs[3]))) {
+            continue;
+        }
+        if (channel->id == BTA_ChannelIdRawPhase) {
+            // The 4 channels are used up, the next set starts after them
+            chInd += 3;
+        }
+        BTA_Status status = calcSet(frame, &args);
+        if (status != BTA_StatusOk) {
+            result = status;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,23 @@
+#ifndef RAW_PHASES_H_INCLUDED
+#define RAW_PHASES_H_INCLUDED
+
+#include <bta.h>
+
+// Pixels are processed in chunks of this many: the raw values are decoded into float working buffers, so that the loops computing
+// distance, amplitude and confidence are free of branches and type dispatch and the compiler can vectorize them
+#define BTA_RAW_PHASES_CHUNK        256
+
+// Distance codes for pixels that could not be measured (the lowest 10 values of a distance channel are invalidation codes)
+#define BTA_RAW_PHASES_CODE_LOW_AMPLITUDE   0
+#define BTA_RAW_PHASES_CODE_SATURATED       1
+
+
+// Adds the channels Distance (UInt16 in millimeters), Amplitude (UInt16) and Confidence (UInt8, percent of the full scale signal) to frame for each set of raw channels.
+// A set is the channels Phase0, Phase90, Phase180 and Phase270, or 4 consecutive RawPhase channels (phase shifts 0, 90, 180 and 270 degrees), or the channels RawI and RawQ
+// (I = phase 0 - phase 180, Q = phase 90 - phase 270), each of the same lens, resolution and modulation frequency.
+// The raw values are decoded according to their data format (SInt16, Mlx12S, Mlx1C11S, Mlx1C11U, Mlx12U), a value at the limit of its format counts as saturated.
+// Pixels with an amplitude below minAmplitude are invalid. No calibration is applied
+BTA_Status BTArawPhasesApply(BTA_Frame *frame, float minAmplitude);
+
+
+#endif
@@ -0,0 +1,349 @@
+#include "temporal_filter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+
+#define ROUND_INT(a)    ((a) >= 0 ? (a) + 0.5 : (a) - 0.5)
+#define ROUND_NONE(a)   (a)
+
+
+BTA_Status BTAtemporalFilterInit(BTA_TemporalFilterInst **inst, BTA_InfoEventInst *infoEventInst) {
+    if (!inst) {
+        return BTA_StatusInvalidParameter;
+    }
+    *inst = (BTA_TemporalFilterInst *)calloc(1, sizeof(BTA_TemporalFilterInst));
+    if (!*inst) {
+        return BTA_StatusOutOfMemory;
+    }
+    (*inst)->infoEventInst = infoEventInst;
+    return BTA_StatusOk;
+}
+
+
+static void freeState(BTA_TemporalFilterState *state) {
+    if (!state) {
+        return;
+    }
+    free(state->ring);
+    free(state->sums);
+    free(state->validCounts);
+    free(state->ema);
+    free(state->emaValidity);
+    free(state);
+}
+
+
+BTA_Status BTAtemporalFilterReset(BTA_TemporalFilterInst *inst) {
+    if (!inst) {
+        return BTA_StatusInvalidParameter;
+    }
+    for (int i = 0; i < inst->statesLen; i++) {
+        freeState(inst->states[i]);
+    }
+    free(inst->states);
+    inst->states = 0;
+    inst->statesLen = 0;
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAtemporalFilterClose(BTA_TemporalFilterInst **inst) {
+    if (!inst) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (!*inst) {
+        // not even opened
+        return BTA_StatusOk;
+    }
+    BTAtemporalFilterReset(*inst);
+    free(*inst);
+    *inst = 0;
+    return BTA_StatusOk;
+}
+
+
+// Valid values are within [validMin, validMax], NaN is always invalid. Invalid results are set to invalidValue.
+// The invalidation conventions are the same as in BTAaverageChannels. Returns 0 if the channel is not to be filtered
+static uint8_t getValidity(BTA_ChannelId id, BTA_DataFormat dataFormat, double *validMin, double *validMax, double *invalidValue) {
+    double typeMin, typeMax;
+    switch (dataFormat) {
+    case BTA_DataFormatUInt8:
+        typeMin = 0;
+        typeMax = UINT8_MAX;
+        break;
+    case BTA_DataFormatUInt16:
+        typeMin = 0;
+        typeMax = UINT16_MAX;
+        break;
+    case BTA_DataFormatUInt32:
+        typeMin = 0;
+        typeMax = UINT32_MAX;
+        break;
+    case BTA_DataFormatSInt16:
+        typeMin = INT16_MIN;
+        typeMax = INT16_MAX;
+        break;
+    case BTA_DataFormatSInt32:
+        typeMin = INT32_MIN;
+        typeMax = INT32_MAX;
+        break;
+    case BTA_DataFormatFloat32:
+        typeMin = -DBL_MAX;
+        typeMax = DBL_MAX;
+        break;
+    default:
+        return 0;
+    }
+    *validMin = typeMin;
+    *validMax = typeMax;
+    *invalidValue = dataFormat == BTA_DataFormatFloat32 ? NAN : 0;
+    switch (id) {
+    case BTA_ChannelIdDistance:
+    case BTA_ChannelIdZ:
+        if (dataFormat != BTA_DataFormatFloat32) {
+            // The lowest 10 values are invalidation codes
+            *validMin = typeMin + 10;
+            *invalidValue = typeMin;
+        }
+        return 1;
+    case BTA_ChannelIdAmplitude:
+        if (dataFormat != BTA_DataFormatFloat32) {
+            *validMax = typeMax - 1;
+            *invalidValue = typeMax;
+        }
+        return 1;
+    case BTA_ChannelIdFlags:
+    case BTA_ChannelIdColor:
+    case BTA_ChannelIdXYZ:
+        // Averaging makes no sense
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+
+#define SLIDING_MEAN_KERNEL(name, T, ROUND)                                                                                     \
+static void name(BTA_TemporalFilterState *state, T *data, int res, double validMin, double validMax, T invalidValue, double maxInvalidRatio) { \
+    T *slot = (T *)state->ring + (size_t)state->ringPos * res;                                                                  \
+    uint8_t full = state->ringFilled == state->windowLen;                                                                       \
+    int filled = full ? state->windowLen : state->ringFilled + 1;                                                               \
+    double maxInvalid = filled * maxInvalidRatio;                                                                               \
+    for (int xy = 0; xy < res; xy++) {                                                                                          \
+        if (full) {                                                                                                             \
+            /* The oldest value leaves the window */                                                                            \
+            double old = slot[xy];                                                                                              \
+            if (old >= validMin && old <= validMax) {                                                                           \
+                state->sums[xy] -= old;                                                                                         \
+                state->validCounts[xy]--;                                                                                       \
+            }                                                                                                                   \
+        }                                                                                                                       \
+        T cur = data[xy];                                                                                                       \
+        double v = cur;                                                                                                         \
+        uint8_t valid = v >= validMin && v <= validMax;                                                                         \
+        slot[xy] = cur;                                                                                                         \
+        if (valid) {                                                                                                            \
+            state->sums[xy] += v;                                                                                               \
+            state->validCounts[xy]++;                                                                                           \
+        }                                                                                                                       \
+        int validCount = state->validCounts[xy];                                                                                \
+        if (validCount && filled - validCount <= maxInvalid) {                                                                  \
+            data[xy] = (T)ROUND(state->sums[xy] / validCount);                                                                  \
+        }                                                                                                                       \
+        else if (valid) {                                                                                                       \
+            data[xy] = invalidValue;                                                                                            \
+        }                                                                                                                       \
+    }                                                                                                                           \
+    state->ringPos = (uint8_t)((state->ringPos + 1) % state->windowLen);                                                        \
+    state->ringFilled = (uint8_t)filled;                                                                                        \
+}
+
+SLIDING_MEAN_KERNEL(slidingMeanUInt8, uint8_t, ROUND_INT)
+SLIDING_MEAN_KERNEL(slidingMeanUInt16, uint16_t, ROUND_INT)
+SLIDING_MEAN_KERNEL(slidingMeanUInt32, uint32_t, ROUND_INT)
+SLIDING_MEAN_KERNEL(slidingMeanSInt16, int16_t, ROUND_INT)
+SLIDING_MEAN_KERNEL(slidingMeanSInt32, int32_t, ROUND_INT)
+SLIDING_MEAN_KERNEL(slidingMeanFloat32, float, ROUND_NONE)
+
+
+#define EMA_KERNEL(name, T, ROUND)                                                                                              \
+static void name(BTA_TemporalFilterState *state, T *data, int res, double validMin, double validMax, T invalidValue, double maxInvalidRatio, float alpha, uint8_t first) { \
+    float *ema = state->ema;                                                                                                    \
+    float *emaValidity = state->emaValidity;                                                                                    \
+    float minValidity = (float)(1.0 - maxInvalidRatio);                                                                         \
+    for (int xy = 0; xy < res; xy++) {                                                                                          \
+        double v = data[xy];                                                                                                    \
+        uint8_t valid = v >= validMin && v <= validMax;                                                                         \
+        if (valid) {                                                                                                            \
+            /* Without valid history the average starts at the current value */                                                \
+            ema[xy] = (first || emaValidity[xy] <= 0) ? (float)v : ema[xy] + alpha * ((float)v - ema[xy]);                      \
+        }                                                                                                                       \
+        emaValidity[xy] = first ? (float)valid : emaValidity[xy] + alpha * ((float)valid - emaValidity[xy]);                    \
+        if (emaValidity[xy] > 0 && emaValidity[xy] >= minValidity) {                                                            \
+            data[xy] = (T)ROUND(ema[xy]);                                                                                       \
+        }                                                                                                                       \
+        else if (valid) {                                                                                                       \
+            data[xy] = invalidValue;                                                                                            \
+        }                                                                                                                       \
+    }                                                                                                                           \
+}
+
+EMA_KERNEL(emaUInt8, uint8_t, ROUND_INT)
+EMA_KERNEL(emaUInt16, uint16_t, ROUND_INT)
+EMA_KERNEL(emaUInt32, uint32_t, ROUND_INT)
+EMA_KERNEL(emaSInt16, int16_t, ROUND_INT)
+EMA_KERNEL(emaSInt32, int32_t, ROUND_INT)
+EMA_KERNEL(emaFloat32, float, ROUND_NONE)
+
+
+static BTA_TemporalFilterState *createState(BTA_Channel *channel, BTA_TemporalFilterMode mode, uint8_t windowLen) {
+    BTA_TemporalFilterState *state = (BTA_TemporalFilterState *)calloc(1, sizeof(BTA_TemporalFilterState));
+    if (!state) {
+        return 0;
+    }
+    int res = channel->xRes * channel->yRes;
+    state->id = channel->id;
+    state->lensIndex = channel->lensIndex;
+    state->xRes = channel->xRes;
+    state->yRes = channel->yRes;
+    state->dataFormat = channel->dataFormat;
+    state->mode = mode;
+    state->windowLen = windowLen;
+    if (mode == BTA_TemporalFilterModeSlidingMean) {
+        state->ring = (uint8_t *)malloc((size_t)windowLen * res * (channel->dataFormat & 0xf));
+        state->sums = (double *)calloc(res, sizeof(double));
+        state->validCounts = (uint8_t *)calloc(res, sizeof(uint8_t));
+        if (!state->ring || !state->sums || !state->validCounts) {
+            freeState(state);
+            return 0;
+        }
+    }
+    else {
+        state->ema = (float *)malloc(res * sizeof(float));
+        state->emaValidity = (float *)malloc(res * sizeof(float));
+        if (!state->ema || !state->emaValidity) {
+            freeState(state);
+            return 0;
+        }
+    }
+    return state;
+}
+
+
+// Finds the state for this kind of channel. A state with different settings is replaced by a fresh one.
+// *isNew tells whether the state has no history yet
+static BTA_TemporalFilterState *getState(BTA_TemporalFilterInst *inst, BTA_Channel *channel, BTA_TemporalFilterMode mode, uint8_t windowLen, uint8_t *isNew) {
+    *isNew = 1;
+    for (int i = 0; i < inst->statesLen; i++) {
+        BTA_TemporalFilterState *state = inst->states[i];
+        if (state->id == channel->id && state->lensIndex == channel->lensIndex && state->xRes == channel->xRes && state->yRes == channel->yRes && state->dataFormat == channel->dataFormat) {
+            if (state->mode == mode && (mode != BTA_TemporalFilterModeSlidingMean || state->windowLen == windowLen)) {
+                *isNew = 0;
+                return state;
+            }
+            BTA_TemporalFilterState *stateNew = createState(channel, mode, windowLen);
+            if (!stateNew) {
+                return 0;
+            }
+            freeState(state);
+            inst->states[i] = stateNew;
+            return stateNew;
+        }
+    }
+    BTA_TemporalFilterState **states = (BTA_TemporalFilterState **)realloc(inst->states, (inst->statesLen + 1) * sizeof(BTA_TemporalFilterState *));
+    if (!states) {
+        return 0;
+    }
+    inst->states = states;
+    BTA_TemporalFilterState *state = createState(channel, mode, windowLen);
+    if (!state) {
+        return 0;
+    }
+    inst->states[inst->statesLen++] = state;
+    return state;
+}
+
+
+BTA_Status BTAtemporalFilterApply(BTA_TemporalFilterInst *inst, BTA_Frame *frame, BTA_TemporalFilterMode mode, uint8_t windowLen, float alpha, float minValidPixelPercentage) {
+    if (!inst || !frame || minValidPixelPercentage < 0 || minValidPixelPercentage > 100) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (mode == BTA_TemporalFilterModeOff) {
+        return BTA_StatusOk;
+    }
+    if (mode == BTA_TemporalFilterModeSlidingMean && windowLen < 1) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (mode == BTA_TemporalFilterModeEma && (alpha <= 0 || alpha > 1)) {
+        return BTA_StatusInvalidParameter;
+    }
+    double maxInvalidRatio = minValidPixelPercentage / 100.0;
+    for (int chInd = 0; chInd < frame->channelsLen; chInd++) {
+        BTA_Channel *channel = frame->channels[chInd];
+        double validMin, validMax, invalidValue;
+        if (!channel->data || !getValidity(channel->id, channel->dataFormat, &validMin, &validMax, &invalidValue)) {
+            continue;
+        }
+        int res = channel->xRes * channel->yRes;
+        if (!res || channel->dataLen < (uint32_t)res * (channel->dataFormat & 0xf)) {
+            continue;
+        }
+        uint8_t isNew;
+        BTA_TemporalFilterState *state = getState(inst, channel, mode, windowLen, &isNew);
+        if (!state) {
+            BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Temporal filter: Cannot allocate state for channel %s", BTAchannelIdToString(channel->id));
+            return BTA_StatusOutOfMemory;
+        }
+        if (mode == BTA_TemporalFilterModeSlidingMean) {
+            switch (channel->dataFormat) {
+            case BTA_DataFormatUInt8:
+                slidingMeanUInt8(state, (uint8_t *)channel->data, res, validMin, validMax, (uint8_t)invalidValue, maxInvalidRatio);
+                break;
+            case BTA_DataFormatUInt16:
+                slidingMeanUInt16(state, (uint16_t *)channel->data, res, validMin, validMax, (uint16_t)invalidValue, maxInvalidRatio);
+                break;
+            case BTA_DataFormatUInt32:
+                slidingMeanUInt32(state, (uint32_t *)channel->data, res, validMin, validMax, (uint32_t)invalidValue, maxInvalidRatio);
+                break;
+            case BTA_DataFormatSInt16:
+                slidingMeanSInt16(state, (int16_t *)channel->data, res, validMin, validMax, (int16_t)invalidValue, maxInvalidRatio);
+                break;
+            case BTA_DataFormatSInt32:
+                slidingMeanSInt32(state, (int32_t *)channel->data, res, validMin, validMax, (int32_t)invalidValue, maxInvalidRatio);
+                break;
+            case BTA_DataFormatFloat32:
+                slidingMeanFloat32(state, (float *)channel->data, res, validMin, validMax, (float)invalidValue, maxInvalidRatio);
+                break;
+            default:
+                break;
+            }
+        }
+        else {
+            switch (channel->dataFormat) {
+            case BTA_DataFormatUInt8:
+                emaUInt8(state, (uint8_t *)channel->data, res, validMin, validMax, (uint8_t)invalidValue, maxInvalidRatio, alpha, isNew);
+                break;
+            case BTA_DataFormatUInt16:
+                emaUInt16(state, (uint16_t *)channel->data, res, validMin, validMax, (uint16_t)invalidValue, maxInvalidRatio, alpha, isNew);
+                break;
+            case BTA_DataFormatUInt32:
+                emaUInt32(state, (uint32_t *)channel->data, res, validMin, validMax, (uint32_t)invalidValue, maxInvalidRatio, alpha, isNew);
+                break;
+            case BTA_DataFormatSInt16:
+                emaSInt16(state, (int16_t *)channel->data, res, validMin, validMax, (int16_t)invalidValue, maxInvalidRatio, alpha, isNew);
+                break;
+            case BTA_DataFormatSInt32:
+                emaSInt32(state, (int32_t *)channel->data, res, validMin, validMax, (int32_t)invalidValue, maxInvalidRatio, alpha, isNew);
+                break;
+            case BTA_DataFormatFloat32:
+                emaFloat32(state, (float *)channel->data, res, validMin, validMax, (float)invalidValue, maxInvalidRatio, alpha, isNew);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    return BTA_StatusOk;
+}
@@ -0,0 +1,52 @@
+#ifndef TEMPORAL_FILTER_H_INCLUDED
+#define TEMPORAL_FILTER_H_INCLUDED
+
+#include <bta.h>
+#include <bta_helper.h>
+
+#define BTA_TEMPORAL_FILTER_WINDOW_MAX      255
+
+
+typedef enum BTA_TemporalFilterMode {
+    BTA_TemporalFilterModeOff = 0,
+    BTA_TemporalFilterModeSlidingMean = 1,  ///< Mean of the last windowLen frames, updated with running sums
+    BTA_TemporalFilterModeEma = 2,          ///< Exponential moving average with weight alpha for the newest frame
+} BTA_TemporalFilterMode;
+
+
+// The state of one channel kind (id, lens index, resolution and data format) across frames
+typedef struct BTA_TemporalFilterState {
+    BTA_ChannelId id;
+    uint8_t lensIndex;
+    uint16_t xRes;
+    uint16_t yRes;
+    BTA_DataFormat dataFormat;
+    BTA_TemporalFilterMode mode;
+    uint8_t windowLen;
+    uint8_t *ring;                  ///< Sliding mean: the raw data of the last windowLen channels
+    uint8_t ringPos;                ///< Sliding mean: index of the oldest entry in ring, this is where the next channel goes
+    uint8_t ringFilled;             ///< Sliding mean: number of valid entries in ring
+    double *sums;                   ///< Sliding mean: per pixel sum of the valid values in ring
+    uint8_t *validCounts;           ///< Sliding mean: per pixel number of valid values in ring
+    float *ema;                     ///< EMA: per pixel average of the valid values
+    float *emaValidity;             ///< EMA: per pixel average of validity (1 valid, 0 invalid)
+} BTA_TemporalFilterState;
+
+
+typedef struct BTA_TemporalFilterInst {
+    BTA_TemporalFilterState **states;
+    uint16_t statesLen;
+    BTA_InfoEventInst *infoEventInst;
+} BTA_TemporalFilterInst;
+
+
+BTA_Status BTAtemporalFilterInit(BTA_TemporalFilterInst **inst, BTA_InfoEventInst *infoEventInst);
+BTA_Status BTAtemporalFilterClose(BTA_TemporalFilterInst **inst);
+// Drops all history, must be called from the thread that calls BTAtemporalFilterApply
+BTA_Status BTAtemporalFilterReset(BTA_TemporalFilterInst *inst);
+// Replaces the data of the channels in frame by the temporal average including that frame. The cost per frame does not depend on windowLen.
+// A resulting pixel is invalid if its value was invalid in more than minValidPixelPercentage percent of the averaged frames
+BTA_Status BTAtemporalFilterApply(BTA_TemporalFilterInst *inst, BTA_Frame *frame, BTA_TemporalFilterMode mode, uint8_t windowLen, float alpha, float minValidPixelPercentage);
+
+
+#endif
@@ -1,5 +1,7 @@
 #include "undistort.h"
 #include <bta_helper.h>
+#include <lens_cache.h>
+#include <pthread_helper.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -9,7 +11,17 @@
 
 
 
-static void initUndistortRectifyMap(BTA_IntrinsicData *intData, uint16_t *xy) {
+typedef struct BTA_UndistortRectifyMapArgs {
+    BTA_IntrinsicData *intData;
+    float *uv;
+} BTA_UndistortRectifyMapArgs;
+
+
+// Writes the (fractional) source coordinates u and v for every destination pixel in rows rowStart to rowEnd - 1 into uv.
+// Rows are independent of each other, so this is run in parallel by BTAparallelFor
+static void initUndistortRectifyMapRows(void *arg, int rowStart, int rowEnd) {
+    BTA_IntrinsicData *intData = ((BTA_UndistortRectifyMapArgs *)arg)->intData;
+    float *uv = ((BTA_UndistortRectifyMapArgs *)arg)->uv + rowStart * intData->xRes * 2;
     if (intData->k4 == 0.0 && intData->k5 == 0.0 && intData->k6 == 0.0) {
         // it's pinhole intrinsic data
         //double ir[9] = { 1/fx,     0,  -cx / fx,
@@ -24,8 +36,8 @@ static void initUndistortRectifyMap(BTA_IntrinsicData *intData, uint16_t *xy) {
         const double k5 = 0.0;
         const double k6 = 0.0;
 
-        uint16_t *xyTemp = xy;
-        for (int row = 0; row < intData->yRes; row++)
+        float *uvTemp = uv;
+        for (int row = rowStart; row < rowEnd; row++)
         {
             double _x = ir2;              // row * ir[1] + ir[2];  // row * 0    + -cx/fx
             double _y = row * ir4 + ir5;  // row * ir[4] + ir[5];  // row * 1/fy + -cy/fx
@@ -42,8 +54,8 @@ static void initUndistortRectifyMap(BTA_IntrinsicData *intData, uint16_t *xy) {
                 double kr = (1 + ((intData->k3 * r2 + intData->k2) * r2 + intData->k1) * r2) / (1 + ((k6 * r2 + k5) * r2 + k4) * r2);
                 double u = intData->fx * (x_1 * kr + intData->p1 * _2xy + intData->p2 * (r2 + 2 * x2)) + intData->cx;
                 double v = intData->fy * (y_1 * kr + intData->p1 * (r2 + 2 * y2) + intData->p2 * _2xy) + intData->cy;
-                *xyTemp++ = (uint16_t)round(u);
-                *xyTemp++ = (uint16_t)round(v);
+                *uvTemp++ = (float)u;
+                *uvTemp++ = (float)v;
 
                 _x += ir0;       // + 1/fx
                 //_y += ir[3];   // + 0
@@ -61,8 +73,8 @@ static void initUndistortRectifyMap(BTA_IntrinsicData *intData, uint16_t *xy) {
         double ir4 = 1 / intData->fy;
         double ir5 = -intData->cy / intData->fy;
 
-        uint16_t *xyTemp = xy;
-        for (int row = 0; row < intData->yRes; row++)
+        float *uvTemp = uv;
+        for (int row = rowStart; row < rowEnd; row++)
         {
             double _x = ir2;              // row * ir[1] + ir[2];  // row * 0    + -cx/fx
             double _y = row * ir4 + ir5;  // row * ir[4] + ir[5];  // row * 1/fy + -cy/fx
@@ -82,8 +94,8 @@ static void initUndistortRectifyMap(BTA_IntrinsicData *intData, uint16_t *xy) {
                 double scale = (r == 0) ? 1.0 : theta_d / r;
                 double u = intData->fx * x_1 * scale + intData->cx;
                 double v = intData->fy * y_1 * scale + intData->cy;
-                *xyTemp++ = (uint16_t)round(u);
-                *xyTemp++ = (uint16_t)round(v);
+                *uvTemp++ = (float)u;
+                *uvTemp++ = (float)v;
 
                 _x += ir0;       // + 1/fx
                 //_y += ir[3];   // + 0
@@ -91,100 +103,260 @@ static void initUndistortRectifyMap(BTA_IntrinsicData *intData, uint16_t *xy) {
             }
         }
     }
+    else {
+        // unknown model, leave the image as it is
+        float *uvTemp = uv;
+        for (int row = rowStart; row < rowEnd; row++) {
+            for (int col = 0; col < intData->xRes; col++) {
+                *uvTemp++ = (float)col;
+                *uvTemp++ = (float)row;
+            }
+        }
+    }
 }
 
 
-static void cvRemap24bit(BTA_UndistortInst *inst, BTA_Channel *channel, uint16_t *xy) {
-    if (inst->dstBufLen < channel->dataLen) {
-        inst->dstBufLen = channel->dataLen;
-        free(inst->dstBuf);
-        inst->dstBuf = malloc(inst->dstBufLen);
-        if (!inst->dstBuf) {
-            inst->dstBufLen = 0;
-            inst->dstBuf = 0;
-            BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Cannot allocate buffer for undistortion");
-            return;
+static void initUndistortRectifyMap(BTA_IntrinsicData *intData, float *uv) {
+    BTA_UndistortRectifyMapArgs args = { intData, uv };
+    BTAparallelFor(intData->yRes, 16, &initUndistortRectifyMapRows, &args);
+}
+
+
+static BTA_UndistortionMap *createUndistortionMap(uint16_t lensIndex, uint16_t xRes, uint16_t yRes) {
+    BTA_UndistortionMap *map = (BTA_UndistortionMap *)calloc(1, sizeof(BTA_UndistortionMap));
+    if (!map) {
+        return 0;
+    }
+    int pxCount = xRes * yRes;
+    map->lensIndex = lensIndex;
+    map->xRes = xRes;
+    map->yRes = yRes;
+    map->dataLen = pxCount * (2 * sizeof(int32_t) + 2 * sizeof(uint16_t));
+    map->data = malloc(map->dataLen);
+    if (!map->data) {
+        free(map);
+        return 0;
+    }
+    map->srcIndexNearest = (int32_t *)map->data;
+    map->srcIndexBilinear = map->srcIndexNearest + pxCount;
+    map->weights = (uint16_t *)(map->srcIndexBilinear + pxCount);
+    return map;
+}
+
+
+static void freeUndistortionMap(BTA_UndistortionMap **map) {
+    if (*map) {
+        free((*map)->data);
+        (*map)->data = 0;
+        free(*map);
+        *map = 0;
+    }
+}
+
+
+// Converts the fractional source coordinates into linear source indices and fixed-point weights, so that the remap
+// kernels need neither a bounds check nor a multiplication per pixel
+static void buildRemapTables(BTA_UndistortionMap *map, float *uv) {
+    int xRes = (int)map->xRes;
+    int yRes = (int)map->yRes;
+    for (int i = 0; i < xRes * yRes; i++) {
+        float u = uv[2 * i];
+        float v = uv[2 * i + 1];
+        int xn = (int)floorf(u + 0.5f);
+        int yn = (int)floorf(v + 0.5f);
+        map->srcIndexNearest[i] = (xn >= 0 && xn < xRes && yn >= 0 && yn < yRes) ? xn + yn * xRes : -1;
+        if (u < 0 || v < 0 || u > xRes - 1 || v > yRes - 1 || xRes < 2 || yRes < 2) {
+            map->srcIndexBilinear[i] = -1;
+            map->weights[2 * i] = 0;
+            map->weights[2 * i + 1] = 0;
+            continue;
         }
+        int x0 = MTHmin((int)u, xRes - 2);
+        int y0 = MTHmin((int)v, yRes - 2);
+        map->srcIndexBilinear[i] = x0 + y0 * xRes;
+        map->weights[2 * i] = (uint16_t)MTHround((u - x0) * BTA_UNDISTORT_FRAC_ONE);
+        map->weights[2 * i + 1] = (uint16_t)MTHround((v - y0) * BTA_UNDISTORT_FRAC_ONE);
     }
-    uint16_t *xyTemp = (uint16_t *)xy;
-    uint8_t *dst = (uint8_t *)inst->dstBuf;
-    for (int i = 0; i < channel->xRes * channel->yRes; i++) {
-        int xTemp = (int)*xyTemp++;
-        int yTemp = (int)*xyTemp++;
-        if (xTemp >= 0 && xTemp < channel->xRes && yTemp >= 0 && yTemp < channel->yRes) {
-            uint8_t *S = channel->data + (xTemp + yTemp * channel->xRes) * 3;
-            *dst++ = *S++;
-            *dst++ = *S++;
-            *dst++ = *S;
+}
+
+
+typedef void (*FN_RemapSpan)(BTA_UndistortionMap *map, uint8_t *src, uint8_t *dst, int i, int n);
+
+
+// Walks the destination image in tiles, so that the source pixels gathered for one tile stay in cache
+static void remapTiled(BTA_UndistortionMap *map, uint8_t *src, uint8_t *dst, FN_RemapSpan remapSpan) {
+    int xRes = (int)map->xRes;
+    int yRes = (int)map->yRes;
+    for (int ty = 0; ty < yRes; ty += BTA_UNDISTORT_TILE_H) {
+        int yEnd = MTHmin(ty + BTA_UNDISTORT_TILE_H, yRes);
+        for (int tx = 0; tx < xRes; tx += BTA_UNDISTORT_TILE_W) {
+            int n = MTHmin(BTA_UNDISTORT_TILE_W, xRes - tx);
+            for (int y = ty; y < yEnd; y++) {
+                remapSpan(map, src, dst, tx + y * xRes, n);
+            }
         }
     }
 }
 
 
-static void cvRemap16bit(BTA_UndistortInst *inst, BTA_Channel *channel, uint16_t *xy) {
-    if (inst->dstBufLen < channel->dataLen) {
-        inst->dstBufLen = channel->dataLen;
-        free(inst->dstBuf);
-        inst->dstBuf = malloc(inst->dstBufLen);
-        if (!inst->dstBuf) {
-            inst->dstBufLen = 0;
-            inst->dstBuf = 0;
-            BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Cannot allocate buffer for undistortion");
-            return;
+static void remapNearest8(BTA_UndistortionMap *map, uint8_t *src, uint8_t *dst, int i, int n) {
+    int32_t *srcIndex = map->srcIndexNearest + i;
+    for (int j = 0; j < n; j++) {
+        int32_t k = srcIndex[j];
+        dst[i + j] = k >= 0 ? src[k] : 0;
+    }
+}
+
+
+static void remapNearest16(BTA_UndistortionMap *map, uint8_t *src, uint8_t *dst, int i, int n) {
+    int32_t *srcIndex = map->srcIndexNearest + i;
+    uint16_t *s = (uint16_t *)src;
+    uint16_t *d = (uint16_t *)dst + i;
+    for (int j = 0; j < n; j++) {
+        int32_t k = srcIndex[j];
+        d[j] = k >= 0 ? s[k] : 0;
+    }
+}
+
+
+static void remapNearest24(BTA_UndistortionMap *map, uint8_t *src, uint8_t *dst, int i, int n) {
+    int32_t *srcIndex = map->srcIndexNearest + i;
+    uint8_t *d = dst + 3 * i;
+    for (int j = 0; j < n; j++) {
+        int32_t k = srcIndex[j];
+        if (k >= 0) {
+            memcpy(d, src + 3 * k, 3);
         }
+        else {
+            memset(d, 0, 3);
+        }
+        d += 3;
     }
-    uint16_t *xyTemp = (uint16_t *)xy;
-    uint16_t *dst = (uint16_t *)inst->dstBuf;
-    for (int i = 0; i < channel->xRes * channel->yRes; i++) {
-        int xTemp = (int)*xyTemp++;
-        int yTemp = (int)*xyTemp++;
-        if (xTemp >= 0 && xTemp < channel->xRes && yTemp >= 0 && yTemp < channel->yRes) {
-            uint16_t *S = (uint16_t *)channel->data + xTemp + yTemp * channel->xRes;
-            *dst++ = *S;
+}
+
+
+static void remapNearest32(BTA_UndistortionMap *map, uint8_t *src, uint8_t *dst, int i, int n) {
+    int32_t *srcIndex = map->srcIndexNearest + i;
+    uint32_t *s = (uint32_t *)src;
+    uint32_t *d = (uint32_t *)dst + i;
+    for (int j = 0; j < n; j++) {
+        int32_t k = srcIndex[j];
+        d[j] = k >= 0 ? s[k] : 0;
+    }
+}
+
+
+// Interpolates cn interleaved 8 bit components per pixel (UInt8: cn = 1, Rgb24: cn = 3)
+static void remapBilinear8(BTA_UndistortionMap *map, uint8_t *src, uint8_t *dst, int i, int n, int cn) {
+    int32_t *srcIndex = map->srcIndexBilinear + i;
+    uint16_t *weights = map->weights + 2 * i;
+    int stride = (int)map->xRes * cn;
+    uint8_t *d = dst + cn * i;
+    for (int j = 0; j < n; j++) {
+        int32_t k = srcIndex[j];
+        if (k < 0) {
+            memset(d, 0, cn);
+            d += cn;
+            continue;
+        }
+        uint32_t wx = weights[2 * j];
+        uint32_t wy = weights[2 * j + 1];
+        uint8_t *s = src + cn * k;
+        for (int c = 0; c < cn; c++) {
+            uint32_t top = s[c] * (BTA_UNDISTORT_FRAC_ONE - wx) + s[c + cn] * wx;
+            uint32_t bottom = s[c + stride] * (BTA_UNDISTORT_FRAC_ONE - wx) + s[c + stride + cn] * wx;
+            *d++ = (uint8_t)((top * (BTA_UNDISTORT_FRAC_ONE - wy) + bottom * wy + (1 << (2 * BTA_UNDISTORT_FRAC_BITS - 1))) >> (2 * BTA_UNDISTORT_FRAC_BITS));
         }
     }
 }
 
 
-static void cvRemap8bit(BTA_UndistortInst *inst, BTA_Channel *channel, uint16_t *xy) {
-    if (inst->dstBufLen < channel->dataLen) {
-        inst->dstBufLen = channel->dataLen;
-        free(inst->dstBuf);
-        inst->dstBuf = malloc(inst->dstBufLen);
-        if (!inst->dstBuf) {
-            inst->dstBufLen = 0;
-            inst->dstBuf = 0;
-            BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Cannot allocate buffer for undistortion");
-            return;
+static void remapBilinearUInt8(BTA_UndistortionMap *map, uint8_t *src, uint8_t *dst, int i, int n) {
+    remapBilinear8(map, src, dst, i, n, 1);
+}
+
+
+static void remapBilinearRgb24(BTA_UndistortionMap *map, uint8_t *src, uint8_t *dst, int i, int n) {
+    remapBilinear8(map, src, dst, i, n, 3);
+}
+
+
+static void remapBilinearUInt16(BTA_UndistortionMap *map, uint8_t *src, uint8_t *dst, int i, int n) {
+    int32_t *srcIndex = map->srcIndexBilinear + i;
+    uint16_t *weights = map->weights + 2 * i;
+    int stride = (int)map->xRes;
+    uint16_t *d = (uint16_t *)dst + i;
+    for (int j = 0; j < n; j++) {
+        int32_t k = srcIndex[j];
+        if (k < 0) {
+            d[j] = 0;
+            continue;
         }
+        uint32_t wx = weights[2 * j];
+        uint32_t wy = weights[2 * j + 1];
+        uint16_t *s = (uint16_t *)src + k;
+        // max 65535 * 256 * 256 still fits in 32 bits
+        uint32_t top = s[0] * (BTA_UNDISTORT_FRAC_ONE - wx) + s[1] * wx;
+        uint32_t bottom = s[stride] * (BTA_UNDISTORT_FRAC_ONE - wx) + s[stride + 1] * wx;
+        d[j] = (uint16_t)(((uint64_t)top * (BTA_UNDISTORT_FRAC_ONE - wy) + (uint64_t)bottom * wy + (1 << (2 * BTA_UNDISTORT_FRAC_BITS - 1))) >> (2 * BTA_UNDISTORT_FRAC_BITS));
     }
-    uint16_t *xyTemp = (uint16_t *)xy;
-    uint8_t *dst = (uint8_t *)inst->dstBuf;
-    for (int i = 0; i < channel->xRes * channel->yRes; i++) {
-        int xTemp = (int)*xyTemp++;
-        int yTemp = (int)*xyTemp++;
-        if (xTemp >= 0 && xTemp < channel->xRes && yTemp >= 0 && yTemp < channel->yRes) {
-            uint8_t *S = channel->data + xTemp + yTemp * channel->xRes;
-            *dst++ = *S;
+}
+
+
+static void remapBilinearFloat32(BTA_UndistortionMap *map, uint8_t *src, uint8_t *dst, int i, int n) {
+    int32_t *srcIndex = map->srcIndexBilinear + i;
+    uint16_t *weights = map->weights + 2 * i;
+    int stride = (int)map->xRes;
+    float *d = (float *)dst + i;
+    for (int j = 0; j < n; j++) {
+        int32_t k = srcIndex[j];
+        if (k < 0) {
+            d[j] = 0;
+            continue;
         }
+        float wx = weights[2 * j] / (float)BTA_UNDISTORT_FRAC_ONE;
+        float wy = weights[2 * j + 1] / (float)BTA_UNDISTORT_FRAC_ONE;
+        float *s = (float *)src + k;
+        float top = s[0] + (s[1] - s[0]) * wx;
+        float bottom = s[stride] + (s[stride + 1] - s[stride]) * wx;
+        d[j] = top + (bottom - top) * wy;
     }
 }
 
 
-static void cvYuv422ToRgb24(BTA_UndistortInst *inst, BTA_Channel *channel, uint16_t *xy) {
-    // YUV422 shares information over several pixels! Convert to RGB first
-    if (inst->dstBufLen < (uint32_t)(3 * channel->xRes * channel->yRes)) {
-        inst->dstBufLen = 3 * channel->xRes * channel->yRes;
+static uint8_t *getDstBuf(BTA_UndistortInst *inst, uint32_t len) {
+    if (inst->dstBufLen < len) {
         free(inst->dstBuf);
-        inst->dstBuf = malloc(inst->dstBufLen);
+        inst->dstBuf = malloc(len);
         if (!inst->dstBuf) {
             inst->dstBufLen = 0;
-            inst->dstBuf = 0;
             BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Cannot allocate buffer for undistortion");
-            return;
+            return 0;
         }
+        inst->dstBufLen = len;
+    }
+    return (uint8_t *)inst->dstBuf;
+}
+
+
+// The result becomes the channel's data and the channel's former buffer is kept for the next call
+static void swapDstBuf(BTA_UndistortInst *inst, BTA_Channel *channel, uint32_t dataLen) {
+    uint8_t *temp = channel->data;
+    uint32_t tempLen = channel->dataLen;
+    channel->data = (uint8_t *)inst->dstBuf;
+    channel->dataLen = dataLen;
+    inst->dstBuf = temp;
+    inst->dstBufLen = tempLen;
+}
+
+
+static BTA_Status cvYuv422ToRgb24(BTA_UndistortInst *inst, BTA_Channel *channel) {
+    // YUV422 shares information over several pixels! Convert to RGB first
+    uint32_t dataLen = 3 * channel->xRes * channel->yRes;
+    uint8_t *dst = getDstBuf(inst, dataLen);
+    if (!dst) {
+        return BTA_StatusOutOfMemory;
     }
-    uint8_t *dst = (uint8_t *)inst->dstBuf;
     int C1 = 0, D = 0, C2 = 0, E = 0;
     uint8_t alter = 1;
     uint16_t *src = (uint16_t *)channel->data;
@@ -208,32 +380,45 @@ static void cvYuv422ToRgb24(BTA_UndistortInst *inst, BTA_Channel *channel, uint1
         alter =  1 - alter;
         src++;
     }
+    swapDstBuf(inst, channel, dataLen);
+    channel->dataFormat = BTA_DataFormatRgb24;
+    return BTA_StatusOk;
+}
 
-    free(channel->data);
-    channel->dataLen = 3 * channel->xRes * channel->yRes;
-    channel->data = (uint8_t *)malloc(channel->dataLen);
-    if (!channel->data) {
-        channel->data = 0;
-        channel->dataLen = 0;
-        BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Cannot allocate buffer for undistortion");
-        return;
-    }
-    uint16_t *xyTemp = (uint16_t *)xy;
-    dst = (uint8_t *)channel->data;
-    for (int i = 0; i < channel->xRes * channel->yRes; i++) {
-        int xTemp = (int)*xyTemp++;
-        int yTemp = (int)*xyTemp++;
-        if (xTemp >= 0 && xTemp < channel->xRes && yTemp >= 0 && yTemp < channel->yRes) {
-            uint8_t *S = (uint8_t *)inst->dstBuf + (xTemp + yTemp * channel->xRes) * 3;
-            *dst++ = *S++;
-            *dst++ = *S++;
-            *dst++ = *S;
-        }
+
+static FN_RemapSpan getRemapSpan(BTA_DataFormat dataFormat, BTA_UndistortInterpolation interpolation) {
+    uint8_t bilinear = interpolation == BTA_UndistortInterpolationBilinear;
+    switch (dataFormat) {
+    case BTA_DataFormatUInt8:
+        return bilinear ? remapBilinearUInt8 : remapNearest8;
+    case BTA_DataFormatUInt16:
+    case BTA_DataFormatUInt16Mlx1C11U:
+    case BTA_DataFormatUInt16Mlx12U:
+        return bilinear ? remapBilinearUInt16 : remapNearest16;
+    case BTA_DataFormatSInt16:
+    case BTA_DataFormatSInt16Mlx1C11S:
+    case BTA_DataFormatSInt16Mlx12S:
+    case BTA_DataFormatRgb565:
+        // Packed and signed formats are not interpolated
+        return remapNearest16;
+    case BTA_DataFormatRgb24:
+        return bilinear ? remapBilinearRgb24 : remapNearest24;
+    case BTA_DataFormatUInt32:
+    case BTA_DataFormatSInt32:
+        return remapNearest32;
+    case BTA_DataFormatFloat32:
+        return bilinear ? remapBilinearFloat32 : remapNearest32;
+    default:
+        return 0;
     }
-    channel->dataFormat = BTA_DataFormatRgb24;
 }
 
 
+static uint32_t getBytesPerPixel(BTA_DataFormat dataFormat) {
+    // the lower nibble of BTA_DataFormat holds the bytes per pixel
+    return dataFormat & 0xf;
+}
+
 
 //-----------------------------------------------------------------------------------------------------------------------------------------------------------------
 //-----------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -257,29 +442,28 @@ BTA_Status BTAundistortInit(BTA_UndistortInst **inst, BTA_InfoEventInst *infoEve
     (*inst)->undistortionMapsLen = 0;
     (*inst)->dstBuf = 0;
     (*inst)->dstBufLen = 0;
+    BTA_Status status = BTAinitMutex(&(*inst)->undistortionMapsMutex);
+    if (status == BTA_StatusOk) {
+        status = BTAinitMutex(&(*inst)->generateMutex);
+    }
+    if (status != BTA_StatusOk) {
+        BTAcloseMutex((*inst)->undistortionMapsMutex);
+        free(*inst);
+        *inst = 0;
+        return status;
+    }
     return BTA_StatusOk;
 }
 
 
-static BTA_Status addUndistortionMap(BTA_UndistortInst *inst, BTA_IntrinsicData *intData) {
-    if (!inst || !intData) {
-        return BTA_StatusInvalidParameter;
-    }
-    BTA_UndistortionMap *map = (BTA_UndistortionMap *)calloc(1, sizeof(BTA_UndistortionMap));
-    if (!map) {
-        return BTA_StatusOutOfMemory;
-    }
-    map->lensIndex = intData->lensIndex;
-    map->xRes = intData->xRes;
-    map->yRes = intData->yRes;
-    map->xy = (uint16_t *)malloc(intData->yRes * intData->xRes * 2 * sizeof(uint16_t));
-    if (!map->xy) {
-        free(map);
-        return BTA_StatusOutOfMemory;
-    }
-    initUndistortRectifyMap(intData, map->xy);
+// Call with undistortionMapsMutex locked. Takes ownership of map. Pass map->data = 0 in order to remember that there is no calibration for this configuration
+static BTA_Status addUndistortionMap(BTA_UndistortInst *inst, BTA_UndistortionMap *map) {
     if (!inst->undistortionMaps) {
         inst->undistortionMaps = (BTA_UndistortionMap **)calloc(1, sizeof(BTA_UndistortionMap *));
+        if (!inst->undistortionMaps) {
+            freeUndistortionMap(&map);
+            return BTA_StatusOutOfMemory;
+        }
         inst->undistortionMapsLen = 1;
     }
     else {
@@ -289,8 +473,7 @@ static BTA_Status addUndistortionMap(BTA_UndistortInst *inst, BTA_IntrinsicData
         if (!inst->undistortionMaps) {
             inst->undistortionMapsLen--;
             inst->undistortionMaps = temp;
-            free(map->xy);
-            free(map);
+            freeUndistortionMap(&map);
             return BTA_StatusOutOfMemory;
         }
     }
@@ -299,36 +482,37 @@ static BTA_Status addUndistortionMap(BTA_UndistortInst *inst, BTA_IntrinsicData
 }
 
 
-static BTA_Status addEmptyUndistortionMap(BTA_UndistortInst *inst, uint16_t lensIndex, uint16_t xRes, uint16_t yRes) {
-    if (!inst) {
-        return BTA_StatusInvalidParameter;
+// Generates the map and stores it in the cache. It is not added to the list yet
+static BTA_UndistortionMap *createUndistortionMapFromIntrinsics(BTA_UndistortInst *inst, BTA_WrapperInst *winst, BTA_IntrinsicData *intData) {
+    BTA_UndistortionMap *map = createUndistortionMap(intData->lensIndex, intData->xRes, intData->yRes);
+    float *uv = (float *)malloc(intData->yRes * intData->xRes * 2 * sizeof(float));
+    if (!map || !uv) {
+        freeUndistortionMap(&map);
+        free(uv);
+        return 0;
+    }
+    initUndistortRectifyMap(intData, uv);
+    buildRemapTables(map, uv);
+    free(uv);
+    if (winst->lpLensCacheEnabled) {
+        BTA_Status status = BTAlensCacheStoreUndistortionMap(winst, intData->lensIndex, intData->xRes, intData->yRes, map->data, map->dataLen);
+        if (status != BTA_StatusOk) {
+            BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, status, "Could not store undistortion map in cache");
+        }
     }
+    return map;
+}
+
+
+static BTA_UndistortionMap *createEmptyUndistortionMap(uint16_t lensIndex, uint16_t xRes, uint16_t yRes) {
     BTA_UndistortionMap *map = (BTA_UndistortionMap *)calloc(1, sizeof(BTA_UndistortionMap));
     if (!map) {
-        return BTA_StatusOutOfMemory;
+        return 0;
     }
     map->lensIndex = lensIndex;
     map->xRes = xRes;
     map->yRes = yRes;
-    map->xy = 0;
-    if (!inst->undistortionMaps) {
-        inst->undistortionMaps = (BTA_UndistortionMap **)calloc(1, sizeof(BTA_UndistortionMap *));
-        inst->undistortionMapsLen = 1;
-    }
-    else {
-        inst->undistortionMapsLen++;
-        BTA_UndistortionMap **temp = inst->undistortionMaps;
-        inst->undistortionMaps = (BTA_UndistortionMap **)realloc(inst->undistortionMaps, inst->undistortionMapsLen * sizeof(BTA_UndistortionMap *));
-        if (!inst->undistortionMaps) {
-            inst->undistortionMapsLen--;
-            inst->undistortionMaps = temp;
-            free(map->xy);
-            free(map);
-            return BTA_StatusOutOfMemory;
-        }
-    }
-    inst->undistortionMaps[inst->undistortionMapsLen - 1] = map;
-    return BTA_StatusOk;
+    return map;
 }
 
 
@@ -340,39 +524,86 @@ BTA_Status BTAundistortClose(BTA_UndistortInst **inst) {
         // not even opened
         return BTA_StatusOk;
     }
+    BTAundistortJoinPrepare(*inst);
     for (int i = 0; i < (*inst)->undistortionMapsLen; i++) {
-        free((*inst)->undistortionMaps[i]->xy);
-        (*inst)->undistortionMaps[i]->xy = 0;
-        free((*inst)->undistortionMaps[i]);
-        (*inst)->undistortionMaps[i] = 0;
+        freeUndistortionMap(&((*inst)->undistortionMaps[i]));
     }
     free((*inst)->undistortionMaps);
     (*inst)->undistortionMaps = 0;
     free((*inst)->dstBuf);
     (*inst)->dstBuf = 0;
+    BTAcloseMutex((*inst)->undistortionMapsMutex);
+    (*inst)->undistortionMapsMutex = 0;
+    BTAcloseMutex((*inst)->generateMutex);
+    (*inst)->generateMutex = 0;
     free(*inst);
     *inst = 0;
     return BTA_StatusOk;
 }
 
 
-static BTA_UndistortionMap *getUndistortionMap(BTA_UndistortInst *inst, BTA_WrapperInst *winst, uint16_t lensIndex, uint16_t xRes, uint16_t yRes) {
+// Call with undistortionMapsMutex locked
+static BTA_UndistortionMap *findUndistortionMap(BTA_UndistortInst *inst, uint16_t lensIndex, uint16_t xRes, uint16_t yRes) {
     for (int i = 0; i < inst->undistortionMapsLen; i++) {
         BTA_UndistortionMap *map = inst->undistortionMaps[i];
         if (lensIndex == map->lensIndex && xRes == map->xRes && yRes == map->yRes) {
             return map;
         }
     }
+    return 0;
+}
+
+
+// The maps are never removed before BTAundistortClose, so the returned pointer stays valid after unlocking
+static BTA_UndistortionMap *lookUpUndistortionMap(BTA_UndistortInst *inst, uint16_t lensIndex, uint16_t xRes, uint16_t yRes) {
+    BTAlockMutex(inst->undistortionMapsMutex);
+    BTA_UndistortionMap *map = findUndistortionMap(inst, lensIndex, xRes, yRes);
+    BTAunlockMutex(inst->undistortionMapsMutex);
+    return map;
+}
+
+
+// Takes ownership of map (which may be null)
+static BTA_UndistortionMap *insertUndistortionMap(BTA_UndistortInst *inst, BTA_UndistortionMap *map) {
+    if (!map) {
+        return 0;
+    }
+    BTAlockMutex(inst->undistortionMapsMutex);
+    BTA_Status status = addUndistortionMap(inst, map);
+    BTAunlockMutex(inst->undistortionMapsMutex);
+    return status == BTA_StatusOk ? map : 0;
+}
+
+
+static BTA_UndistortionMap *createUndistortionMapFromCache(BTA_UndistortInst *inst, BTA_WrapperInst *winst, uint16_t lensIndex, uint16_t xRes, uint16_t yRes) {
+    if (!winst->lpLensCacheEnabled) {
+        return 0;
+    }
+    BTA_UndistortionMap *map = createUndistortionMap(lensIndex, xRes, yRes);
+    if (!map) {
+        return 0;
+    }
+    if (BTAlensCacheLoadUndistortionMap(winst, lensIndex, xRes, yRes, map->data, map->dataLen) != BTA_StatusOk) {
+        freeUndistortionMap(&map);
+        return 0;
+    }
+    BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "Loaded undistortion data for %dx%d, lensIndex %d from cache", xRes, yRes, lensIndex);
+    return map;
+}
+
+
+// Call with generateMutex locked. Reads flash and generates, the map is not added to the list yet
+static BTA_UndistortionMap *createUndistortionMapFromFlash(BTA_UndistortInst *inst, BTA_WrapperInst *winst, uint16_t lensIndex, uint16_t xRes, uint16_t yRes) {
     BTA_IntrinsicData **intData = 0;
     uint16_t intDataLen = 0;
     BTA_Status status = BTAreadGeomModelFromFlash(winst, &intData, &intDataLen, 0, 0, 1);
     if (status == BTA_StatusOk && intDataLen > 0) {
         for (int i = 0; i < intDataLen; i++) {
             if (intData[i]->lensIndex == lensIndex && xRes == intData[i]->xRes && yRes == intData[i]->yRes) {
-                addUndistortionMap(inst, intData[i]);
-                BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "Loaded undistortion data for RGB %dx%d, lensIndex %d", xRes, yRes, lensIndex);
+                BTA_UndistortionMap *map = createUndistortionMapFromIntrinsics(inst, winst, intData[i]);
+                BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "Loaded undistortion data for %dx%d, lensIndex %d", xRes, yRes, lensIndex);
                 BTAfreeIntrinsicData(&intData, intDataLen);
-                return inst->undistortionMaps[inst->undistortionMapsLen - 1];
+                return map;
             }
         }
         BTAfreeIntrinsicData(&intData, intDataLen);
@@ -382,53 +613,219 @@ static BTA_UndistortionMap *getUndistortionMap(BTA_UndistortInst *inst, BTA_Wrap
     if (status == BTA_StatusOk) {
         if (xRes == intDataTemp.xRes && yRes == intDataTemp.yRes) {
             intDataTemp.lensIndex = lensIndex;
-            addUndistortionMap(inst, &intDataTemp);
-            BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "Loaded undistortion data for RGB %dx%d, lensIndex %d (legacy format)", xRes, yRes, lensIndex);
-            return inst->undistortionMaps[inst->undistortionMapsLen - 1];
+            BTA_UndistortionMap *map = createUndistortionMapFromIntrinsics(inst, winst, &intDataTemp);
+            BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "Loaded undistortion data for %dx%d, lensIndex %d (legacy format)", xRes, yRes, lensIndex);
+            return map;
+        }
+    }
+    BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "No undistortion data available for %dx%d, lensIndex %d", xRes, yRes, lensIndex);
+    return createEmptyUndistortionMap(lensIndex, xRes, yRes);
+}
+
+
+// Loading and generating happen under generateMutex only, so that undistorting channels whose maps are at hand isn't stalled meanwhile
+static BTA_UndistortionMap *getUndistortionMap(BTA_UndistortInst *inst, BTA_WrapperInst *winst, uint16_t lensIndex, uint16_t xRes, uint16_t yRes) {
+    BTA_UndistortionMap *map = lookUpUndistortionMap(inst, lensIndex, xRes, yRes);
+    if (map || !winst) {
+        // Without winst (deferred postprocessing) only maps already generated can be used
+        return map;
+    }
+    BTAlockMutex(inst->generateMutex);
+    // Another thread may have generated it meanwhile
+    map = lookUpUndistortionMap(inst, lensIndex, xRes, yRes);
+    if (!map) {
+        map = createUndistortionMapFromCache(inst, winst, lensIndex, xRes, yRes);
+        if (!map) {
+            map = createUndistortionMapFromFlash(inst, winst, lensIndex, xRes, yRes);
+        }
+        map = insertUndistortionMap(inst, map);
+    }
+    BTAunlockMutex(inst->generateMutex);
+    return map;
+}
+
+
+// Call with generateMutex locked. Returns 1 if the maps of all intrinsics listed in the cache are there now
+static uint8_t prepareFromCache(BTA_UndistortInst *inst, BTA_WrapperInst *winst) {
+    BTA_LensCacheIndex index;
+    if (!winst->lpLensCacheEnabled || BTAlensCacheLoadUndistortionIndex(winst, &index) != BTA_StatusOk) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < index.entriesLen; i++) {
+        uint16_t lensIndex = (uint16_t)index.entries[i].lensIndex;
+        uint16_t xRes = (uint16_t)index.entries[i].xRes;
+        uint16_t yRes = (uint16_t)index.entries[i].yRes;
+        if (!lookUpUndistortionMap(inst, lensIndex, xRes, yRes) && !insertUndistortionMap(inst, createUndistortionMapFromCache(inst, winst, lensIndex, xRes, yRes))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+BTA_Status BTAundistortPrepare(BTA_UndistortInst *inst, BTA_WrapperInst *winst) {
+    if (!inst || !winst) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTAlockMutex(inst->generateMutex);
+    if (prepareFromCache(inst, winst)) {
+        BTAunlockMutex(inst->generateMutex);
+        return BTA_StatusOk;
+    }
+    BTA_IntrinsicData **intData = 0;
+    uint16_t intDataLen = 0;
+    BTA_Status status = BTAreadGeomModelFromFlash(winst, &intData, &intDataLen, 0, 0, 1);
+    if (status != BTA_StatusOk) {
+        BTAunlockMutex(inst->generateMutex);
+        return status;
+    }
+    BTA_LensCacheIndex index = { 0 };
+    for (int i = 0; i < intDataLen; i++) {
+        uint16_t lensIndex = intData[i]->lensIndex;
+        uint16_t xRes = intData[i]->xRes;
+        uint16_t yRes = intData[i]->yRes;
+        if (index.entriesLen < BTA_LENS_CACHE_INDEX_LEN_MAX) {
+            index.entries[index.entriesLen].lensIndex = lensIndex;
+            index.entries[index.entriesLen].xRes = xRes;
+            index.entries[index.entriesLen].yRes = yRes;
+            index.entriesLen++;
+        }
+        if (lookUpUndistortionMap(inst, lensIndex, xRes, yRes) || insertUndistortionMap(inst, createUndistortionMapFromCache(inst, winst, lensIndex, xRes, yRes))) {
+            continue;
+        }
+        if (insertUndistortionMap(inst, createUndistortionMapFromIntrinsics(inst, winst, intData[i]))) {
+            BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "Prepared undistortion data for %dx%d, lensIndex %d", xRes, yRes, lensIndex);
+        }
+    }
+    BTAfreeIntrinsicData(&intData, intDataLen);
+    if (winst->lpLensCacheEnabled && intDataLen <= BTA_LENS_CACHE_INDEX_LEN_MAX) {
+        status = BTAlensCacheStoreUndistortionIndex(winst, &index);
+        if (status != BTA_StatusOk) {
+            BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, status, "Could not store undistortion index in cache");
         }
     }
-    addEmptyUndistortionMap(inst, (uint16_t)lensIndex, xRes, yRes);
-    BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "No undistortion data available for RGB %dx%d, lensIndex %d", xRes, yRes, lensIndex);
-    return inst->undistortionMaps[inst->undistortionMapsLen - 1];
+    BTAunlockMutex(inst->generateMutex);
+    return BTA_StatusOk;
 }
 
 
-BTA_Status BTAundistortApply(BTA_UndistortInst *inst, BTA_WrapperInst *winst, BTA_Frame *frame) {
+static void *prepareRunFunction(void *handle) {
+    BTA_UndistortInst *inst = (BTA_UndistortInst *)handle;
+    BTA_Status status = BTAundistortPrepare(inst, inst->prepareWinst);
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, status, "Undistortion data not prepared, will try on first frame");
+    }
+    BTAatomicStore(&inst->prepareRunning, 0);
+    return 0;
+}
+
+
+BTA_Status BTAundistortPrepareAsync(BTA_UndistortInst *inst, BTA_WrapperInst *winst) {
     if (!inst || !winst) {
         return BTA_StatusInvalidParameter;
     }
+    if (BTAatomicLoad(&inst->prepareRunning)) {
+        return BTA_StatusOk;
+    }
+    // The previous thread is done, so this doesn't wait
+    BTAundistortJoinPrepare(inst);
+    inst->prepareWinst = winst;
+    BTAatomicStore(&inst->prepareRunning, 1);
+    BTA_Status status = BTAcreateThread(&inst->prepareThread, &prepareRunFunction, inst);
+    if (status != BTA_StatusOk) {
+        BTAatomicStore(&inst->prepareRunning, 0);
+    }
+    return status;
+}
+
+
+void BTAundistortJoinPrepare(BTA_UndistortInst *inst) {
+    if (!inst || !inst->prepareThread) {
+        return;
+    }
+    BTAjoinThread(inst->prepareThread);
+    inst->prepareThread = 0;
+}
+
+
+// Returns 1 if the channel is to be undistorted and the interpolation to use for it
+static uint8_t isChannelToUndistort(BTA_Channel *channel, uint8_t rgbEnabled, uint8_t tofEnabled, BTA_UndistortInterpolation interpolation, BTA_UndistortInterpolation *channelInterpolation) {
+    if (channel->xRes == 0 || channel->yRes == 0 || (channel->flags & 1) || (channel->flags & 2)) {
+        // resolution isn't valid, an overlay or already undistorted
+        return 0;
+    }
+    *channelInterpolation = interpolation;
+    if (channel->id == BTA_ChannelIdColor) {
+        if (!rgbEnabled) {
+            return 0;
+        }
+    }
+    else if (channel->id == BTA_ChannelIdDistance || channel->id == BTA_ChannelIdAmplitude || channel->id == BTA_ChannelIdConfidence) {
+        if (!tofEnabled) {
+            return 0;
+        }
+        if (channel->id != BTA_ChannelIdAmplitude) {
+            // Interpolating across depth edges produces flying pixels, interpolating confidences is meaningless
+            *channelInterpolation = BTA_UndistortInterpolationNearest;
+        }
+    }
+    else {
+        return 0;
+    }
+    return channel->dataFormat == BTA_DataFormatYuv422 || getRemapSpan(channel->dataFormat, *channelInterpolation);
+}
+
+
+BTA_Status BTAundistortPrepareFrame(BTA_UndistortInst *inst, BTA_WrapperInst *winst, BTA_Frame *frame, uint8_t rgbEnabled, uint8_t tofEnabled) {
+    if (!inst || !winst || !frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    for (int chIn = 0; chIn < frame->channelsLen; chIn++) {
+        BTA_Channel *channel = frame->channels[chIn];
+        BTA_UndistortInterpolation channelInterpolation;
+        if (isChannelToUndistort(channel, rgbEnabled, tofEnabled, BTA_UndistortInterpolationNearest, &channelInterpolation)) {
+            getUndistortionMap(inst, winst, channel->lensIndex, channel->xRes, channel->yRes);
+        }
+    }
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAundistortApply(BTA_UndistortInst *inst, BTA_WrapperInst *winst, BTA_Frame *frame, uint8_t rgbEnabled, uint8_t tofEnabled, BTA_UndistortInterpolation interpolation) {
+    if (!inst) {
+        return BTA_StatusInvalidParameter;
+    }
     if (!frame) {
         return BTA_StatusInvalidParameter;
     }
     for (int chIn = 0; chIn < frame->channelsLen; chIn++) {
         BTA_Channel *channel = frame->channels[chIn];
-        if (channel->id != BTA_ChannelIdColor || channel->xRes == 0 || channel->yRes == 0 || (channel->flags & 1) || (channel->flags & 2)) {
-            // channel isn't RGB, resolution isn't valid, an overlay or already undistorted
+        BTA_UndistortInterpolation channelInterpolation;
+        if (!isChannelToUndistort(channel, rgbEnabled, tofEnabled, interpolation, &channelInterpolation)) {
             continue;
         }
         BTA_UndistortionMap *map = getUndistortionMap(inst, winst, channel->lensIndex, channel->xRes, channel->yRes);
-        if (!map->xy) {
+        if (!map || !map->data) {
             // No calibration data available
             continue;
         }
-        if (channel->dataFormat == BTA_DataFormatRgb24) {
-            cvRemap24bit(inst, channel, map->xy);
-            channel->flags |= 2;
-        }
-        else if (channel->dataFormat == BTA_DataFormatRgb565) {
-            cvRemap16bit(inst, channel, map->xy);
-            channel->flags |= 2;
-        }
-        else if (channel->dataFormat == BTA_DataFormatUInt8) {
-            cvRemap8bit(inst, channel, map->xy);
-            channel->flags |= 2;
+        if (channel->dataFormat == BTA_DataFormatYuv422) {
+            if (cvYuv422ToRgb24(inst, channel) != BTA_StatusOk) {
+                continue;
+            }
         }
-        else if (channel->dataFormat == BTA_DataFormatYuv422) {
-            cvYuv422ToRgb24(inst, channel, map->xy);
+        uint32_t dataLen = channel->xRes * channel->yRes * getBytesPerPixel(channel->dataFormat);
+        if (channel->dataLen < dataLen) {
+            BTAinfoEventHelper(inst->infoEventInst, VERBOSE_WARNING, BTA_StatusInvalidData, "BTAundistortApply: channel data too short");
+            continue;
         }
-        else {
+        uint8_t *dst = getDstBuf(inst, dataLen);
+        if (!dst) {
             continue;
         }
+        remapTiled(map, channel->data, dst, getRemapSpan(channel->dataFormat, channelInterpolation));
+        swapDstBuf(inst, channel, dataLen);
+        channel->flags |= 2;
     }
     return BTA_StatusOk;
-}
\ No newline at end of file
+}
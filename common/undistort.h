@@ -1,6 +1,3 @@
-
-
-
 #ifndef UNDISTORT_H_INCLUDED
 #define UNDISTORT_H_INCLUDED
 
@@ -12,11 +9,27 @@
 //} BTA_UndistortConfig;
 
 
+#define BTA_UNDISTORT_FRAC_BITS     8
+#define BTA_UNDISTORT_FRAC_ONE      (1 << BTA_UNDISTORT_FRAC_BITS)
+#define BTA_UNDISTORT_TILE_W        64
+#define BTA_UNDISTORT_TILE_H        16
+
+
+typedef enum BTA_UndistortInterpolation {
+    BTA_UndistortInterpolationNearest = 0,
+    BTA_UndistortInterpolationBilinear = 1,
+} BTA_UndistortInterpolation;
+
+
 typedef struct BTA_UndistortionMap {
     uint16_t lensIndex;
     uint32_t xRes;
     uint32_t yRes;
-    uint16_t *xy;
+    void *data;                     ///< One allocation holding the tables below. This is what gets cached on disk
+    uint32_t dataLen;
+    int32_t *srcIndexNearest;       ///< Per destination pixel: linear index of the nearest source pixel, -1 if outside the image
+    int32_t *srcIndexBilinear;      ///< Per destination pixel: linear index of the upper left of the 4 source pixels, -1 if outside the image
+    uint16_t *weights;              ///< Per destination pixel: weights of the right and the lower neighbours in 1/BTA_UNDISTORT_FRAC_ONE
 } BTA_UndistortionMap;
 
 
@@ -25,13 +38,29 @@ typedef struct BTA_UndistortInst {
     uint16_t undistortionMapsLen;
     void *dstBuf;
     uint32_t dstBufLen;
+    void *undistortionMapsMutex;    ///< Guards undistortionMaps, held only for lookups and insertions
+    void *generateMutex;            ///< Serializes reading flash, loading from cache and generating maps
+    void *prepareThread;            ///< Runs BTAundistortPrepare for BTAundistortPrepareAsync, joined by BTAundistortJoinPrepare
+    BTA_WrapperInst *prepareWinst;
+    BTA_Atomic32 prepareRunning;
     BTA_InfoEventInst *infoEventInst;
 } BTA_UndistortInst;
 
 
 BTA_Status BTAundistortInit(BTA_UndistortInst **inst, BTA_InfoEventInst *infoEventInst);
 BTA_Status BTAundistortClose(BTA_UndistortInst **inst);
-BTA_Status BTAundistortApply(BTA_UndistortInst *inst, BTA_WrapperInst *winst, BTA_Frame *frame);
+// Loads or generates the maps for all intrinsics stored on the device right away, so that the first frame doesn't have to.
+// Flash is not read if the cache holds all of them
+BTA_Status BTAundistortPrepare(BTA_UndistortInst *inst, BTA_WrapperInst *winst);
+// Runs BTAundistortPrepare on a thread of its own, so that the caller doesn't wait for the flash read. A frame needing a map meanwhile waits for it.
+// Nothing is started while a preparation is still running
+BTA_Status BTAundistortPrepareAsync(BTA_UndistortInst *inst, BTA_WrapperInst *winst);
+// Waits for BTAundistortPrepareAsync to finish. Must be called before winst's connection is closed
+void BTAundistortJoinPrepare(BTA_UndistortInst *inst);
+// Generates or loads the maps needed for the frame, so that BTAundistortApply can be called without winst later
+BTA_Status BTAundistortPrepareFrame(BTA_UndistortInst *inst, BTA_WrapperInst *winst, BTA_Frame *frame, uint8_t rgbEnabled, uint8_t tofEnabled);
+// winst may be null, then only maps already generated are used
+BTA_Status BTAundistortApply(BTA_UndistortInst *inst, BTA_WrapperInst *winst, BTA_Frame *frame, uint8_t rgbEnabled, uint8_t tofEnabled, BTA_UndistortInterpolation interpolation);
 
 
-#endif
\ No newline at end of file
+#endif
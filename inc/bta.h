@@ -365,7 +365,8 @@ DLLEXPORT BTA_Status BTA_CALLCONV BTAcloneFrame(BTA_Frame *frameSrc, BTA_Frame *
 ///     @brief  Actively requests a frame.
 ///             For this function to work, frameQueueLength and frameQueueMode must be set to queue frames!
 ///             For most applications it is adviced to use the frameArrived/Ex/Ex2 callback instead
-///             BTAfreeFrame must not be called on the frame because it remains in the queue
+///             The frame remains in the queue, you get a reference of your own (see BTAretainFrame): it stays valid even if the queue drops it meanwhile
+///             (BTA_QueueModeDropOldest) or BTAgetFrame takes it, and BTAfreeFrame must be called on it afterwards. The frame is shared, don't modify it
 ///     @param  handle Handle of the device to be used
 ///     @param  frame Pointer to frame (null if failed) on return (needs to be freed with BTAfreeFrame)
 ///     @param  millisecondsTimeout Timeout to wait if no frame is yet available in [ms]. If timeout == 0 the function waits endlessly for a frame from the device.
@@ -378,6 +379,7 @@ DLLEXPORT BTA_Status BTA_CALLCONV BTApeekFrame(BTA_Handle handle, BTA_Frame **fr
 ///             For this function to work, frameQueueLength and frameQueueMode must be set to queue frames!
 ///             For most applications it is adviced to use the frameArrived/Ex/Ex2 callback instead
 ///             If successful, BTAfreeFrame must be called afterwards.
+///             With frameQueueMode BTA_QueueModeLatest you get the newest frame right away, or the next one as soon as it arrives
 ///     @param  handle Handle of the device to be used
 ///     @param  frame Pointer to frame (null if failed) on return (needs to be freed with BTAfreeFrame)
 ///     @param  millisecondsTimeout Timeout to wait if no frame is yet available in [ms]. If timeout == 0 the function waits endlessly for a frame from the device.
@@ -386,13 +388,44 @@ DLLEXPORT BTA_Status BTA_CALLCONV BTAgetFrame(BTA_Handle handle, BTA_Frame** fra
 
 
 
-///     @brief  Helper function to free a BTA_Frame structure
+///     @brief  Actively requests all queued frames at once, up to maxCount.
+///             For this function to work, frameQueueLength and frameQueueMode must be set to queue frames!
+///             Only the first frame is waited for, the function then returns with the frames queued at that time (oldest first).
+///             If successful, BTAfreeFrame must be called on each of the frames afterwards.
+///     @param  handle Handle of the device to be used
+///     @param  frames Array of at least maxCount frame pointers allocated by the caller, receives the frames
+///     @param  maxCount The maximum number of frames to get
+///     @param  count Pointer to the number of frames in frames on return
+///     @param  millisecondsTimeout Timeout to wait if no frame is yet available in [ms]. If timeout == 0 the function waits endlessly for a frame from the device.
+///     @return Please refer to bta_status.h
+DLLEXPORT BTA_Status BTA_CALLCONV BTAgetFrames(BTA_Handle handle, BTA_Frame **frames, uint32_t maxCount, uint32_t *count, uint32_t millisecondsTimeout);
+
+
+
+///     @brief  Helper function to free a BTA_Frame structure. Same as BTAreleaseFrame: if the frame was retained, only the reference is dropped
 ///     @param  frame The pointer to the frame to be freed; points to null on return
 ///     @return Please refer to bta_status.h
 DLLEXPORT BTA_Status BTA_CALLCONV BTAfreeFrame(BTA_Frame **frame);
 
 
 
+///     @brief  Adds a reference to the frame, so that it can be handed to another consumer (thread) without cloning it.
+///             Each reference is dropped with BTAreleaseFrame (or BTAfreeFrame), the last one frees the frame.
+///             A frame with more than one reference is shared and must not be modified anymore (use BTAcloneFrame for a private copy).
+///             Pending postprocessing stays pending (see BTAmaterializeFrame): the first holder to access the frame completes it, the others wait for that
+///     @param  frame The frame to be shared
+///     @return Please refer to bta_status.h
+DLLEXPORT BTA_Status BTA_CALLCONV BTAretainFrame(BTA_Frame *frame);
+
+
+
+///     @brief  Drops a reference to the frame and frees it if it was the last one. Thread-safe with respect to other holders of the frame
+///     @param  frame The pointer to the frame to be released; points to null on return
+///     @return Please refer to bta_status.h
+DLLEXPORT BTA_Status BTA_CALLCONV BTAreleaseFrame(BTA_Frame **frame);
+
+
+
 ///     @brief  Get number of currently queued frames
 ///     @return Please refer to bta_status.h
 DLLEXPORT BTA_Status BTA_CALLCONV BTAgetFrameCount(BTA_Handle handle, uint32_t *frameCount);
@@ -406,6 +439,18 @@ DLLEXPORT BTA_Status BTA_CALLCONV BTAflushFrameQueue(BTA_Handle handle);
 
 
 
+///     @brief  Returns a file descriptor (Linux eventfd) that is readable while frames are queued, so the application can wait for frames
+///             together with its other file descriptors in one poll / epoll_wait instead of blocking in BTAgetFrame or polling.
+///             For this function to work, frameQueueLength and frameQueueMode must be set to queue frames!
+///             The descriptor belongs to the library: don't read from or close it, and remove it from epoll before BTAclose.
+///             It stays readable until BTAgetFrame, BTAgetFrames or BTAflushFrameQueue takes the last frame queued (level-triggered)
+///     @param  handle Handle of the device to be used
+///     @param  fd Pointer to the file descriptor on return
+///     @return Please refer to bta_status.h. BTA_StatusNotSupported on platforms other than Linux
+DLLEXPORT BTA_Status BTA_CALLCONV BTAgetFrameEventFd(BTA_Handle handle, int *fd);
+
+
+
 ///     @brief  Convenience function for extracting channel data from a provided frame.
 ///             It simply returns the pointer and copies some information. The same data can be accessed directly going through the BTA_Frame structure.
 ///             If there is no matching channel is present in the frame, an error is returned.
@@ -504,6 +549,15 @@ DLLEXPORT BTA_Status BTA_CALLCONV BTAgetChannels(BTA_Frame *frame, BTA_ChannelFi
 
 
 
+///     @brief  With BTA_LibParamLazyPostprocessing enabled, the channels derived by calcXYZ, color from ToF and undistortion are computed on first access.
+///             The BTAget* functions, BTAcloneFrame and BTAserializeFrame do this implicitly. Call this function before accessing the BTA_Frame structure directly.
+///             Works after the handle is closed. The holders of a shared frame (see BTAretainFrame) may call it concurrently, the postprocessing runs once.
+///     @param  frame The frame to complete
+///     @return Please refer to bta_status.h
+DLLEXPORT BTA_Status BTA_CALLCONV BTAmaterializeFrame(BTA_Frame *frame);
+
+
+
 ///     @brief  Facilitates setting the integration time for the default capture sequence(s)
 ///     @param  handle Handle of the device to be used
 ///     @param  integrationTime The desired integration time in [us]
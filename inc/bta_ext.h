@@ -38,7 +38,10 @@ typedef enum BTA_QueueMode {
     BTA_QueueModeDoNotQueue = 0,                ///< No queueing
     BTA_QueueModeDropOldest = 1,                ///< Before an overflow, the oldest item in the queue is removed
     BTA_QueueModeDropCurrent = 2,               ///< When full, the queue remains unchanged
-    BTA_QueueModeAvoidDrop = 3                  ///< When full, the equeue function returns an error to the producer (do not use in BTAopen()!)
+    BTA_QueueModeAvoidDrop = 3,                 ///< When full, the equeue function returns an error to the producer (do not use in BTAopen()!)
+    BTA_QueueModeLatest = 4                     ///< Frames only: a mailbox holding the newest frame, the queue length is ignored. A newer frame replaces (frees) the one
+                                                ///< not dequeued yet. Dequeued frames are freed by the caller as in the other modes. Frames are handed over by pointer,
+                                                ///< not copied into recycled buffers, so every frame is still allocated by the library and freed when replaced or dequeued
 } BTA_QueueMode;
 
 
@@ -94,10 +97,32 @@ typedef enum BTA_LibParam {
 
 
     BTA_LibParamCalcXYZ = 100,                          ///< If enabled, a distance channel is available and the lenscalib can be read from the device, cartesian coordinate channels X, Y and Z are calculated and added to the frame
-    BTA_LibParamOffsetForCalcXYZ = 101,                 ///< This offset is applied to the distance channel before calculating the cartesian coordinates
+    BTA_LibParamOffsetForCalcXYZ = 101,                 ///< This offset [mm] is applied to the distance channel before calculating the cartesian coordinates
     BTA_LibParamBilateralFilterWindow = 102,            ///< The bilateral filter with this window size is applied to any distance channel
-    BTA_LibParamGenerateColorFromTof = 103,             ///< >0: Based on data from ToF sensor a channel with BTA_ChanneldIdColor is added (and possibly undistorted)
+    BTA_LibParamGenerateColorFromTof = 103,             ///< >0: Based on data from ToF sensor a channel with BTA_ChanneldIdColor is added (and possibly undistorted). 1: amplitude min to max is stretched to 0..255, 2: percentile stretch (see BTA_LibParamColorFromTofPercentile)
     BTA_LibParamBltstreamCompressionMode = 104,         ///< Set a value of BTA_CompressionMode in order to activate compression when grabbing
+    BTA_LibParamCalcXYZFloat32 = 105,                   ///< >0: The channels calculated by BTA_LibParamCalcXYZ are of BTA_DataFormatFloat32 (unit of the distance channel, invalid pixels NaN) instead of BTA_DataFormatSInt16 [mm]
+    BTA_LibParamCalcXYZInterleaved = 106,               ///< >0: BTA_LibParamCalcXYZ adds one channel BTA_ChannelIdXYZ holding x, y, z triplets per pixel instead of the channels X, Y and Z
+    BTA_LibParamLensCacheEnabled = 107,                 ///< >0: Lens vectors and undistortion maps are cached on disk per device serial number, firmware version and resolution (directory 'bta_cache' or environment variable BTA_CACHE_DIR)
+    BTA_LibParamUndistortTof = 108,                     ///< > 0: Channels of the kind BTA_ChannelIdDistance, BTA_ChannelIdAmplitude and BTA_ChannelIdConfidence are undistorted if intrinsic data for that configuration is present. Not together with a BinningFactor > 1 or a region of interest
+    BTA_LibParamUndistortInterpolation = 109,           ///< 0: Nearest neighbour, 1: bilinear interpolation for undistortion (distances and confidences are always undistorted with nearest neighbour)
+    BTA_LibParamJpgDecodeScale = 110,                   ///< 1 (default): Decode jpeg channels at full resolution, 2, 4 or 8: decode at 1/2, 1/4 or 1/8 of the resolution in the DCT domain (much faster, for previews)
+    BTA_LibParamTemporalFilterMode = 111,               ///< Temporal averaging of the channels of consecutive frames. 0: off (default), 1: sliding mean over BTA_LibParamTemporalFilterWindow frames, 2: exponential moving average with BTA_LibParamTemporalFilterAlpha
+    BTA_LibParamTemporalFilterWindow = 112,             ///< Number of frames averaged by the sliding mean (1 to 255, default 8)
+    BTA_LibParamTemporalFilterAlpha = 113,              ///< Weight of the newest frame in the exponential moving average (0 < alpha <= 1, default 0.2)
+    BTA_LibParamTemporalFilterMinValidPixelPercentage = 114, ///< If a pixel is invalid in more averaged frames than this percentage, the resulting pixel is also invalid (default 50)
+    BTA_LibParamLazyPostprocessing = 115,               ///< >0: calcXYZ, color from ToF and undistortion are deferred until the frame's data is first accessed (see BTAmaterializeFrame), frames never looked at cost nothing
+    BTA_LibParamBinningFactor = 116,                    ///< 1 (default): off, 2 or 4: the ToF channels are binned to 1/2 or 1/4 of their resolution before any other postprocessing. Lens vectors for calcXYZ are binned alike. Packed Mlx raw channels are decimated. Not together with UndistortTof (the undistortion maps are for the full resolution)
+    BTA_LibParamBinningMode = 117,                      ///< How distance and Z are binned, only valid pixels count. 0: mean (default), 1: median, 2: minimum. Amplitude is always averaged
+    BTA_LibParamColorFromTofPercentile = 118,           ///< For BTA_LibParamGenerateColorFromTof 2: percentage of the darkest and of the brightest pixels that are clipped, [0, 50) (default 1)
+    BTA_LibParamRawPhasesProcessing = 119,              ///< >0: Distance, amplitude and confidence channels are calculated from raw phase or I/Q channels in the library, before any other postprocessing
+    BTA_LibParamRawPhasesMinAmplitude = 120,            ///< For BTA_LibParamRawPhasesProcessing: pixels with a lower amplitude are invalid (default 0)
+    BTA_LibParamPhaseUnwrapping = 121,                  ///< >0: Distance channels of two sequences with different modulation frequencies are combined into one with extended unambiguous range (see BTAunwrapDistances)
+    BTA_LibParamCallbackDispatchQueueLength = 122,      ///< 0 (default): the frameArrived callbacks run on the library's parsing thread. >0: they run on a pool of threads shared by all handles (frames of one handle stay in order),
+                                                        ///< up to this many frames wait for them. Also applies to the frame queue. Changing it drops the frames waiting; do not change it from within a callback
+    BTA_LibParamCallbackDispatchQueueMode = 123,        ///< For BTA_LibParamCallbackDispatchQueueLength: BTA_QueueModeDropOldest (default) or BTA_QueueModeDropCurrent when the callbacks can't keep up
+    BTA_LibParamCallbackBacklog = 124,                  ///< Readonly: count of frames waiting for the callbacks (max since last read, read to clear!)
+    BTA_LibParamCallbackDuration = 125,                 ///< Readonly: time the callbacks needed for a frame, only with BTA_LibParamCallbackDispatchQueueLength (max since last read, read to clear!) [ms]
 
     BTA_LIBParamDataStreamAllowIncompleteFrames = 200,  ///< Set this parameter to 1 if you wish to receive incomplete frames (pixels missing due to transmission errors are invalidated according to camera manual)
 
@@ -184,6 +209,84 @@ typedef struct BTA_LensVectors {
 } BTA_LensVectors;
 
 
+#define BTA_PARSE_FILTER_CHANNEL_FILTERS_MAX    16
+
+///     @brief  Selects what BTAparseFrame copies out of the received data. Channels not selected are never copied, cropped channels are copied row by row.
+typedef struct BTA_ParseFilter {
+    BTA_ChannelFilter channelFilters[BTA_PARSE_FILTER_CHANNEL_FILTERS_MAX];  ///< A channel is parsed if it matches any of these (see BTAgetChannels), its id as delivered to the application
+    uint8_t channelFiltersLen;                          ///< 0: all channels are parsed
+    uint16_t roiX;                                      ///< Column of the upper left pixel of the region of interest
+    uint16_t roiY;                                      ///< Row of the upper left pixel of the region of interest
+    uint16_t roiXRes;                                   ///< Width of the region of interest. 0: no cropping
+    uint16_t roiYRes;                                   ///< Height of the region of interest. 0: no cropping
+} BTA_ParseFilter;
+
+
+#define BTA_SUBSCRIPTION_CHANNEL_FILTERS_MAX    16
+
+///     @brief  What a subscriber (see BTAsubscribe) receives and how its frames are queued
+typedef struct BTA_SubscriptionConfig {
+    uint16_t queueLength;                               ///< The maximum number of frames queued for this subscriber (not used with BTA_QueueModeLatest)
+    BTA_QueueMode queueMode;                            ///< BTA_QueueModeDropOldest, BTA_QueueModeDropCurrent or BTA_QueueModeLatest
+    uint16_t decimation;                                ///< >1: only every decimation-th frame is delivered to this subscriber
+    BTA_ChannelFilter channelFilters[BTA_SUBSCRIPTION_CHANNEL_FILTERS_MAX];  ///< A channel is delivered if it matches any of these (see BTAgetChannels)
+    uint8_t channelFiltersLen;                          ///< 0: all channels are delivered
+} BTA_SubscriptionConfig;
+
+typedef void* BTA_SubscriptionHandle;
+
+
+///     @brief  Where frames got lost on their way through the library and how much the stages were backed up, see BTAgetPipelineStats.
+///             All values refer to the time since the previous call of BTAgetPipelineStats
+typedef struct BTA_PipelineStats {
+    uint32_t packetBufferUnavailableCount;              ///< Ethernet: the UDP receive thread found no free packet buffer because parsing can't keep up (packets are then lost in the socket)
+    uint32_t framesEvictedCount;                        ///< Ethernet: frames still being assembled that were replaced by newer ones before they were complete
+    uint32_t framesDiscardedCount;                      ///< Ethernet: frames given up during assembly (first packet missing, inconsistent packet headers)
+    uint32_t framesIncompleteCount;                     ///< Frames not parsed because packets were missing (see BTA_LIBParamDataStreamAllowIncompleteFrames)
+    uint32_t framesParseErrorCount;                     ///< Frames not parsed for other reasons (CRC, unknown format, out of memory)
+    uint32_t frameQueueDroppedCount;                    ///< Frames dropped by the frame queue because the application didn't fetch them in time
+    uint32_t callbackDispatchDroppedCount;              ///< Frames dropped because the callbacks couldn't keep up (see BTA_LibParamCallbackDispatchQueueLength)
+    uint32_t subscriptionsDroppedCount;                 ///< Frames dropped by the subscriber queues or not delivered for lack of memory, all subscribers summed up.
+                                                        ///< A frame without any channel passing a subscriber's filters is not a drop
+    uint32_t grabbingDroppedCount;                      ///< Frames not grabbed because writing the file couldn't keep up
+    uint32_t packetsToParseCountMax;                    ///< Ethernet: high-water mark of received packets waiting to be parsed
+    uint32_t frameQueueCountMax;                        ///< High-water mark of the frame queue
+    uint32_t callbackDispatchCountMax;                  ///< High-water mark of the frames waiting for the dispatched callbacks
+    uint32_t subscriptionsCountMax;                     ///< High-water mark of the fullest subscriber queue
+    uint32_t grabbingQueueCountMax;                     ///< High-water mark of the frames waiting to be grabbed
+    uint64_t packetBufferWaitMicros;                    ///< Ethernet: time the UDP receive thread was blocked waiting for a free packet buffer [us]
+    uint64_t callbacksMicros;                           ///< Time the parsing thread was blocked in the frameArrived callbacks (not dispatched) [us]
+} BTA_PipelineStats;
+
+
+///     @brief  How the points falling into the same cell of a planar view are combined
+typedef enum BTA_PlanarViewAggregation {
+    BTA_PlanarViewAggregationNearestZ = 0,              ///< z and amplitude of the point with the smallest z
+    BTA_PlanarViewAggregationMaxZ = 1,                  ///< z and amplitude of the point with the largest z
+    BTA_PlanarViewAggregationMean = 2,                  ///< Mean z and mean amplitude of the points
+    BTA_PlanarViewAggregationCount = 3,                 ///< Only the number of points is determined, z is NaN and amplitude 0 for all cells
+} BTA_PlanarViewAggregation;
+
+
+///     @brief  Geometry of a planar view: cell (xRes / 2, yRes / 2) holds the points around x = 0, y = 0
+typedef struct BTA_PlanarViewConfig {
+    uint16_t xRes;                                      ///< Number of cells in x direction
+    uint16_t yRes;                                      ///< Number of cells in y direction
+    float cellSize;                                     ///< Edge length of a cell in the unit of the coordinates (millimeters for BTA_DataFormatSInt16)
+    BTA_PlanarViewAggregation aggregation;
+} BTA_PlanarViewConfig;
+
+
+///     @brief  The result of BTAprojectPlanarView, cells in row major order
+typedef struct BTA_PlanarView {
+    uint16_t xRes;
+    uint16_t yRes;
+    float *z;                                           ///< Per cell: aggregated z in the unit of the coordinates, NaN for empty cells
+    uint16_t *amplitudes;                               ///< Per cell: aggregated amplitude, 0 for empty cells or if the frame has no amplitudes
+    uint32_t *counts;                                   ///< Per cell: number of valid points that fell into the cell
+} BTA_PlanarView;
+
+
 ///     @brief  This struct is used for the representation of the BTA_Config struct.
 ///             Programming languages that don't use header files are able to query the elements of BTA_Config generically.
 typedef struct BTA_ConfigStructOrg {
@@ -286,6 +389,60 @@ DLLEXPORT BTA_Status BTA_CALLCONV BTAsetLibParam(BTA_Handle handle, BTA_LibParam
 DLLEXPORT BTA_Status BTA_CALLCONV BTAgetLibParam(BTA_Handle handle, BTA_LibParam libParam, float *value);
 
 
+///     @brief  Sets which channels and which region of interest are parsed from the data stream from now on.
+///             The region of interest is given in pixels of the channels containing it. Color channels, channels not containing it and
+///             compressed channels are not cropped. Lens vectors and undistortion maps only exist for full resolutions, so a
+///             region of interest is rejected with BTA_StatusIllegalOperation while BTA_LibParamCalcXYZ or BTA_LibParamUndistortTof
+///             is enabled, and enabling those is rejected while a region of interest is set.
+///     @param  handle      Handle of the device to be used
+///     @param  filter      The filter to apply, copied. Null: parse everything
+///     @return             Please refer to bta_status.h
+DLLEXPORT BTA_Status BTA_CALLCONV BTAsetParseFilter(BTA_Handle handle, const BTA_ParseFilter *filter);
+
+
+///     @brief  Function for getting the filter set by BTAsetParseFilter.
+///     @param  handle      Handle of the device to be used
+///     @param  filter      On return it holds a copy of the current filter
+///     @return             Please refer to bta_status.h
+DLLEXPORT BTA_Status BTA_CALLCONV BTAgetParseFilter(BTA_Handle handle, BTA_ParseFilter *filter);
+
+
+///     @brief  Adds a consumer with its own frame queue. Every frame captured from now on is offered to each subscriber independently of
+///             the frameQueue and the frameArrived callbacks. Subscribers share the frame data: they receive the same frame (see BTAretainFrame),
+///             or, with channel filters, a frame referring to the matching channels of it (see BTA_Frame.sharedFrom). So frames must not be modified.
+///             Frames without any matching channel are not delivered
+///     @param  handle          Handle of the device to be used
+///     @param  config          The configuration of the subscriber, copied
+///     @param  subscription    On return the handle of the new subscription, to be passed to BTAgetSubscribedFrame and BTAunsubscribe
+///     @return                 Please refer to bta_status.h
+DLLEXPORT BTA_Status BTA_CALLCONV BTAsubscribe(BTA_Handle handle, const BTA_SubscriptionConfig *config, BTA_SubscriptionHandle *subscription);
+
+
+///     @brief  Removes a subscriber and frees the frames still queued for it. No thread may be waiting in BTAgetSubscribedFrame for it anymore.
+///             Subscriptions still existing are removed by BTAclose
+///     @param  handle          Handle of the device to be used
+///     @param  subscription    The subscription to be removed; points to null on return
+///     @return                 Please refer to bta_status.h
+DLLEXPORT BTA_Status BTA_CALLCONV BTAunsubscribe(BTA_Handle handle, BTA_SubscriptionHandle *subscription);
+
+
+///     @brief  Like BTAgetFrame, but takes the frame from the queue of the given subscriber. BTAfreeFrame must be called on it afterwards
+///     @param  subscription    The subscription returned by BTAsubscribe
+///     @param  frame           Pointer to frame (null if failed) on return
+///     @param  millisecondsTimeout Timeout to wait if no frame is yet available in [ms]. If timeout == 0 the function waits endlessly
+///     @return                 Please refer to bta_status.h
+DLLEXPORT BTA_Status BTA_CALLCONV BTAgetSubscribedFrame(BTA_SubscriptionHandle subscription, BTA_Frame **frame, uint32_t millisecondsTimeout);
+
+
+
+///     @brief  Returns the frame drops per reason, the high-water marks of the queues and the time the data stream threads were blocked, all since the previous call.
+///             Every event is counted in exactly one call. Unlike the infoEvents, this is meant to be polled periodically to detect backpressure and find the stage that is the bottleneck
+///     @param  handle  Handle of the device to be used
+///     @param  stats   Pointer to the statistics on return
+///     @return         Please refer to bta_status.h
+DLLEXPORT BTA_Status BTA_CALLCONV BTAgetPipelineStats(BTA_Handle handle, BTA_PipelineStats *stats);
+
+
 
 
 ///     @brief  Initiates a reset of the device
@@ -398,6 +555,7 @@ DLLEXPORT BTA_Status BTA_CALLCONV BTAinitGrabbingConfig(BTA_GrabbingConfig *conf
 
 
 ///     @brief  Issues the library to grab (or stop grabbing) all the frames and store them to the file provided in the config.
+///             The frames are shared with the grabbing thread (see BTAretainFrame): while grabbing, frames handed to the application must not be modified.
 ///     @param  handle Handle of the device to be used.
 ///     @param  config Pointer to the config structure specifying parameters for the grabbing process.
 ///                    Pass null in order to stop grabbing.
@@ -476,6 +634,7 @@ DLLEXPORT BTA_Status BTA_CALLCONV BFQenqueue(BFQ_FrameQueueHandle handle, BTA_Fr
 
 
 ///     @brief Dequeues a frame. You get the exact same frame that was enqueued, not a clone. So now is the time to call BTAfreeFrame (when frame is no longer needed)
+///            In mode BTA_QueueModeLatest you get the newest frame not dequeued yet
 ///     @param handle Handle of the queue
 ///     @param frame Pointer to the frame dequeued on return
 ///     @param timeout The maximum time in [ms] to wait for a frame to become available if the queue is currently empty. (0: infinite!)
@@ -484,12 +643,61 @@ DLLEXPORT BTA_Status BTA_CALLCONV BFQenqueue(BFQ_FrameQueueHandle handle, BTA_Fr
 DLLEXPORT BTA_Status BTA_CALLCONV BFQdequeue(BFQ_FrameQueueHandle handle, BTA_Frame **frame, uint32_t timeout);
 
 
+///     @brief Dequeues up to maxCount frames at once, oldest first. Only the first frame is waited for, the others are the ones queued at that time.
+///            As with BFQdequeue, BTAfreeFrame is to be called on each of them (mode BTA_QueueModeLatest returns at most one frame)
+///     @param handle Handle of the queue
+///     @param frames Array of at least maxCount frame pointers allocated by the caller, receives the frames dequeued
+///     @param maxCount The maximum number of frames to dequeue
+///     @param count Pointer to the number of frames dequeued on return
+///     @param timeout The maximum time in [ms] to wait for the first frame to become available if the queue is currently empty. (0: infinite!)
+///     @return BTA_StatusOk on success
+///             BTA_StatusTimeOut if there is no frame in the queue
+DLLEXPORT BTA_Status BTA_CALLCONV BFQdequeueMany(BFQ_FrameQueueHandle handle, BTA_Frame **frames, uint32_t maxCount, uint32_t *count, uint32_t timeout);
+
+
+///     @brief Returns the oldest frame without removing it from the queue. The frame is retained (see BTAretainFrame), so it stays valid even if the queue drops it,
+///            and BTAfreeFrame must be called on it. Don't peek and dequeue in different threads at the same time.
+///            The call returns as soon as a frame is enqueued, it doesn't poll
+///     @param handle Handle of the queue
+///     @param frame Pointer to the oldest frame on return
+///     @param timeout The maximum time in [ms] to wait for a frame to become available if the queue is currently empty. (0: infinite!)
+///     @return BTA_StatusOk on success
+///             BTA_StatusTimeOut if there is no frame in the queue
+DLLEXPORT BTA_Status BTA_CALLCONV BFQpeek(BFQ_FrameQueueHandle handle, BTA_Frame **frame, uint32_t timeout);
+
+
 ///     @brief Empties the queue. Also, BTAfreeFrame is called on all the inserted frames.
 ///     @param handle Handle of the queue
 ///     @return BTA_StatusOk on success
 DLLEXPORT BTA_Status BTA_CALLCONV BFQclear(BFQ_FrameQueueHandle handle);
 
 
+///     @brief Returns a file descriptor (Linux eventfd) that is readable while frames are queued, for use with poll / epoll. It is created on the first call
+///            and belongs to the queue (closed by BFQclose). Don't read from it: enqueueing sets it, dequeueing or clearing the last frame resets it
+///     @param handle Handle of the queue
+///     @param fd Pointer to the file descriptor on return
+///     @return BTA_StatusOk on success
+///             BTA_StatusNotSupported on platforms other than Linux
+DLLEXPORT BTA_Status BTA_CALLCONV BFQgetEventFd(BFQ_FrameQueueHandle handle, int *fd);
+
+
+///     @brief Returns how many frames the queue dropped because it was full and the highest count of frames it held, both since the last call (read to clear).
+///            In mode BTA_QueueModeLatest, a frame replaced by a newer one before it was dequeued counts as dropped
+///     @param handle Handle of the queue
+///     @param droppedCount Pointer to the count of dropped frames on return
+///     @param countMax Pointer to the high-water mark on return
+///     @return BTA_StatusOk on success
+DLLEXPORT BTA_Status BTA_CALLCONV BFQgetStatistics(BFQ_FrameQueueHandle handle, uint32_t *droppedCount, uint32_t *countMax);
+
+
+///     @brief While interrupted, BFQdequeue, BFQdequeueMany and BFQpeek return BTA_StatusTimeOut right away if the queue is empty instead of waiting.
+///            Setting it wakes the threads waiting, so a consumer thread can wait without a timeout and still be stopped promptly
+///     @param handle Handle of the queue
+///     @param interrupted 1: interrupt, 0: wait for frames again
+///     @return BTA_StatusOk on success
+DLLEXPORT BTA_Status BTA_CALLCONV BFQsetInterrupted(BFQ_FrameQueueHandle handle, uint8_t interrupted);
+
+
 
 
 
@@ -536,6 +744,44 @@ DLLEXPORT BTA_Status BTA_CALLCONV BTAcalcXYZ(BTA_Frame *frame, BTA_LensVectors *
 
 
 DLLEXPORT BTA_Status BTA_CALLCONV BTAcalcMonochromeFromAmplitude(BTA_Frame *frame);
+/// @brief  Adds a BTA_ChannelIdColor channel in BTA_DataFormatUInt8 for each amplitude channel, stretching the amplitudes to 0..255.
+///         A flat amplitude image yields a black channel
+///     @param frame The frame to add the channels to
+///     @param percentile Percentage of the darkest and of the brightest pixels that are clipped, [0, 50). 0 stretches from minimum to maximum
+///     @return BTA_StatusOk on success
+DLLEXPORT BTA_Status BTA_CALLCONV BTAcalcMonochromeFromAmplitudeEx(BTA_Frame *frame, float percentile);
+
+
+///     @brief Projects the point cloud of a frame onto the x-y plane (a top view for a camera looking down)
+///            Uses the channel BTA_ChannelIdXYZ or the channels X, Y and Z, in BTA_DataFormatSInt16 or BTA_DataFormatFloat32, and the amplitude channel of
+///            the same lens and resolution if present. Invalid points and points outside the grid are skipped. Large point clouds are processed in parallel
+///     @param frame The frame containing the cartesian coordinates
+///     @param config Resolution, cell size and aggregation of the planar view
+///     @param planarView If *planarView is null, a newly allocated planar view is returned, to be freed with BTAfreePlanarView.
+///                       Otherwise *planarView is overwritten and must have the resolution of config (pass the result of an earlier call to avoid allocations)
+///     @return BTA_StatusOk on success
+///     @brief Calculates distance (UInt16 in millimeters), amplitude (UInt16) and confidence (UInt8, percent of the full scale signal) from raw channels
+///            A set of raw channels is Phase0, Phase90, Phase180 and Phase270, or 4 consecutive RawPhase channels (phase shifts 0, 90, 180 and 270 degrees),
+///            or RawI and RawQ (I = phase 0 - phase 180, Q = phase 90 - phase 270), each of the same sequence, lens, resolution and modulation frequency.
+///            The Mlx data formats are decoded, a raw value at the limit of its format marks the pixel as saturated (distance 1). No calibration is applied
+///     @param frame The frame containing the raw channels. On return the 3 channels are inserted for each set. Must not be shared (see BTAretainFrame)
+///     @param minAmplitude Pixels with a lower amplitude are invalid (distance 0)
+///     @return BTA_StatusOk on success, BTA_StatusIllegalOperation for a shared frame
+DLLEXPORT BTA_Status BTA_CALLCONV BTAcalcDistancesFromPhases(BTA_Frame *frame, float minAmplitude);
+
+
+///     @brief Dual frequency phase unwrapping: pairs distance channels of different sequences (sequenceCounter) and modulation frequencies, with the same lens,
+///            resolution, data format (UInt16 or Float32) and unit, and combines each pair into one distance channel. Its unambiguous range is that of the
+///            greatest common divisor of the two frequencies, which becomes the channel's modulation frequency.
+///            The result replaces the data of the pair's first channel, the second one is removed. A pixel invalid in either channel is invalid in the result.
+///            A UInt16 pair whose unambiguous range exceeds UINT16_MAX millimeters yields a UInt32 channel
+///     @param frame The frame containing the distance channels. Must not be shared (see BTAretainFrame)
+///     @return BTA_StatusOk on success, BTA_StatusIllegalOperation for a shared frame
+DLLEXPORT BTA_Status BTA_CALLCONV BTAunwrapDistances(BTA_Frame *frame);
+
+
+DLLEXPORT BTA_Status BTA_CALLCONV BTAprojectPlanarView(BTA_Frame *frame, const BTA_PlanarViewConfig *config, BTA_PlanarView **planarView);
+DLLEXPORT BTA_Status BTA_CALLCONV BTAfreePlanarView(BTA_PlanarView **planarView);
 
 
 
@@ -554,6 +800,7 @@ DLLEXPORT uint8_t BTA_CALLCONV BTAisUsbDevice(uint16_t deviceType);
 DLLEXPORT uint8_t BTA_CALLCONV BTAisP100Device(uint16_t deviceType);
 DLLEXPORT uint8_t BTA_CALLCONV BTAisUartDevice(uint16_t deviceType);
 
+// Inserting into or removing from a shared frame (retained, see BTAretainFrame, or delivered to a subscription) fails with BTA_StatusIllegalOperation
 DLLEXPORT BTA_Status BTA_CALLCONV BTAinsertChannelIntoFrame(BTA_Frame *frame, BTA_Channel *channel);
 DLLEXPORT BTA_Status BTA_CALLCONV BTAinsertChannelIntoFrame2(BTA_Frame *frame, BTA_ChannelId id, uint16_t xRes, uint16_t yRes, BTA_DataFormat dataFormat, BTA_Unit unit, uint32_t integrationTime, uint32_t modulationFrequency, uint8_t *data, uint32_t dataLen,
                                                              BTA_Metadata **metadata, uint32_t metadataLen, uint8_t lensIndex, uint32_t flags, uint8_t sequenceCounter, float gain);
@@ -563,12 +810,23 @@ DLLEXPORT BTA_Status BTA_CALLCONV BTAcloneChannelEmpty(BTA_Channel *channelSrc,
 DLLEXPORT BTA_Status BTA_CALLCONV BTAinsertMetadataIntoChannel(BTA_Channel *channel, BTA_Metadata *metadata);
 DLLEXPORT BTA_Status BTA_CALLCONV BTAinsertMetadataDataIntoChannel(BTA_Channel *channel, BTA_MetadataId id, void *data, uint32_t dataLen);
 DLLEXPORT BTA_Status BTA_CALLCONV BTAcloneMetadata(BTA_Metadata *metadataSrc, BTA_Metadata **metadataDst);
+// The channel arithmetic functions below (BTAdivideChannelByNumber to BTAclampChannelInPlace, and BTAchangeDataFormat) support UInt8, UInt16, UInt32,
+// SInt16, SInt32, Float32 and Float64 in any combination. Results are saturated to the data format of the first (in place) or resulting channel.
+// Note: earlier versions let SInt32 sums and differences wrap around and BTAchangeDataFormat from SInt32 to UInt16 keep the lower 16 bits only.
+// Results calculated with a float operand are rounded to nearest for integer formats, except for division: it truncates toward zero as integer
+// division does. Integer division by zero yields 0
 DLLEXPORT BTA_Status BTA_CALLCONV BTAdivideChannelByNumber(BTA_Channel *dividend, uint32_t divisor, BTA_Channel **quotient);
 DLLEXPORT BTA_Status BTA_CALLCONV BTAaddChannelInPlace(BTA_Channel *augendSum, BTA_Channel *addend);
 DLLEXPORT BTA_Status BTA_CALLCONV BTAsubtChannelInPlace(BTA_Channel *minuendDiff, BTA_Channel *subtrahend);
 DLLEXPORT BTA_Status BTA_CALLCONV BTAsubtChannel(BTA_Channel *minuend, BTA_Channel *subtrahend, BTA_Channel **diff);
 DLLEXPORT BTA_Status BTA_CALLCONV BTAthresholdInPlace(BTA_Channel *channel, uint32_t threshold, uint8_t alsoNegative);
 DLLEXPORT BTA_Status BTA_CALLCONV BTAchangeDataFormat(BTA_Channel *channel, BTA_DataFormat dataFormat);
+DLLEXPORT BTA_Status BTA_CALLCONV BTAmultiplyChannelInPlace(BTA_Channel *multiplicandProduct, BTA_Channel *multiplier);
+DLLEXPORT BTA_Status BTA_CALLCONV BTAdivideChannelInPlace(BTA_Channel *dividendQuotient, BTA_Channel *divisor);
+DLLEXPORT BTA_Status BTA_CALLCONV BTAminChannelInPlace(BTA_Channel *channelMin, BTA_Channel *channel);
+DLLEXPORT BTA_Status BTA_CALLCONV BTAmaxChannelInPlace(BTA_Channel *channelMax, BTA_Channel *channel);
+DLLEXPORT BTA_Status BTA_CALLCONV BTAscaleOffsetChannelInPlace(BTA_Channel *channel, float scale, float offset);
+DLLEXPORT BTA_Status BTA_CALLCONV BTAclampChannelInPlace(BTA_Channel *channel, float min, float max);
 DLLEXPORT BTA_Status BTA_CALLCONV BTAfreeChannel(BTA_Channel **channel);
 DLLEXPORT BTA_Status BTA_CALLCONV BTAfreeMetadata(BTA_Metadata **metadata);
 
@@ -595,6 +853,8 @@ DLLEXPORT int BTA_CALLCONV BTAframeModeToImageMode(int deviceType, BTA_FrameMode
 DLLEXPORT BTA_Status BTA_CALLCONV BTAgetNetworkBroadcastAddrs(uint8_t ***localIpAddrs, uint8_t ***networkBroadcastAddrs, uint32_t *networkBroadcastAddrsLen);
 DLLEXPORT void BTA_CALLCONV BTAfreeNetworkBroadcastAddrs(uint8_t ***localIpAddrs, uint8_t ***networkBroadcastAddrs, uint32_t networkBroadcastAddrsLen);
 
+///     @brief Projects int16 coordinates into the planar view buffers (planarViewScale in centimeters per cell), keeping the point with the smallest z per cell.
+///            Cells without points are left untouched. Please use BTAprojectPlanarView
 DLLEXPORT void BTA_CALLCONV BTAgeneratePlanarView(int16_t *chX, int16_t *chY, int16_t *chZ, uint16_t *chAmp, int resX, int resY, int planarViewResX, int planarViewResY, float planarViewScale, int16_t *planarViewZ, uint16_t *planarViewAmp);
 
 
@@ -99,6 +99,7 @@ typedef enum BTA_ChannelId {
     BTA_ChannelIdRawDist =     0x4000,   // Unfiltered unitless distance values (full unumbiguous range) scaled to full range of corresponding BTA_DataFormat (former BTA_ChannelIdPhase)
     BTA_ChannelIdBalance =    0x10000,
     BTA_ChannelIdStdDev =     0x20000,
+    BTA_ChannelIdXYZ =        0x40000,   // Interleaved cartesian coordinates (x, y, z triplets per pixel)
 
     BTA_ChannelIdCustom01 = 0x1000000,
     BTA_ChannelIdCustom02 = 0x2000000,
@@ -166,6 +167,7 @@ typedef enum BTA_MetadataId {
     BTA_MetadataIdMlxMeta2              = 0xa720b907,
     BTA_MetadataIdMlxTest               = 0xa720b908,
     BTA_MetadataIdMlxAdcData            = 0xa720b909,
+    BTA_MetadataIdDeferredPostprocessing = 0xd5f0a1c3,  ///< Internal, pending postprocessing of the frame. Removed when the frame is materialized
 } BTA_MetadataId;
 
 
@@ -229,6 +231,8 @@ typedef struct BTA_Frame {
     uint8_t sequenceCounter;            ///< DEPRECATED
     BTA_Metadata **metadata;            ///< List of pointers to additional generic data
     uint32_t metadataLen;               ///< The number of BTA_Metadata pointers stored in metadata
+    volatile uint32_t refCount;         ///< References held in addition to the creator's, see BTAretainFrame. 0 for a newly created frame
+    struct BTA_Frame *sharedFrom;       ///< If not null, channels and metadata belong to this frame, which is retained (see BTAsubscribe). 0 for a newly created frame
     //uint32_t shmOffset;                 ///< in case of shared memory, this is the 'id' that is returned to the camera's shared memory management
     /*TODO uint16_t deviceType;
     BTA_DeviceType interfaceType;
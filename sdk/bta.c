@@ -19,11 +19,13 @@
 */
 
 #include "bta_helper.h"
+#include "bta_dispatch.h"
 #include <bta_discovery_helper.h>
 #include <bta_oshelper.h>
 #include <sockets_helper.h>
 #include <timing_helper.h>
 #include <pthread_helper.h>
+#include <bta_atomic.h>
 #include <bitconverter.h>
 #include <bta_serialization.h>
 #include "configuration.h"
@@ -42,6 +44,9 @@
 #endif
 #include <undistort.h>
 #include <calcXYZ.h>
+#include <calc_channel.h>
+#include <temporal_filter.h>
+#include <binning.h>
 #include <bvq_queue.h>
 
 #include <crc16.h>
@@ -82,6 +87,10 @@ static char checkStatusHnfu[(2 * (int)(BTA_VER_NON_FUNC == BTA_STATUS_H_VER_NON_
 #define MARK_USED(x) ((void)(x))
 
 
+// Handles between BTAopen and BTAclose. The last one closed stops the parallel-for pool
+static BTA_Atomic32 handlesOpenCount = 0;
+
+
 #ifndef BTA_WO_ETH
 void *BTAETHdiscoveryRunFunction(BTA_DiscoveryInst *inst);
 BTA_Status BTAETHopen(BTA_Config *config, BTA_WrapperInst *wrapperInst);
@@ -660,6 +669,8 @@ BTA_Status BTA_CALLCONV BTAopen(BTA_Config *config, BTA_Handle *handle) {
     if (!winst) {
         return BTA_StatusOutOfMemory;
     }
+    // From here on, failing goes through BTAclose
+    BTAatomicFetchAdd(&handlesOpenCount, 1);
 
     // Initialize LibParams
     winst->lpDataStreamReadFailedCount = 0;
@@ -680,13 +691,32 @@ BTA_Status BTA_CALLCONV BTAopen(BTA_Config *config, BTA_Handle *handle) {
     winst->lpBilateralFilterWindow = 0;
     winst->lpCalcXyzEnabled = 0;
     winst->lpCalcXyzOffset = 0;
+    winst->lpCalcXyzFloat32 = 0;
+    winst->lpCalcXyzInterleaved = 0;
+    winst->lpLensCacheEnabled = 0;
     winst->lpColorFromTofEnabled = 0;
 #   ifndef BTA_WO_LIBJPEG
     winst->lpJpgDecodeEnabled = 1;
 #   else
     winst->lpJpgDecodeEnabled = 0;
 #   endif
+    winst->lpJpgDecodeScale = 1;
     winst->lpUndistortRgbEnabled = 0;
+    winst->lpUndistortTofEnabled = 0;
+    winst->lpUndistortInterpolation = BTA_UndistortInterpolationNearest;
+    winst->lpTemporalFilterMode = BTA_TemporalFilterModeOff;
+    winst->lpTemporalFilterWindow = 8;
+    winst->lpTemporalFilterAlpha = 0.2f;
+    winst->lpTemporalFilterMinValidPixelPercentage = 50;
+    winst->lpLazyPostprocessing = 0;
+    winst->lpBinningFactor = 1;
+    winst->lpBinningMode = BTA_BinningModeMean;
+    winst->lpColorFromTofPercentile = 1;
+    winst->lpRawPhasesProcessing = 0;
+    winst->lpRawPhasesMinAmplitude = 0;
+    winst->lpPhaseUnwrapping = 0;
+    winst->lpCallbackDispatchQueueLength = 0;
+    winst->lpCallbackDispatchQueueMode = BTA_QueueModeDropOldest;
     winst->lpDebugFlags01 = 0;
     winst->lpDebugValue01 = 0;
     winst->lpDebugValue02 = 0;
@@ -727,15 +757,16 @@ BTA_Status BTA_CALLCONV BTAopen(BTA_Config *config, BTA_Handle *handle) {
     }
 
     // generic config plausibility checks
-    int configTest = !!config->frameQueueMode + !!config->frameQueueLength;
+    // The mailbox of mode Latest has no length
+    int configTest = !!config->frameQueueMode + (!!config->frameQueueLength || config->frameQueueMode == BTA_QueueModeLatest);
     if (configTest != 0 && configTest != 2) {
         if (!config->frameQueueMode) BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, BTA_StatusConfigParamError, "BTAopen: frameQueueMode is missing");
         if (!config->frameQueueLength) BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, BTA_StatusConfigParamError, "BTAopen: frameQueueLength is missing");
         BTAclose((BTA_Handle *)&winst);
         return BTA_StatusInvalidParameter;
     }
-    if (config->frameQueueMode != BTA_QueueModeDoNotQueue && config->frameQueueMode != BTA_QueueModeDropCurrent && config->frameQueueMode != BTA_QueueModeDropOldest) {
-        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, BTA_StatusConfigParamError, "BTAopen: Only queue modes DropCurrent and DropOldest are allowed");
+    if (config->frameQueueMode != BTA_QueueModeDoNotQueue && config->frameQueueMode != BTA_QueueModeDropCurrent && config->frameQueueMode != BTA_QueueModeDropOldest && config->frameQueueMode != BTA_QueueModeLatest) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, BTA_StatusConfigParamError, "BTAopen: Only queue modes DropCurrent, DropOldest and Latest are allowed");
         BTAclose((BTA_Handle *)&winst);
         return BTA_StatusInvalidParameter;
     }
@@ -798,13 +829,13 @@ BTA_Status BTA_CALLCONV BTAopen(BTA_Config *config, BTA_Handle *handle) {
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_WARNING, BTA_StatusConfigParamError, "BTAopen: Parameter averageWindowLength ignored, not supported");
     }
 
-    if (config->frameQueueMode != BTA_QueueModeDoNotQueue && config->frameQueueMode != BTA_QueueModeDropOldest && config->frameQueueMode != BTA_QueueModeDropCurrent) {
-        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, BTA_StatusConfigParamError, "BTAopen: Invalid frameQueueMode, use BTA_QueueModeDoNotQueue, BTA_QueueModeDropOldest or BTA_QueueModeDropCurrent");
+    if (config->frameQueueMode != BTA_QueueModeDoNotQueue && config->frameQueueMode != BTA_QueueModeDropOldest && config->frameQueueMode != BTA_QueueModeDropCurrent && config->frameQueueMode != BTA_QueueModeLatest) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, BTA_StatusConfigParamError, "BTAopen: Invalid frameQueueMode, use BTA_QueueModeDoNotQueue, BTA_QueueModeDropOldest, BTA_QueueModeDropCurrent or BTA_QueueModeLatest");
         BTAclose((BTA_Handle *)&winst);
         return BTA_StatusInvalidParameter;
     }
 
-    if ((!config->frameQueueLength && config->frameQueueMode != BTA_QueueModeDoNotQueue) || (config->frameQueueLength && config->frameQueueMode == BTA_QueueModeDoNotQueue)) {
+    if ((!config->frameQueueLength && config->frameQueueMode != BTA_QueueModeDoNotQueue && config->frameQueueMode != BTA_QueueModeLatest) || (config->frameQueueLength && config->frameQueueMode == BTA_QueueModeDoNotQueue)) {
         // queueing on and queue size == 0 or queueing off and queue size > 0. Contradiction
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, BTA_StatusConfigParamError, "BTAopen: Invalid frameQueueLength - frameQueueMode combination");
         BTAclose((BTA_Handle *)&winst);
@@ -829,6 +860,44 @@ BTA_Status BTA_CALLCONV BTAopen(BTA_Config *config, BTA_Handle *handle) {
         return status;
     }
 
+    status = BTAinitMutex(&(winst->parseFilterMutex));
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, status, "BTAopen: Error initializing parse filter");
+        BTAETHclose(winst);
+        return status;
+    }
+
+    status = BTAinitMutex(&(winst->subscriptionsMutex));
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, status, "BTAopen: Error initializing subscriptions");
+        BTAETHclose(winst);
+        return status;
+    }
+
+    status = BTAcallbackDispatchInit(winst);
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, status, "BTAopen: Error initializing callback dispatching");
+        BTAETHclose(winst);
+        return status;
+    }
+
+    status = BTAinitMutex(&(winst->pipelineStatsMutex));
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, status, "BTAopen: Error initializing pipeline statistics");
+        BTAETHclose(winst);
+        return status;
+    }
+
+    status = BTAinitMutex(&(winst->pauseMutex));
+    if (status == BTA_StatusOk) {
+        status = BTAinitCondition(&(winst->condPauseChanged));
+    }
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, status, "BTAopen: Error initializing pause condition");
+        BTAETHclose(winst);
+        return status;
+    }
+
     status = BTAundistortInit(&(winst->undistortInst), winst->infoEventInst);
     if (status != BTA_StatusOk) {
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, status, "BTAopen: Error initializing undistort");
@@ -843,6 +912,29 @@ BTA_Status BTA_CALLCONV BTAopen(BTA_Config *config, BTA_Handle *handle) {
         return status;
     }
 
+    status = BTApostprocessContextCreate(&(winst->postprocessContext), winst->calcXYZInst, winst->undistortInst);
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, status, "BTAopen: Error initializing postprocessing");
+        BTAETHclose(winst);
+        return status;
+    }
+
+    status = BTAtemporalFilterInit(&(winst->temporalFilterInst), winst->infoEventInst);
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, status, "BTAopen: Error initializing temporal filter");
+        BTAETHclose(winst);
+        return status;
+    }
+
+#   ifndef BTA_WO_LIBJPEG
+    status = BTAjpegInit(&(winst->jpgInst), winst->infoEventInst);
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, status, "BTAopen: Error initializing jpeg decoder");
+        BTAETHclose(winst);
+        return status;
+    }
+#   endif
+
     winst->frameArrivedInst = (BTA_FrameArrivedInst *)calloc(1, sizeof(BTA_FrameArrivedInst));
     if (!winst->frameArrivedInst) {
         BTAclose((BTA_Handle *)&winst);
@@ -859,7 +951,7 @@ BTA_Status BTA_CALLCONV BTAopen(BTA_Config *config, BTA_Handle *handle) {
         return BTA_StatusOutOfMemory;
     }
 
-    BVQinit(8, BTA_QueueModeDropOldest, 0, &winst->lpDataStreamFramesParsedPerSecFrametimes);
+    BVQinit(8, BTA_QueueModeDropOldest, 0, 0, &winst->lpDataStreamFramesParsedPerSecFrametimes);
 
 #   ifndef BTA_WO_ETH
     if (config->deviceType == BTA_DeviceTypeAny || config->deviceType == BTA_DeviceTypeEthernet) {
@@ -1081,6 +1173,8 @@ BTA_Status BTA_CALLCONV BTAclose(BTA_Handle *handle) {
         return BTA_StatusInvalidParameter;
     }
     BTAinfoEventHelper(winst->infoEventInst, VERBOSE_WRITE_OP, BTA_StatusInformation, "BTAclose call");
+    // It reads flash through the connection
+    BTAundistortJoinPrepare(winst->undistortInst);
     BTA_Status status;
     if (winst->close) {
         status = winst->close(winst);
@@ -1089,22 +1183,77 @@ BTA_Status BTA_CALLCONV BTAclose(BTA_Handle *handle) {
         }
     }
 
+    // Waits for the callback running, drops the frames not yet dispatched. Callbacks may call into the handle, so before anything is torn down
+    status = BTAdispatchClose(&winst->dispatchInst);
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAclose: Failed to close callback dispatching!");
+    }
+
+    if (winst->postprocessContext) {
+        // Frames with deferred postprocessing may still be around, the last one closes calcXYZ and undistort
+        BTApostprocessContextClose(&(winst->postprocessContext));
+        winst->calcXYZInst = 0;
+        winst->undistortInst = 0;
+    }
+
     status = BTAcalcXYZClose(&(winst->calcXYZInst));
     if (status != BTA_StatusOk) {
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAclose: Failed to close calcXYZ!");
     }
 
+    status = BTAtemporalFilterClose(&(winst->temporalFilterInst));
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAclose: Failed to close temporal filter!");
+    }
+
     status = BTAundistortClose(&(winst->undistortInst));
     if (status != BTA_StatusOk) {
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAclose: Failed to close undistort!");
     }
 
+#   ifndef BTA_WO_LIBJPEG
+    status = BTAjpegClose(&(winst->jpgInst));
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAclose: Failed to close jpeg decoder!");
+    }
+#   endif
+
     //BTAinfoEventHelper(winst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "BTAclose: Closing grabber");
     status = BGRBclose(&(winst->grabInst));
     if (status != BTA_StatusOk) {
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAclose: Failed to close grabber!");
     }
 
+    status = BTAcloseMutex(winst->parseFilterMutex);
+    winst->parseFilterMutex = 0;
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAclose: Failed to close parse filter mutex!");
+    }
+
+    while (BTAatomicLoad(&winst->subscriptionsLen)) {
+        BTA_SubscriptionHandle subscription = winst->subscriptions[0];
+        BTAunsubscribe(winst, &subscription);
+    }
+    status = BTAcloseMutex(winst->subscriptionsMutex);
+    winst->subscriptionsMutex = 0;
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAclose: Failed to close subscriptions mutex!");
+    }
+
+    BTAcloseCondition(winst->condPauseChanged);
+    winst->condPauseChanged = 0;
+    status = BTAcloseMutex(winst->pauseMutex);
+    winst->pauseMutex = 0;
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAclose: Failed to close pause mutex!");
+    }
+
+    status = BTAcloseMutex(winst->pipelineStatsMutex);
+    winst->pipelineStatsMutex = 0;
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAclose: Failed to close pipeline statistics mutex!");
+    }
+
     if (winst->frameQueue) {
         //BTAinfoEventHelper(winst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "BTAclose: Closing frameQueue");
         status = BFQclose(&(winst->frameQueue));
@@ -1135,6 +1284,10 @@ BTA_Status BTA_CALLCONV BTAclose(BTA_Handle *handle) {
     winst->frameArrivedInst = 0;
     free(*handle);
     *handle = 0;
+    if (BTAatomicFetchAdd(&handlesOpenCount, (uint32_t)-1) == 1) {
+        // Frames materialized later start the pool again
+        BTAparallelForShutdown();
+    }
     return BTA_StatusOk;
 }
 
@@ -1239,6 +1392,34 @@ BTA_Status BTA_CALLCONV BTAgetFrame(BTA_Handle handle, BTA_Frame **frame, uint32
 }
 
 
+BTA_Status BTA_CALLCONV BTAgetFrames(BTA_Handle handle, BTA_Frame **frames, uint32_t maxCount, uint32_t *count, uint32_t millisecondsTimeout) {
+    BTA_WrapperInst *winst = (BTA_WrapperInst *)handle;
+    if (!winst || !frames || !count) {
+        return BTA_StatusInvalidParameter;
+    }
+
+    if (!winst->frameQueue) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusIllegalOperation, "BTAgetFrames: Frame queueing must be enabled in BTAopen");
+        return BTA_StatusIllegalOperation;
+    }
+    return BFQdequeueMany(winst->frameQueue, frames, maxCount, count, millisecondsTimeout);
+}
+
+
+BTA_Status BTA_CALLCONV BTApeekFrame(BTA_Handle handle, BTA_Frame **frame, uint32_t millisecondsTimeout) {
+    BTA_WrapperInst *winst = (BTA_WrapperInst *)handle;
+    if (!winst || !frame) {
+        return BTA_StatusInvalidParameter;
+    }
+
+    if (!winst->frameQueue) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusIllegalOperation, "BTApeekFrame: Frame queueing must be enabled in BTAopen");
+        return BTA_StatusIllegalOperation;
+    }
+    return BFQpeek(winst->frameQueue, frame, millisecondsTimeout);
+}
+
+
 BTA_Status BTA_CALLCONV BTAsetChannelSelection(BTA_Handle handle, BTA_ChannelSelection *channelSelection, int channelSelectionCount) {
     BTA_WrapperInst *winst = (BTA_WrapperInst *)handle;
     if (!winst) {
@@ -1361,6 +1542,19 @@ BTA_Status BTA_CALLCONV BTAflushFrameQueue(BTA_Handle handle) {
 }
 
 
+BTA_Status BTA_CALLCONV BTAgetFrameEventFd(BTA_Handle handle, int *fd) {
+    BTA_WrapperInst *winst = (BTA_WrapperInst *)handle;
+    if (!winst || !fd) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (!winst->frameQueue) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusIllegalOperation, "BTAgetFrameEventFd: Frame queueing must be enabled in BTAopen");
+        return BTA_StatusIllegalOperation;
+    }
+    return BFQgetEventFd(winst->frameQueue, fd);
+}
+
+
 BTA_Status BTA_CALLCONV BTAsetIntegrationTime(BTA_Handle handle, uint32_t integrationTime) {
     BTA_WrapperInst *winst = (BTA_WrapperInst *)handle;
     if (!winst) {
@@ -1533,6 +1727,15 @@ BTA_Status BTA_CALLCONV BTAwriteRegister(BTA_Handle handle, uint32_t address, ui
 }
 
 
+// Lens vectors and undistortion maps only exist for full resolutions, so a cropped channel can't be looked up in them
+static uint8_t isRoiSet(BTA_WrapperInst *winst) {
+    BTAlockMutex(winst->parseFilterMutex);
+    uint8_t roiSet = winst->parseFilter.roiXRes && winst->parseFilter.roiYRes;
+    BTAunlockMutex(winst->parseFilterMutex);
+    return roiSet;
+}
+
+
 BTA_Status BTA_CALLCONV BTAsetLibParam(BTA_Handle handle, BTA_LibParam libParam, float value) {
     BTA_WrapperInst *winst = (BTA_WrapperInst *)handle;
     if (!winst) {
@@ -1554,14 +1757,157 @@ BTA_Status BTA_CALLCONV BTAsetLibParam(BTA_Handle handle, BTA_LibParam libParam,
         winst->infoEventInst->verbosity = (uint8_t)value;
         break;
     case BTA_LibParamUndistortRgb:
-        winst->lpUndistortRgbEnabled = (uint8_t)(value != 0);
+    case BTA_LibParamUndistortTof: {
+        if (libParam == BTA_LibParamUndistortTof && value != 0 && isRoiSet(winst)) {
+            BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusIllegalOperation, "BTAsetLibParam: Undistortion not possible while the parse filter crops to a region of interest");
+            status = BTA_StatusIllegalOperation;
+            break;
+        }
+        if (libParam == BTA_LibParamUndistortTof && value != 0 && winst->lpBinningFactor > 1) {
+            BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusIllegalOperation, "BTAsetLibParam: Undistortion not possible while binning");
+            status = BTA_StatusIllegalOperation;
+            break;
+        }
+        uint8_t wasEnabled = winst->lpUndistortRgbEnabled || winst->lpUndistortTofEnabled;
+        if (libParam == BTA_LibParamUndistortRgb) {
+            winst->lpUndistortRgbEnabled = (uint8_t)(value != 0);
+        }
+        else {
+            winst->lpUndistortTofEnabled = (uint8_t)(value != 0);
+        }
+        if (!wasEnabled && value != 0) {
+            // Generate the undistortion maps now rather than on the first frame, but without waiting for the flash read here
+            BTA_Status status2 = BTAundistortPrepareAsync(winst->undistortInst, winst);
+            if (status2 != BTA_StatusOk) {
+                BTAinfoEventHelper(winst->infoEventInst, VERBOSE_INFO, status2, "BTAsetLibParam: Undistortion data not prepared, will try on first frame");
+            }
+        }
+        break;
+    }
+    case BTA_LibParamUndistortInterpolation:
+        if (value != BTA_UndistortInterpolationNearest && value != BTA_UndistortInterpolationBilinear) {
+            status = BTA_StatusInvalidParameter;
+            break;
+        }
+        winst->lpUndistortInterpolation = (uint8_t)value;
+        break;
+    case BTA_LibParamTemporalFilterMode:
+        if (value != BTA_TemporalFilterModeOff && value != BTA_TemporalFilterModeSlidingMean && value != BTA_TemporalFilterModeEma) {
+            status = BTA_StatusInvalidParameter;
+            break;
+        }
+        winst->lpTemporalFilterMode = (uint8_t)value;
+        break;
+    case BTA_LibParamTemporalFilterWindow:
+        if (value < 1 || value > BTA_TEMPORAL_FILTER_WINDOW_MAX) {
+            status = BTA_StatusInvalidParameter;
+            break;
+        }
+        winst->lpTemporalFilterWindow = (uint8_t)value;
+        break;
+    case BTA_LibParamTemporalFilterAlpha:
+        if (value <= 0 || value > 1) {
+            status = BTA_StatusInvalidParameter;
+            break;
+        }
+        winst->lpTemporalFilterAlpha = value;
+        break;
+    case BTA_LibParamTemporalFilterMinValidPixelPercentage:
+        if (value < 0 || value > 100) {
+            status = BTA_StatusInvalidParameter;
+            break;
+        }
+        winst->lpTemporalFilterMinValidPixelPercentage = value;
+        break;
+    case BTA_LibParamLazyPostprocessing:
+        winst->lpLazyPostprocessing = (uint8_t)(value != 0);
+        break;
+    case BTA_LibParamBinningFactor:
+        if (value != 1 && value != 2 && value != 4) {
+            status = BTA_StatusInvalidParameter;
+            break;
+        }
+        if (value > 1 && winst->lpUndistortTofEnabled) {
+            // The undistortion maps only exist for the full resolution
+            BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusIllegalOperation, "BTAsetLibParam: Binning not possible while ToF undistortion is on");
+            status = BTA_StatusIllegalOperation;
+            break;
+        }
+        winst->lpBinningFactor = (uint8_t)value;
+        break;
+    case BTA_LibParamBinningMode:
+        if (value != BTA_BinningModeMean && value != BTA_BinningModeMedian && value != BTA_BinningModeMin) {
+            status = BTA_StatusInvalidParameter;
+            break;
+        }
+        winst->lpBinningMode = (uint8_t)value;
+        break;
+    case BTA_LibParamColorFromTofPercentile:
+        if (value < 0 || value >= 50) {
+            status = BTA_StatusInvalidParameter;
+            break;
+        }
+        winst->lpColorFromTofPercentile = value;
+        break;
+    case BTA_LibParamRawPhasesProcessing:
+        winst->lpRawPhasesProcessing = (uint8_t)(value != 0);
+        break;
+    case BTA_LibParamRawPhasesMinAmplitude:
+        if (value < 0) {
+            status = BTA_StatusInvalidParameter;
+            break;
+        }
+        winst->lpRawPhasesMinAmplitude = value;
+        break;
+    case BTA_LibParamPhaseUnwrapping:
+        winst->lpPhaseUnwrapping = (uint8_t)(value != 0);
+        break;
+    case BTA_LibParamCallbackDispatchQueueLength:
+        if (value < 0 || value > UINT16_MAX || value != (int)value) {
+            status = BTA_StatusInvalidParameter;
+            break;
+        }
+        status = BTAdispatchConfigure(winst->dispatchInst, (uint32_t)value, (BTA_QueueMode)winst->lpCallbackDispatchQueueMode);
+        if (status == BTA_StatusOk) {
+            winst->lpCallbackDispatchQueueLength = (uint32_t)value;
+        }
+        break;
+    case BTA_LibParamCallbackDispatchQueueMode:
+        if (value != BTA_QueueModeDropOldest && value != BTA_QueueModeDropCurrent) {
+            status = BTA_StatusInvalidParameter;
+            break;
+        }
+        if (winst->lpCallbackDispatchQueueLength && value != winst->lpCallbackDispatchQueueMode) {
+            status = BTAdispatchConfigure(winst->dispatchInst, winst->lpCallbackDispatchQueueLength, (BTA_QueueMode)value);
+        }
+        if (status == BTA_StatusOk) {
+            winst->lpCallbackDispatchQueueMode = (uint8_t)value;
+        }
+        break;
+    case BTA_LibParamCallbackBacklog:
+    case BTA_LibParamCallbackDuration:
+        status = BTA_StatusIllegalOperation;
         break;
     case BTA_LibParamCalcXYZ:
+        if (value != 0 && isRoiSet(winst)) {
+            BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusIllegalOperation, "BTAsetLibParam: CalcXYZ not possible while the parse filter crops to a region of interest");
+            status = BTA_StatusIllegalOperation;
+            break;
+        }
         winst->lpCalcXyzEnabled = (uint8_t)(value != 0);
         break;
     case BTA_LibParamOffsetForCalcXYZ:
         winst->lpCalcXyzOffset = value;
         break;
+    case BTA_LibParamCalcXYZFloat32:
+        winst->lpCalcXyzFloat32 = (uint8_t)(value != 0);
+        break;
+    case BTA_LibParamCalcXYZInterleaved:
+        winst->lpCalcXyzInterleaved = (uint8_t)(value != 0);
+        break;
+    case BTA_LibParamLensCacheEnabled:
+        winst->lpLensCacheEnabled = (uint8_t)(value != 0);
+        break;
     case BTA_LibParamBilateralFilterWindow: {
         uint8_t windowSize = (uint8_t)value;
         if (windowSize == 0 || (windowSize >= 3 && (windowSize % 2) == 1)) {
@@ -1569,9 +1915,14 @@ BTA_Status BTA_CALLCONV BTAsetLibParam(BTA_Handle handle, BTA_LibParam libParam,
             break;
         }
         status = BTA_StatusInvalidParameter;
+        break;
     }
     case BTA_LibParamGenerateColorFromTof:
-        winst->lpColorFromTofEnabled = (uint8_t)(value != 0);
+        if (value != 0 && value != 1 && value != 2) {
+            status = BTA_StatusInvalidParameter;
+            break;
+        }
+        winst->lpColorFromTofEnabled = (uint8_t)value;
         break;
     case BTA_LibParamEnableJpgDecoding:
 #       ifndef BTA_WO_LIBJPEG
@@ -1580,12 +1931,22 @@ BTA_Status BTA_CALLCONV BTAsetLibParam(BTA_Handle handle, BTA_LibParam libParam,
         status = value ? BTA_StatusNotSupported : BTA_StatusOk;
 #       endif
         break;
+    case BTA_LibParamJpgDecodeScale:
+        if (value != 1 && value != 2 && value != 4 && value != 8) {
+            status = BTA_StatusInvalidParameter;
+            break;
+        }
+        winst->lpJpgDecodeScale = (uint8_t)value;
+        break;
     case BTA_LibParamBltstreamCompressionMode:
         winst->grabInst->lpBltstreamCompressionMode = (BTA_CompressionMode)value;
         break;
 
     case BTA_LibParamPauseCaptureThread:
+        BTAlockMutex(winst->pauseMutex);
         winst->lpPauseCaptureThread = (uint8_t)(value != 0);
+        BTAunlockMutex(winst->pauseMutex);
+        BTAnotifyPauseChanged(winst);
         break;
 
 
@@ -1672,12 +2033,72 @@ BTA_Status BTA_CALLCONV BTAgetLibParam(BTA_Handle handle, BTA_LibParam libParam,
     case BTA_LibParamUndistortRgb:
         *value = (float)winst->lpUndistortRgbEnabled;
         break;
+    case BTA_LibParamUndistortTof:
+        *value = (float)winst->lpUndistortTofEnabled;
+        break;
+    case BTA_LibParamUndistortInterpolation:
+        *value = (float)winst->lpUndistortInterpolation;
+        break;
+    case BTA_LibParamTemporalFilterMode:
+        *value = (float)winst->lpTemporalFilterMode;
+        break;
+    case BTA_LibParamTemporalFilterWindow:
+        *value = (float)winst->lpTemporalFilterWindow;
+        break;
+    case BTA_LibParamTemporalFilterAlpha:
+        *value = winst->lpTemporalFilterAlpha;
+        break;
+    case BTA_LibParamTemporalFilterMinValidPixelPercentage:
+        *value = winst->lpTemporalFilterMinValidPixelPercentage;
+        break;
+    case BTA_LibParamLazyPostprocessing:
+        *value = (float)winst->lpLazyPostprocessing;
+        break;
+    case BTA_LibParamBinningFactor:
+        *value = (float)winst->lpBinningFactor;
+        break;
+    case BTA_LibParamBinningMode:
+        *value = (float)winst->lpBinningMode;
+        break;
+    case BTA_LibParamColorFromTofPercentile:
+        *value = winst->lpColorFromTofPercentile;
+        break;
+    case BTA_LibParamRawPhasesProcessing:
+        *value = (float)winst->lpRawPhasesProcessing;
+        break;
+    case BTA_LibParamRawPhasesMinAmplitude:
+        *value = winst->lpRawPhasesMinAmplitude;
+        break;
+    case BTA_LibParamPhaseUnwrapping:
+        *value = (float)winst->lpPhaseUnwrapping;
+        break;
+    case BTA_LibParamCallbackDispatchQueueLength:
+        *value = (float)winst->lpCallbackDispatchQueueLength;
+        break;
+    case BTA_LibParamCallbackDispatchQueueMode:
+        *value = (float)winst->lpCallbackDispatchQueueMode;
+        break;
+    case BTA_LibParamCallbackBacklog:
+        *value = (float)BTAdispatchGetBacklogMax(winst->dispatchInst);
+        break;
+    case BTA_LibParamCallbackDuration:
+        *value = BTAdispatchGetDurationMax(winst->dispatchInst);
+        break;
     case BTA_LibParamCalcXYZ:
         *value = (float)winst->lpCalcXyzEnabled;
         break;
     case BTA_LibParamOffsetForCalcXYZ:
         *value = winst->lpCalcXyzOffset;
         break;
+    case BTA_LibParamCalcXYZFloat32:
+        *value = (float)winst->lpCalcXyzFloat32;
+        break;
+    case BTA_LibParamCalcXYZInterleaved:
+        *value = (float)winst->lpCalcXyzInterleaved;
+        break;
+    case BTA_LibParamLensCacheEnabled:
+        *value = (float)winst->lpLensCacheEnabled;
+        break;
     case BTA_LibParamBilateralFilterWindow:
         *value = (float)winst->lpBilateralFilterWindow;
         break;
@@ -1687,6 +2108,9 @@ BTA_Status BTA_CALLCONV BTAgetLibParam(BTA_Handle handle, BTA_LibParam libParam,
     case BTA_LibParamEnableJpgDecoding:
         *value = (float)winst->lpJpgDecodeEnabled;
         break;
+    case BTA_LibParamJpgDecodeScale:
+        *value = (float)winst->lpJpgDecodeScale;
+        break;
     case BTA_LibParamBltstreamCompressionMode:
         *value = (float)winst->grabInst->lpBltstreamCompressionMode;
         break;
@@ -1818,6 +2242,169 @@ BTA_Status BTA_CALLCONV BTAgetLibParam(BTA_Handle handle, BTA_LibParam libParam,
 }
 
 
+BTA_Status BTA_CALLCONV BTAsetParseFilter(BTA_Handle handle, const BTA_ParseFilter *filter) {
+    BTA_WrapperInst *winst = (BTA_WrapperInst *)handle;
+    if (!winst) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (filter && filter->channelFiltersLen > BTA_PARSE_FILTER_CHANNEL_FILTERS_MAX) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (filter) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_WRITE_OP, BTA_StatusInformation, "BTAsetParseFilter call:  channelFiltersLen %d  roi %d,%d %dx%d", filter->channelFiltersLen, filter->roiX, filter->roiY, filter->roiXRes, filter->roiYRes);
+    }
+    else {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_WRITE_OP, BTA_StatusInformation, "BTAsetParseFilter call:  none");
+    }
+    BTAlockMutex(winst->parseFilterMutex);
+    if (filter && filter->roiXRes && filter->roiYRes && (winst->lpCalcXyzEnabled || winst->lpUndistortTofEnabled)) {
+        BTAunlockMutex(winst->parseFilterMutex);
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusIllegalOperation, "BTAsetParseFilter: Disable calcXYZ and ToF undistortion before cropping to a region of interest");
+        return BTA_StatusIllegalOperation;
+    }
+    if (filter) {
+        winst->parseFilter = *filter;
+    }
+    else {
+        memset(&(winst->parseFilter), 0, sizeof(BTA_ParseFilter));
+    }
+    BTAunlockMutex(winst->parseFilterMutex);
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTA_CALLCONV BTAsubscribe(BTA_Handle handle, const BTA_SubscriptionConfig *config, BTA_SubscriptionHandle *subscription) {
+    BTA_WrapperInst *winst = (BTA_WrapperInst *)handle;
+    if (!winst || !config || !subscription) {
+        return BTA_StatusInvalidParameter;
+    }
+    *subscription = 0;
+    if (config->queueMode != BTA_QueueModeDropOldest && config->queueMode != BTA_QueueModeDropCurrent && config->queueMode != BTA_QueueModeLatest) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusInvalidParameter, "BTAsubscribe: Only queue modes DropCurrent, DropOldest and Latest are allowed");
+        return BTA_StatusInvalidParameter;
+    }
+    if (!config->queueLength && config->queueMode != BTA_QueueModeLatest) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusInvalidParameter, "BTAsubscribe: queueLength is missing");
+        return BTA_StatusInvalidParameter;
+    }
+    if (config->channelFiltersLen > BTA_SUBSCRIPTION_CHANNEL_FILTERS_MAX) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTA_Subscription *subscriptionNew = (BTA_Subscription *)calloc(1, sizeof(BTA_Subscription));
+    if (!subscriptionNew) {
+        return BTA_StatusOutOfMemory;
+    }
+    subscriptionNew->config = *config;
+    BTA_Status status = BFQinit(config->queueLength, config->queueMode, &subscriptionNew->queue);
+    if (status != BTA_StatusOk) {
+        free(subscriptionNew);
+        return status;
+    }
+    BTAlockMutex(winst->subscriptionsMutex);
+    if (winst->subscriptionsLen == BTA_SUBSCRIPTIONS_MAX) {
+        BTAunlockMutex(winst->subscriptionsMutex);
+        BFQclose(&subscriptionNew->queue);
+        free(subscriptionNew);
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "BTAsubscribe: No more than %d subscriptions", BTA_SUBSCRIPTIONS_MAX);
+        return BTA_StatusOutOfMemory;
+    }
+    winst->subscriptions[winst->subscriptionsLen] = subscriptionNew;
+    BTAatomicFetchAdd(&winst->subscriptionsLen, 1);
+    BTAunlockMutex(winst->subscriptionsMutex);
+    BTAinfoEventHelper(winst->infoEventInst, VERBOSE_WRITE_OP, BTA_StatusInformation, "BTAsubscribe call:  queueLength %d  queueMode %d  decimation %d  channelFiltersLen %d", config->queueLength, config->queueMode, config->decimation, config->channelFiltersLen);
+    *subscription = subscriptionNew;
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTA_CALLCONV BTAunsubscribe(BTA_Handle handle, BTA_SubscriptionHandle *subscription) {
+    BTA_WrapperInst *winst = (BTA_WrapperInst *)handle;
+    if (!winst || !subscription || !*subscription) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTA_Subscription *subscriptionOld = (BTA_Subscription *)*subscription;
+    BTAlockMutex(winst->subscriptionsMutex);
+    int i;
+    for (i = 0; i < (int)winst->subscriptionsLen && winst->subscriptions[i] != subscriptionOld; i++);
+    if (i == (int)winst->subscriptionsLen) {
+        BTAunlockMutex(winst->subscriptionsMutex);
+        return BTA_StatusInvalidParameter;
+    }
+    memmove(&(winst->subscriptions[i]), &(winst->subscriptions[i + 1]), (winst->subscriptionsLen - i - 1) * sizeof(BTA_Subscription *));
+    BTAatomicFetchAdd(&winst->subscriptionsLen, (uint32_t)-1);
+    BTAunlockMutex(winst->subscriptionsMutex);
+    BTA_Status status = BFQclose(&subscriptionOld->queue);
+    free(subscriptionOld);
+    *subscription = 0;
+    return status;
+}
+
+
+BTA_Status BTA_CALLCONV BTAgetSubscribedFrame(BTA_SubscriptionHandle subscription, BTA_Frame **frame, uint32_t millisecondsTimeout) {
+    if (!subscription || !frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    return BFQdequeue(((BTA_Subscription *)subscription)->queue, frame, millisecondsTimeout);
+}
+
+
+BTA_Status BTA_CALLCONV BTAgetPipelineStats(BTA_Handle handle, BTA_PipelineStats *stats) {
+    BTA_WrapperInst *winst = (BTA_WrapperInst *)handle;
+    if (!winst || !stats) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTA_PipelineStats statsTemp;
+    memset(&statsTemp, 0, sizeof(BTA_PipelineStats));
+    BTA_PipelineCounters *counters = &winst->pipelineCounters;
+    // Concurrent calls don't interleave. Each value is exchanged with 0, an event happening meanwhile is counted in this call or the next
+    BTAlockMutex(winst->pipelineStatsMutex);
+    statsTemp.packetBufferUnavailableCount = BTAatomicExchange(&counters->packetBufferUnavailableCount, 0);
+    statsTemp.framesEvictedCount = BTAatomicExchange(&counters->framesEvictedCount, 0);
+    statsTemp.framesDiscardedCount = BTAatomicExchange(&counters->framesDiscardedCount, 0);
+    statsTemp.framesIncompleteCount = BTAatomicExchange(&counters->framesIncompleteCount, 0);
+    statsTemp.framesParseErrorCount = BTAatomicExchange(&counters->framesParseErrorCount, 0);
+    statsTemp.subscriptionsDroppedCount = BTAatomicExchange(&counters->subscriptionsDroppedCount, 0);
+    statsTemp.packetsToParseCountMax = BTAatomicExchange(&counters->packetsToParseCountMax, 0);
+    statsTemp.packetBufferWaitMicros = BTAatomicExchange64(&counters->packetBufferWaitMicros, 0);
+    statsTemp.callbacksMicros = BTAatomicExchange64(&counters->callbacksMicros, 0);
+
+    // The queues count for themselves
+    if (winst->frameQueue) {
+        BFQgetStatistics(winst->frameQueue, &statsTemp.frameQueueDroppedCount, &statsTemp.frameQueueCountMax);
+    }
+    BTAdispatchGetStatistics(winst->dispatchInst, &statsTemp.callbackDispatchDroppedCount, &statsTemp.callbackDispatchCountMax);
+    BTAlockMutex(winst->subscriptionsMutex);
+    for (int i = 0; i < (int)winst->subscriptionsLen; i++) {
+        uint32_t droppedCount, countMax;
+        if (BFQgetStatistics(winst->subscriptions[i]->queue, &droppedCount, &countMax) == BTA_StatusOk) {
+            statsTemp.subscriptionsDroppedCount += droppedCount;
+            if (countMax > statsTemp.subscriptionsCountMax) {
+                statsTemp.subscriptionsCountMax = countMax;
+            }
+        }
+    }
+    BTAunlockMutex(winst->subscriptionsMutex);
+    if (winst->grabInst && winst->grabInst->grabbingQueue) {
+        BFQgetStatistics(winst->grabInst->grabbingQueue, &statsTemp.grabbingDroppedCount, &statsTemp.grabbingQueueCountMax);
+    }
+    BTAunlockMutex(winst->pipelineStatsMutex);
+    *stats = statsTemp;
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTA_CALLCONV BTAgetParseFilter(BTA_Handle handle, BTA_ParseFilter *filter) {
+    BTA_WrapperInst *winst = (BTA_WrapperInst *)handle;
+    if (!winst || !filter) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTAlockMutex(winst->parseFilterMutex);
+    *filter = winst->parseFilter;
+    BTAunlockMutex(winst->parseFilterMutex);
+    return BTA_StatusOk;
+}
+
+
 BTA_Status BTA_CALLCONV BTAsendReset(BTA_Handle handle) {
     BTA_WrapperInst *winst = (BTA_WrapperInst *)handle;
     if (!winst) {
@@ -2244,6 +2831,7 @@ BTA_Status BTA_CALLCONV BTAgetDataByChannelId(BTA_Frame *frame, BTA_ChannelId ch
     if (!frame || !frame->channels || !data || !dataFormat || !unit || !xRes || !yRes) {
         return BTA_StatusInvalidParameter;
     }
+    BTAmaterializeFrame(frame);
     for (int chInd = 0; chInd < frame->channelsLen; chInd++) {
         if (frame->channels[chInd]->id == channelId) {
             *dataFormat = frame->channels[chInd]->dataFormat;
@@ -2263,6 +2851,7 @@ BTA_Status BTA_CALLCONV BTAgetDistances(BTA_Frame *frame, void **distBuffer, BTA
     if (!frame || !frame->channels || !distBuffer || !dataFormat || !unit || !xRes || !yRes) {
         return BTA_StatusInvalidParameter;
     }
+    BTAmaterializeFrame(frame);
     for (chInd = 0; chInd < frame->channelsLen; chInd++) {
         if (frame->channels[chInd]->id == BTA_ChannelIdDistance) {
             *dataFormat = frame->channels[chInd]->dataFormat;
@@ -2282,6 +2871,7 @@ BTA_Status BTA_CALLCONV BTAgetAmplitudes(BTA_Frame *frame, void **ampBuffer, BTA
     if (!frame || !frame->channels || !ampBuffer || !dataFormat || !unit || !xRes || !yRes) {
         return BTA_StatusInvalidParameter;
     }
+    BTAmaterializeFrame(frame);
     for (chInd = 0; chInd < frame->channelsLen; chInd++) {
         if (frame->channels[chInd]->id == BTA_ChannelIdAmplitude) {
             *dataFormat = frame->channels[chInd]->dataFormat;
@@ -2301,6 +2891,7 @@ BTA_Status BTA_CALLCONV BTAgetFlags(BTA_Frame *frame, void **flagBuffer, BTA_Dat
     if (!frame || !frame->channels || !flagBuffer || !dataFormat || !unit || !xRes || !yRes) {
         return BTA_StatusInvalidParameter;
     }
+    BTAmaterializeFrame(frame);
     for (i = 0; i < frame->channelsLen; i++) {
         if (frame->channels[i]->id == BTA_ChannelIdFlags) {
             *dataFormat = frame->channels[i]->dataFormat;
@@ -2323,6 +2914,7 @@ BTA_Status BTA_CALLCONV BTAgetXYZcoordinates(BTA_Frame *frame, void **xBuffer, v
     if (!frame || !frame->channels || !xBuffer || !yBuffer || !zBuffer || !dataFormat || !unit || !xRes || !yRes) {
         return BTA_StatusInvalidParameter;
     }
+    BTAmaterializeFrame(frame);
     for (chInd = 0; chInd < frame->channelsLen; chInd++) {
         if (frame->channels[chInd]->id == BTA_ChannelIdX) {
             xChannel = chInd;
@@ -2364,6 +2956,7 @@ BTA_Status BTA_CALLCONV BTAgetColors(BTA_Frame *frame, void **colorBuffer, BTA_D
     if (!frame || !frame->channels || !colorBuffer || !dataFormat || !unit || !xRes || !yRes) {
         return BTA_StatusInvalidParameter;
     }
+    BTAmaterializeFrame(frame);
     for (int chInd = 0; chInd < frame->channelsLen; chInd++) {
         if (frame->channels[chInd]->id == BTA_ChannelIdColor) {
             *dataFormat = frame->channels[chInd]->dataFormat;
@@ -2382,15 +2975,11 @@ BTA_Status BTA_CALLCONV BTAgetChannels(BTA_Frame *frame, BTA_ChannelFilter *filt
     if (!frame || !frame->channels || !filter || !channels || !channlesLen || !*channlesLen) {
         return BTA_StatusInvalidParameter;
     }
+    BTAmaterializeFrame(frame);
     int count = 0;
     for (int chInd = 0; chInd < frame->channelsLen; chInd++) {
         BTA_Channel *channel = frame->channels[chInd];
-        if (filter->filterByChannelId && channel->id != filter->id) continue;
-        if (filter->filterByResolution && (channel->xRes != filter->xRes || channel->yRes != filter->yRes)) continue;
-        if (filter->filterByDataFormat && channel->dataFormat != filter->dataFormat) continue;
-        if (filter->filterByLensIndex && channel->lensIndex != filter->lensIndex) continue;
-        if (filter->filterByFlagsMask & (channel->flags ^ filter->flags)) continue;
-        if (filter->filterBySequenceCounter && channel->sequenceCounter != filter->sequenceCounter) continue;
+        if (!BTAchannelMatchesFilter(channel, filter)) continue;
         // It's a match!
         channels[count++] = channel;
         if (count >= *channlesLen) {
@@ -2402,6 +2991,11 @@ BTA_Status BTA_CALLCONV BTAgetChannels(BTA_Frame *frame, BTA_ChannelFilter *filt
 }
 
 
+BTA_Status BTA_CALLCONV BTAmaterializeFrame(BTA_Frame *frame) {
+    return BTApostprocessMaterialize(frame);
+}
+
+
 BTA_Status BTA_CALLCONV BTAgetMetadata(BTA_Channel *channel, BTA_MetadataId metadataId, void **metadata, uint32_t *metadataLen) {
     if (!channel || !metadata || !metadataLen) {
         return BTA_StatusInvalidParameter;
@@ -2423,12 +3017,16 @@ BTA_Status BTA_CALLCONV BTAcloneFrame(BTA_Frame *frameSrc, BTA_Frame **frameDst)
     if (!frameSrc || !frameDst) {
         return BTA_StatusInvalidParameter;
     }
+    // The clone must not share the deferred postprocessing, so complete it
+    BTAmaterializeFrame(frameSrc);
     *frameDst = 0;
     frame = (BTA_Frame *)malloc(sizeof(BTA_Frame));
     if (!frame) {
         return BTA_StatusOutOfMemory;
     }
     memcpy(frame, frameSrc, sizeof(BTA_Frame));
+    frame->refCount = 0;
+    frame->sharedFrom = 0;
     frame->channels = (BTA_Channel **)calloc(frame->channelsLen, sizeof(BTA_Channel *));
     if (!frame->channels) {
         free(frame);
@@ -2463,6 +3061,7 @@ BTA_Status BTA_CALLCONV BTAcloneFrame(BTA_Frame *frameSrc, BTA_Frame **frameDst)
 
 
 BTA_Status BTA_CALLCONV BTAgetSerializedLength(BTA_Frame *frame, uint32_t *frameSerializedLen) {
+    BTAmaterializeFrame(frame);
     uint32_t length = 0;
     length += sizeof(uint16_t);                     // preamble
     length += sizeof(uint8_t);                      // version of serialized frame
@@ -2636,12 +3235,15 @@ BTA_Status BTA_CALLCONV BTAdeserializeFrame(BTA_Frame **framePtr, uint8_t *frame
 }
 
 
-BTA_Status BTA_CALLCONV BTAfreeFrame(BTA_Frame **frame) {
-    if (!frame) {
-        return BTA_StatusInvalidParameter;
-    }
-    if (!*frame) {
-        return BTA_StatusInvalidParameter;
+static void freeFrame(BTA_Frame **frame) {
+    if ((*frame)->sharedFrom) {
+        // Only the lists are its own
+        free((*frame)->channels);
+        free((*frame)->metadata);
+        BTAreleaseFrame(&((*frame)->sharedFrom));
+        free(*frame);
+        *frame = 0;
+        return;
     }
     if ((*frame)->channels) {
         for (int i = 0; i < (*frame)->channelsLen; i++) {
@@ -2659,6 +3261,36 @@ BTA_Status BTA_CALLCONV BTAfreeFrame(BTA_Frame **frame) {
     (*frame)->metadata = 0;
     free(*frame);
     *frame = 0;
+}
+
+
+BTA_Status BTA_CALLCONV BTAfreeFrame(BTA_Frame **frame) {
+    return BTAreleaseFrame(frame);
+}
+
+
+BTA_Status BTA_CALLCONV BTAretainFrame(BTA_Frame *frame) {
+    if (!frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    // Pending postprocessing stays deferred, the first holder to access the frame completes it
+    BTAatomicFetchAdd((BTA_Atomic32 *)&frame->refCount, 1);
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTA_CALLCONV BTAreleaseFrame(BTA_Frame **frame) {
+    if (!frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (!*frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    // The sole owner skips the atomic decrement. Otherwise whoever finds no reference left frees
+    if (BTAatomicLoad((BTA_Atomic32 *)&(*frame)->refCount) == 0 || BTAatomicFetchAdd((BTA_Atomic32 *)&(*frame)->refCount, (uint32_t)-1) == 0) {
+        freeFrame(frame);
+    }
+    *frame = 0;
     return BTA_StatusOk;
 }
 
@@ -2745,6 +3377,7 @@ const char *BTA_CALLCONV BTAlibParamToString(BTA_LibParam libParam) {
     case BTA_LibParamUndistortRgb: return "UndistortRgb";
     case BTA_LibParamInfoEventVerbosity: return "InfoEventVerbosity";
     case BTA_LibParamEnableJpgDecoding: return "EnableJpgDecoding";
+    case BTA_LibParamJpgDecodeScale: return "JpgDecodeScale";
     case BTA_LibParamDataStreamReadFailedCount: return "DataStreamReadFailedCount";
     case BTA_LibParamDataStreamBytesReceivedCount: return "DataStreamBytesReceivedCount";
     case BTA_LibParamDataStreamPacketsReceivedCount: return "DataStreamPacketsReceivedCount";
@@ -2766,6 +3399,26 @@ const char *BTA_CALLCONV BTAlibParamToString(BTA_LibParam libParam) {
     case BTA_LibParamDataSockOptRcvbuf: return "DataSockOptRcvbuf";
     case BTA_LibParamCalcXYZ: return "CalcXYZ";
     case BTA_LibParamOffsetForCalcXYZ: return "OffsetForCalcXYZ";
+    case BTA_LibParamCalcXYZFloat32: return "CalcXYZFloat32";
+    case BTA_LibParamCalcXYZInterleaved: return "CalcXYZInterleaved";
+    case BTA_LibParamLensCacheEnabled: return "LensCacheEnabled";
+    case BTA_LibParamUndistortTof: return "UndistortTof";
+    case BTA_LibParamUndistortInterpolation: return "UndistortInterpolation";
+    case BTA_LibParamTemporalFilterMode: return "TemporalFilterMode";
+    case BTA_LibParamTemporalFilterWindow: return "TemporalFilterWindow";
+    case BTA_LibParamTemporalFilterAlpha: return "TemporalFilterAlpha";
+    case BTA_LibParamTemporalFilterMinValidPixelPercentage: return "TemporalFilterMinValidPixelPercentage";
+    case BTA_LibParamLazyPostprocessing: return "LazyPostprocessing";
+    case BTA_LibParamBinningFactor: return "BinningFactor";
+    case BTA_LibParamBinningMode: return "BinningMode";
+    case BTA_LibParamColorFromTofPercentile: return "ColorFromTofPercentile";
+    case BTA_LibParamRawPhasesProcessing: return "RawPhasesProcessing";
+    case BTA_LibParamRawPhasesMinAmplitude: return "RawPhasesMinAmplitude";
+    case BTA_LibParamPhaseUnwrapping: return "PhaseUnwrapping";
+    case BTA_LibParamCallbackDispatchQueueLength: return "CallbackDispatchQueueLength";
+    case BTA_LibParamCallbackDispatchQueueMode: return "CallbackDispatchQueueMode";
+    case BTA_LibParamCallbackBacklog: return "CallbackBacklog";
+    case BTA_LibParamCallbackDuration: return "CallbackDuration";
     case BTA_LibParamBilateralFilterWindow: return "BilateralFilterWindow";
     case BTA_LibParamGenerateColorFromTof: return "GenerateColorFromTof";
     case BTA_LibParamBltstreamCompressionMode: return "BltstreamCompressionMode";
@@ -2979,6 +3632,8 @@ const char *BTA_CALLCONV BTAchannelIdToString(BTA_ChannelId id) {
         return "Balance";
     case BTA_ChannelIdStdDev:
         return "StdDev";
+    case BTA_ChannelIdXYZ:
+        return "XYZ";
     case BTA_ChannelIdCustom01:
         return "Custom01";
     case BTA_ChannelIdCustom02:
@@ -3079,6 +3734,9 @@ BTA_Status BTA_CALLCONV BTAinsertChannelIntoFrame(BTA_Frame *frame, BTA_Channel
     if (!frame || !channel) {
         return BTA_StatusInvalidParameter;
     }
+    if (BTAisFrameShared(frame)) {
+        return BTA_StatusIllegalOperation;
+    }
     if (!frame->channels) {
         frame->channels = (BTA_Channel **)malloc(sizeof(BTA_Channel *));
         if (!frame->channels) {
@@ -3103,6 +3761,13 @@ BTA_Status BTA_CALLCONV BTAinsertChannelIntoFrame(BTA_Frame *frame, BTA_Channel
 
 BTA_Status BTA_CALLCONV BTAinsertChannelIntoFrame2(BTA_Frame *frame, BTA_ChannelId id, uint16_t xRes, uint16_t yRes, BTA_DataFormat dataFormat, BTA_Unit unit, uint32_t integrationTime, uint32_t modulationFrequency, uint8_t *data, uint32_t dataLen,
                                                    BTA_Metadata **metadata, uint32_t metadataLen, uint8_t lensIndex, uint32_t flags, uint8_t sequenceCounter, float gain) {
+    if (!frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (BTAisFrameShared(frame)) {
+        // Checked before the channel is built, so the caller still owns data
+        return BTA_StatusIllegalOperation;
+    }
     BTA_Channel *channel;
     channel = (BTA_Channel *)calloc(1, sizeof(BTA_Channel));
     if (!channel) {
@@ -3135,6 +3800,9 @@ BTA_Status BTA_CALLCONV BTAremoveChannelFromFrame(BTA_Frame *frame, BTA_Channel
     if (!frame->channels) {
         return BTA_StatusInvalidParameter;
     }
+    if (BTAisFrameShared(frame)) {
+        return BTA_StatusIllegalOperation;
+    }
     uint8_t channelsLenNew = 0;
     int chInd;
     for (chInd = 0; chInd < frame->channelsLen; chInd++) {
@@ -3285,94 +3953,39 @@ BTA_Status BTA_CALLCONV BTAcloneMetadata(BTA_Metadata *metadataSrc, BTA_Metadata
 
 
 BTA_Status BTA_CALLCONV BTAdivideChannelByNumber(BTA_Channel *dividend, uint32_t divisor, BTA_Channel **quotient/*, BTA_InfoEventInst *infoEventInst*/) {
-    int xy;
     BTA_Channel *result;
-    if (!dividend || !divisor) {
+    if (!dividend || !divisor || !quotient) {
         return BTA_StatusInvalidParameter;
     }
-    BTAcloneChannel(dividend, &result);
-    switch (dividend->dataFormat) {
-    case BTA_DataFormatUInt16:
-        for (xy = 0; xy < dividend->xRes * dividend->yRes; xy++) {
-            ((uint16_t *)result->data)[xy] = (uint16_t)(((uint16_t *)dividend->data)[xy] / divisor);
-        }
-        break;
-    case BTA_DataFormatSInt32:
-        for (xy = 0; xy < dividend->xRes * dividend->yRes; xy++) {
-            ((int32_t *)result->data)[xy] = (int32_t)(((int32_t *)dividend->data)[xy] / divisor);
-        }
-        break;
-    default:
+    if (!BTAcalcChannelIsSupported(dividend->dataFormat)) {
         //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusNotSupported, "BTAdivideChannelByNumber unsupported channel format");
         return BTA_StatusNotSupported;
     }
+    BTA_Status status = BTAcloneChannel(dividend, &result);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    status = BTAcalcChannelScalar(result, BTA_CalcChannelOpDivide, divisor);
+    if (status != BTA_StatusOk) {
+        BTAfreeChannel(&result);
+        return status;
+    }
     *quotient = result;
     return BTA_StatusOk;
 }
 
 
 BTA_Status BTA_CALLCONV BTAaddChannelInPlace(BTA_Channel *augendSum, BTA_Channel *addend/*, BTA_InfoEventInst *infoEventInst*/) {
-    int xy;
-    if (!augendSum || !addend) {
-        return BTA_StatusInvalidParameter;
-    }
-    if (augendSum->xRes != addend->xRes || augendSum->yRes != addend->yRes) {
-        //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusInvalidParameter, "BTAaddChannelInPlace wrong resolution");
-        return BTA_StatusInvalidParameter;
-    }
-    switch (augendSum->dataFormat) {
-    case BTA_DataFormatSInt32:
-        switch (addend->dataFormat) {
-        case BTA_DataFormatUInt16:
-            for (xy = 0; xy < augendSum->xRes * augendSum->yRes; xy++) {
-                ((int32_t *)augendSum->data)[xy] += ((uint16_t *)addend->data)[xy];
-            }
-            break;
-        default:
-            //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusNotSupported, "BTAaddChannelInPlace unsupported addend format");
-            return BTA_StatusNotSupported;
-        }
-        break;
-    default:
-        //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusNotSupported, "BTAaddChannelInPlace unsupported addend format");
-        return BTA_StatusNotSupported;
-    }
-    return BTA_StatusOk;
+    return BTAcalcChannelBinary(augendSum, addend, BTA_CalcChannelOpAdd);
 }
 
 
 BTA_Status BTA_CALLCONV BTAsubtChannelInPlace(BTA_Channel *minuendDiff, BTA_Channel *subtrahend/*, BTA_InfoEventInst *infoEventInst*/) {
-    int xy;
-    if (!minuendDiff || !subtrahend) {
-        return BTA_StatusInvalidParameter;
-    }
-    if (minuendDiff->xRes != subtrahend->xRes || minuendDiff->yRes != subtrahend->yRes) {
-        //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusInvalidParameter, "BTAsubtChannelInPlace wrong resolution");
-        return BTA_StatusInvalidParameter;
-    }
-    switch (minuendDiff->dataFormat) {
-    case BTA_DataFormatSInt32:
-        switch (subtrahend->dataFormat) {
-        case BTA_DataFormatUInt16:
-            for (xy = 0; xy < minuendDiff->xRes * minuendDiff->yRes; xy++) {
-                ((int32_t *)minuendDiff->data)[xy] -= ((uint16_t *)subtrahend->data)[xy];
-            }
-            break;
-        default:
-            //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusNotSupported, "BTAsubtChannelInPlace unsupported subtrahend format", subtrahend->dataFormat);
-            return BTA_StatusNotSupported;
-        }
-        break;
-    default:
-        //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusNotSupported, "BTAsubtChannelInPlace unsupported minuend format", minuendDiff->dataFormat);
-        return BTA_StatusNotSupported;
-    }
-    return BTA_StatusOk;
+    return BTAcalcChannelBinary(minuendDiff, subtrahend, BTA_CalcChannelOpSubtract);
 }
 
 
 BTA_Status BTA_CALLCONV BTAsubtChannel(BTA_Channel *minuend, BTA_Channel *subtrahend, BTA_Channel **diff/*, BTA_InfoEventInst *infoEventInst*/) {
-    int xy;
     BTA_Channel *result;
     if (!minuend || !subtrahend || !diff) {
         return BTA_StatusInvalidParameter;
@@ -3381,110 +3994,80 @@ BTA_Status BTA_CALLCONV BTAsubtChannel(BTA_Channel *minuend, BTA_Channel *subtra
         //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusInvalidParameter, "BTAsubtChannel wrong resolution");
         return BTA_StatusInvalidParameter;
     }
-    BTAcloneChannel(minuend, &result);
-    switch (result->dataFormat) {
-    case BTA_DataFormatSInt32:
-        switch (subtrahend->dataFormat) {
-        case BTA_DataFormatUInt16:
-            for (xy = 0; xy < result->xRes * result->yRes; xy++) {
-                ((int32_t *)result->data)[xy] -= ((uint16_t *)subtrahend->data)[xy];
-            }
-            break;
-        default:
-            //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusNotSupported, "BTAsubtChannel unsupported subtrahend format", subtrahend->dataFormat);
-            BTAfreeChannel(&result);
-            return BTA_StatusNotSupported;
-        }
-        break;
-    default:
-        //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusNotSupported, "BTAsubtChannel unsupported minuend format", minuend->dataFormat);
+    BTA_Status status = BTAcloneChannel(minuend, &result);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    status = BTAcalcChannelBinary(result, subtrahend, BTA_CalcChannelOpSubtract);
+    if (status != BTA_StatusOk) {
         BTAfreeChannel(&result);
-        return BTA_StatusNotSupported;
+        return status;
     }
     *diff = result;
     return BTA_StatusOk;
 }
 
 
+BTA_Status BTA_CALLCONV BTAmultiplyChannelInPlace(BTA_Channel *multiplicandProduct, BTA_Channel *multiplier) {
+    return BTAcalcChannelBinary(multiplicandProduct, multiplier, BTA_CalcChannelOpMultiply);
+}
+
+
+BTA_Status BTA_CALLCONV BTAdivideChannelInPlace(BTA_Channel *dividendQuotient, BTA_Channel *divisor) {
+    return BTAcalcChannelBinary(dividendQuotient, divisor, BTA_CalcChannelOpDivide);
+}
+
+
+BTA_Status BTA_CALLCONV BTAminChannelInPlace(BTA_Channel *channelMin, BTA_Channel *channel) {
+    return BTAcalcChannelBinary(channelMin, channel, BTA_CalcChannelOpMin);
+}
+
+
+BTA_Status BTA_CALLCONV BTAmaxChannelInPlace(BTA_Channel *channelMax, BTA_Channel *channel) {
+    return BTAcalcChannelBinary(channelMax, channel, BTA_CalcChannelOpMax);
+}
+
+
+BTA_Status BTA_CALLCONV BTAscaleOffsetChannelInPlace(BTA_Channel *channel, float scale, float offset) {
+    return BTAcalcChannelScaleOffset(channel, scale, offset);
+}
+
+
+BTA_Status BTA_CALLCONV BTAclampChannelInPlace(BTA_Channel *channel, float min, float max) {
+    return BTAcalcChannelClamp(channel, min, max);
+}
+
+
 BTA_Status BTA_CALLCONV BTAthresholdInPlace(BTA_Channel *channel, uint32_t threshold, uint8_t alsoNegative/*, BTA_InfoEventInst *infoEventInst*/) {
-    int xy;
-    if (!channel) {
-        return BTA_StatusInvalidParameter;
-    }
-    if (alsoNegative) {
-        switch (channel->dataFormat) {
-        case BTA_DataFormatUInt16:
-            for (xy = 0; xy < channel->xRes * channel->yRes; xy++) {
-                ((uint16_t *)channel->data)[xy] = ((uint16_t *)channel->data)[xy] > threshold;
-            }
-            break;
-        case BTA_DataFormatSInt32:
-            for (xy = 0; xy < channel->xRes * channel->yRes; xy++) {
-                ((int32_t *)channel->data)[xy] = (((int32_t *)channel->data)[xy] > (int32_t)threshold) || (((int32_t *)channel->data)[xy] < -(int32_t)threshold);
-            }
-            break;
-        default:
-            //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusNotSupported, "BTAthresholdInPlace unsupported format", channel->dataFormat);
-            return BTA_StatusNotSupported;
-        }
-    }
-    else {
-        switch (channel->dataFormat) {
-        case BTA_DataFormatUInt16:
-            for (xy = 0; xy < channel->xRes * channel->yRes; xy++) {
-                ((uint16_t *)channel->data)[xy] = ((uint16_t *)channel->data)[xy] > threshold;
-            }
-            break;
-        case BTA_DataFormatSInt32:
-            for (xy = 0; xy < channel->xRes * channel->yRes; xy++) {
-                ((int32_t *)channel->data)[xy] = ((int32_t *)channel->data)[xy] > (int32_t)threshold;
-            }
-            break;
-        default:
-            //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusNotSupported, "BTAthresholdInPlace unsupported format", channel->dataFormat);
-            return BTA_StatusNotSupported;
-        }
-    }
-    return BTA_StatusOk;
+    return BTAcalcChannelThreshold(channel, threshold, alsoNegative);
 }
 
 
 BTA_Status BTA_CALLCONV BTAchangeDataFormat(BTA_Channel *channel, BTA_DataFormat dataFormat/*, BTA_InfoEventInst *infoEventInst*/) {
-    int xy;
     if (!channel) {
         return BTA_StatusInvalidParameter;
     }
-    switch (channel->dataFormat) {
-    case BTA_DataFormatSInt32:
-        switch (dataFormat) {
-        case BTA_DataFormatUInt16: {
-            uint32_t dataLen = channel->xRes * channel->yRes * sizeof(uint16_t);
-            uint16_t *data = (uint16_t *)malloc(dataLen);
-            if (!data) {
-                return BTA_StatusOutOfMemory;
-            }
-            for (xy = 0; xy < channel->xRes * channel->yRes; xy++) {
-                data[xy] = (uint16_t)((int32_t *)channel->data)[xy];
-            }
-            free(channel->data);
-            channel->dataLen = dataLen;
-            channel->data = (uint8_t *)data;
-            channel->dataFormat = dataFormat;
-            break;
-        }
-
-        case BTA_DataFormatSInt32:
-            return BTA_StatusOk;
-
-        default:
-            //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusNotSupported, "BTAsubtChannel unsupported subtrahend format", dataFormat);
-            return BTA_StatusNotSupported;
-        }
-        break;
-    default:
-        //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusNotSupported, "BTAsubtChannel unsupported minuend format", channel->dataFormat);
+    if (channel->dataFormat == dataFormat) {
+        return BTA_StatusOk;
+    }
+    if (!BTAcalcChannelIsSupported(channel->dataFormat) || !BTAcalcChannelIsSupported(dataFormat)) {
+        //BTAinfoEventHelper(infoEventInst, IMPORTANCE_ERROR, BTA_StatusNotSupported, "BTAchangeDataFormat unsupported format");
         return BTA_StatusNotSupported;
     }
+    uint32_t dataLen = channel->xRes * channel->yRes * (dataFormat & 0xf);
+    uint8_t *data = (uint8_t *)malloc(dataLen);
+    if (!data) {
+        return BTA_StatusOutOfMemory;
+    }
+    BTA_Status status = BTAcalcChannelConvert(channel->data, channel->dataFormat, data, dataFormat, channel->xRes * channel->yRes);
+    if (status != BTA_StatusOk) {
+        free(data);
+        return status;
+    }
+    free(channel->data);
+    channel->dataLen = dataLen;
+    channel->data = data;
+    channel->dataFormat = dataFormat;
     return BTA_StatusOk;
 }
 
@@ -3516,6 +4099,9 @@ BTA_Status BTA_CALLCONV BTAfreeMetadata(BTA_Metadata **metadata) {
         return BTA_StatusInvalidParameter;
     }
     if (*metadata) {
+        if ((*metadata)->id == BTA_MetadataIdDeferredPostprocessing && (*metadata)->data) {
+            BTApostprocessContextRelease(&(((BTA_DeferredPostprocess *)(*metadata)->data)->context));
+        }
         free((*metadata)->data);
         (*metadata)->data = 0;
         free(*metadata);
@@ -3692,21 +4278,3 @@ BTA_Status BTA_CALLCONV BTAgetNetworkBroadcastAddrs(uint8_t ***localIpAddrs, uin
     }
     return BTA_StatusOk;
 }
-
-
-void BTA_CALLCONV BTAgeneratePlanarView(int16_t *chX, int16_t *chY, int16_t *chZ, uint16_t *chAmp, int resX, int resY, int planarViewResX, int planarViewResY, float planarViewScale, int16_t *planarViewZ, uint16_t *planarViewAmp) {
-    planarViewScale *= 10.0;
-    int planarViewResXhalf = planarViewResX / 2;
-    int planarViewResYhalf = planarViewResY / 2;
-    int x, y, index;
-    int count = resX * resY;
-    for (int i = 0; i < count; i++) {
-        x = (int)(chX[i] / planarViewScale + planarViewResXhalf);
-        y = (int)(chY[i] / planarViewScale + planarViewResYhalf);
-        index = x + y * planarViewResX;
-        //#print('x: y: z:', x, y, frame.channels[z_ch_index].data[i])
-        planarViewZ[index] = chZ[i];
-        //# create top view amp image
-        planarViewAmp[index] = chAmp[i];
-    }
-}
@@ -0,0 +1,302 @@
+#include "bta_dispatch.h"
+#include <pthread_helper.h>
+#include <timing_helper.h>
+#include <stdlib.h>
+
+
+// The pool exists while at least one handle dispatches. initMutex serializes its creation and destruction, mutex guards everything else
+static struct {
+    void *initMutex;                ///< Created on first use and never closed
+    int usersCount;
+    void *mutex;
+    void *condWork;                 ///< A handle was added to the list
+    void *condIdle;                 ///< A handle is not running anymore
+    BTA_DispatchInst *head;         ///< Handles waiting to be served, oldest first
+    BTA_DispatchInst *tail;
+    void *threads[BTA_DISPATCH_THREADS_MAX];
+    int threadsLen;
+    uint8_t stop;
+} pool;
+
+
+// Called with pool.mutex locked
+static void pushInst(BTA_DispatchInst *inst) {
+    inst->next = 0;
+    if (pool.tail) {
+        pool.tail->next = inst;
+    }
+    else {
+        pool.head = inst;
+    }
+    pool.tail = inst;
+    BTAsignalCondition(pool.condWork);
+}
+
+
+// Called with pool.mutex locked
+static void removeInst(BTA_DispatchInst *inst) {
+    BTA_DispatchInst **link = &pool.head;
+    BTA_DispatchInst *prev = 0;
+    while (*link && *link != inst) {
+        prev = *link;
+        link = &((*link)->next);
+    }
+    if (!*link) {
+        return;
+    }
+    *link = inst->next;
+    if (pool.tail == inst) {
+        pool.tail = prev;
+    }
+    inst->next = 0;
+}
+
+
+static void *poolRunFunction(void *arg) {
+    (void)arg;
+    BTAlockMutex(pool.mutex);
+    while (1) {
+        while (!pool.stop && !pool.head) {
+            BTAwaitConditionTimed(pool.condWork, pool.mutex, 0);
+        }
+        if (!pool.head) {
+            break;
+        }
+        BTA_DispatchInst *inst = pool.head;
+        removeInst(inst);
+        inst->running = 1;
+        // This thread is the only consumer of the queue while running. A non-empty queue only blocks (briefly) if the producer dropped
+        // the frame meanwhile, so the queue is used without pool.mutex
+        int served = 0;
+        while (served < BTA_DISPATCH_BATCH || !pool.head) {
+            BTAunlockMutex(pool.mutex);
+            BTA_Frame *frame;
+            uint8_t dequeued = BVQgetCount(inst->queue) && BVQdequeue(inst->queue, (void **)&frame, 1) == BTA_StatusOk;
+            if (dequeued) {
+                uint64_t timeStart = BTAgetTickCountNano();
+                inst->run(inst->arg, frame);
+                BTAatomicMax(&inst->durationMaxMicros, (uint32_t)((BTAgetTickCountNano() - timeStart) / 1000));
+            }
+            BTAlockMutex(pool.mutex);
+            if (!dequeued) {
+                break;
+            }
+            served++;
+        }
+        inst->running = 0;
+        if (BVQgetCount(inst->queue)) {
+            // Others were waiting, back in line
+            pushInst(inst);
+        }
+        else {
+            inst->scheduled = 0;
+        }
+        BTAbroadcastCondition(pool.condIdle);
+    }
+    BTAunlockMutex(pool.mutex);
+    return 0;
+}
+
+
+static BTA_Status lockInit() {
+    BTA_Status status = BTAinitMutexOnce(&pool.initMutex);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    BTAlockMutex(pool.initMutex);
+    return BTA_StatusOk;
+}
+
+
+static void unlockInit() {
+    BTAunlockMutex(pool.initMutex);
+}
+
+
+// Only after a successful poolAcquire, so initMutex exists
+static void poolRelease() {
+    lockInit();
+    if (--pool.usersCount) {
+        unlockInit();
+        return;
+    }
+    BTAlockMutex(pool.mutex);
+    pool.stop = 1;
+    BTAbroadcastCondition(pool.condWork);
+    BTAunlockMutex(pool.mutex);
+    for (int i = 0; i < pool.threadsLen; i++) {
+        BTAjoinThread(pool.threads[i]);
+    }
+    pool.threadsLen = 0;
+    BTAcloseCondition(pool.condIdle);
+    BTAcloseCondition(pool.condWork);
+    BTAcloseMutex(pool.mutex);
+    pool.condIdle = pool.condWork = pool.mutex = 0;
+    unlockInit();
+}
+
+
+// One more thread per handle dispatching, up to BTA_DISPATCH_THREADS_MAX
+static BTA_Status poolAcquire() {
+    BTA_Status status = lockInit();
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    if (!pool.usersCount) {
+        status = BTAinitMutex(&pool.mutex);
+        if (status == BTA_StatusOk) status = BTAinitCondition(&pool.condWork);
+        if (status == BTA_StatusOk) status = BTAinitCondition(&pool.condIdle);
+        if (status != BTA_StatusOk) {
+            BTAcloseCondition(pool.condWork);
+            BTAcloseMutex(pool.mutex);
+            pool.condIdle = pool.condWork = pool.mutex = 0;
+            unlockInit();
+            return status;
+        }
+        pool.stop = 0;
+    }
+    pool.usersCount++;
+    if (pool.threadsLen < BTA_DISPATCH_THREADS_MAX && pool.threadsLen < pool.usersCount) {
+        if (BTAcreateThread(&pool.threads[pool.threadsLen], &poolRunFunction, 0) == BTA_StatusOk) {
+            pool.threadsLen++;
+        }
+    }
+    if (!pool.threadsLen) {
+        unlockInit();
+        poolRelease();
+        return BTA_StatusRuntimeError;
+    }
+    unlockInit();
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAdispatchInit(BTA_DispatchInst **inst, FN_BTA_DispatchRun run, void *arg) {
+    if (!inst || !run) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTA_DispatchInst *instNew = (BTA_DispatchInst *)calloc(1, sizeof(BTA_DispatchInst));
+    if (!instNew) {
+        return BTA_StatusOutOfMemory;
+    }
+    BTA_Status status = BTAinitMutex(&instNew->mutex);
+    if (status != BTA_StatusOk) {
+        free(instNew);
+        return status;
+    }
+    instNew->run = run;
+    instNew->arg = arg;
+    *inst = instNew;
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAdispatchConfigure(BTA_DispatchInst *inst, uint32_t queueLength, BTA_QueueMode queueMode) {
+    if (!inst) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (queueLength && queueMode != BTA_QueueModeDropOldest && queueMode != BTA_QueueModeDropCurrent) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTAlockMutex(inst->mutex);
+    if (inst->queue) {
+        BTAlockMutex(pool.mutex);
+        while (inst->running) {
+            BTAwaitConditionTimed(pool.condIdle, pool.mutex, 0);
+        }
+        removeInst(inst);
+        inst->scheduled = 0;
+        BVQ_QueueHandle queue = inst->queue;
+        inst->queue = 0;
+        BTAunlockMutex(pool.mutex);
+        BVQclose(&queue);
+        poolRelease();
+    }
+    BTA_Status status = BTA_StatusOk;
+    if (queueLength) {
+        BVQ_QueueHandle queue;
+        status = BVQinit(queueLength, queueMode, (FN_FreeItem)&BTAfreeFrame, 0, &queue);
+        if (status == BTA_StatusOk) {
+            status = poolAcquire();
+            if (status == BTA_StatusOk) {
+                BTAlockMutex(pool.mutex);
+                inst->queue = queue;
+                BTAunlockMutex(pool.mutex);
+            }
+            else {
+                BVQclose(&queue);
+            }
+        }
+    }
+    BTAunlockMutex(inst->mutex);
+    return status;
+}
+
+
+BTA_Status BTAdispatchFrame(BTA_DispatchInst *inst, BTA_Frame *frame) {
+    if (!inst || !frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTAlockMutex(inst->mutex);
+    if (!inst->queue) {
+        BTAunlockMutex(inst->mutex);
+        return BTA_StatusNotSupported;
+    }
+    // Full: the queue drops according to its mode, freeing the frame dropped outside of pool.mutex.
+    // The pool thread decides to unschedule only with pool.mutex locked after seeing the queue empty, so we either see it unscheduled or it sees the frame
+    BVQenqueue(inst->queue, frame);
+    BTAatomicMax(&inst->backlogMax, BVQgetCount(inst->queue));
+    BTAlockMutex(pool.mutex);
+    if (!inst->scheduled) {
+        inst->scheduled = 1;
+        pushInst(inst);
+    }
+    BTAunlockMutex(pool.mutex);
+    BTAunlockMutex(inst->mutex);
+    return BTA_StatusOk;
+}
+
+
+uint32_t BTAdispatchGetBacklogMax(BTA_DispatchInst *inst) {
+    if (!inst) {
+        return 0;
+    }
+    return BTAatomicExchange(&inst->backlogMax, 0);
+}
+
+
+float BTAdispatchGetDurationMax(BTA_DispatchInst *inst) {
+    if (!inst) {
+        return 0;
+    }
+    return BTAatomicExchange(&inst->durationMaxMicros, 0) / 1000.0f;
+}
+
+
+BTA_Status BTAdispatchGetStatistics(BTA_DispatchInst *inst, uint32_t *droppedCount, uint32_t *countMax) {
+    if (!inst || !droppedCount || !countMax) {
+        return BTA_StatusInvalidParameter;
+    }
+    *droppedCount = *countMax = 0;
+    BTAlockMutex(inst->mutex);
+    if (inst->queue) {
+        BVQgetStatistics(inst->queue, droppedCount, countMax);
+    }
+    BTAunlockMutex(inst->mutex);
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTAdispatchClose(BTA_DispatchInst **inst) {
+    if (!inst) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (!*inst) {
+        return BTA_StatusOk;
+    }
+    BTA_Status status = BTAdispatchConfigure(*inst, 0, BTA_QueueModeDoNotQueue);
+    BTAcloseMutex((*inst)->mutex);
+    free(*inst);
+    *inst = 0;
+    return status;
+}
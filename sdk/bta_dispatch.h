@@ -0,0 +1,43 @@
+#ifndef BTA_DISPATCH_H_INCLUDED
+#define BTA_DISPATCH_H_INCLUDED
+
+#include <bta.h>
+#include <bvq_queue.h>
+#include <bta_atomic.h>
+
+// Threads shared by all handles dispatching frames. A handle is served by one thread at a time, so its frames stay in order
+#define BTA_DISPATCH_THREADS_MAX    4
+// A thread serves this many frames of a handle in a row before it moves on to the next handle waiting
+#define BTA_DISPATCH_BATCH          4
+
+
+typedef void (*FN_BTA_DispatchRun)(void *arg, BTA_Frame *frame);
+
+typedef struct BTA_DispatchInst {
+    BVQ_QueueHandle queue;          ///< Null: dispatching off, the frames are handled on the calling thread
+    FN_BTA_DispatchRun run;         ///< Handles one frame (and takes ownership)
+    void *arg;
+    uint8_t scheduled;              ///< Waiting in the pool or being served
+    uint8_t running;                ///< A pool thread is in run
+    void *mutex;                    ///< Guards queue against BTAdispatchConfigure
+    BTA_Atomic32 backlogMax;        ///< Max frames queued since last read
+    BTA_Atomic32 durationMaxMicros; ///< Max time of run since last read
+    struct BTA_DispatchInst *next;  ///< In the list of handles waiting in the pool
+} BTA_DispatchInst;
+
+
+BTA_Status BTAdispatchInit(BTA_DispatchInst **inst, FN_BTA_DispatchRun run, void *arg);
+// queueLength 0 turns dispatching off. Frames still waiting are dropped. Must not be called from within run
+BTA_Status BTAdispatchConfigure(BTA_DispatchInst *inst, uint32_t queueLength, BTA_QueueMode queueMode);
+// Takes ownership of frame on success. BTA_StatusNotSupported if dispatching is off: the caller handles the frame itself
+BTA_Status BTAdispatchFrame(BTA_DispatchInst *inst, BTA_Frame *frame);
+// Read to clear
+uint32_t BTAdispatchGetBacklogMax(BTA_DispatchInst *inst);
+// Read to clear [ms]
+float BTAdispatchGetDurationMax(BTA_DispatchInst *inst);
+// Frames dropped and high-water mark of the queue, read to clear. Zero while dispatching is off
+BTA_Status BTAdispatchGetStatistics(BTA_DispatchInst *inst, uint32_t *droppedCount, uint32_t *countMax);
+BTA_Status BTAdispatchClose(BTA_DispatchInst **inst);
+
+
+#endif
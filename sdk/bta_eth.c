@@ -60,6 +60,7 @@ static BTA_Status sendRetrReqComplete(BTA_WrapperInst *winst, BTA_FrameToParse *
 static BTA_Status sendRetrReqGap(BTA_WrapperInst *winst, BTA_FrameToParse *frameToParse, uint16_t pcGapBeg, uint16_t pcGapEnd);
 
 static void *connectionMonitorRunFunction(void *handle);
+static void waitForStateChange(BTA_EthLibInst *inst, uint32_t msecs);
 static BTA_Status sendKeepAliveMsg(BTA_WrapperInst *inst);
 
 static BTA_Status readRegister(BTA_WrapperInst *winst, uint32_t address, uint32_t *data, uint32_t *registerCount, uint32_t timeout);
@@ -185,6 +186,15 @@ BTA_Status BTAETHopen(BTA_Config *config, BTA_WrapperInst *winst) {
         BTAETHclose(winst);
         return status;
     }
+    status = BTAinitMutex(&inst->stateMutex);
+    if (status == BTA_StatusOk) {
+        status = BTAinitCondition(&inst->condStateChanged);
+    }
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, status, "BTAopen Eth: Cannot init stateMutex or condStateChanged");
+        BTAETHclose(winst);
+        return status;
+    }
 
 #   ifdef PLAT_WINDOWS
     WSADATA wsaData;
@@ -446,7 +456,19 @@ BTA_Status BTAETHclose(BTA_WrapperInst *winst) {
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusInvalidParameter, "BTAclose Eth: inst missing!");
         return BTA_StatusInvalidParameter;
     }
-    inst->closing = 1;
+    if (inst->stateMutex) {
+        BTAlockMutex(inst->stateMutex);
+        inst->closing = 1;
+        BTAbroadcastCondition(inst->condStateChanged);
+        BTAunlockMutex(inst->stateMutex);
+    }
+    else {
+        inst->closing = 1;
+    }
+    // Wake the data stream threads waiting for packets, buffers or resume
+    BCBinterrupt(inst->packetsToParseQueue);
+    BCBinterrupt(inst->packetsToFillQueue);
+    BTAnotifyPauseChanged(winst);
     status = BTAjoinThread(inst->shmReadThread);
     if (status != BTA_StatusOk) {
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAclose Eth: Failed to join shmReadThread");
@@ -486,6 +508,12 @@ BTA_Status BTAETHclose(BTA_WrapperInst *winst) {
     if (status != BTA_StatusOk) {
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAclose: Failed to close controlMutex");
     }
+    if (inst->condStateChanged) {
+        BTAcloseCondition(inst->condStateChanged);
+    }
+    if (inst->stateMutex) {
+        BTAcloseMutex(inst->stateMutex);
+    }
     free(inst->keepAliveInst);
     inst->keepAliveInst = 0;
     free(inst);
@@ -975,6 +1003,16 @@ BTA_Status BTAETHgetFrameMode(BTA_WrapperInst *winst, BTA_FrameMode *frameMode)
 }
 
 
+// Waits up to msecs, but returns as soon as BTAETHclose is called
+static void waitForStateChange(BTA_EthLibInst *inst, uint32_t msecs) {
+    BTAlockMutex(inst->stateMutex);
+    if (!inst->closing) {
+        BTAwaitConditionTimed(inst->condStateChanged, inst->stateMutex, (int)msecs);
+    }
+    BTAunlockMutex(inst->stateMutex);
+}
+
+
 static void *connectionMonitorRunFunction(void *handle) {
     BTA_WrapperInst *winst = (BTA_WrapperInst *)handle;
     if (!winst) {
@@ -1294,7 +1332,7 @@ static void *connectionMonitorRunFunction(void *handle) {
                         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, BTA_StatusWarning, "UDP data: Failed to bind socket, error: %s (%d)", errorToString(err), err);
                         closesocket(inst->udpDataSocket);
                         inst->udpDataSocket = INVALID_SOCKET;
-                        BTAmsleep(840);
+                        waitForStateChange(inst, 840);
                     }
                 }
             }
@@ -1356,8 +1394,8 @@ static void *connectionMonitorRunFunction(void *handle) {
             BTApostSemaphore(inst->semConnectionEstablishment);
             firstCycle = 0;
         }
-        
-        BTAmsleep(250);
+
+        waitForStateChange(inst, 250);
     }
     if (firstCycle) {
         BTApostSemaphore(inst->semConnectionEstablishment);
@@ -1630,7 +1668,12 @@ static void *udpReadRunFunction(void *handle) {
     while (!inst->closing) {
 
         if (winst->lpPauseCaptureThread) {
-            BTAmsleep(50);
+            // Woken up by BTAsetLibParam or BTAETHclose
+            BTAlockMutex(winst->pauseMutex);
+            while (winst->lpPauseCaptureThread && !inst->closing) {
+                BTAwaitConditionTimed(winst->condPauseChanged, winst->pauseMutex, 0);
+            }
+            BTAunlockMutex(winst->pauseMutex);
             continue;
         }
 
@@ -1653,8 +1696,15 @@ static void *udpReadRunFunction(void *handle) {
                 }
                 else {
                     BTAinfoEventHelper(winst->infoEventInst, VERBOSE_WARNING, status, "UdpReadThread: No packet buffer available packetsToFillQueueLength=%d queueLengthMax=%d", BCBgetSize(inst->packetsToFillQueue), udpDataQueueLen);
-                    BTAmsleep(50);
-                    continue;
+                    // The parsing thread puts buffers back as soon as it is done with them, BTAETHclose interrupts
+                    uint64_t timeWaitStart = BTAgetTickCountNano();
+                    status = BCBgetTimed(inst->packetsToFillQueue, (void **)&udpPacket, 1000);
+                    BTAatomicFetchAdd(&winst->pipelineCounters.packetBufferUnavailableCount, 1);
+                    BTAatomicFetchAdd64(&winst->pipelineCounters.packetBufferWaitMicros, (BTAgetTickCountNano() - timeWaitStart) / 1000);
+                    if (status != BTA_StatusOk) {
+                        udpPacket = 0;
+                        continue;
+                    }
                 }
             }
 
@@ -1806,6 +1856,7 @@ static void *parseFramesRunFunction(void *handle) {
         // This is for statistics
         int count = BCBgetSize(inst->packetsToParseQueue);
         winst->lpDataStreamPacketsToParse = (float)MTHmax(count, (int)winst->lpDataStreamPacketsToParse);
+        BTAatomicMax(&winst->pipelineCounters.packetsToParseCountMax, (uint32_t)count);
 
 #           if defined BTA_DEBUG
         loopCount++;
@@ -1868,17 +1919,10 @@ static void *parseFramesRunFunction(void *handle) {
 
         // lpDataStreamPacketWaitTimeout is the time that has to pass (no packet received for a certain frame during this time) before any action is taken
         // ..so I figured we listen to Shannon and loop for checks at intervals of half that time
-        uint64_t timeEnd = BTAgetTickCount64() + (uint64_t)(inst->lpDataStreamPacketWaitTimeout / 2);
-        while (!inst->closing) {
-            status = BCBget(inst->packetsToParseQueue, (void **)&packet);
-            if (status == BTA_StatusOk) {
-                break;
-            }
-            if (BTAgetTickCount64() > timeEnd) {
-                packet = 0;
-                break;
-            }
-            BTAmsleep(1 + (uint32_t)(inst->lpDataStreamPacketWaitTimeout / 20));
+        // The UDP read thread wakes us with each packet, BTAETHclose interrupts
+        status = BCBgetTimed(inst->packetsToParseQueue, (void **)&packet, 1 + (uint32_t)(inst->lpDataStreamPacketWaitTimeout / 2));
+        if (status != BTA_StatusOk) {
+            packet = 0;
         }
         if (!packet || inst->closing) {
             continue;
@@ -2008,6 +2052,7 @@ static void *parseFramesRunFunction(void *handle) {
                         }
                     }
                     if (packetsDroppedCount) {
+                        BTAatomicFetchAdd(&winst->pipelineCounters.framesEvictedCount, 1);
                         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "ParseFramesThread: Frame %d incomplete: %d packets (%d bytes) dropped", frameCounterDropped, packetsDroppedCount, bytesDropped);
                     }
                 }
@@ -2032,6 +2077,7 @@ static void *parseFramesRunFunction(void *handle) {
                         }
                     }
                     framePacketsLen *= 2;
+                    BTAatomicFetchAdd(&winst->pipelineCounters.framesDiscardedCount, 1);
                     free(framePacketsA);
                     framePacketsA = 0;
                     free(framePacketsB);
@@ -2194,6 +2240,7 @@ static void *parseFramesRunFunction(void *handle) {
                                 ftpTemp->timestamp = 0;
                                 winst->lpDataStreamPacketsReceivedCount += ftpTemp->packetCountGot;
                                 winst->lpDataStreamPacketsMissedCount += ftpTemp->packetCountTotal - ftpTemp->packetCountGot;
+                                BTAatomicFetchAdd(&winst->pipelineCounters.framesDiscardedCount, 1);
                                 BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusWarning, "ParseFramesThread v2: first packet is missing, discard");
                                 break;
                             }
@@ -2249,6 +2296,9 @@ static void *parseFramesRunFunction(void *handle) {
                     if (!ftp) {
                         // No free slots left, find oldest ftp and use it
                         ftp = getOldest(framesToParse, framesToParseLen);
+                        if (ftp) {
+                            BTAatomicFetchAdd(&winst->pipelineCounters.framesEvictedCount, 1);
+                        }
                     }
                     if (!ftp) {
                         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_INFO, BTA_StatusWarning, "UDP data v2: Init a new ftp: No oldest ftp found!");
@@ -2264,12 +2314,14 @@ static void *parseFramesRunFunction(void *handle) {
 
                 if (packHead->frameLen != ftp->frameSize) {
                     BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusWarning, "ParseFramesThread v2: wrong frameLen", packHead->frameLen, ftp->frameSize);
+                    BTAatomicFetchAdd(&winst->pipelineCounters.framesDiscardedCount, 1);
                     ftp->timestamp = 0;
                     ftp = 0;
                     break;
                 }
                 if (packHead->packetCountTotal != ftp->packetCountTotal) {
                     BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusWarning, "ParseFramesThread v2: wrong packetCountTotal", packHead->packetCountTotal, ftp->packetCountTotal);
+                    BTAatomicFetchAdd(&winst->pipelineCounters.framesDiscardedCount, 1);
                     ftp->timestamp = 0;
                     ftp = 0;
                     break;
@@ -78,6 +78,8 @@ typedef struct BTA_EthLibInst {
     SOCKET tcpControlSocket;
     SOCKET udpControlSocket;
     void *controlMutex;
+    void *stateMutex;                   ///< Guards closing for the waits on condStateChanged
+    void *condStateChanged;             ///< Broadcast by BTAETHclose, ends the connection monitor's wait between its cycles
     void *semConnectionEstablishment;
     BTA_KeepAliveInst *keepAliveInst;
 
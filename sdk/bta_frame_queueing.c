@@ -18,41 +18,407 @@
 
 #include <bta_oshelper.h>
 #include <bvq_queue.h>
+#include <bta_atomic.h>
+#include <pthread_helper.h>
+#include <timing_helper.h>
 #include <stdlib.h>
 #include <assert.h>
+#ifdef PLAT_LINUX
+#   include <sys/eventfd.h>
+#   include <unistd.h>
+#endif
 
 
+// Mailbox for BTA_QueueModeLatest: one slot holding the newest frame. The producer exchanges its frame in and releases the one it displaced,
+// the reader exchanges the slot empty and owns the frame it got. Frames are handed over by pointer, neither side copies or waits for the other.
+// A reader taking a frame that is there locks nothing. Waiting readers and peeking readers (which take the frame out for a moment) use mutex.
+// Unlike a triple buffer, frame storage is not recycled: the parser allocates every frame and the displaced ones are freed
+typedef struct BFQ_Mailbox {
+    void *volatile frame;           ///< The newest frame not taken by a reader, or null
+    BTA_Atomic32 waitersCount;      ///< Readers blocked. Only if there are any, the producer takes mutex to wake them
+    void *mutex;
+    void *condFrameAdded;
+    BTA_Atomic32 droppedCount;      ///< Frames replaced before a reader took them, since BFQgetStatistics
+    uint8_t interrupted;            ///< See BFQsetInterrupted, guarded by mutex
+} BFQ_Mailbox;
+
+
+typedef struct BFQ_FrameQueueInst {
+    BVQ_QueueHandle queue;          ///< All modes but BTA_QueueModeLatest
+    BFQ_Mailbox *mailbox;           ///< BTA_QueueModeLatest
+    BTA_Atomic32 eventFdPlusOne;    ///< 0 until BFQgetEventFd is called, then the eventfd + 1
+    BTA_Atomic32 eventSet;          ///< The eventfd was written and not yet reset, so enqueueing doesn't need a syscall for every frame
+} BFQ_FrameQueueInst;
+
+
+static BTA_Status mailboxInit(BFQ_Mailbox **mailbox) {
+    BFQ_Mailbox *inst = (BFQ_Mailbox *)calloc(1, sizeof(BFQ_Mailbox));
+    if (!inst) {
+        return BTA_StatusOutOfMemory;
+    }
+    BTA_Status status = BTAinitMutex(&inst->mutex);
+    if (status != BTA_StatusOk) {
+        free(inst);
+        return status;
+    }
+    status = BTAinitCondition(&inst->condFrameAdded);
+    if (status != BTA_StatusOk) {
+        BTAcloseMutex(inst->mutex);
+        free(inst);
+        return status;
+    }
+    *mailbox = inst;
+    return BTA_StatusOk;
+}
+
+
+static void mailboxClear(BFQ_Mailbox *inst) {
+    BTA_Frame *frame = (BTA_Frame *)BTAatomicExchangePointer(&inst->frame, 0);
+    if (frame) {
+        BTAfreeFrame(&frame);
+    }
+}
+
+
+static void mailboxClose(BFQ_Mailbox **mailbox) {
+    BFQ_Mailbox *inst = *mailbox;
+    mailboxClear(inst);
+    BTAcloseCondition(inst->condFrameAdded);
+    BTAcloseMutex(inst->mutex);
+    free(inst);
+    *mailbox = 0;
+}
+
+
+static void mailboxPublish(BFQ_Mailbox *inst, BTA_Frame *frame) {
+    BTA_Frame *frameOld = (BTA_Frame *)BTAatomicExchangePointer(&inst->frame, frame);
+    if (frameOld) {
+        BTAatomicFetchAdd(&inst->droppedCount, 1);
+        BTAfreeFrame(&frameOld);
+    }
+    // Either the reader sees the new frame or we see the reader waiting
+    BTAatomicFence();
+    if (BTAatomicLoad(&inst->waitersCount)) {
+        BTAlockMutex(inst->mutex);
+        BTAbroadcastCondition(inst->condFrameAdded);
+        BTAunlockMutex(inst->mutex);
+    }
+}
+
+
+// Called with mutex locked. Peeking (!consume) takes the frame out for a moment to retain it, then puts it back unless a newer one arrived meanwhile
+static uint8_t mailboxTryTake(BFQ_Mailbox *inst, BTA_Frame **frame, uint8_t consume) {
+    BTA_Frame *frameTemp = (BTA_Frame *)BTAatomicExchangePointer(&inst->frame, 0);
+    if (!frameTemp) {
+        return 0;
+    }
+    if (!consume) {
+        BTAretainFrame(frameTemp);
+        if (!BTAatomicCompareExchangePointer(&inst->frame, 0, frameTemp)) {
+            // Replaced, drop the mailbox's reference
+            BTA_Frame *frameReplaced = frameTemp;
+            BTAatomicFetchAdd(&inst->droppedCount, 1);
+            BTAfreeFrame(&frameReplaced);
+        }
+    }
+    *frame = frameTemp;
+    return 1;
+}
+
+
+static BTA_Status mailboxGet(BFQ_Mailbox *inst, BTA_Frame **frame, uint32_t msecsTimeout, uint8_t consume) {
+    if (consume) {
+        // Fast path. If a peeking reader has the frame out for the moment, the slow path below waits for it on mutex
+        *frame = (BTA_Frame *)BTAatomicExchangePointer(&inst->frame, 0);
+        if (*frame) {
+            return BTA_StatusOk;
+        }
+    }
+    uint64_t endTime = BTAgetTickCount64() + msecsTimeout;
+    BTA_Status status = BTA_StatusOk;
+    BTAlockMutex(inst->mutex);
+    if (!mailboxTryTake(inst, frame, consume)) {
+        BTAatomicFetchAdd(&inst->waitersCount, 1);
+        BTAatomicFence();
+        while (!mailboxTryTake(inst, frame, consume)) {
+            if (inst->interrupted) {
+                status = BTA_StatusTimeOut;
+                break;
+            }
+            uint32_t msecsRemaining = 0;
+            if (msecsTimeout) {
+                uint64_t now = BTAgetTickCount64();
+                if (now >= endTime) {
+                    status = BTA_StatusTimeOut;
+                    break;
+                }
+                msecsRemaining = endTime - now > INT32_MAX ? INT32_MAX : (uint32_t)(endTime - now);
+            }
+            status = BTAwaitConditionTimed(inst->condFrameAdded, inst->mutex, (int)msecsRemaining);
+            if (status != BTA_StatusOk && status != BTA_StatusTimeOut) {
+                break;
+            }
+            status = BTA_StatusOk;
+        }
+        BTAatomicFetchAdd(&inst->waitersCount, (uint32_t)-1);
+    }
+    if (status != BTA_StatusOk) {
+        *frame = 0;
+    }
+    BTAunlockMutex(inst->mutex);
+    return status;
+}
+
 
 BTA_Status BTA_CALLCONV BFQinit(uint32_t frameQueueLength, BTA_QueueMode frameQueueMode, BFQ_FrameQueueHandle *handle) {
     if (!handle) {
         return BTA_StatusInvalidParameter;
     }
+    if (frameQueueMode == BTA_QueueModeLatest) {
+        BFQ_FrameQueueInst *inst = (BFQ_FrameQueueInst *)calloc(1, sizeof(BFQ_FrameQueueInst));
+        if (!inst) {
+            return BTA_StatusOutOfMemory;
+        }
+        BTA_Status status = mailboxInit(&inst->mailbox);
+        if (status != BTA_StatusOk) {
+            free(inst);
+            return status;
+        }
+        *handle = inst;
+        return BTA_StatusOk;
+    }
     BVQ_QueueHandle handleTemp;
-    BTA_Status status = BVQinit(frameQueueLength, frameQueueMode, (FN_FreeItem)&BTAfreeFrame, &handleTemp);
-    if (status == BTA_StatusOk) {
-        *handle = handleTemp;
+    BTA_Status status = BVQinit(frameQueueLength, frameQueueMode, (FN_FreeItem)&BTAfreeFrame, (FN_RetainItem)&BTAretainFrame, &handleTemp);
+    if (status != BTA_StatusOk) {
+        return status;
     }
-    return status;
+    if (!handleTemp) {
+        // Not queueing
+        *handle = 0;
+        return BTA_StatusOk;
+    }
+    BFQ_FrameQueueInst *inst = (BFQ_FrameQueueInst *)calloc(1, sizeof(BFQ_FrameQueueInst));
+    if (!inst) {
+        BVQclose(&handleTemp);
+        return BTA_StatusOutOfMemory;
+    }
+    inst->queue = handleTemp;
+    *handle = inst;
+    return BTA_StatusOk;
 }
 
 
 BTA_Status BTA_CALLCONV BFQclose(BFQ_FrameQueueHandle *handle) {
-    return BVQclose(handle);
+    if (!handle) {
+        return BTA_StatusInvalidParameter;
+    }
+    BFQ_FrameQueueInst *inst = (BFQ_FrameQueueInst *)*handle;
+    if (!inst) {
+        return BTA_StatusOk;
+    }
+    if (inst->mailbox) {
+        mailboxClose(&inst->mailbox);
+    }
+    else {
+        BTA_Status status = BVQclose(&inst->queue);
+        if (status != BTA_StatusOk) {
+            return status;
+        }
+    }
+#   ifdef PLAT_LINUX
+        if (inst->eventFdPlusOne) {
+            close((int)inst->eventFdPlusOne - 1);
+        }
+#   endif
+    free(inst);
+    *handle = 0;
+    return BTA_StatusOk;
+}
+
+// The eventfd is readable while frames are queued: enqueue sets it, a dequeue leaving the queue empty resets it
+static void eventSignal(BFQ_FrameQueueInst *inst) {
+#   ifdef PLAT_LINUX
+        uint32_t fdPlusOne = BTAatomicLoad(&inst->eventFdPlusOne);
+        if (fdPlusOne && !BTAatomicExchange(&inst->eventSet, 1)) {
+            uint64_t one = 1;
+            (void)!write((int)fdPlusOne - 1, &one, sizeof(one));
+        }
+#   else
+        (void)inst;
+#   endif
+}
+
+static void eventReset(BFQ_FrameQueueInst *inst) {
+#   ifdef PLAT_LINUX
+        uint32_t fdPlusOne = BTAatomicLoad(&inst->eventFdPlusOne);
+        if (!fdPlusOne) {
+            return;
+        }
+        uint32_t count;
+        BFQgetCount(inst, &count);
+        if (count) {
+            return;
+        }
+        // Drain first, then clear eventSet: a write landing in between would otherwise be drained while eventSet stays set
+        uint64_t value;
+        (void)!read((int)fdPlusOne - 1, &value, sizeof(value));
+        BTAatomicExchange(&inst->eventSet, 0);
+        // A frame enqueued meanwhile may have found eventSet still set and not written
+        BFQgetCount(inst, &count);
+        if (count) {
+            eventSignal(inst);
+        }
+#   else
+        (void)inst;
+#   endif
+}
+
+BTA_Status BTA_CALLCONV BFQgetEventFd(BFQ_FrameQueueHandle handle, int *fd) {
+    BFQ_FrameQueueInst *inst = (BFQ_FrameQueueInst *)handle;
+    if (!inst || !fd) {
+        return BTA_StatusInvalidParameter;
+    }
+#   ifdef PLAT_LINUX
+        uint32_t fdPlusOne = BTAatomicLoad(&inst->eventFdPlusOne);
+        if (!fdPlusOne) {
+            int fdNew = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (fdNew < 0) {
+                return BTA_StatusRuntimeError;
+            }
+            if (!BTAatomicCompareExchange(&inst->eventFdPlusOne, 0, (uint32_t)fdNew + 1)) {
+                // Another thread was quicker
+                close(fdNew);
+            }
+            fdPlusOne = BTAatomicLoad(&inst->eventFdPlusOne);
+            uint32_t count;
+            BFQgetCount(inst, &count);
+            if (count) {
+                eventSignal(inst);
+            }
+        }
+        *fd = (int)fdPlusOne - 1;
+        return BTA_StatusOk;
+#   else
+        *fd = -1;
+        return BTA_StatusNotSupported;
+#   endif
+}
+
+BTA_Status BTA_CALLCONV BFQgetStatistics(BFQ_FrameQueueHandle handle, uint32_t *droppedCount, uint32_t *countMax) {
+    BFQ_FrameQueueInst *inst = (BFQ_FrameQueueInst *)handle;
+    if (!inst || !droppedCount || !countMax) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (inst->mailbox) {
+        *droppedCount = BTAatomicExchange(&inst->mailbox->droppedCount, 0);
+        // Never more than the newest frame
+        return BFQgetCount(inst, countMax);
+    }
+    return BVQgetStatistics(inst->queue, droppedCount, countMax);
+}
+
+BTA_Status BTA_CALLCONV BFQsetInterrupted(BFQ_FrameQueueHandle handle, uint8_t interrupted) {
+    BFQ_FrameQueueInst *inst = (BFQ_FrameQueueInst *)handle;
+    if (!inst) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (inst->mailbox) {
+        BTAlockMutex(inst->mailbox->mutex);
+        inst->mailbox->interrupted = interrupted;
+        BTAbroadcastCondition(inst->mailbox->condFrameAdded);
+        BTAunlockMutex(inst->mailbox->mutex);
+        return BTA_StatusOk;
+    }
+    return BVQsetInterrupted(inst->queue, interrupted);
 }
 
 BTA_Status BTA_CALLCONV BFQgetCount(BFQ_FrameQueueHandle handle, uint32_t *count) {
-    *count = BVQgetCount(handle);
+    BFQ_FrameQueueInst *inst = (BFQ_FrameQueueInst *)handle;
+    if (!inst || !count) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (inst->mailbox) {
+        *count = BTAatomicLoadPointer(&inst->mailbox->frame) != 0;
+        return BTA_StatusOk;
+    }
+    *count = BVQgetCount(inst->queue);
     return BTA_StatusOk;
 }
 
 BTA_Status BTA_CALLCONV BFQenqueue(BFQ_FrameQueueHandle handle, BTA_Frame *frame) {
-    return BVQenqueue(handle, frame);
+    BFQ_FrameQueueInst *inst = (BFQ_FrameQueueInst *)handle;
+    if (!inst || !frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTA_Status status = BTA_StatusOk;
+    if (inst->mailbox) {
+        mailboxPublish(inst->mailbox, frame);
+    }
+    else {
+        status = BVQenqueue(inst->queue, frame);
+    }
+    eventSignal(inst);
+    return status;
 }
 
 BTA_Status BTA_CALLCONV BFQdequeue(BFQ_FrameQueueHandle handle, BTA_Frame **frame, uint32_t msecsTimeout) {
-    return BVQdequeue(handle, (void **)frame, msecsTimeout);
+    BFQ_FrameQueueInst *inst = (BFQ_FrameQueueInst *)handle;
+    if (!inst || !frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTA_Status status;
+    if (inst->mailbox) {
+        status = mailboxGet(inst->mailbox, frame, msecsTimeout, 1);
+    }
+    else {
+        status = BVQdequeue(inst->queue, (void **)frame, msecsTimeout);
+    }
+    eventReset(inst);
+    return status;
+}
+
+BTA_Status BTA_CALLCONV BFQdequeueMany(BFQ_FrameQueueHandle handle, BTA_Frame **frames, uint32_t maxCount, uint32_t *count, uint32_t msecsTimeout) {
+    BFQ_FrameQueueInst *inst = (BFQ_FrameQueueInst *)handle;
+    if (count) *count = 0;
+    if (!inst || !frames || !maxCount || !count) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTA_Status status;
+    if (inst->mailbox) {
+        // The mailbox only ever holds the newest frame
+        status = mailboxGet(inst->mailbox, &frames[0], msecsTimeout, 1);
+        *count = status == BTA_StatusOk;
+    }
+    else {
+        status = BVQdequeueMany(inst->queue, (void **)frames, maxCount, count, msecsTimeout);
+    }
+    eventReset(inst);
+    return status;
+}
+
+BTA_Status BTA_CALLCONV BFQpeek(BFQ_FrameQueueHandle handle, BTA_Frame **frame, uint32_t msecsTimeout) {
+    BFQ_FrameQueueInst *inst = (BFQ_FrameQueueInst *)handle;
+    if (!inst || !frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (inst->mailbox) {
+        return mailboxGet(inst->mailbox, frame, msecsTimeout, 0);
+    }
+    return BVQpeek(inst->queue, (void **)frame, msecsTimeout);
 }
 
 BTA_Status BTA_CALLCONV BFQclear(BFQ_FrameQueueHandle handle) {
-    return BVQclear(handle);
-}
\ No newline at end of file
+    BFQ_FrameQueueInst *inst = (BFQ_FrameQueueInst *)handle;
+    if (!inst) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTA_Status status = BTA_StatusOk;
+    if (inst->mailbox) {
+        mailboxClear(inst->mailbox);
+    }
+    else {
+        status = BVQclear(inst->queue);
+    }
+    eventReset(inst);
+    return status;
+}
@@ -123,6 +123,7 @@ BTA_Status BGRBstart(BTA_GrabInst *inst, BTA_GrabbingConfig *config, BTA_DeviceI
     BTAfLargeClose(file);
 
     BFQclear(inst->grabbingQueue);
+    BFQsetInterrupted(inst->grabbingQueue, 0);
     inst->grabbingEnabled = 1;
     int result = BTAcreateThread(&(inst->grabbingThread), &grabRunFunction, (void *)inst);
     if (result != 0) {
@@ -145,12 +146,13 @@ BTA_Status BGRBgrab(BTA_GrabInst *inst, BTA_Frame *frame) {
         return BTA_StatusOk;
     }
 
-    BTA_Frame *frameCopy;
-    BTAcloneFrame(frame, &frameCopy);
-    BTA_Status status = BFQenqueue(inst->grabbingQueue, frameCopy);
+    // The grabbing thread only reads the frame, so it shares it with the application instead of cloning it
+    BTAretainFrame(frame);
+    BTA_Frame *frameShared = frame;
+    BTA_Status status = BFQenqueue(inst->grabbingQueue, frameShared);
     if (status != BTA_StatusOk) {
         BTAinfoEventHelper(inst->infoEventInst, VERBOSE_WARNING, status, "Grabbing: Queue is full, not grabbing frame #%d", frame->frameCounter);
-        BTAfreeFrame(&frameCopy);
+        BTAfreeFrame(&frameShared);
     }
     return status;
 }
@@ -166,19 +168,22 @@ static void *grabRunFunction(void *handle) {
     }
     while (1) {
         BTA_Frame *frame;
-        status = BFQdequeue(inst->grabbingQueue, &frame, 100);
+        // Waits until a frame arrives or BGRBstop interrupts
+        status = BFQdequeue(inst->grabbingQueue, &frame, 0);
         if (status == BTA_StatusOk) {
             int32_t frameSerializedLen;
             status = BTAgetSerializedLength(frame, (uint32_t *)&frameSerializedLen);
             if (status != BTA_StatusOk) {
                 BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, status, "Grabbing: Error in BTAgetSerializedLength");
                 BTAfLargeClose(file);
+                BTAfreeFrame(&frame);
                 return 0;
             }
             uint8_t *frameSerialized = (uint8_t *)malloc(sizeof(uint32_t) + frameSerializedLen + sizeof(uint32_t));
             if (!frameSerialized) {
                 BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Grabbing: Cannot allocate");
                 BTAfLargeClose(file);
+                BTAfreeFrame(&frame);
                 return 0;
             }
             int32_t frameSerializedLenTemp = frameSerializedLen;
@@ -188,6 +193,7 @@ static void *grabRunFunction(void *handle) {
                 frameSerialized = 0;
                 BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, status, "Grabbing: Error in BTAserializeFrame");
                 BTAfLargeClose(file);
+                BTAfreeFrame(&frame);
                 return 0;
             }
             if (frameSerializedLenTemp != frameSerializedLen) {
@@ -195,6 +201,7 @@ static void *grabRunFunction(void *handle) {
                 frameSerialized = 0;
                 BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, BTA_StatusRuntimeError, "Grabbing: Error, BTAserializeFrame result %d differs from BTAgetSerializedLength %d", frameSerializedLenTemp, frameSerializedLen);
                 BTAfLargeClose(file);
+                BTAfreeFrame(&frame);
                 return 0;
             }
 
@@ -207,6 +214,7 @@ static void *grabRunFunction(void *handle) {
                     frameSerialized = 0;
                     BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Grabbing: Cannot allocate for compression");
                     BTAfLargeClose(file);
+                    BTAfreeFrame(&frame);
                     return 0;
                 }
                 uint8_t *dst = frameSerializedCompressed + sizeof(uint32_t);
@@ -219,6 +227,7 @@ static void *grabRunFunction(void *handle) {
                 if (status != BTA_StatusOk) {
                     BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, BTA_StatusRuntimeError, "Grabbing: Error in BTAcompressSerializedFrame");
                     BTAfLargeClose(file);
+                    BTAfreeFrame(&frame);
                     return 0;
                 }
                 BTAinfoEventHelper(inst->infoEventInst, VERBOSE_DEBUG, BTA_StatusInformation, "Grabbing: compressed bltframe %d : %d = %f%% in %lums", dstLen, frameSerializedLen, (float)dstLen / frameSerializedLen * 100.0f, timeEnd - timeStart);
@@ -243,7 +252,9 @@ static void *grabRunFunction(void *handle) {
                     if (!inst->grabbingEnabled) {
                         // Not able to write and grabbing disabled -> abort
                         BTAinfoEventHelper(inst->infoEventInst, VERBOSE_ERROR, status, "Grabbing: Aborting!");
+                        free(frameSerialized);
                         BTAfLargeClose(file);
+                        BTAfreeFrame(&frame);
                         return 0;
                     }
                 }
@@ -251,6 +262,7 @@ static void *grabRunFunction(void *handle) {
             inst->totalFrameCount++;
             free(frameSerialized);
             frameSerialized = 0;
+            BTAfreeFrame(&frame);
         }
         else if (!inst->grabbingEnabled) {
             // Nothing in queue and grabbing disabled -> We're done
@@ -266,6 +278,8 @@ BTA_Status BGRBstop(BTA_GrabInst *inst) {
         return BTA_StatusInvalidParameter;
     }
     inst->grabbingEnabled = 0;
+    // The grabbing thread writes the frames still queued, then finds the queue empty and quits
+    BFQsetInterrupted(inst->grabbingQueue, 1);
     BTAinfoEventHelper(inst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "Stopping grabbing");
     BTA_Status status = BTAjoinThread(inst->grabbingThread);
     if (status != BTA_StatusOk) {
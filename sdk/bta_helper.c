@@ -39,8 +39,14 @@
 #include <undistort.h>
 #include <calc_bilateral.h>
 #include <calcXYZ.h>
+#include <temporal_filter.h>
+#include <binning.h>
+#include <raw_phases.h>
+#include <phase_unwrapping.h>
 #include <bta_jpg.h>
 #include <bvq_queue.h>
+#include <pthread_helper.h>
+#include "bta_dispatch.h"
 
 
 
@@ -51,7 +57,17 @@ static BTA_Status parseGeomModel(uint8_t* data, uint32_t dataLen, BTA_IntrinsicD
 static BTA_ChannelId BTAETHgetChannelId(BTA_EthImgMode imgMode, uint8_t channelIndex);
 static BTA_DataFormat BTAETHgetDataFormat(BTA_EthImgMode imgMode, uint8_t channelIndex, uint8_t colorMode, uint8_t rawPhaseContent);
 static BTA_Unit BTAETHgetUnit(BTA_EthImgMode imgMode, uint8_t channelIndex);
-static void insertChannelData(BTA_Channel *channel, uint8_t *data, uint32_t dataLen);
+typedef enum BTA_ChannelDataConversion {
+    BTA_ChannelDataConversionCopy,
+    BTA_ChannelDataConversionNegate,
+    BTA_ChannelDataConversionMlx12S,
+    BTA_ChannelDataConversionMlx1C11S,
+    BTA_ChannelDataConversionMlx1C11U,
+} BTA_ChannelDataConversion;
+static BTA_ChannelDataConversion toBtaCoordinateSystem(BTA_Channel *channel);
+static void copyChannelData(BTA_Channel *channel, BTA_ChannelDataConversion conversion, uint8_t *data, uint32_t dataLen, const BTA_ParseFilter *parseFilter);
+static uint8_t isChannelSelected(const BTA_ParseFilter *parseFilter, BTA_Channel *channel);
+static void sortCartesianChannels(BTA_Frame *frame);
 static BTA_Status setMissingAsInvalid(BTA_ChannelId channelId, BTA_DataFormat dataFormat, uint8_t *channelDataStart, int channelDataLength, BTA_FrameToParse *frameToParse);
 
 static void insertChannelDataFromShm(BTA_WrapperInst *winst, BTA_Channel *channel, uint8_t *data, uint32_t dataLen);
@@ -224,28 +240,310 @@ static void logToFile(BTA_InfoEventInst *infoEventInst, BTA_Status status, const
 
 
 
+BTA_Status BTApostprocessContextCreate(BTA_PostprocessContext **context, struct BTA_CalcXYZInst *calcXYZInst, struct BTA_UndistortInst *undistortInst) {
+    if (!context) {
+        return BTA_StatusInvalidParameter;
+    }
+    *context = (BTA_PostprocessContext *)calloc(1, sizeof(BTA_PostprocessContext));
+    if (!*context) {
+        return BTA_StatusOutOfMemory;
+    }
+    BTA_Status status = BTAinitMutex(&((*context)->mutex));
+    if (status != BTA_StatusOk) {
+        free(*context);
+        *context = 0;
+        return status;
+    }
+    (*context)->refCount = 1;
+    (*context)->calcXYZInst = calcXYZInst;
+    (*context)->undistortInst = undistortInst;
+    return BTA_StatusOk;
+}
+
+
+void BTApostprocessContextClose(BTA_PostprocessContext **context) {
+    if (!context || !*context) {
+        return;
+    }
+    // The infoEventInst is freed with the handle
+    BTAlockMutex((*context)->mutex);
+    if ((*context)->calcXYZInst) {
+        (*context)->calcXYZInst->infoEventInst = 0;
+    }
+    if ((*context)->undistortInst) {
+        (*context)->undistortInst->infoEventInst = 0;
+    }
+    BTAunlockMutex((*context)->mutex);
+    BTApostprocessContextRelease(context);
+}
+
+
+void BTApostprocessContextRelease(BTA_PostprocessContext **context) {
+    if (!context || !*context) {
+        return;
+    }
+    BTA_PostprocessContext *ctx = *context;
+    *context = 0;
+    BTAlockMutex(ctx->mutex);
+    int refCount = --ctx->refCount;
+    BTAunlockMutex(ctx->mutex);
+    if (refCount > 0) {
+        return;
+    }
+    BTAcalcXYZClose(&(ctx->calcXYZInst));
+    BTAundistortClose(&(ctx->undistortInst));
+    BTAcloseMutex(ctx->mutex);
+    free(ctx);
+}
+
+
+// The steps that derive channels from others. winst is null when completing deferred postprocessing. The caller holds the context's mutex
+static void postprocessDerived(BTA_PostprocessContext *context, BTA_WrapperInst *winst, BTA_Frame *frame, BTA_DeferredPostprocess *settings) {
+    if (settings->calcXyzEnabled) {
+        BTAcalcXYZApply(context->calcXYZInst, winst, frame, settings->calcXyzOffset, settings->calcXyzFloat32, settings->calcXyzInterleaved);
+    }
+    if (settings->colorFromTofEnabled) {
+        BTAcalcMonochromeFromAmplitudeEx(frame, settings->colorFromTofEnabled == 2 ? settings->colorFromTofPercentile : 0);
+    }
+    if (settings->undistortRgbEnabled || settings->undistortTofEnabled) {
+        BTAundistortApply(context->undistortInst, winst, frame, settings->undistortRgbEnabled, settings->undistortTofEnabled, (BTA_UndistortInterpolation)settings->undistortInterpolation);
+    }
+}
+
+
+static BTA_Status insertFrameMetadata(BTA_Frame *frame, BTA_MetadataId id, void *data, uint32_t dataLen) {
+    BTA_Metadata *metadata = (BTA_Metadata *)malloc(sizeof(BTA_Metadata));
+    if (!metadata) {
+        return BTA_StatusOutOfMemory;
+    }
+    BTA_Metadata **metadataList = (BTA_Metadata **)realloc(frame->metadata, (frame->metadataLen + 1) * sizeof(BTA_Metadata *));
+    if (!metadataList) {
+        free(metadata);
+        return BTA_StatusOutOfMemory;
+    }
+    metadata->id = id;
+    metadata->data = data;
+    metadata->dataLen = dataLen;
+    frame->metadata = metadataList;
+    frame->metadata[frame->metadataLen++] = metadata;
+    return BTA_StatusOk;
+}
+
+
+// Loads what the derived steps need while winst is still available and leaves the steps themselves to BTApostprocessMaterialize
+static BTA_Status postprocessDefer(BTA_PostprocessContext *context, BTA_WrapperInst *winst, BTA_Frame *frame, BTA_DeferredPostprocess *settings) {
+    BTA_DeferredPostprocess *deferred = (BTA_DeferredPostprocess *)malloc(sizeof(BTA_DeferredPostprocess));
+    if (!deferred) {
+        return BTA_StatusOutOfMemory;
+    }
+    *deferred = *settings;
+    deferred->context = context;
+    BTAlockMutex(context->mutex);
+    if (settings->calcXyzEnabled) {
+        BTAcalcXYZPrepareFrame(context->calcXYZInst, winst, frame);
+    }
+    if (settings->undistortRgbEnabled || settings->undistortTofEnabled) {
+        BTAundistortPrepareFrame(context->undistortInst, winst, frame, settings->undistortRgbEnabled, settings->undistortTofEnabled);
+    }
+    context->refCount++;
+    BTAunlockMutex(context->mutex);
+    BTA_Status status = insertFrameMetadata(frame, BTA_MetadataIdDeferredPostprocessing, deferred, sizeof(BTA_DeferredPostprocess));
+    if (status != BTA_StatusOk) {
+        BTApostprocessContextRelease(&(deferred->context));
+        free(deferred);
+    }
+    return status;
+}
+
+
+#ifdef PLAT_WINDOWS
+#   define THREAD_LOCAL __declspec(thread)
+#else
+#   define THREAD_LOCAL __thread
+#endif
+
+// Serializes the completion of shared frames: their holders may access them on several threads at once
+static void *materializeMutex = 0;
+// The shared frame this thread completes under materializeMutex. The deferred steps may insert channels into it (see BTAisFrameShared)
+static THREAD_LOCAL BTA_Frame *materializingFrame = 0;
+
+
+static BTA_Status materialize(BTA_Frame *frame) {
+    for (uint32_t mdInd = 0; mdInd < frame->metadataLen; mdInd++) {
+        BTA_Metadata *metadata = frame->metadata[mdInd];
+        if (metadata->id != BTA_MetadataIdDeferredPostprocessing) {
+            continue;
+        }
+        // Remove the record first, so that clones and serialized frames never see it
+        memmove(&(frame->metadata[mdInd]), &(frame->metadata[mdInd + 1]), (frame->metadataLen - mdInd - 1) * sizeof(BTA_Metadata *));
+        if (!--frame->metadataLen) {
+            free(frame->metadata);
+            frame->metadata = 0;
+        }
+        BTA_DeferredPostprocess *deferred = (BTA_DeferredPostprocess *)metadata->data;
+        if (deferred && deferred->context) {
+            BTAlockMutex(deferred->context->mutex);
+            postprocessDerived(deferred->context, 0, frame, deferred);
+            BTAunlockMutex(deferred->context->mutex);
+        }
+        // Releases the reference on the context
+        return BTAfreeMetadata(&metadata);
+    }
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTApostprocessMaterialize(BTA_Frame *frame) {
+    if (!frame) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (!BTAisFrameShared(frame)) {
+        // The only holder, or the deferred steps call back in here
+        return materialize(frame);
+    }
+    // The first holder to access the frame runs the deferred steps, the others wait for it and find them removed
+    BTA_Status status = BTAinitMutexOnce(&materializeMutex);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    BTAlockMutex(materializeMutex);
+    materializingFrame = frame;
+    status = materialize(frame);
+    materializingFrame = 0;
+    BTAunlockMutex(materializeMutex);
+    return status;
+}
+
+
 void BTApostprocess(BTA_WrapperInst *winst, BTA_Frame *frame) {
+    if (winst->lpRawPhasesProcessing) {
+        // Everything else works on distances and amplitudes
+        BTArawPhasesApply(frame, winst->lpRawPhasesMinAmplitude);
+    }
+    if (winst->lpPhaseUnwrapping) {
+        // Before binning, which would mix values from both sides of a wrap
+        BTAphaseUnwrappingApply(frame);
+    }
+    if (winst->lpBinningFactor > 1) {
+        // First, so that all following steps work on less data
+        BTAbinningApply(frame, winst->lpBinningFactor, (BTA_BinningMode)winst->lpBinningMode);
+    }
 #   ifndef BTA_WO_LIBJPEG
     if (winst->lpJpgDecodeEnabled) {
-        BTAjpegFrameToRgb24(frame);
+        BTAjpegFrameToRgb24(winst->jpgInst, frame, winst->lpJpgDecodeScale);
     }
 #   endif
+    if (winst->lpTemporalFilterMode) {
+        BTAtemporalFilterApply(winst->temporalFilterInst, frame, (BTA_TemporalFilterMode)winst->lpTemporalFilterMode, winst->lpTemporalFilterWindow, winst->lpTemporalFilterAlpha, winst->lpTemporalFilterMinValidPixelPercentage);
+    }
+    else if (winst->temporalFilterInst && winst->temporalFilterInst->statesLen) {
+        // Don't keep the history in memory while off. Done here because this thread is the only one using the states
+        BTAtemporalFilterReset(winst->temporalFilterInst);
+    }
     if (winst->lpBilateralFilterWindow) {
         BTAcalcBilateralApply(winst, frame, winst->lpBilateralFilterWindow);
     }
-    if (winst->lpCalcXyzEnabled) {
-        BTAcalcXYZApply(winst->calcXYZInst, winst, frame, winst->lpCalcXyzOffset);
+    BTA_DeferredPostprocess settings;
+    settings.context = winst->postprocessContext;
+    settings.calcXyzEnabled = winst->lpCalcXyzEnabled;
+    settings.calcXyzOffset = winst->lpCalcXyzOffset;
+    settings.calcXyzFloat32 = winst->lpCalcXyzFloat32;
+    settings.calcXyzInterleaved = winst->lpCalcXyzInterleaved;
+    settings.colorFromTofEnabled = winst->lpColorFromTofEnabled;
+    settings.colorFromTofPercentile = winst->lpColorFromTofPercentile;
+    settings.undistortRgbEnabled = winst->lpUndistortRgbEnabled;
+    settings.undistortTofEnabled = winst->lpUndistortTofEnabled;
+    settings.undistortInterpolation = winst->lpUndistortInterpolation;
+    if (!settings.context || (!settings.calcXyzEnabled && !settings.colorFromTofEnabled && !settings.undistortRgbEnabled && !settings.undistortTofEnabled)) {
+        return;
+    }
+    if (winst->lpLazyPostprocessing && postprocessDefer(settings.context, winst, frame, &settings) == BTA_StatusOk) {
+        return;
+    }
+    BTAlockMutex(settings.context->mutex);
+    postprocessDerived(settings.context, winst, frame, &settings);
+    BTAunlockMutex(settings.context->mutex);
+}
+
+
+// A frame holding the channels of frame matching the filters of the subscription. Shares the channels and metadata, they are kept alive
+// by a reference to frame. If all channels match, frame itself is shared. *frameShared is null if no channel matches, that's no error
+static BTA_Status createSubscriberFrame(BTA_Subscription *subscription, BTA_Frame *frame, BTA_Frame **frameShared) {
+    *frameShared = 0;
+    if (!subscription->config.channelFiltersLen) {
+        BTAretainFrame(frame);
+        *frameShared = frame;
+        return BTA_StatusOk;
+    }
+    // The deferred postprocessing adds and replaces channels, the filters apply to the completed frame
+    BTAmaterializeFrame(frame);
+    BTA_Channel *channels[UINT8_MAX];
+    int channelsLen = 0;
+    for (int chInd = 0; chInd < frame->channelsLen; chInd++) {
+        for (int i = 0; i < subscription->config.channelFiltersLen; i++) {
+            if (BTAchannelMatchesFilter(frame->channels[chInd], &(subscription->config.channelFilters[i]))) {
+                channels[channelsLen++] = frame->channels[chInd];
+                break;
+            }
+        }
+    }
+    if (!channelsLen) {
+        return BTA_StatusOk;
+    }
+    BTAretainFrame(frame);
+    if (channelsLen == frame->channelsLen) {
+        *frameShared = frame;
+        return BTA_StatusOk;
+    }
+    BTA_Frame *frameNew = (BTA_Frame *)malloc(sizeof(BTA_Frame));
+    if (!frameNew) {
+        BTAfreeFrame(&frame);
+        return BTA_StatusOutOfMemory;
+    }
+    memcpy(frameNew, frame, sizeof(BTA_Frame));
+    frameNew->refCount = 0;
+    frameNew->channels = (BTA_Channel **)malloc(channelsLen * sizeof(BTA_Channel *));
+    frameNew->metadata = frame->metadataLen ? (BTA_Metadata **)malloc(frame->metadataLen * sizeof(BTA_Metadata *)) : 0;
+    if (!frameNew->channels || (frame->metadataLen && !frameNew->metadata)) {
+        free(frameNew->channels);
+        free(frameNew->metadata);
+        free(frameNew);
+        BTAfreeFrame(&frame);
+        return BTA_StatusOutOfMemory;
     }
-    if (winst->lpColorFromTofEnabled) {
-        BTAcalcMonochromeFromAmplitude(frame);
+    memcpy(frameNew->channels, channels, channelsLen * sizeof(BTA_Channel *));
+    frameNew->channelsLen = (uint8_t)channelsLen;
+    if (frame->metadataLen) {
+        memcpy(frameNew->metadata, frame->metadata, frame->metadataLen * sizeof(BTA_Metadata *));
     }
-    if (winst->lpUndistortRgbEnabled) {
-        BTAundistortApply(winst->undistortInst, winst, frame);
+    frameNew->sharedFrom = frame;
+    *frameShared = frameNew;
+    return BTA_StatusOk;
+}
+
+
+static void deliverToSubscriptions(BTA_WrapperInst *winst, BTA_Frame *frame) {
+    BTAlockMutex(winst->subscriptionsMutex);
+    for (int i = 0; i < (int)winst->subscriptionsLen; i++) {
+        BTA_Subscription *subscription = winst->subscriptions[i];
+        if (subscription->config.decimation > 1 && subscription->framesOffered++ % subscription->config.decimation) {
+            continue;
+        }
+        BTA_Frame *frameShared;
+        if (createSubscriberFrame(subscription, frame, &frameShared) != BTA_StatusOk) {
+            BTAatomicFetchAdd(&winst->pipelineCounters.subscriptionsDroppedCount, 1);
+        }
+        else if (frameShared && BFQenqueue(subscription->queue, frameShared) != BTA_StatusOk) {
+            BTAatomicFetchAdd(&winst->pipelineCounters.subscriptionsDroppedCount, 1);
+            BTAfreeFrame(&frameShared);
+        }
     }
+    BTAunlockMutex(winst->subscriptionsMutex);
 }
 
 
-void BTAcallbackEnqueue(BTA_WrapperInst *winst, BTA_Frame *frame) {
+static void callbackEnqueue(void *arg, BTA_Frame *frame) {
+    BTA_WrapperInst *winst = (BTA_WrapperInst *)arg;
     uint8_t userFreesFrame = 0;
     if (winst->frameArrivedInst) {
         if (winst->frameArrivedInst->frameArrived) {
@@ -263,7 +561,7 @@ void BTAcallbackEnqueue(BTA_WrapperInst *winst, BTA_Frame *frame) {
 
     if (!userFreesFrame) {
         if (winst->frameQueue) {
-            BVQenqueue(winst->frameQueue, frame);
+            BFQenqueue(winst->frameQueue, frame);
         }
         else {
             BTAfreeFrame(&frame);
@@ -272,11 +570,49 @@ void BTAcallbackEnqueue(BTA_WrapperInst *winst, BTA_Frame *frame) {
 }
 
 
+// The callbacks and the frame queue are served by the dispatch threads once enabled
+BTA_Status BTAcallbackDispatchInit(BTA_WrapperInst *winst) {
+    return BTAdispatchInit(&winst->dispatchInst, &callbackEnqueue, winst);
+}
+
+
+void BTAcallbackEnqueue(BTA_WrapperInst *winst, BTA_Frame *frame) {
+    // Unlocked check, so that frames aren't delayed by the mutex without any subscription. One subscribed meanwhile gets the next frame
+    if (BTAatomicLoad(&winst->subscriptionsLen)) {
+        // First, the callbacks may take the frame
+        deliverToSubscriptions(winst, frame);
+    }
+    if (winst->dispatchInst && BTAdispatchFrame(winst->dispatchInst, frame) == BTA_StatusOk) {
+        return;
+    }
+    uint64_t timeStart = BTAgetTickCountNano();
+    callbackEnqueue(winst, frame);
+    BTAatomicFetchAdd64(&winst->pipelineCounters.callbacksMicros, (BTAgetTickCountNano() - timeStart) / 1000);
+}
+
+
+void BTAnotifyPauseChanged(BTA_WrapperInst *winst) {
+    if (!winst->pauseMutex) {
+        // BTAopen failed early
+        return;
+    }
+    BTAlockMutex(winst->pauseMutex);
+    BTAbroadcastCondition(winst->condPauseChanged);
+    BTAunlockMutex(winst->pauseMutex);
+}
+
+
 BTA_Status BTAparsePostprocessGrabCallbackEnqueue(BTA_WrapperInst *winst, BTA_FrameToParse *frameToParse) {
     BTA_Frame *frame;
     BTA_Status status = BTAparseFrame(winst, frameToParse, &frame);
     if (status != BTA_StatusOk) {
         // BTAparseFrame itself calls infoEvent on error
+        if (frameToParse->packetCountGot < frameToParse->packetCountTotal) {
+            BTAatomicFetchAdd(&winst->pipelineCounters.framesIncompleteCount, 1);
+        }
+        else {
+            BTAatomicFetchAdd(&winst->pipelineCounters.framesParseErrorCount, 1);
+        }
         return status;
     }
     BTApostprocessGrabCallbackEnqueue(winst, frame);
@@ -1714,11 +2050,16 @@ BTA_Status BTAparseFrame(BTA_WrapperInst *winst, BTA_FrameToParse *frameToParse,
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_WARNING, BTA_StatusInvalidData, "Parsing frame %d: First packet is missing, abort", frameToParse->frameCounter);
         return BTA_StatusInvalidData;
     }
-    BTA_Frame *frame = (BTA_Frame *)malloc(sizeof(BTA_Frame));
+    BTA_Frame *frame = (BTA_Frame *)calloc(1, sizeof(BTA_Frame));
     if (!frame) {
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Parsing frame: Could not allocate a");
         return BTA_StatusOutOfMemory;
     }
+    // Work on a copy, the application may change the filter meanwhile
+    BTA_ParseFilter parseFilter;
+    BTAlockMutex(winst->parseFilterMutex);
+    parseFilter = winst->parseFilter;
+    BTAunlockMutex(winst->parseFilterMutex);
 
     // 2 bytes 'dont care'
     uint32_t i = 2;
@@ -1847,17 +2188,20 @@ BTA_Status BTAparseFrame(BTA_WrapperInst *winst, BTA_FrameToParse *frameToParse,
             BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Parsing frame v3: Could not allocate b");
             return BTA_StatusOutOfMemory;
         }
-        for (uint8_t chInd = 0; chInd < frame->channelsLen; chInd++) {
+        uint8_t channelsLenIn = frame->channelsLen;
+        uint8_t chOut = 0;
+        for (uint8_t chInd = 0; chInd < channelsLenIn; chInd++) {
             uint8_t rawPhaseContent = (rawPhaseContent32 >> (4 * chInd)) & 0xf;
             BTA_Channel *channel = (BTA_Channel *)malloc(sizeof(BTA_Channel));
             if (!channel) {
                 // free channels created so far
-                frame->channelsLen = chInd;
+                frame->channelsLen = chOut;
                 BTAfreeFrame(&frame);
                 BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Parsing frame v3: Could not allocate c");
                 return BTA_StatusOutOfMemory;
             }
-            frame->channels[chInd] = channel;
+            frame->channels[chOut] = channel;
+            channel->data = 0;
             channel->metadata = 0;
             channel->metadataLen = 0;
             channel->gain = 0;
@@ -1896,7 +2240,7 @@ BTA_Status BTAparseFrame(BTA_WrapperInst *winst, BTA_FrameToParse *frameToParse,
                     void *metadata = malloc(metadataLen);
                     if (!metadata) {
                         // free channels created so far
-                        frame->channelsLen = chInd + 1;
+                        frame->channelsLen = chOut + 1;
                         BTAfreeFrame(&frame);
                         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Parsing frame v3: Could not allocate d");
                         return BTA_StatusOutOfMemory;
@@ -1920,23 +2264,11 @@ BTA_Status BTAparseFrame(BTA_WrapperInst *winst, BTA_FrameToParse *frameToParse,
                 channel->dataLen = channel->xRes * channel->yRes * (channel->dataFormat & 0xf);
             }
 
-            channel->data = (uint8_t *)malloc(channel->dataLen);
-            if (!channel->data) {
-                free(channel);
-                channel = 0;
-                // free channels created so far
-                frame->channelsLen = chInd;
-                BTAfreeFrame(&frame);
-                BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Parsing frame v3: Could not allocate d");
-                return BTA_StatusOutOfMemory;
-            }
-
-            // before the memcopy check if there is enough input data
+            // before the copy check if there is enough input data
             if (dataLen < i + channel->dataLen) {
-                free(channel);
-                channel = 0;
+                BTAfreeChannel(&channel);
                 // free channels created so far
-                frame->channelsLen = chInd;
+                frame->channelsLen = chOut;
                 BTAfreeFrame(&frame);
                 BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Parsing frame v3: data too short %d", dataLen);
                 return BTA_StatusOutOfMemory;
@@ -1944,104 +2276,92 @@ BTA_Status BTAparseFrame(BTA_WrapperInst *winst, BTA_FrameToParse *frameToParse,
 
             //---------------------------------------------------------------------
             // copy data with special cases (also convert from SentisTofM100 coordinate system to BltTofApi coordinat system)
+            BTA_ChannelDataConversion conversion = BTA_ChannelDataConversionCopy;
             if (channel->id == BTA_ChannelIdX) {
                 channel->id = BTA_ChannelIdZ;
-                memcpy(channel->data, data + i, channel->dataLen);
             }
             else if (channel->id == BTA_ChannelIdY) {
                 channel->id = BTA_ChannelIdX;
-                int16_t *channelDataTempSrc = (int16_t *)(data + i);
-                int16_t *channelDataTempDst = (int16_t *)channel->data;
-                for (int32_t j = 0; j < channel->xRes * channel->yRes; j++) {
-                    *channelDataTempDst++ = -*channelDataTempSrc++;
-                }
+                conversion = BTA_ChannelDataConversionNegate;
             }
             else if (channel->id == BTA_ChannelIdZ) {
                 channel->id = BTA_ChannelIdY;
-                int16_t *channelDataTempSrc = (int16_t *)(data + i);
-                int16_t *channelDataTempDst = (int16_t *)channel->data;
-                for (int32_t j = 0; j < channel->xRes * channel->yRes; j++) {
-                    *channelDataTempDst++ = -*channelDataTempSrc++;
-                }
+                conversion = BTA_ChannelDataConversionNegate;
             }
             else if (channel->dataFormat == BTA_DataFormatSInt16Mlx12S) {
-                int16_t *channelDataTempSrc = (int16_t *)(data + i);
-                int16_t *channelDataTempDst = (int16_t *)channel->data;
-                for (int32_t j = 0; j < channel->xRes * channel->yRes; j++) {
-                    //*channelDataTempDst++ = (*channelDataTempSrc++ << 4) >> 4;
-                    *channelDataTempDst++ = (*channelDataTempSrc & 0x0800) ? (*channelDataTempSrc | 0xf000) : *channelDataTempSrc;
-                    channelDataTempSrc++;
-                }
-            }
-            else if (channel->dataFormat == BTA_DataFormatUInt16Mlx12U) {
-                memcpy(channel->data, data + i, channel->dataLen);
+                conversion = BTA_ChannelDataConversionMlx12S;
             }
             else if (channel->dataFormat == BTA_DataFormatSInt16Mlx1C11S) {
-                int16_t *channelDataTempSrc = (int16_t *)(data + i);
-                int16_t *channelDataTempDst = (int16_t *)channel->data;
-                for (int32_t j = 0; j < channel->xRes * channel->yRes; j++) {
-                    //*channelDataTempDst++ = (*channelDataTempSrc++ << 5) >> 5;
-                    *channelDataTempDst++ = (*channelDataTempSrc & 0x0400) ? (*channelDataTempSrc | 0xfc00) : *channelDataTempSrc;
-                    channelDataTempSrc++;
-                }
+                conversion = BTA_ChannelDataConversionMlx1C11S;
             }
             else if (channel->dataFormat == BTA_DataFormatUInt16Mlx1C11U) {
-                uint16_t *channelDataTempSrc = (uint16_t *)(data + i);
-                uint16_t *channelDataTempDst = (uint16_t *)channel->data;
-                for (int32_t j = 0; j < channel->xRes * channel->yRes; j++) {
-                    *channelDataTempDst++ = *channelDataTempSrc++ & 0x07ff;
-                }
+                conversion = BTA_ChannelDataConversionMlx1C11U;
             }
-            else {
-                memcpy(channel->data, data + i, channel->dataLen);
+
+            uint8_t selected = isChannelSelected(&parseFilter, channel);
+            uint32_t channelDataLenIn = channel->dataLen;
+            uint16_t xResIn = channel->xRes;
+            if (selected) {
+                copyChannelData(channel, conversion, data + i, channelDataLenIn, &parseFilter);
+                if (!channel->data) {
+                    free(channel);
+                    channel = 0;
+                    // free channels created so far
+                    frame->channelsLen = chOut;
+                    BTAfreeFrame(&frame);
+                    BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Parsing frame v3: Could not allocate d");
+                    return BTA_StatusOutOfMemory;
+                }
             }
 
             // advance input data index
-            i += channel->dataLen;
+            i += channelDataLenIn;
 
-            channel->metadata = 0;
-            channel->metadataLen = 0;
             if (channel->id == BTA_ChannelIdRawPhase || channel->id == BTA_ChannelIdRawI || channel->id == BTA_ChannelIdRawQ) { //(imgMode == BTA_EthImgModeRawPhases || imgMode == BTA_EthImgModeRawQI)
                 // read last lines of metadata
                 if (postMetaData & 2) {
-                    uint32_t metadataLen = 8 * channel->xRes * sizeof(uint16_t);
-                    void *metadata = malloc(metadataLen);
-                    memcpy(metadata, data + i, metadataLen);
+                    uint32_t metadataLen = 8 * xResIn * sizeof(uint16_t);
+                    if (selected) {
+                        void *metadata = malloc(metadataLen);
+                        memcpy(metadata, data + i, metadataLen);
+                        BTAinsertMetadataDataIntoChannel(channel, BTA_MetadataIdMlxTest, metadata, metadataLen);
+                    }
                     i += metadataLen;
-                    BTAinsertMetadataDataIntoChannel(channel, BTA_MetadataIdMlxTest, metadata, metadataLen);
                 }
                 if (postMetaData & 4) {
-                    uint32_t metadataLen = channel->xRes * sizeof(uint16_t);
-                    void *metadata = malloc(metadataLen);
-                    memcpy(metadata, data + i, metadataLen);
+                    uint32_t metadataLen = xResIn * sizeof(uint16_t);
+                    if (selected) {
+                        void *metadata = malloc(metadataLen);
+                        memcpy(metadata, data + i, metadataLen);
+                        BTAinsertMetadataDataIntoChannel(channel, BTA_MetadataIdMlxAdcData, metadata, metadataLen);
+                    }
                     i += metadataLen;
-                    BTAinsertMetadataDataIntoChannel(channel, BTA_MetadataIdMlxAdcData, metadata, metadataLen);
                 }
                 if (postMetaData & 1) {
-                    uint32_t metadataLen = channel->xRes * sizeof(uint16_t);
-                    void *metadata = malloc(metadataLen);
-                    memcpy(metadata, data + i, metadataLen);
+                    uint32_t metadataLen = xResIn * sizeof(uint16_t);
+                    if (selected) {
+                        void *metadata = malloc(metadataLen);
+                        memcpy(metadata, data + i, metadataLen);
+                        BTAinsertMetadataDataIntoChannel(channel, BTA_MetadataIdMlxMeta2, metadata, metadataLen);
+                    }
                     i += metadataLen;
-                    BTAinsertMetadataDataIntoChannel(channel, BTA_MetadataIdMlxMeta2, metadata, metadataLen);
                 }
             }
+            if (selected) {
+                chOut++;
+            }
+            else {
+                BTAfreeChannel(&channel);
+            }
         }
+        frame->channelsLen = chOut;
         frame->metadataLen = 0;
         frame->metadata = 0;
 
         // just reorder X, Y, Z channelpointer, so they are alphabetical
         if (imgMode == BTA_EthImgModeXYZ || imgMode == BTA_EthImgModeXYZAmp || imgMode == BTA_EthImgModeXYZColor ||
-            imgMode == BTA_EthImgModeXYZConfColor || imgMode == BTA_EthImgModeXYZAmpColorOverlay) {
-            BTA_Channel *channelTemp = frame->channels[0];
-            frame->channels[0] = frame->channels[1];
-            frame->channels[1] = frame->channels[2];
-            frame->channels[2] = channelTemp;
-        }
-        else if (imgMode == BTA_EthImgModeDistXYZ) {
-            BTA_Channel *channelTemp = frame->channels[1];
-            frame->channels[1] = frame->channels[2];
-            frame->channels[2] = frame->channels[3];
-            frame->channels[3] = channelTemp;
+            imgMode == BTA_EthImgModeXYZConfColor || imgMode == BTA_EthImgModeXYZAmpColorOverlay || imgMode == BTA_EthImgModeDistXYZ) {
+            sortCartesianChannels(frame);
         }
         if (i != dataLen) {
             BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusRuntimeError, "Parsing frame v3: Unexpected payload length, i: %d  dataLen: %d", i, dataLen);
@@ -2226,14 +2546,21 @@ BTA_Status BTAparseFrame(BTA_WrapperInst *winst, BTA_FrameToParse *frameToParse,
                     BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Parsing frame v4: data too short: %d", dataLen);
                     return BTA_StatusOutOfMemory;
                 }
+                BTA_ChannelDataConversion conversion = toBtaCoordinateSystem(channel);
+                if (!isChannelSelected(&parseFilter, channel)) {
+                    free(channel);
+                    frame->channels[chInd] = 0;
+                    dataStream += data4DescTofV1->dataLen;
+                    break;
+                }
                 BTA_Status status = setMissingAsInvalid((BTA_ChannelId)data4DescTofV1->channelId, (BTA_DataFormat)data4DescTofV1->dataFormat, dataStream, data4DescTofV1->dataLen, frameToParse);
                 if (status == BTA_StatusOk) {
-                    insertChannelData(channel, dataStream, data4DescTofV1->dataLen);
+                    copyChannelData(channel, conversion, dataStream, data4DescTofV1->dataLen, &parseFilter);
                 }
                 else {
                     channel->xRes = 0;
                     channel->yRes = 0;
-                    insertChannelData(channel, 0, 0);
+                    copyChannelData(channel, conversion, 0, 0, &parseFilter);
                 }
                 dataStream += data4DescTofV1->dataLen;
                 chInd++;
@@ -2270,14 +2597,21 @@ BTA_Status BTAparseFrame(BTA_WrapperInst *winst, BTA_FrameToParse *frameToParse,
                     BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Parsing frame v4: data too short: %d", dataLen);
                     return BTA_StatusOutOfMemory;
                 }
+                BTA_ChannelDataConversion conversion = toBtaCoordinateSystem(channel);
+                if (!isChannelSelected(&parseFilter, channel)) {
+                    free(channel);
+                    frame->channels[chInd] = 0;
+                    dataStream += data4DescColorV1->dataLen;
+                    break;
+                }
                 BTA_Status status = setMissingAsInvalid(BTA_ChannelIdColor, (BTA_DataFormat)data4DescColorV1->colorFormat, dataStream, data4DescColorV1->dataLen, frameToParse);
                 if (status == BTA_StatusOk) {
-                    insertChannelData(channel, dataStream, data4DescColorV1->dataLen);
+                    copyChannelData(channel, conversion, dataStream, data4DescColorV1->dataLen, &parseFilter);
                 }
                 else {
                     channel->xRes = 0;
                     channel->yRes = 0;
-                    insertChannelData(channel, 0, 0);
+                    copyChannelData(channel, conversion, 0, 0, &parseFilter);
                 }
                 dataStream += data4DescColorV1->dataLen;
                 chInd++;
@@ -2333,6 +2667,11 @@ BTA_Status BTAparseFrame(BTA_WrapperInst *winst, BTA_FrameToParse *frameToParse,
             }
         }
 
+        if (frame->channels) {
+            // Channels not selected by the parse filter
+            frame->channelsLen = chInd;
+        }
+
         if ((int)(dataStream - data) != (int)dataLen) {
             BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusWarning, "Parsing frame v4: Unexpected payload length, i: %d  dataLen: %d", (int)(dataStream - data), dataLen);
         }
@@ -2360,104 +2699,165 @@ BTA_Status BTAparseFrame(BTA_WrapperInst *winst, BTA_FrameToParse *frameToParse,
 
 //---------------------------------------------------------------------
 // copy data with special cases (also convert from SentisTofM100 coordinate system to BltTofApi coordinate system)
-// channel->data must already be allocated
-static void insertChannelData(BTA_Channel *channel, uint8_t *data, uint32_t dataLen) {
-    channel->dataLen = dataLen;
+// Renames the channel and returns the conversion its data needs
+static BTA_ChannelDataConversion toBtaCoordinateSystem(BTA_Channel *channel) {
     if (!(channel->flags & 0x2) && channel->id == BTA_ChannelIdX) {
         // Transform coordinate system from camera to bta spec
         channel->id = BTA_ChannelIdZ;
-        channel->data = (uint8_t *)malloc(channel->dataLen);
-        if (!channel->data) {
-            channel->dataLen = 0;
-            return;
-        }
-        memcpy(channel->data, data, channel->dataLen);
         channel->flags &= ~2;
+        return BTA_ChannelDataConversionCopy;
     }
-    else if (!(channel->flags & 0x2) && channel->id == BTA_ChannelIdY) {
+    if (!(channel->flags & 0x2) && channel->id == BTA_ChannelIdY) {
         // Transform coordinate system from camera to bta spec
         channel->id = BTA_ChannelIdX;
-        channel->data = (uint8_t *)malloc(channel->dataLen);
-        if (!channel->data) {
-            channel->dataLen = 0;
-            return;
-        }
-        int16_t *channelDataTempSrc = (int16_t *)data;
-        int16_t *channelDataTempDst = (int16_t *)channel->data;
-        int px = dataLen / (channel->dataFormat & 0xf);
-        for (int32_t j = 0; j < px; j++) {
-            *channelDataTempDst++ = -*channelDataTempSrc++;
-        }
         channel->flags &= ~2;
+        return BTA_ChannelDataConversionNegate;
     }
-    else if (!(channel->flags & 0x2) && channel->id == BTA_ChannelIdZ) {
+    if (!(channel->flags & 0x2) && channel->id == BTA_ChannelIdZ) {
         // Transform coordinate system from camera to bta spec
         channel->id = BTA_ChannelIdY;
-        channel->data = (uint8_t *)malloc(channel->dataLen);
-        if (!channel->data) {
-            channel->dataLen = 0;
-            return;
-        }
-        int16_t *channelDataTempSrc = (int16_t *)data;
-        int16_t *channelDataTempDst = (int16_t *)channel->data;
-        int px = dataLen / (channel->dataFormat & 0xf);
-        for (int32_t j = 0; j < px; j++) {
-            *channelDataTempDst++ = -*channelDataTempSrc++;
-        }
         channel->flags &= ~2;
+        return BTA_ChannelDataConversionNegate;
     }
-    else if (channel->dataFormat == BTA_DataFormatSInt16Mlx12S) {
-        channel->data = (uint8_t *)malloc(channel->dataLen);
-        if (!channel->data) {
-            channel->dataLen = 0;
-            return;
+    if (channel->dataFormat == BTA_DataFormatSInt16Mlx12S) {
+        return BTA_ChannelDataConversionMlx12S;
+    }
+    if (channel->dataFormat == BTA_DataFormatSInt16Mlx1C11S) {
+        return BTA_ChannelDataConversionMlx1C11S;
+    }
+    if (channel->dataFormat == BTA_DataFormatUInt16Mlx1C11U) {
+        return BTA_ChannelDataConversionMlx1C11U;
+    }
+    return BTA_ChannelDataConversionCopy;
+}
+
+
+static void convertChannelData(BTA_ChannelDataConversion conversion, uint8_t *dst, const uint8_t *src, uint32_t len) {
+    int16_t *dstS16 = (int16_t *)dst;
+    const int16_t *srcS16 = (const int16_t *)src;
+    uint32_t px = len / sizeof(int16_t);
+    switch (conversion) {
+    case BTA_ChannelDataConversionNegate:
+        for (uint32_t j = 0; j < px; j++) {
+            dstS16[j] = -srcS16[j];
         }
-        int16_t *channelDataTempSrc = (int16_t *)data;
-        int16_t *channelDataTempDst = (int16_t *)channel->data;
-        int px = dataLen / (channel->dataFormat & 0xf);
-        for (int32_t j = 0; j < px; j++) {
-            *channelDataTempDst++ = (*channelDataTempSrc & 0x0800) ? (*channelDataTempSrc | 0xf800) : *channelDataTempSrc;
-            channelDataTempSrc++;
+        break;
+    case BTA_ChannelDataConversionMlx12S:
+        for (uint32_t j = 0; j < px; j++) {
+            dstS16[j] = (srcS16[j] & 0x0800) ? (srcS16[j] | 0xf000) : srcS16[j];
         }
-    }
-    else if (channel->dataFormat == BTA_DataFormatSInt16Mlx1C11S) {
-        channel->data = (uint8_t *)malloc(channel->dataLen);
-        if (!channel->data) {
-            channel->dataLen = 0;
-            return;
+        break;
+    case BTA_ChannelDataConversionMlx1C11S:
+        for (uint32_t j = 0; j < px; j++) {
+            dstS16[j] = (srcS16[j] & 0x0400) ? (srcS16[j] | 0xfc00) : srcS16[j];
         }
-        int16_t *channelDataTempSrc = (int16_t *)data;
-        int16_t *channelDataTempDst = (int16_t *)channel->data;
-        int px = dataLen / (channel->dataFormat & 0xf);
-        for (int32_t j = 0; j < px; j++) {
-            *channelDataTempDst++ = (*channelDataTempSrc & 0x0400) ? (*channelDataTempSrc | 0xfc00) : *channelDataTempSrc;
-            channelDataTempSrc++;
+        break;
+    case BTA_ChannelDataConversionMlx1C11U:
+        for (uint32_t j = 0; j < px; j++) {
+            ((uint16_t *)dst)[j] = ((const uint16_t *)src)[j] & 0x07ff;
         }
+        break;
+    default:
+        memcpy(dst, src, len);
+        break;
     }
-    else if (channel->dataFormat == BTA_DataFormatUInt16Mlx1C11U) {
-        channel->data = (uint8_t *)malloc(channel->dataLen);
-        if (!channel->data) {
-            channel->dataLen = 0;
-            return;
+}
+
+
+// Returns 1 if the region of interest of parseFilter is to be cut out of the channel
+static uint8_t isChannelCropped(const BTA_ParseFilter *parseFilter, BTA_Channel *channel, uint32_t dataLen) {
+    if (!parseFilter->roiXRes || !parseFilter->roiYRes || channel->id == BTA_ChannelIdColor || channel->dataFormat == BTA_DataFormatYuv422) {
+        return 0;
+    }
+    uint32_t bytesPerPixel = channel->dataFormat & 0xf;
+    if (!bytesPerPixel || dataLen != (uint32_t)channel->xRes * channel->yRes * bytesPerPixel) {
+        // compressed or no data
+        return 0;
+    }
+    return (uint32_t)parseFilter->roiX + parseFilter->roiXRes <= channel->xRes && (uint32_t)parseFilter->roiY + parseFilter->roiYRes <= channel->yRes;
+}
+
+
+// Allocates channel->data and fills it from data, converting and cropping to the region of interest on the way. channel->data is null on error
+static void copyChannelData(BTA_Channel *channel, BTA_ChannelDataConversion conversion, uint8_t *data, uint32_t dataLen, const BTA_ParseFilter *parseFilter) {
+    uint32_t rowLen = dataLen;
+    uint32_t rowCount = 1;
+    uint32_t srcStride = 0;
+    if (isChannelCropped(parseFilter, channel, dataLen)) {
+        uint32_t bytesPerPixel = channel->dataFormat & 0xf;
+        srcStride = channel->xRes * bytesPerPixel;
+        data += parseFilter->roiY * srcStride + parseFilter->roiX * bytesPerPixel;
+        rowLen = parseFilter->roiXRes * bytesPerPixel;
+        rowCount = parseFilter->roiYRes;
+        channel->xRes = parseFilter->roiXRes;
+        channel->yRes = parseFilter->roiYRes;
+    }
+    channel->dataLen = rowLen * rowCount;
+    channel->data = (uint8_t *)malloc(channel->dataLen);
+    if (!channel->data) {
+        channel->dataLen = 0;
+        return;
+    }
+    for (uint32_t y = 0; y < rowCount; y++) {
+        convertChannelData(conversion, channel->data + y * rowLen, data + y * srcStride, rowLen);
+    }
+}
+
+
+static uint8_t isChannelSelected(const BTA_ParseFilter *parseFilter, BTA_Channel *channel) {
+    if (!parseFilter->channelFiltersLen) {
+        return 1;
+    }
+    for (int i = 0; i < parseFilter->channelFiltersLen; i++) {
+        if (BTAchannelMatchesFilter(channel, &(parseFilter->channelFilters[i]))) {
+            return 1;
         }
-        uint16_t *channelDataTempSrc = (uint16_t *)data;
-        uint16_t *channelDataTempDst = (uint16_t *)channel->data;
-        int px = dataLen / (channel->dataFormat & 0xf);
-        for (int32_t j = 0; j < px; j++) {
-            *channelDataTempDst++ = *channelDataTempSrc++ & 0x07ff;
+    }
+    return 0;
+}
+
+
+// Brings the channels X, Y and Z into alphabetical order, keeping the positions the three occupy
+static void sortCartesianChannels(BTA_Frame *frame) {
+    int positions[3];
+    int positionsLen = 0;
+    for (int chInd = 0; chInd < frame->channelsLen && positionsLen < 3; chInd++) {
+        BTA_ChannelId id = frame->channels[chInd]->id;
+        if (id == BTA_ChannelIdX || id == BTA_ChannelIdY || id == BTA_ChannelIdZ) {
+            positions[positionsLen++] = chInd;
         }
     }
-    else {
-        channel->data = (uint8_t *)malloc(channel->dataLen);
-        if (!channel->data) {
-            channel->dataLen = 0;
-            return;
+    // BTA_ChannelIdX < BTA_ChannelIdY < BTA_ChannelIdZ
+    for (int i = 1; i < positionsLen; i++) {
+        for (int j = i; j > 0 && frame->channels[positions[j - 1]]->id > frame->channels[positions[j]]->id; j--) {
+            BTA_Channel *channelTemp = frame->channels[positions[j - 1]];
+            frame->channels[positions[j - 1]] = frame->channels[positions[j]];
+            frame->channels[positions[j]] = channelTemp;
         }
-        memcpy(channel->data, data, channel->dataLen);
     }
 }
 
 
+uint8_t BTAchannelMatchesFilter(BTA_Channel *channel, const BTA_ChannelFilter *filter) {
+    if (filter->filterByChannelId && channel->id != filter->id) return 0;
+    if (filter->filterByResolution && (channel->xRes != filter->xRes || channel->yRes != filter->yRes)) return 0;
+    if (filter->filterByDataFormat && channel->dataFormat != filter->dataFormat) return 0;
+    if (filter->filterByLensIndex && channel->lensIndex != filter->lensIndex) return 0;
+    if (filter->filterByFlagsMask & (channel->flags ^ filter->flags)) return 0;
+    if (filter->filterBySequenceCounter && channel->sequenceCounter != filter->sequenceCounter) return 0;
+    return 1;
+}
+
+
+uint8_t BTAisFrameShared(BTA_Frame *frame) {
+    if (frame == materializingFrame) {
+        // Its holders wait for this thread before they access it
+        return 0;
+    }
+    return frame->sharedFrom || BTAatomicLoad((BTA_Atomic32 *)&frame->refCount) > 0;
+}
+
+
 static BTA_ChannelId BTAETHgetChannelId(BTA_EthImgMode imgMode, uint8_t channelIndex) {
     switch (imgMode) {
     case BTA_EthImgModeRawdistAmp:
@@ -3445,7 +3845,7 @@ BTA_Status BTAparseFrameFromShm(BTA_Handle handle, uint8_t *data, BTA_Frame **fr
 
     uint64_t timeParseFrame = BTAgetTickCountNano() / 1000;
     *framePtr = 0;
-    BTA_Frame *frame = (BTA_Frame *)malloc(sizeof(BTA_Frame));
+    BTA_Frame *frame = (BTA_Frame *)calloc(1, sizeof(BTA_Frame));
     if (!frame) {
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusOutOfMemory, "Parsing frame: Could not allocate a");
         return BTA_StatusOutOfMemory;
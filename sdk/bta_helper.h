@@ -23,6 +23,7 @@
 
 #include "bta_grabbing.h"
 #include <bvq_queue.h>
+#include <bta_atomic.h>
 
 #include "fifo.h"
 #include <semaphore.h>
@@ -73,6 +74,53 @@ typedef struct BTA_FrameArrivedInst {
 } BTA_FrameArrivedInst;
 
 
+// Shares calcXYZ and undistort between the handle and the frames whose postprocessing is deferred, so that these can be completed after BTAclose
+typedef struct BTA_PostprocessContext {
+    void *mutex;                            ///< Serializes all use of the insts below and guards refCount
+    int refCount;                           ///< The handle plus one per frame with deferred postprocessing
+    struct BTA_CalcXYZInst *calcXYZInst;
+    struct BTA_UndistortInst *undistortInst;
+} BTA_PostprocessContext;
+
+
+// Stored as frame metadata with id BTA_MetadataIdDeferredPostprocessing. The LibParams as they were when the frame was captured
+typedef struct BTA_DeferredPostprocess {
+    BTA_PostprocessContext *context;        ///< Holds a reference, released when the metadata is freed
+    uint8_t calcXyzEnabled;
+    float calcXyzOffset;
+    uint8_t calcXyzFloat32;
+    uint8_t calcXyzInterleaved;
+    uint8_t colorFromTofEnabled;            ///< 1: min/max stretch, 2: percentile stretch
+    float colorFromTofPercentile;
+    uint8_t undistortRgbEnabled;
+    uint8_t undistortTofEnabled;
+    uint8_t undistortInterpolation;
+} BTA_DeferredPostprocess;
+
+
+#define BTA_SUBSCRIPTIONS_MAX       16
+
+typedef struct BTA_Subscription {
+    BTA_SubscriptionConfig config;
+    BFQ_FrameQueueHandle queue;
+    uint32_t framesOffered;                 ///< For the decimation
+} BTA_Subscription;
+
+
+// The handle's own part of BTA_PipelineStats, counted lock-free by the data stream threads. BTAgetPipelineStats exchanges each value with 0
+typedef struct BTA_PipelineCounters {
+    BTA_Atomic32 packetBufferUnavailableCount;
+    BTA_Atomic32 framesEvictedCount;
+    BTA_Atomic32 framesDiscardedCount;
+    BTA_Atomic32 framesIncompleteCount;
+    BTA_Atomic32 framesParseErrorCount;
+    BTA_Atomic32 subscriptionsDroppedCount;
+    BTA_Atomic32 packetsToParseCountMax;
+    BTA_Atomic64 packetBufferWaitMicros;
+    BTA_Atomic64 callbacksMicros;
+} BTA_PipelineCounters;
+
+
 typedef struct BTA_WrapperInst {
     void *inst;
     BTA_InfoEventInst *infoEventInst;
@@ -84,6 +132,20 @@ typedef struct BTA_WrapperInst {
     struct BTA_JpgInst *jpgInst;
     struct BTA_UndistortInst *undistortInst;
     struct BTA_CalcXYZInst *calcXYZInst;
+    struct BTA_TemporalFilterInst *temporalFilterInst;
+    BTA_PostprocessContext *postprocessContext;
+
+    BTA_ParseFilter parseFilter;
+    void *parseFilterMutex;
+
+    BTA_Subscription *subscriptions[BTA_SUBSCRIPTIONS_MAX];
+    BTA_Atomic32 subscriptionsLen;          ///< Changed under subscriptionsMutex only, but BTAcallbackEnqueue reads it without
+    void *subscriptionsMutex;               ///< Guards subscriptions against BTAsubscribe / BTAunsubscribe while frames are delivered
+
+    struct BTA_DispatchInst *dispatchInst;  ///< Runs the callbacks on the dispatch threads, see BTA_LibParamCallbackDispatchQueueLength
+
+    BTA_PipelineCounters pipelineCounters;  ///< The queue statistics are added in BTAgetPipelineStats
+    void *pipelineStatsMutex;               ///< Serializes BTAgetPipelineStats, so one call's values are collected together
 
     uint32_t modFreqs[15];
     int modFreqsReadFromDevice;
@@ -132,13 +194,35 @@ typedef struct BTA_WrapperInst {
     uint64_t lpDataStreamFramesParsedPerSecUpdated;
 
     uint8_t lpPauseCaptureThread;
+    void *pauseMutex;                       ///< Guards lpPauseCaptureThread for the threads waiting on condPauseChanged
+    void *condPauseChanged;                 ///< Broadcast when lpPauseCaptureThread changes or the handle closes, see BTAnotifyPauseChanged
 
     uint8_t lpBilateralFilterWindow;
     uint8_t lpCalcXyzEnabled;
     float lpCalcXyzOffset;
+    uint8_t lpCalcXyzFloat32;
+    uint8_t lpCalcXyzInterleaved;
+    uint8_t lpLensCacheEnabled;
+    char lensCacheKey[64];                  ///< Device type, serial number and firmware version naming the cache files, empty until the first lookup (see lens_cache.c)
     uint8_t lpColorFromTofEnabled;
     uint8_t lpJpgDecodeEnabled;
+    uint8_t lpJpgDecodeScale;
     uint8_t lpUndistortRgbEnabled;
+    uint8_t lpUndistortTofEnabled;
+    uint8_t lpUndistortInterpolation;
+    uint8_t lpTemporalFilterMode;
+    uint8_t lpTemporalFilterWindow;
+    float lpTemporalFilterAlpha;
+    float lpTemporalFilterMinValidPixelPercentage;
+    uint8_t lpLazyPostprocessing;
+    uint8_t lpBinningFactor;
+    uint8_t lpBinningMode;
+    float lpColorFromTofPercentile;
+    uint8_t lpRawPhasesProcessing;
+    float lpRawPhasesMinAmplitude;
+    uint8_t lpPhaseUnwrapping;
+    uint32_t lpCallbackDispatchQueueLength;
+    uint8_t lpCallbackDispatchQueueMode;
 
     uint32_t lpDebugFlags01;
     float lpDebugValue01;
@@ -422,9 +506,23 @@ BTA_Status BTAtoByteStream(BTA_EthCommand cmd, BTA_EthSubCommand subCmd, uint32_
 BTA_Status BTAparseControlHeader(uint8_t *request, uint8_t *data, uint32_t *payloadLength, uint32_t *flags, uint32_t *dataCrc32, uint8_t *parseError, BTA_InfoEventInst *infoEventInst);
 BTA_Status BTAparseFrame(BTA_WrapperInst *winst, BTA_FrameToParse *frameToParse, BTA_Frame **framePtr);
 
+uint8_t BTAchannelMatchesFilter(BTA_Channel *channel, const BTA_ChannelFilter *filter);
+// A subscriber frame borrows the channels of the original frame, a retained one is read by other holders. Neither may get channels added or removed,
+// except by the thread completing it in BTApostprocessMaterialize
+uint8_t BTAisFrameShared(BTA_Frame *frame);
+BTA_Status BTApostprocessContextCreate(BTA_PostprocessContext **context, struct BTA_CalcXYZInst *calcXYZInst, struct BTA_UndistortInst *undistortInst);
+// Releases the handle's reference and detaches the insts from its infoEventInst. Frames still holding a reference keep the insts alive
+void BTApostprocessContextClose(BTA_PostprocessContext **context);
+void BTApostprocessContextRelease(BTA_PostprocessContext **context);
+// Completes the deferred postprocessing of the frame, if any. The holders of a shared frame may call it concurrently, the steps run once
+BTA_Status BTApostprocessMaterialize(BTA_Frame *frame);
+void BTApostprocess(BTA_WrapperInst *winst, BTA_Frame *frame);
 BTA_Status BTAparsePostprocessGrabCallbackEnqueue(BTA_WrapperInst *winst, BTA_FrameToParse *frameToParse);
 /*      @brief  Function that handles the image processing queue and consumes the frame, respectively frees it  */
 void BTApostprocessGrabCallbackEnqueue(BTA_WrapperInst *winst, BTA_Frame *frame);
+BTA_Status BTAcallbackDispatchInit(BTA_WrapperInst *winst);
+/*      @brief  Wakes the threads waiting for lpPauseCaptureThread to be cleared, so they check it (and their closing flag) again  */
+void BTAnotifyPauseChanged(BTA_WrapperInst *winst);
 
 BTA_Status BTAparseLenscalib(uint8_t* data, uint32_t dataLen, BTA_LensVectors** calcXYZVectors, BTA_InfoEventInst *infoEventInst);
 
@@ -5,6 +5,10 @@
 #include <bta.h>
 #include <bta_helper.h>
 #include <mth_math.h>
+#include <pthread_helper.h>
+#include <raw_phases.h>
+#include <phase_unwrapping.h>
+#include <math.h>
 
 
 BTA_Status BTA_CALLCONV BTAaverageFrames(BTA_Frame** frames, int framesLen, float minValidPixelPercentage, BTA_Frame** result) {
@@ -47,14 +51,146 @@ BTA_Status BTA_CALLCONV BTAaverageFrames(BTA_Frame** frames, int framesLen, floa
 }
 
 
+// Pixels are averaged in blocks of this size, so that the accumulators and the invalid pixel histogram stay in the cache
+#define AVERAGE_BLOCK_LEN       512
+// Minimum number of pixels per thread
+#define AVERAGE_PARALLEL_MIN    16384
+
+typedef enum AverageKind {
+    AverageKindPlain,           ///< All values are valid
+    AverageKindCodes,           ///< The lowest 10 values are invalidation codes, an invalid result gets the most frequent code (Distance, Z)
+    AverageKindMax,             ///< The maximum value is invalid (Amplitude, Flags)
+} AverageKind;
+
+typedef struct AverageArgs {
+    BTA_Channel **channels;
+    int channelsLen;
+    BTA_Channel *result;
+    AverageKind kind;
+    float minInvalidCount;      ///< A pixel with at least this many invalid values (and at least one) is invalid
+} AverageArgs;
+
+
+// Integer formats: exact sums in int64, rounding half away from zero like MTHround
+#define AVERAGE_ROWS_INT(name, T, TMIN, TMAX)                                                                                   \
+static void name(void *arg, int rowStart, int rowEnd) {                                                                         \
+    AverageArgs *args = (AverageArgs *)arg;                                                                                     \
+    int xRes = args->result->xRes;                                                                                              \
+    int end = rowEnd * xRes;                                                                                                    \
+    int64_t sums[AVERAGE_BLOCK_LEN];                                                                                            \
+    uint16_t invalids[AVERAGE_BLOCK_LEN];                                                                                       \
+    uint16_t codes[AVERAGE_BLOCK_LEN][10];                                                                                      \
+    for (int blockStart = rowStart * xRes; blockStart < end; blockStart += AVERAGE_BLOCK_LEN) {                                 \
+        int n = MTHmin(AVERAGE_BLOCK_LEN, end - blockStart);                                                                    \
+        memset(sums, 0, n * sizeof(int64_t));                                                                                   \
+        memset(invalids, 0, n * sizeof(uint16_t));                                                                              \
+        if (args->kind == AverageKindCodes) {                                                                                   \
+            memset(codes, 0, n * sizeof(codes[0]));                                                                             \
+        }                                                                                                                       \
+        for (int chInd = 0; chInd < args->channelsLen; chInd++) {                                                               \
+            const T *src = (const T *)args->channels[chInd]->data + blockStart;                                                 \
+            switch (args->kind) {                                                                                               \
+            case AverageKindPlain:                                                                                              \
+                for (int i = 0; i < n; i++) {                                                                                   \
+                    sums[i] += src[i];                                                                                          \
+                }                                                                                                               \
+                break;                                                                                                          \
+            case AverageKindCodes:                                                                                              \
+                for (int i = 0; i < n; i++) {                                                                                   \
+                    T v = src[i];                                                                                               \
+                    if (v < (T)(TMIN + 10)) {                                                                                   \
+                        codes[i][v - (TMIN)]++;                                                                                 \
+                        invalids[i]++;                                                                                          \
+                    }                                                                                                           \
+                    else {                                                                                                      \
+                        sums[i] += v;                                                                                           \
+                    }                                                                                                           \
+                }                                                                                                               \
+                break;                                                                                                          \
+            case AverageKindMax:                                                                                                \
+                for (int i = 0; i < n; i++) {                                                                                   \
+                    T v = src[i];                                                                                               \
+                    uint8_t invalid = v == (T)(TMAX);                                                                           \
+                    invalids[i] += invalid;                                                                                     \
+                    sums[i] += invalid ? 0 : v;                                                                                 \
+                }                                                                                                               \
+                break;                                                                                                          \
+            }                                                                                                                   \
+        }                                                                                                                       \
+        T *dst = (T *)args->result->data + blockStart;                                                                          \
+        for (int i = 0; i < n; i++) {                                                                                           \
+            if (invalids[i] && (invalids[i] >= args->minInvalidCount || invalids[i] == args->channelsLen)) {                    \
+                if (args->kind == AverageKindCodes) {                                                                           \
+                    uint16_t max = 0;                                                                                           \
+                    int code = 0;                                                                                               \
+                    for (int c = 0; c < 10; c++) {                                                                              \
+                        if (codes[i][c] > max) {                                                                                \
+                            code = c;                                                                                           \
+                            max = codes[i][c];                                                                                  \
+                        }                                                                                                       \
+                    }                                                                                                           \
+                    dst[i] = (T)((TMIN) + code);                                                                                \
+                }                                                                                                               \
+                else {                                                                                                          \
+                    dst[i] = (T)(TMAX);                                                                                         \
+                }                                                                                                               \
+            }                                                                                                                   \
+            else {                                                                                                              \
+                int64_t count = args->channelsLen - invalids[i];                                                                \
+                int64_t sum = sums[i];                                                                                          \
+                dst[i] = (T)(sum >= 0 ? (sum + count / 2) / count : (sum - count / 2) / count);                                 \
+            }                                                                                                                   \
+        }                                                                                                                       \
+    }                                                                                                                           \
+}
+
+AVERAGE_ROWS_INT(averageRowsUInt8, uint8_t, 0, UINT8_MAX)
+AVERAGE_ROWS_INT(averageRowsUInt16, uint16_t, 0, UINT16_MAX)
+AVERAGE_ROWS_INT(averageRowsUInt32, uint32_t, 0, UINT32_MAX)
+AVERAGE_ROWS_INT(averageRowsSInt16, int16_t, INT16_MIN, INT16_MAX)
+AVERAGE_ROWS_INT(averageRowsSInt32, int32_t, INT32_MIN, INT32_MAX)
+
+
+// Float32: NaN is the only invalid value, for all kinds
+static void averageRowsFloat32(void *arg, int rowStart, int rowEnd) {
+    AverageArgs *args = (AverageArgs *)arg;
+    int xRes = args->result->xRes;
+    int end = rowEnd * xRes;
+    double sums[AVERAGE_BLOCK_LEN];
+    uint16_t invalids[AVERAGE_BLOCK_LEN];
+    for (int blockStart = rowStart * xRes; blockStart < end; blockStart += AVERAGE_BLOCK_LEN) {
+        int n = MTHmin(AVERAGE_BLOCK_LEN, end - blockStart);
+        memset(sums, 0, n * sizeof(double));
+        memset(invalids, 0, n * sizeof(uint16_t));
+        for (int chInd = 0; chInd < args->channelsLen; chInd++) {
+            const float *src = (const float *)args->channels[chInd]->data + blockStart;
+            for (int i = 0; i < n; i++) {
+                float v = src[i];
+                uint8_t invalid = v != v;
+                invalids[i] += invalid;
+                sums[i] += invalid ? 0 : v;
+            }
+        }
+        float *dst = (float *)args->result->data + blockStart;
+        for (int i = 0; i < n; i++) {
+            if (invalids[i] && (invalids[i] >= args->minInvalidCount || invalids[i] == args->channelsLen)) {
+                dst[i] = NAN;
+            }
+            else {
+                dst[i] = (float)(sums[i] / (args->channelsLen - invalids[i]));
+            }
+        }
+    }
+}
+
+
 BTA_Status BTA_CALLCONV BTAaverageChannels(BTA_Channel **channels, int channelsLen, float minValidPixelPercentage, BTA_Channel **result) {
-    if (!channels || channelsLen < 1 || !result || minValidPixelPercentage < 0 || minValidPixelPercentage > 100) {
+    if (!channels || channelsLen < 1 || channelsLen > UINT16_MAX || !result || minValidPixelPercentage < 0 || minValidPixelPercentage > 100) {
         return BTA_StatusInvalidParameter;
     }
     BTA_ChannelId id = channels[0]->id;
     uint16_t xRes = channels[0]->xRes;
     uint16_t yRes = channels[0]->yRes;
-    int res = (int)xRes * yRes;
     BTA_DataFormat dataFormat = channels[0]->dataFormat;
     BTA_Unit unit = channels[0]->unit;
     for (int chInd = 1; chInd < channelsLen; chInd++) {
@@ -62,396 +198,61 @@ BTA_Status BTA_CALLCONV BTAaverageChannels(BTA_Channel **channels, int channelsL
             return BTA_StatusInvalidData;
         }
     }
-    // Allocate for sums
-    double* sums = (double *)calloc(res, sizeof(double));
-    if (!sums) {
-        return BTA_StatusOutOfMemory;
+    if (id == BTA_ChannelIdColor) {
+        // No averaging, just clone the first channel (todo?)
+        return BTAcloneChannel(channels[0], result);
+    }
+    void (*averageRows)(void *arg, int rowStart, int rowEnd);
+    switch (dataFormat) {
+    case BTA_DataFormatUInt8:
+        averageRows = averageRowsUInt8;
+        break;
+    case BTA_DataFormatUInt16:
+    case BTA_DataFormatUInt16Mlx12U:
+    case BTA_DataFormatUInt16Mlx1C11U:
+        averageRows = averageRowsUInt16;
+        break;
+    case BTA_DataFormatSInt16:
+    case BTA_DataFormatSInt16Mlx12S:
+    case BTA_DataFormatSInt16Mlx1C11S:
+        averageRows = averageRowsSInt16;
+        break;
+    case BTA_DataFormatUInt32:
+        averageRows = averageRowsUInt32;
+        break;
+    case BTA_DataFormatSInt32:
+        averageRows = averageRowsSInt32;
+        break;
+    case BTA_DataFormatFloat32:
+        averageRows = averageRowsFloat32;
+        break;
+    default:
+        return BTA_StatusNotSupported;
     }
     // Allocate for result channel
     BTA_Status status = BTAcloneChannelEmpty(channels[0], result);
     if (status != BTA_StatusOk) {
-        free(sums);
         return status;
     }
-    // Allocate for invalid pixel statistics
-    uint16_t **invalidsCounts = 0;
-    if (id == BTA_ChannelIdDistance || id == BTA_ChannelIdZ || id == BTA_ChannelIdAmplitude || id == BTA_ChannelIdFlags) {
-        invalidsCounts = (uint16_t **)malloc(res * sizeof(uint16_t *));
-        if (!invalidsCounts) {
-            free(sums);
-            return BTA_StatusOutOfMemory;
-        }
-        for (int xy = 0; xy < res; xy++) {
-            invalidsCounts[xy] = (uint16_t *)calloc(11, sizeof(uint16_t));
-            if (!invalidsCounts[xy]) {
-                free(sums);
-                free(invalidsCounts);
-                return BTA_StatusOutOfMemory;
-            }
-        }
-    }
-    BTA_Channel* resultTemp = *result;
+    AverageArgs args;
+    args.channels = channels;
+    args.channelsLen = channelsLen;
+    args.result = *result;
+    args.minInvalidCount = channelsLen * minValidPixelPercentage / 100;
     switch (id) {
-
     case BTA_ChannelIdDistance:
     case BTA_ChannelIdZ:
-        switch (dataFormat) {
-
-        case BTA_DataFormatUInt8:
-            for (int chInd = 0; chInd < channelsLen; chInd++) {
-                for (int xy = 0; xy < res; xy++) {
-                    uint8_t v = ((uint8_t*)channels[chInd]->data)[xy];
-                    if (v < 10) {
-                        invalidsCounts[xy][v]++;
-                        invalidsCounts[xy][10]++;
-                    }
-                    else {
-                        sums[xy] += v;
-                    }
-                }
-            }
-            for (int xy = 0; xy < res; xy++) {
-                if (invalidsCounts[xy][10] >= channelsLen * minValidPixelPercentage / 100) {
-                    uint16_t max = 0;
-                    for (uint8_t i = 0; i < 10; i++) {
-                        if (invalidsCounts[xy][i] > max) {
-                            ((uint8_t*)resultTemp->data)[xy] = i;
-                            max = invalidsCounts[xy][i];
-                        }
-                    }
-                }
-                else {
-                    ((uint8_t*)resultTemp->data)[xy] = (uint8_t)MTHround(sums[xy] / (channelsLen - invalidsCounts[xy][10]));
-                }
-            }
-            break;
-        case BTA_DataFormatUInt16:
-        case BTA_DataFormatUInt16Mlx12U:
-        case BTA_DataFormatUInt16Mlx1C11U:
-            for (int chInd = 0; chInd < channelsLen; chInd++) {
-                for (int xy = 0; xy < res; xy++) {
-                    uint16_t v = ((uint16_t*)channels[chInd]->data)[xy];
-                    if (v < 10) {
-                        invalidsCounts[xy][v]++;
-                        invalidsCounts[xy][10]++;
-                    }
-                    else {
-                        sums[xy] += v;
-                    }
-                }
-            }
-            for (int xy = 0; xy < res; xy++) {
-                if (invalidsCounts[xy][10] >= channelsLen * minValidPixelPercentage / 100) {
-                    uint16_t max = 0;
-                    for (uint8_t i = 0; i < 10; i++) {
-                        if (invalidsCounts[xy][i] > max) {
-                            ((uint16_t*)resultTemp->data)[xy] = i;
-                            max = invalidsCounts[xy][i];
-                        }
-                    }
-                }
-                else {
-                    ((uint16_t*)resultTemp->data)[xy] = (uint16_t)MTHround(sums[xy] / (channelsLen - invalidsCounts[xy][10]));
-                }
-            }
-            break;
-        case BTA_DataFormatSInt16:
-        case BTA_DataFormatSInt16Mlx12S:
-        case BTA_DataFormatSInt16Mlx1C11S:
-            for (int chInd = 0; chInd < channelsLen; chInd++) {
-                for (int xy = 0; xy < res; xy++) {
-                    int16_t v = ((int16_t*)channels[chInd]->data)[xy];
-                    if (v < INT16_MIN + 10) {
-                        invalidsCounts[xy][v - INT16_MIN]++;
-                        invalidsCounts[xy][10]++;
-                    }
-                    else {
-                        sums[xy] += v;
-                    }
-                }
-            }
-            for (int xy = 0; xy < res; xy++) {
-                if (invalidsCounts[xy][10] >= channelsLen * minValidPixelPercentage / 100) {
-                    uint16_t max = 0;
-                    for (uint8_t i = 0; i < 10; i++) {
-                        if (invalidsCounts[xy][i] > max) {
-                            ((int16_t*)resultTemp->data)[xy] = i;
-                            max = invalidsCounts[xy][i];
-                        }
-                    }
-                }
-                else {
-                    ((int16_t*)resultTemp->data)[xy] = (int16_t)MTHround(sums[xy] / (channelsLen - invalidsCounts[xy][10]));
-                }
-            }
-            break;
-        case BTA_DataFormatUInt32:
-            for (int chInd = 0; chInd < channelsLen; chInd++) {
-                for (int xy = 0; xy < res; xy++) {
-                    uint32_t v = ((uint32_t*)channels[chInd]->data)[xy];
-                    if (v < 10) {
-                        invalidsCounts[xy][v]++;
-                        invalidsCounts[xy][10]++;
-                    }
-                    else {
-                        sums[xy] += v;
-                    }
-                }
-            }
-            for (int xy = 0; xy < res; xy++) {
-                if (invalidsCounts[xy][10] >= channelsLen * minValidPixelPercentage / 100) {
-                    uint16_t max = 0;
-                    for (uint8_t i = 0; i < 10; i++) {
-                        if (invalidsCounts[xy][i] > max) {
-                            ((uint32_t*)resultTemp->data)[xy] = i;
-                            max = invalidsCounts[xy][i];
-                        }
-                    }
-                }
-                else {
-                    ((uint32_t*)resultTemp->data)[xy] = (uint32_t)MTHround(sums[xy] / (channelsLen - invalidsCounts[xy][10]));
-                }
-            }
-            break;
-        case BTA_DataFormatSInt32:
-            for (int chInd = 0; chInd < channelsLen; chInd++) {
-                for (int xy = 0; xy < res; xy++) {
-                    int32_t v = ((int32_t*)channels[chInd]->data)[xy];
-                    if (v < INT32_MIN + 10) {
-                        invalidsCounts[xy][v - INT32_MIN]++;
-                        invalidsCounts[xy][10]++;
-                    }
-                    else {
-                        sums[xy] += v;
-                    }
-                }
-            }
-            for (int xy = 0; xy < res; xy++) {
-                if (invalidsCounts[xy][10] >= channelsLen * minValidPixelPercentage / 100) {
-                    uint16_t max = 0;
-                    for (uint8_t i = 0; i < 10; i++) {
-                        if (invalidsCounts[xy][i] > max) {
-                            ((int32_t*)resultTemp->data)[xy] = i;
-                            max = invalidsCounts[xy][i];
-                        }
-                    }
-                }
-                else {
-                    ((int32_t*)resultTemp->data)[xy] = (int32_t)MTHround(sums[xy] / (channelsLen - invalidsCounts[xy][10]));
-                }
-            }
-            break;
-        default:
-            BTAfreeChannel(result);
-            for (int xy = 0; xy < res; xy++) free(invalidsCounts[xy]);
-            free(invalidsCounts);
-            free(sums);
-            return BTA_StatusNotSupported;
-        }
+        args.kind = AverageKindCodes;
+        break;
+    case BTA_ChannelIdAmplitude:
+    case BTA_ChannelIdFlags:
+        args.kind = AverageKindMax;
+        break;
+    default:
+        args.kind = AverageKindPlain;
         break;
-
-        case BTA_ChannelIdAmplitude:
-        case BTA_ChannelIdFlags:
-            switch (dataFormat) {
-
-            case BTA_DataFormatUInt8:
-                for (int chInd = 0; chInd < channelsLen; chInd++) {
-                    for (int xy = 0; xy < res; xy++) {
-                        uint8_t v = ((uint8_t*)channels[chInd]->data)[xy];
-                        if (v == UINT8_MAX) {
-                            invalidsCounts[xy][10]++;
-                        }
-                        else {
-                            sums[xy] += v;
-                        }
-                    }
-                }
-                for (int xy = 0; xy < res; xy++) {
-                    if (invalidsCounts[xy][10] >= channelsLen * minValidPixelPercentage / 100) {
-                        ((uint8_t*)resultTemp->data)[xy] = UINT8_MAX;
-                    }
-                    else {
-                        ((uint8_t*)resultTemp->data)[xy] = (uint8_t)MTHround(sums[xy] / (channelsLen - invalidsCounts[xy][10]));
-                    }
-                }
-                break;
-            case BTA_DataFormatUInt16:
-            case BTA_DataFormatUInt16Mlx12U:
-            case BTA_DataFormatUInt16Mlx1C11U:
-                for (int chInd = 0; chInd < channelsLen; chInd++) {
-                    for (int xy = 0; xy < res; xy++) {
-                        uint16_t v = ((uint16_t*)channels[chInd]->data)[xy];
-                        if (v == UINT16_MAX) {
-                            invalidsCounts[xy][10]++;
-                        }
-                        else {
-                            sums[xy] += v;
-                        }
-                    }
-                }
-                for (int xy = 0; xy < res; xy++) {
-                    if (invalidsCounts[xy][10] >= channelsLen * minValidPixelPercentage / 100) {
-                        ((uint16_t*)resultTemp->data)[xy] = UINT16_MAX;
-                    }
-                    else {
-                        ((uint16_t*)resultTemp->data)[xy] = (uint16_t)MTHround(sums[xy] / (channelsLen - invalidsCounts[xy][10]));
-                    }
-                }
-                break;
-            case BTA_DataFormatSInt16:
-            case BTA_DataFormatSInt16Mlx12S:
-            case BTA_DataFormatSInt16Mlx1C11S:
-                for (int chInd = 0; chInd < channelsLen; chInd++) {
-                    for (int xy = 0; xy < res; xy++) {
-                        int16_t v = ((int16_t*)channels[chInd]->data)[xy];
-                        if (v == INT16_MAX) {
-                            invalidsCounts[xy][10]++;
-                        }
-                        else {
-                            sums[xy] += v;
-                        }
-                    }
-                }
-                for (int xy = 0; xy < res; xy++) {
-                    if (invalidsCounts[xy][10] >= channelsLen * minValidPixelPercentage / 100) {
-                        ((int16_t*)resultTemp->data)[xy] = INT16_MAX;
-                    }
-                    else {
-                        ((int16_t*)resultTemp->data)[xy] = (int16_t)MTHround(sums[xy] / (channelsLen - invalidsCounts[xy][10]));
-                    }
-                }
-                break;
-            case BTA_DataFormatUInt32:
-                for (int chInd = 0; chInd < channelsLen; chInd++) {
-                    for (int xy = 0; xy < res; xy++) {
-                        uint32_t v = ((uint32_t*)channels[chInd]->data)[xy];
-                        if (v == UINT32_MAX) {
-                            invalidsCounts[xy][10]++;
-                        }
-                        else {
-                            sums[xy] += v;
-                        }
-                    }
-                }
-                for (int xy = 0; xy < res; xy++) {
-                    if (invalidsCounts[xy][10] >= channelsLen * minValidPixelPercentage / 100) {
-                        ((uint32_t*)resultTemp->data)[xy] = UINT32_MAX;
-                    }
-                    else {
-                        ((uint32_t*)resultTemp->data)[xy] = (uint32_t)MTHround(sums[xy] / (channelsLen - invalidsCounts[xy][10]));
-                    }
-                }
-                break;
-            case BTA_DataFormatSInt32:
-                for (int chInd = 0; chInd < channelsLen; chInd++) {
-                    for (int xy = 0; xy < res; xy++) {
-                        int32_t v = ((int32_t*)channels[chInd]->data)[xy];
-                        if (v == INT32_MAX) {
-                            invalidsCounts[xy][10]++;
-                        }
-                        else {
-                            sums[xy] += v;
-                        }
-                    }
-                }
-                for (int xy = 0; xy < res; xy++) {
-                    if (invalidsCounts[xy][10] >= channelsLen * minValidPixelPercentage / 100) {
-                        ((int32_t*)resultTemp->data)[xy] = INT32_MAX;
-                    }
-                    else {
-                        ((int32_t*)resultTemp->data)[xy] = (int32_t)MTHround(sums[xy] / (channelsLen - invalidsCounts[xy][10]));
-                    }
-                }
-                break;
-            default:
-                BTAfreeChannel(result);
-                for (int xy = 0; xy < res; xy++) free(invalidsCounts[xy]);
-                free(invalidsCounts);
-                free(sums);
-                return BTA_StatusNotSupported;
-            }
-            break;
-
-        case BTA_ChannelIdColor:
-            // No averaging, just clone the first channel (todo?)
-            BTAfreeChannel(result);
-            status = BTAcloneChannel(channels[0], result);
-            if (status != BTA_StatusOk) {
-                free(sums);
-                return status;
-            }
-            break;
-
-        default:
-            switch (dataFormat) {
-
-            case BTA_DataFormatUInt8:
-                for (int chInd = 0; chInd < channelsLen; chInd++) {
-                    for (int xy = 0; xy < res; xy++) {
-                        sums[xy] += ((uint8_t*)channels[chInd]->data)[xy];
-                    }
-                }
-                for (int xy = 0; xy < res; xy++) {
-                    ((uint8_t*)resultTemp->data)[xy] = (uint8_t)MTHround(sums[xy] / channelsLen);
-                }
-                break;
-            case BTA_DataFormatUInt16:
-            case BTA_DataFormatUInt16Mlx12U:
-            case BTA_DataFormatUInt16Mlx1C11U:
-                for (int chInd = 0; chInd < channelsLen; chInd++) {
-                    for (int xy = 0; xy < res; xy++) {
-                        sums[xy] += ((uint16_t*)channels[chInd]->data)[xy];
-                    }
-                }
-                for (int xy = 0; xy < res; xy++) {
-                    ((uint16_t*)resultTemp->data)[xy] = (uint16_t)MTHround(sums[xy] / channelsLen);
-                }
-                break;
-            case BTA_DataFormatSInt16:
-            case BTA_DataFormatSInt16Mlx12S:
-            case BTA_DataFormatSInt16Mlx1C11S:
-                for (int chInd = 0; chInd < channelsLen; chInd++) {
-                    for (int xy = 0; xy < res; xy++) {
-                        sums[xy] += ((int16_t*)channels[chInd]->data)[xy];
-                    }
-                }
-                for (int xy = 0; xy < res; xy++) {
-                    ((int16_t*)resultTemp->data)[xy] = (int16_t)MTHround(sums[xy] / channelsLen);
-                }
-                break;
-            case BTA_DataFormatUInt32:
-                for (int chInd = 0; chInd < channelsLen; chInd++) {
-                    for (int xy = 0; xy < res; xy++) {
-                        sums[xy] += ((uint32_t*)channels[chInd]->data)[xy];
-                    }
-                }
-                for (int xy = 0; xy < res; xy++) {
-                    ((uint32_t*)resultTemp->data)[xy] = (uint32_t)MTHround(sums[xy] / channelsLen);
-                }
-                break;
-            case BTA_DataFormatSInt32:
-                for (int chInd = 0; chInd < channelsLen; chInd++) {
-                    for (int xy = 0; xy < res; xy++) {
-                        sums[xy] += ((int32_t*)channels[chInd]->data)[xy];
-                    }
-                }
-                for (int xy = 0; xy < res; xy++) {
-                    ((int32_t*)resultTemp->data)[xy] = (int32_t)MTHround(sums[xy] / channelsLen);
-                }
-                break;
-            default:
-                BTAfreeChannel(result);
-                for (int xy = 0; xy < res; xy++) free(invalidsCounts[xy]);
-                free(invalidsCounts);
-                free(sums);
-                return BTA_StatusNotSupported;
-            }
-    }
-    if (id == BTA_ChannelIdDistance || id == BTA_ChannelIdZ || id == BTA_ChannelIdAmplitude || id == BTA_ChannelIdFlags) {
-        for (int xy = 0; xy < res; xy++) free(invalidsCounts[xy]);
-        free(invalidsCounts);
     }
-    free(sums);
+    BTAparallelFor(yRes, MTHmax(1, AVERAGE_PARALLEL_MIN / MTHmax(1, xRes)), averageRows, &args);
     return BTA_StatusOk;
 }
 
@@ -565,11 +366,106 @@ BTA_Status BTA_CALLCONV BTAcalcXYZ(BTA_Frame *frame, BTA_LensVectors **lensVecto
 }
 
 
-BTA_Status BTA_CALLCONV BTAcalcMonochromeFromAmplitude(BTA_Frame *frame) {
+#define MONO_HISTOGRAM_SHIFT    6
+#define MONO_HISTOGRAM_LEN      (1 << (16 - MONO_HISTOGRAM_SHIFT))
+
+
+// One pass over the amplitudes: the range to stretch to [0, 255]. For percentile > 0 the lowest and highest percentile percent of the pixels
+// are excluded, found with a histogram of 1024 bins (a bin is 64 amplitudes wide)
+static void getMonochromeRange(const uint16_t *dataAmp, int pxCount, float percentile, uint16_t *low, uint16_t *high) {
+    uint16_t ampMin = UINT16_MAX;
+    uint16_t ampMax = 0;
+    if (percentile <= 0) {
+        for (int xy = 0; xy < pxCount; xy++) {
+            ampMin = dataAmp[xy] < ampMin ? dataAmp[xy] : ampMin;
+            ampMax = dataAmp[xy] > ampMax ? dataAmp[xy] : ampMax;
+        }
+        *low = ampMin;
+        *high = ampMax;
+        return;
+    }
+    uint32_t histogram[MONO_HISTOGRAM_LEN] = { 0 };
+    for (int xy = 0; xy < pxCount; xy++) {
+        uint16_t amp = dataAmp[xy];
+        ampMin = amp < ampMin ? amp : ampMin;
+        ampMax = amp > ampMax ? amp : ampMax;
+        histogram[amp >> MONO_HISTOGRAM_SHIFT]++;
+    }
+    uint32_t countOutside = (uint32_t)(pxCount * percentile / 100);
+    uint32_t count = 0;
+    int binLow = 0;
+    while (binLow < MONO_HISTOGRAM_LEN - 1 && count + histogram[binLow] <= countOutside) {
+        count += histogram[binLow++];
+    }
+    count = 0;
+    int binHigh = MONO_HISTOGRAM_LEN - 1;
+    while (binHigh > binLow && count + histogram[binHigh] <= countOutside) {
+        count += histogram[binHigh--];
+    }
+    uint32_t percentileLow = (uint32_t)binLow << MONO_HISTOGRAM_SHIFT;
+    uint32_t percentileHigh = ((uint32_t)binHigh << MONO_HISTOGRAM_SHIFT) | ((1 << MONO_HISTOGRAM_SHIFT) - 1);
+    *low = (uint16_t)MTHmax(percentileLow, (uint32_t)ampMin);
+    *high = (uint16_t)MTHmin(percentileHigh, (uint32_t)ampMax);
+}
+
+
+// Stretches [low, high] to [0, 255], pixels outside are clamped. Multiplies by the reciprocal in 16.16 fixed point instead of dividing per pixel,
+// the loop is branch free so that the compiler can vectorize it. A flat image (high <= low) yields 0
+static void amplitudeToMonochrome(const uint16_t *dataAmp, uint8_t *dataMono, int pxCount, uint16_t low, uint16_t high) {
+    if (high <= low) {
+        memset(dataMono, 0, pxCount);
+        return;
+    }
+    // (amp - low) <= range, so the product is at most 255 << 16 and fits into 32 bits
+    uint32_t range = high - low;
+    uint32_t factor = ((255u << 16) + range - 1) / range;
+    for (int xy = 0; xy < pxCount; xy++) {
+        uint32_t amp = dataAmp[xy];
+        amp = amp < low ? low : amp;
+        amp = amp > high ? high : amp;
+        uint32_t mono = ((amp - low) * factor) >> 16;
+        dataMono[xy] = (uint8_t)(mono > 255 ? 255 : mono);
+    }
+}
+
+
+BTA_Status BTA_CALLCONV BTAcalcDistancesFromPhases(BTA_Frame *frame, float minAmplitude) {
+    if (!frame || minAmplitude < 0) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (BTAisFrameShared(frame)) {
+        return BTA_StatusIllegalOperation;
+    }
+    BTAmaterializeFrame(frame);
+    return BTArawPhasesApply(frame, minAmplitude);
+}
+
+
+BTA_Status BTA_CALLCONV BTAunwrapDistances(BTA_Frame *frame) {
     if (!frame) {
         return BTA_StatusInvalidParameter;
     }
-    for (int chInd = 0; chInd < frame->channelsLen; chInd++) {
+    if (BTAisFrameShared(frame)) {
+        // The pair's first channel is overwritten in place
+        return BTA_StatusIllegalOperation;
+    }
+    BTAmaterializeFrame(frame);
+    return BTAphaseUnwrappingApply(frame);
+}
+
+
+BTA_Status BTA_CALLCONV BTAcalcMonochromeFromAmplitude(BTA_Frame *frame) {
+    return BTAcalcMonochromeFromAmplitudeEx(frame, 0);
+}
+
+
+BTA_Status BTA_CALLCONV BTAcalcMonochromeFromAmplitudeEx(BTA_Frame *frame, float percentile) {
+    if (!frame || percentile < 0 || percentile >= 50) {
+        return BTA_StatusInvalidParameter;
+    }
+    // Only the amplitude channels present now, not the ones added below
+    int channelsLen = frame->channelsLen;
+    for (int chInd = 0; chInd < channelsLen; chInd++) {
         BTA_Channel *channel = frame->channels[chInd];
         if (channel->id != BTA_ChannelIdAmplitude || channel->xRes == 0 || channel->yRes == 0) {
             continue;
@@ -577,22 +473,14 @@ BTA_Status BTA_CALLCONV BTAcalcMonochromeFromAmplitude(BTA_Frame *frame) {
         if (channel->dataFormat == BTA_DataFormatUInt16) {
             int pxCount = channel->xRes * channel->yRes;
             uint16_t *dataAmp = (uint16_t *)channel->data;
+            // The frame takes ownership, so this can't come from a pool
             uint8_t *dataMono = (uint8_t *)malloc(pxCount * sizeof(uint8_t));
             if (!dataMono) {
                 return BTA_StatusOutOfMemory;
             }
-            uint16_t ampMin = UINT16_MAX;
-            uint16_t ampMax = 0;
-            for (int xy = 0; xy < pxCount; xy++) {
-                ampMin = *dataAmp < ampMin ? *dataAmp : ampMin;
-                ampMax = *dataAmp > ampMax ? *dataAmp : ampMax;
-                dataAmp++;
-            }
-            dataAmp = (uint16_t *)channel->data;
-            uint8_t *data = dataMono;
-            for (int xy = 0; xy < pxCount; xy++) {
-                *data++ = (uint8_t)((*dataAmp++ - ampMin) * 255 / (ampMax - ampMin));
-            }
+            uint16_t low, high;
+            getMonochromeRange(dataAmp, pxCount, percentile, &low, &high);
+            amplitudeToMonochrome(dataAmp, dataMono, pxCount, low, high);
             BTA_Status status = BTAinsertChannelIntoFrame2(frame, BTA_ChannelIdColor, channel->xRes, channel->yRes, BTA_DataFormatUInt8, BTA_UnitUnitLess, 0, 0, dataMono, pxCount * sizeof(uint8_t),
                                                            0, 0, channel->lensIndex, channel->flags, channel->sequenceCounter, channel->gain);
             if (status != BTA_StatusOk) {
@@ -609,3 +497,347 @@ BTA_Status BTA_CALLCONV BTAcalcMonochromeFromAmplitude(BTA_Frame *frame) {
 }
 
 
+
+
+// ------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Planar view
+
+
+// Below this many points per thread, the threads' partial grids cost more than they save
+#define PLANAR_VIEW_PARALLEL_MIN    16384
+
+
+// Accumulates points: z and amp hold the chosen point (nearest / max) or the sums (mean)
+typedef struct PlanarViewGrid {
+    double *z;
+    double *amp;
+    uint32_t *counts;
+} PlanarViewGrid;
+
+
+typedef struct PlanarViewArgs {
+    const void *x;
+    const void *y;
+    const void *z;
+    int stride;                     // 1: planar coordinates, 3: interleaved
+    BTA_DataFormat dataFormat;
+    const uint16_t *amp;            // optional
+    int count;
+    int xRes;
+    int yRes;
+    float cellsPerUnit;
+    BTA_PlanarViewAggregation aggregation;
+    PlanarViewGrid grid;            // the result, partial grids are merged into it under mutex
+    void *mutex;
+} PlanarViewArgs;
+
+
+static BTA_Status planarViewGridAlloc(PlanarViewGrid *grid, int cellsCount) {
+    // One allocation, the doubles first for alignment
+    uint8_t *data = (uint8_t *)calloc(cellsCount, 2 * sizeof(double) + sizeof(uint32_t));
+    if (!data) {
+        return BTA_StatusOutOfMemory;
+    }
+    grid->z = (double *)data;
+    grid->amp = grid->z + cellsCount;
+    grid->counts = (uint32_t *)(grid->amp + cellsCount);
+    return BTA_StatusOk;
+}
+
+
+static inline void planarViewAccumulate(PlanarViewGrid *grid, int cell, double z, double amp, BTA_PlanarViewAggregation aggregation) {
+    switch (aggregation) {
+    case BTA_PlanarViewAggregationNearestZ:
+        if (!grid->counts[cell] || z < grid->z[cell]) {
+            grid->z[cell] = z;
+            grid->amp[cell] = amp;
+        }
+        break;
+    case BTA_PlanarViewAggregationMaxZ:
+        if (!grid->counts[cell] || z > grid->z[cell]) {
+            grid->z[cell] = z;
+            grid->amp[cell] = amp;
+        }
+        break;
+    case BTA_PlanarViewAggregationMean:
+        grid->z[cell] += z;
+        grid->amp[cell] += amp;
+        break;
+    default:
+        break;
+    }
+}
+
+
+// Scatters the points [start, end) into grid. The float comparison for the cell position also rejects NaN
+#define PLANAR_VIEW_SCATTER(name, T, IS_VALID_Z)                                                                                \
+static void name(const PlanarViewArgs *args, int start, int end, PlanarViewGrid *grid) {                                        \
+    const T *x = (const T *)args->x;                                                                                            \
+    const T *y = (const T *)args->y;                                                                                            \
+    const T *z = (const T *)args->z;                                                                                            \
+    int stride = args->stride;                                                                                                  \
+    float xHalf = (float)(args->xRes / 2);                                                                                      \
+    float yHalf = (float)(args->yRes / 2);                                                                                      \
+    for (int i = start; i < end; i++) {                                                                                         \
+        T zi = z[i * stride];                                                                                                   \
+        if (!(IS_VALID_Z(zi))) {                                                                                                \
+            continue;                                                                                                           \
+        }                                                                                                                       \
+        float cx = x[i * stride] * args->cellsPerUnit + xHalf;                                                                  \
+        float cy = y[i * stride] * args->cellsPerUnit + yHalf;                                                                  \
+        if (!(cx >= 0 && cx < args->xRes && cy >= 0 && cy < args->yRes)) {                                                     \
+            continue;                                                                                                           \
+        }                                                                                                                       \
+        int cell = (int)cy * args->xRes + (int)cx;                                                                              \
+        planarViewAccumulate(grid, cell, zi, args->amp ? args->amp[i] : 0, args->aggregation);                                  \
+        grid->counts[cell]++;                                                                                                   \
+    }                                                                                                                           \
+}
+
+
+// calcXYZ marks invalid SInt16 points with z in [INT16_MIN, INT16_MIN + 9], invalid Float32 points with NaN
+#define PLANAR_VIEW_VALID_SINT16(z)     ((z) > INT16_MIN + 9)
+#define PLANAR_VIEW_VALID_FLOAT32(z)    ((z) == (z))
+
+PLANAR_VIEW_SCATTER(planarViewScatterSInt16, int16_t, PLANAR_VIEW_VALID_SINT16)
+PLANAR_VIEW_SCATTER(planarViewScatterFloat32, float, PLANAR_VIEW_VALID_FLOAT32)
+
+
+static void planarViewScatter(const PlanarViewArgs *args, int start, int end, PlanarViewGrid *grid) {
+    if (args->dataFormat == BTA_DataFormatSInt16) {
+        planarViewScatterSInt16(args, start, end, grid);
+    }
+    else {
+        planarViewScatterFloat32(args, start, end, grid);
+    }
+}
+
+
+static void planarViewMerge(PlanarViewGrid *grid, const PlanarViewGrid *partial, int cellsCount, BTA_PlanarViewAggregation aggregation) {
+    for (int cell = 0; cell < cellsCount; cell++) {
+        if (!partial->counts[cell]) {
+            continue;
+        }
+        if (aggregation == BTA_PlanarViewAggregationMean) {
+            grid->z[cell] += partial->z[cell];
+            grid->amp[cell] += partial->amp[cell];
+        }
+        else if (aggregation != BTA_PlanarViewAggregationCount) {
+            planarViewAccumulate(grid, cell, partial->z[cell], partial->amp[cell], aggregation);
+        }
+        grid->counts[cell] += partial->counts[cell];
+    }
+}
+
+
+// A chunk of points goes into a partial grid of its own, which is then merged into the result. If all points are in one chunk, or there is no memory
+// for a partial grid, the chunk is scattered into the result directly
+static void planarViewRun(void *arg, int start, int end) {
+    PlanarViewArgs *args = (PlanarViewArgs *)arg;
+    int cellsCount = args->xRes * args->yRes;
+    PlanarViewGrid partial;
+    if (start == 0 && end == args->count) {
+        planarViewScatter(args, start, end, &args->grid);
+        return;
+    }
+    if (planarViewGridAlloc(&partial, cellsCount) != BTA_StatusOk) {
+        BTAlockMutex(args->mutex);
+        planarViewScatter(args, start, end, &args->grid);
+        BTAunlockMutex(args->mutex);
+        return;
+    }
+    planarViewScatter(args, start, end, &partial);
+    BTAlockMutex(args->mutex);
+    planarViewMerge(&args->grid, &partial, cellsCount, args->aggregation);
+    BTAunlockMutex(args->mutex);
+    free(partial.z);
+}
+
+
+// Projects the points described by args (without grid and mutex) into the output arrays, each of them xRes * yRes long
+static BTA_Status planarViewProject(PlanarViewArgs *args, float *z, uint16_t *amplitudes, uint32_t *counts) {
+    int cellsCount = args->xRes * args->yRes;
+    BTA_Status status = planarViewGridAlloc(&args->grid, cellsCount);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    status = BTAinitMutex(&args->mutex);
+    if (status != BTA_StatusOk) {
+        free(args->grid.z);
+        return status;
+    }
+    // Each chunk merges a whole grid, so a chunk should have at least as many points as the grid has cells
+    BTAparallelFor(args->count, MTHmax(PLANAR_VIEW_PARALLEL_MIN, cellsCount), planarViewRun, args);
+    BTAcloseMutex(args->mutex);
+    args->mutex = 0;
+
+    PlanarViewGrid *grid = &args->grid;
+    for (int cell = 0; cell < cellsCount; cell++) {
+        uint32_t count = grid->counts[cell];
+        counts[cell] = count;
+        if (!count || args->aggregation == BTA_PlanarViewAggregationCount) {
+            z[cell] = NAN;
+            amplitudes[cell] = 0;
+        }
+        else if (args->aggregation == BTA_PlanarViewAggregationMean) {
+            z[cell] = (float)(grid->z[cell] / count);
+            amplitudes[cell] = (uint16_t)(grid->amp[cell] / count + 0.5);
+        }
+        else {
+            z[cell] = (float)grid->z[cell];
+            amplitudes[cell] = (uint16_t)grid->amp[cell];
+        }
+    }
+    free(args->grid.z);
+    return BTA_StatusOk;
+}
+
+
+static BTA_Channel *findChannel(BTA_Frame *frame, BTA_ChannelId id, uint8_t lensIndex, uint16_t xRes, uint16_t yRes) {
+    for (int chInd = 0; chInd < frame->channelsLen; chInd++) {
+        BTA_Channel *channel = frame->channels[chInd];
+        if (channel->id == id && channel->lensIndex == lensIndex && channel->xRes == xRes && channel->yRes == yRes && channel->data) {
+            return channel;
+        }
+    }
+    return 0;
+}
+
+
+// Finds the coordinates in frame, interleaved or planar, and the matching amplitudes
+static BTA_Status planarViewFindInput(BTA_Frame *frame, PlanarViewArgs *args) {
+    for (int chInd = 0; chInd < frame->channelsLen; chInd++) {
+        BTA_Channel *channel = frame->channels[chInd];
+        if ((channel->id != BTA_ChannelIdXYZ && channel->id != BTA_ChannelIdZ) || !channel->data ||
+            (channel->dataFormat != BTA_DataFormatSInt16 && channel->dataFormat != BTA_DataFormatFloat32)) {
+            continue;
+        }
+        int pxCount = channel->xRes * channel->yRes;
+        uint32_t bytesPerCoord = channel->dataFormat & 0xf;
+        if (channel->id == BTA_ChannelIdXYZ) {
+            if (channel->dataLen != 3 * pxCount * bytesPerCoord) {
+                continue;
+            }
+            args->x = channel->data;
+            args->y = channel->data + bytesPerCoord;
+            args->z = channel->data + 2 * bytesPerCoord;
+            args->stride = 3;
+        }
+        else {
+            BTA_Channel *channelX = findChannel(frame, BTA_ChannelIdX, channel->lensIndex, channel->xRes, channel->yRes);
+            BTA_Channel *channelY = findChannel(frame, BTA_ChannelIdY, channel->lensIndex, channel->xRes, channel->yRes);
+            if (!channelX || !channelY || channelX->dataFormat != channel->dataFormat || channelY->dataFormat != channel->dataFormat ||
+                channel->dataLen != pxCount * bytesPerCoord || channelX->dataLen != channel->dataLen || channelY->dataLen != channel->dataLen) {
+                continue;
+            }
+            args->x = channelX->data;
+            args->y = channelY->data;
+            args->z = channel->data;
+            args->stride = 1;
+        }
+        args->dataFormat = channel->dataFormat;
+        args->count = pxCount;
+        BTA_Channel *channelAmp = findChannel(frame, BTA_ChannelIdAmplitude, channel->lensIndex, channel->xRes, channel->yRes);
+        args->amp = channelAmp && channelAmp->dataFormat == BTA_DataFormatUInt16 ? (uint16_t *)channelAmp->data : 0;
+        return BTA_StatusOk;
+    }
+    return BTA_StatusInvalidData;
+}
+
+
+BTA_Status BTA_CALLCONV BTAprojectPlanarView(BTA_Frame *frame, const BTA_PlanarViewConfig *config, BTA_PlanarView **planarView) {
+    if (!frame || !config || !planarView || !config->xRes || !config->yRes || !(config->cellSize > 0) ||
+        config->aggregation < BTA_PlanarViewAggregationNearestZ || config->aggregation > BTA_PlanarViewAggregationCount) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (*planarView && ((*planarView)->xRes != config->xRes || (*planarView)->yRes != config->yRes)) {
+        return BTA_StatusInvalidParameter;
+    }
+    BTAmaterializeFrame(frame);
+    PlanarViewArgs args = { 0 };
+    BTA_Status status = planarViewFindInput(frame, &args);
+    if (status != BTA_StatusOk) {
+        return status;
+    }
+    args.xRes = config->xRes;
+    args.yRes = config->yRes;
+    args.cellsPerUnit = 1.0f / config->cellSize;
+    args.aggregation = config->aggregation;
+
+    BTA_PlanarView *pv = *planarView;
+    if (!pv) {
+        int cellsCount = config->xRes * config->yRes;
+        pv = (BTA_PlanarView *)calloc(1, sizeof(BTA_PlanarView));
+        if (!pv) {
+            return BTA_StatusOutOfMemory;
+        }
+        pv->xRes = config->xRes;
+        pv->yRes = config->yRes;
+        pv->z = (float *)malloc(cellsCount * sizeof(float));
+        pv->amplitudes = (uint16_t *)malloc(cellsCount * sizeof(uint16_t));
+        pv->counts = (uint32_t *)malloc(cellsCount * sizeof(uint32_t));
+        if (!pv->z || !pv->amplitudes || !pv->counts) {
+            BTAfreePlanarView(&pv);
+            return BTA_StatusOutOfMemory;
+        }
+    }
+    status = planarViewProject(&args, pv->z, pv->amplitudes, pv->counts);
+    if (status != BTA_StatusOk) {
+        if (!*planarView) {
+            BTAfreePlanarView(&pv);
+        }
+        return status;
+    }
+    *planarView = pv;
+    return BTA_StatusOk;
+}
+
+
+BTA_Status BTA_CALLCONV BTAfreePlanarView(BTA_PlanarView **planarView) {
+    if (!planarView) {
+        return BTA_StatusInvalidParameter;
+    }
+    if (*planarView) {
+        free((*planarView)->z);
+        free((*planarView)->amplitudes);
+        free((*planarView)->counts);
+        free(*planarView);
+        *planarView = 0;
+    }
+    return BTA_StatusOk;
+}
+
+
+void BTA_CALLCONV BTAgeneratePlanarView(int16_t *chX, int16_t *chY, int16_t *chZ, uint16_t *chAmp, int resX, int resY, int planarViewResX, int planarViewResY, float planarViewScale, int16_t *planarViewZ, uint16_t *planarViewAmp) {
+    if (!chX || !chY || !chZ || !planarViewZ || !planarViewAmp || resX <= 0 || resY <= 0 || planarViewResX <= 0 || planarViewResY <= 0 || !(planarViewScale > 0)) {
+        return;
+    }
+    int cellsCount = planarViewResX * planarViewResY;
+    float *z = (float *)malloc(cellsCount * sizeof(float));
+    uint16_t *amplitudes = (uint16_t *)malloc(cellsCount * sizeof(uint16_t));
+    uint32_t *counts = (uint32_t *)malloc(cellsCount * sizeof(uint32_t));
+    PlanarViewArgs args = { 0 };
+    args.x = chX;
+    args.y = chY;
+    args.z = chZ;
+    args.stride = 1;
+    args.dataFormat = BTA_DataFormatSInt16;
+    args.amp = chAmp;
+    args.count = resX * resY;
+    args.xRes = planarViewResX;
+    args.yRes = planarViewResY;
+    // planarViewScale is in centimeters per cell
+    args.cellsPerUnit = 1.0f / (planarViewScale * 10);
+    args.aggregation = BTA_PlanarViewAggregationNearestZ;
+    if (z && amplitudes && counts && planarViewProject(&args, z, amplitudes, counts) == BTA_StatusOk) {
+        for (int cell = 0; cell < cellsCount; cell++) {
+            if (counts[cell]) {
+                planarViewZ[cell] = (int16_t)z[cell];
+                planarViewAmp[cell] = amplitudes[cell];
+            }
+        }
+    }
+    free(z);
+    free(amplitudes);
+    free(counts);
+}
@@ -39,6 +39,7 @@ static void *bufferRunFunction(void *handle);
 static void *streamRunFunction(void *handle);
 static BTA_Status getFrameFromFile(BTA_WrapperInst *winst, int32_t index, BTA_Frame **frame);
 static BTA_Status freeFrameAndIndex(FrameAndIndex **frameAndIndex);
+static void notifyStateChanged(BTA_StreamLibInst *inst);
 ////////////////////////////////////////////////////////////////////////////////
 
 
@@ -80,7 +81,17 @@ BTA_Status BTASTREAMopen(BTA_Config *config, BTA_WrapperInst *winst) {
 
     BTA_Status status;
 
-    status = BVQinit(frameQueueInternalLength, BTA_QueueModeAvoidDrop, (FN_FreeItem)&freeFrameAndIndex, &inst->frameAndIndexQueueInst);
+    status = BTAinitMutex(&inst->stateMutex);
+    if (status == BTA_StatusOk) {
+        status = BTAinitCondition(&inst->condStateChanged);
+    }
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAopen stream: Not able to init stateMutex or condStateChanged");
+        BTASTREAMclose(winst);
+        return status;
+    }
+
+    status = BVQinit(frameQueueInternalLength, BTA_QueueModeAvoidDrop, (FN_FreeItem)&freeFrameAndIndex, 0, &inst->frameAndIndexQueueInst);
     if (status != BTA_StatusOk) {
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAopen stream: Not able to init internal frame queue");
         BTASTREAMclose(winst);
@@ -224,10 +235,19 @@ BTA_Status BTASTREAMclose(BTA_WrapperInst *winst) {
         return BTA_StatusInvalidParameter;
     }
     inst->closing = 1;
+    if (inst->stateMutex) {
+        notifyStateChanged(inst);
+    }
     BTA_Status status = BTAjoinThread(inst->parseThread);
     if (status != BTA_StatusOk) {
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAclose stream: Failed to join parseThread");
     }
+    if (inst->condStateChanged) {
+        BTAcloseCondition(inst->condStateChanged);
+    }
+    if (inst->stateMutex) {
+        BTAcloseMutex(inst->stateMutex);
+    }
     BTAfLargeClose(inst->file);
     free(inst->inputFilename);
     inst->inputFilename = 0;
@@ -790,8 +810,13 @@ static void *streamRunFunction(void *handle) {
                 return 0;
             }
             if (!frameAndIndexQueueCount) {
-                // allow buffer to fill a bit if the queue has to be filled from scratch
-                BTAmsleep(250);
+                // allow buffer to fill a bit if the queue has to be filled from scratch (unless playback is stopped meanwhile)
+                float autoPlaybackSpeed = inst->autoPlaybackSpeed;
+                BTAlockMutex(inst->stateMutex);
+                if (inst->autoPlaybackSpeed == autoPlaybackSpeed && !inst->closing) {
+                    BTAwaitConditionTimed(inst->condStateChanged, inst->stateMutex, 250);
+                }
+                BTAunlockMutex(inst->stateMutex);
             }
 
             //BTAinfoEventHelper(winst->infoEventInst, IMPORTANCE_INFO, BTA_EventIdInformation, "StreamThread: Stream starts");
@@ -806,7 +831,7 @@ static void *streamRunFunction(void *handle) {
                         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "Stream: End of stream reached");
                     }
                     if (status == BTA_StatusTimeOut) {
-                        BTAmsleep(5);
+                        // The peek itself waited
                         continue;
                     }
                     // error
@@ -831,30 +856,39 @@ static void *streamRunFunction(void *handle) {
                 if (timestampDiff > 30*60*1000) {
                     timestampDiff = 1;
                 }
-                // The frames timestamp implies the framerate. calc waiting time and wait
+                // The frames timestamp implies the framerate. calc waiting time and wait. A change of speed or closing ends the wait early
                 while (inst->autoPlaybackSpeed != 0 && !inst->closing) {
-                    BTAmsleep(1);
-                    float autoPlaybackSpeed = inst->autoPlaybackSpeed > 0 ? inst->autoPlaybackSpeed : -inst->autoPlaybackSpeed;
+                    float autoPlaybackSpeedSigned = inst->autoPlaybackSpeed;
+                    float autoPlaybackSpeed = autoPlaybackSpeedSigned > 0 ? autoPlaybackSpeedSigned : -autoPlaybackSpeedSigned;
                     if (autoPlaybackSpeed == 0) {
                         break;
                     }
                     uint64_t timeTrigger = timeTriggerPrev + (uint64_t)(timestampDiff / autoPlaybackSpeed);
-                    if (BTAgetTickCount64() >= timeTrigger) {
-                        BVQdequeue(inst->frameAndIndexQueueInst, 0, 0);
-                        BTApostprocessGrabCallbackEnqueue(winst, frameAndIndex->frame);
-                        inst->frameIndex = frameAndIndex->index;
-                        // Frame is still in use, only free struct:
-                        free(frameAndIndex);
-                        timeTriggerPrev = timeTrigger;
-                        timestampPrev = timeStamp;
-                        break;
+                    uint64_t now = BTAgetTickCount64();
+                    if (now < timeTrigger) {
+                        uint64_t msecsToWait = timeTrigger - now;
+                        BTAlockMutex(inst->stateMutex);
+                        if (inst->autoPlaybackSpeed == autoPlaybackSpeedSigned && !inst->closing) {
+                            BTAwaitConditionTimed(inst->condStateChanged, inst->stateMutex, msecsToWait > INT32_MAX ? INT32_MAX : (int)msecsToWait);
+                        }
+                        BTAunlockMutex(inst->stateMutex);
+                        continue;
                     }
+                    BVQdequeue(inst->frameAndIndexQueueInst, 0, 0);
+                    BTApostprocessGrabCallbackEnqueue(winst, frameAndIndex->frame);
+                    inst->frameIndex = frameAndIndex->index;
+                    // Frame is still in use, only free struct:
+                    free(frameAndIndex);
+                    timeTriggerPrev = timeTrigger;
+                    timestampPrev = timeStamp;
+                    break;
                 }
             }
             // stop the bufferThread
             inst->abortBufferThread = 1;
             status = BTAjoinThread(inst->bufferThread);
             inst->bufferThread = 0;
+            notifyStateChanged(inst);
             if (status != BTA_StatusOk) {
                 BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "Stream: RunFunction failed to join bufferThread");
             }
@@ -862,7 +896,12 @@ static void *streamRunFunction(void *handle) {
 
         while (inst->autoPlaybackSpeed == 0 && !inst->closing) {
             if (inst->frameIndexToSeek < 0) {
-                BTAmsleep(22);
+                // Idle until playback is started, a seek requested or the stream closed
+                BTAlockMutex(inst->stateMutex);
+                while (inst->autoPlaybackSpeed == 0 && inst->frameIndexToSeek < 0 && !inst->closing) {
+                    BTAwaitConditionTimed(inst->condStateChanged, inst->stateMutex, 0);
+                }
+                BTAunlockMutex(inst->stateMutex);
                 continue;
             }
             BVQclear(inst->frameAndIndexQueueInst);
@@ -871,17 +910,37 @@ static void *streamRunFunction(void *handle) {
             if (status != BTA_StatusOk) {
                 BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "Stream: getFrameFromFile failed %d", inst->frameIndexToSeek);
                 inst->frameIndexToSeek = -1;
+                notifyStateChanged(inst);
                 continue;
             }
             BTApostprocessGrabCallbackEnqueue(winst, frame);
             inst->frameIndex = inst->frameIndexToSeek;
             inst->frameIndexToSeek = -1;
+            notifyStateChanged(inst);
         }
     }
     return 0;
 }
 
 
+// The writer changes the state, then broadcasts with stateMutex locked. Waiters check the state with stateMutex locked, so no change is missed
+static void notifyStateChanged(BTA_StreamLibInst *inst) {
+    BTAlockMutex(inst->stateMutex);
+    BTAbroadcastCondition(inst->condStateChanged);
+    BTAunlockMutex(inst->stateMutex);
+}
+
+
+// Waits until the stream thread handled a seek, or no buffer thread is running anymore (stop == 1)
+static void waitForStreamThread(BTA_StreamLibInst *inst, uint8_t stop) {
+    BTAlockMutex(inst->stateMutex);
+    while (!inst->closing && (stop ? inst->bufferThread != 0 : inst->frameIndexToSeek >= 0)) {
+        BTAwaitConditionTimed(inst->condStateChanged, inst->stateMutex, 0);
+    }
+    BTAunlockMutex(inst->stateMutex);
+}
+
+
 static BTA_Status freeFrameAndIndex(FrameAndIndex **frameAndIndex) {
     if (!frameAndIndex) {
         return BTA_StatusInvalidParameter;
@@ -916,11 +975,11 @@ BTA_Status BTASTREAMsetLibParam(BTA_WrapperInst *winst, BTA_LibParam libParam, f
         else {
             // change of playback direction
             inst->autoPlaybackSpeed = 0;
-            while (inst->bufferThread) {
-                BTAmsleep(5);
-            }
+            notifyStateChanged(inst);
+            waitForStreamThread(inst, 1);
             inst->autoPlaybackSpeed = value;
         }
+        notifyStateChanged(inst);
         return BTA_StatusOk;
     case BTA_LibParamStreamPos:
         if (inst->frameIndexToSeek >= 0) {
@@ -929,9 +988,8 @@ BTA_Status BTASTREAMsetLibParam(BTA_WrapperInst *winst, BTA_LibParam libParam, f
         }
         inst->autoPlaybackSpeed = 0;
         inst->frameIndexToSeek = (int32_t)value;
-        while (inst->frameIndexToSeek >= 0) {
-            BTAmsleep(5);
-        }
+        notifyStateChanged(inst);
+        waitForStreamThread(inst, 0);
         return BTA_StatusOk;
     case BTA_LibParamStreamPosIncrement: {
         if (inst->frameIndexToSeek >= 0) {
@@ -942,9 +1000,8 @@ BTA_Status BTASTREAMsetLibParam(BTA_WrapperInst *winst, BTA_LibParam libParam, f
         int32_t frameIndexToSeek = (int32_t)inst->frameIndex + (int32_t)value;
         if (frameIndexToSeek < 0) frameIndexToSeek = 0;
         inst->frameIndexToSeek = frameIndexToSeek;
-        while (inst->frameIndexToSeek >= 0) {
-            BTAmsleep(5);
-        }
+        notifyStateChanged(inst);
+        waitForStreamThread(inst, 0);
         return BTA_StatusOk;
     }
     default:
@@ -33,6 +33,8 @@ typedef struct BTA_StreamLibInst {
 
     void *parseThread;
     uint8_t closing;
+    void *stateMutex;           ///< For the waits on condStateChanged
+    void *condStateChanged;     ///< Broadcast after closing, autoPlaybackSpeed, frameIndexToSeek or bufferThread changed
 
     BVQ_QueueHandle frameAndIndexQueueInst;
 
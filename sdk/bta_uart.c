@@ -367,7 +367,7 @@ static BTA_Status readFrame(BTA_WrapperInst *winst, uint8_t **dataPtr, uint32_t
 
 
 static BTA_Status parseFrame(BTA_WrapperInst *winst, uint8_t *data, uint32_t dataLen, BTA_Frame **framePtr) {
-    BTA_Frame *frame = (BTA_Frame *)malloc(sizeof(BTA_Frame));
+    BTA_Frame *frame = (BTA_Frame *)calloc(1, sizeof(BTA_Frame));
     if (!frame) {
         return BTA_StatusOutOfMemory;
     }
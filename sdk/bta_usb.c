@@ -26,6 +26,8 @@
 static void *readFramesRunFunction(void *handle);
 static void *connectionMonitorRunFunction(void *handle);
 static BTA_Status sendKeepAliveMsg(BTA_WrapperInst *inst);
+static void waitForStateChange(BTA_UsbLibInst *inst, uint32_t msecs);
+static void notifyStateChanged(BTA_UsbLibInst *inst);
 
 static BTA_Status readRegister(BTA_WrapperInst *winst, uint32_t address, uint32_t *data, uint32_t *registerCount, uint32_t timeout);
 
@@ -87,6 +89,15 @@ BTA_Status BTAUSBopen(BTA_Config *config, BTA_WrapperInst *winst) {
         BTAUSBclose(winst);
         return status;
     }
+    status = BTAinitMutex(&inst->stateMutex);
+    if (status == BTA_StatusOk) {
+        status = BTAinitCondition(&inst->condStateChanged);
+    }
+    if (status != BTA_StatusOk) {
+        BTAinfoEventHelper(winst->infoEventInst, VERBOSE_CRITICAL, status, "BTAopen USB: cannot init stateMutex or condStateChanged");
+        BTAUSBclose(winst);
+        return status;
+    }
 
     // Start connection monitor thread
     status = BTAcreateThread(&(inst->connectionMonitorThread), &connectionMonitorRunFunction, (void *)winst);
@@ -128,7 +139,15 @@ BTA_Status BTAUSBclose(BTA_WrapperInst *winst) {
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusInvalidParameter, "BTAclose USB: inst missing!");
         return BTA_StatusInvalidParameter;
     }
-    inst->closing = 1;
+    if (inst->stateMutex) {
+        BTAlockMutex(inst->stateMutex);
+        inst->closing = 1;
+        BTAunlockMutex(inst->stateMutex);
+        notifyStateChanged(inst);
+    }
+    else {
+        inst->closing = 1;
+    }
 
     BTA_Status status;
     status = BTAjoinThread(inst->readFramesThread);
@@ -149,6 +168,12 @@ BTA_Status BTAUSBclose(BTA_WrapperInst *winst) {
     if (status != BTA_StatusOk) {
         BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, status, "BTAclose USB: Failed to close handleMutex");
     }
+    if (inst->condStateChanged) {
+        BTAcloseCondition(inst->condStateChanged);
+    }
+    if (inst->stateMutex) {
+        BTAcloseMutex(inst->stateMutex);
+    }
     free(inst->pon);
     free(inst);
     winst->inst = 0;
@@ -156,6 +181,24 @@ BTA_Status BTAUSBclose(BTA_WrapperInst *winst) {
 }
 
 
+// Waits up to msecs, but returns as soon as BTAUSBclose is called or a connection is established. Returning early now and then is harmless,
+// the callers are back-off waits that check their state again anyway
+static void waitForStateChange(BTA_UsbLibInst *inst, uint32_t msecs) {
+    BTAlockMutex(inst->stateMutex);
+    if (!inst->closing) {
+        BTAwaitConditionTimed(inst->condStateChanged, inst->stateMutex, (int)msecs);
+    }
+    BTAunlockMutex(inst->stateMutex);
+}
+
+
+static void notifyStateChanged(BTA_UsbLibInst *inst) {
+    BTAlockMutex(inst->stateMutex);
+    BTAbroadcastCondition(inst->condStateChanged);
+    BTAunlockMutex(inst->stateMutex);
+}
+
+
 static void *connectionMonitorRunFunction(void *handle) {
     BTA_WrapperInst *winst = (BTA_WrapperInst *)handle;
     if (!winst) {
@@ -290,6 +333,7 @@ static void *connectionMonitorRunFunction(void *handle) {
                                             inst->usbHandle = usbHandle;
                                             inst->interfaceNumber = interfaceNumber;
                                             BTAunlockMutex(inst->dataMutex);
+                                            notifyStateChanged(inst);
                                             BTAinfoEventHelper(winst->infoEventInst, VERBOSE_INFO, BTA_StatusInformation, "USB: Connection established");
                                             break;
                                         }
@@ -353,7 +397,7 @@ static void *connectionMonitorRunFunction(void *handle) {
             firstCycle = 0;
         }
 
-        BTAmsleep(250);
+        waitForStateChange(inst, 250);
     }
     if (firstCycle) {
         BTApostSemaphore(inst->semConnectionEstablishment);
@@ -691,7 +735,8 @@ static void *readFramesRunFunction(void *handle) {
                     timeLastErrorMsg = BTAgetTickCount64();
                     BTAinfoEventHelper(winst->infoEventInst, VERBOSE_ERROR, BTA_StatusWarning, "ReadFramesThread: no connection");
                 }
-                BTAmsleep(2000);
+                // The connection monitor wakes us when it reconnected
+                waitForStateChange(inst, 2000);
                 continue;
             }
             int bytesRead = 0;
@@ -704,8 +749,8 @@ static void *readFramesRunFunction(void *handle) {
                 }
                 if (err != LIBUSB_ERROR_TIMEOUT) {
                     winst->lpDataStreamReadFailedCount += 1;
-                    // dataReceiveTimeout does not always apply, so wait manually before retrying
-                    BTAmsleep(2000);
+                    // dataReceiveTimeout does not always apply, so wait manually before retrying (unless closing or reconnected)
+                    waitForStateChange(inst, 2000);
                 }
                 continue;
             }
@@ -42,6 +42,8 @@ typedef struct BTA_UsbLibInst {
     void *dataMutex;
     void *controlMutex;
     void *semConnectionEstablishment;
+    void *stateMutex;                   ///< Guards closing for the waits on condStateChanged
+    void *condStateChanged;             ///< Broadcast by BTAUSBclose and when a connection was established, ends the threads' back-off waits
 
     void *readFramesThread;
     void *connectionMonitorThread;
@@ -0,0 +1,102 @@
+#include <bta.h>
+#include <bta_ext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static int failedCount = 0;
+
+
+#define CHECK(condition)                                                        \
+    if (!(condition)) {                                                         \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);   \
+        failedCount++;                                                          \
+    }
+
+
+static BTA_Channel channel(BTA_DataFormat dataFormat, void *data, uint32_t dataLen, uint16_t xRes) {
+    BTA_Channel ch;
+    memset(&ch, 0, sizeof(ch));
+    ch.dataFormat = dataFormat;
+    ch.data = (uint8_t *)data;
+    ch.dataLen = dataLen;
+    ch.xRes = xRes;
+    ch.yRes = 1;
+    return ch;
+}
+
+
+// An integer dst combined with a float src must not have the src rounded before the operation
+static void checkIntegerByFloat() {
+    uint16_t gained[4] = { 100, 100, 3, 65000 };
+    float gains[4] = { 0.3f, 0.5f, 0.5f, 2.0f };
+    BTA_Channel dst = channel(BTA_DataFormatUInt16, gained, sizeof(gained), 4);
+    BTA_Channel src = channel(BTA_DataFormatFloat32, gains, sizeof(gains), 4);
+    CHECK(BTAmultiplyChannelInPlace(&dst, &src) == BTA_StatusOk);
+    CHECK(gained[0] == 30);
+    CHECK(gained[1] == 50);
+    CHECK(gained[2] == 2);
+    CHECK(gained[3] == UINT16_MAX);
+
+    int16_t quotients[3] = { 10, -10, 7 };
+    double divisors[3] = { 4, 0.5, 0 };
+    dst = channel(BTA_DataFormatSInt16, quotients, sizeof(quotients), 3);
+    src = channel(BTA_DataFormatFloat64, divisors, sizeof(divisors), 3);
+    CHECK(BTAdivideChannelInPlace(&dst, &src) == BTA_StatusOk);
+    // Truncated like integer division
+    CHECK(quotients[0] == 2);
+    CHECK(quotients[1] == -20);
+    CHECK(quotients[2] == 0);
+
+    uint8_t sums[2] = { 200, 10 };
+    float addends[2] = { 100.4f, -20.6f };
+    dst = channel(BTA_DataFormatUInt8, sums, sizeof(sums), 2);
+    src = channel(BTA_DataFormatFloat32, addends, sizeof(addends), 2);
+    CHECK(BTAaddChannelInPlace(&dst, &src) == BTA_StatusOk);
+    CHECK(sums[0] == UINT8_MAX);
+    CHECK(sums[1] == 0);
+}
+
+
+static void checkIntegerByInteger() {
+    uint16_t quotients[2] = { 7, 7 };
+    uint8_t divisors[2] = { 2, 0 };
+    BTA_Channel dst = channel(BTA_DataFormatUInt16, quotients, sizeof(quotients), 2);
+    BTA_Channel src = channel(BTA_DataFormatUInt8, divisors, sizeof(divisors), 2);
+    CHECK(BTAdivideChannelInPlace(&dst, &src) == BTA_StatusOk);
+    CHECK(quotients[0] == 3);
+    CHECK(quotients[1] == 0);
+
+    // Saturated, not wrapped around or truncated to the lower bits
+    int32_t sums[2] = { INT32_MAX - 1, -70000 };
+    uint16_t addends[2] = { 1000, 5 };
+    dst = channel(BTA_DataFormatSInt32, sums, sizeof(sums), 2);
+    src = channel(BTA_DataFormatUInt16, addends, sizeof(addends), 2);
+    CHECK(BTAaddChannelInPlace(&dst, &src) == BTA_StatusOk);
+    CHECK(sums[0] == INT32_MAX);
+    CHECK(sums[1] == -69995);
+
+    BTA_Channel *converted = (BTA_Channel *)calloc(1, sizeof(BTA_Channel));
+    int32_t *values = (int32_t *)malloc(3 * sizeof(int32_t));
+    values[0] = 70000;
+    values[1] = -1;
+    values[2] = 1234;
+    *converted = channel(BTA_DataFormatSInt32, values, 3 * sizeof(int32_t), 3);
+    CHECK(BTAchangeDataFormat(converted, BTA_DataFormatUInt16) == BTA_StatusOk);
+    CHECK(((uint16_t *)converted->data)[0] == UINT16_MAX);
+    CHECK(((uint16_t *)converted->data)[1] == 0);
+    CHECK(((uint16_t *)converted->data)[2] == 1234);
+    BTAfreeChannel(&converted);
+}
+
+
+int main() {
+    checkIntegerByFloat();
+    checkIntegerByInteger();
+    if (failedCount) {
+        printf("%d checks failed\n", failedCount);
+        return 1;
+    }
+    return 0;
+}
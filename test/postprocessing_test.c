@@ -0,0 +1,175 @@
+#include <bta.h>
+#include <bta_ext.h>
+#include <calcXYZ.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+
+static int failedCount = 0;
+
+
+#define CHECK(condition)                                                        \
+    if (!(condition)) {                                                         \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);   \
+        failedCount++;                                                          \
+    }
+
+
+#define SPEED_OF_LIGHT_MM   299792458000.0
+#define PX_COUNT            4
+
+
+static const uint32_t distances[PX_COUNT] = { 70000, 1000, 0, 40000 };
+
+
+// A distance channel as measured with modulationFrequency: distances wrapped to its unambiguous range, invalid pixels keep their code
+static void insertWrapped(BTA_Frame *frame, uint32_t modulationFrequency, uint8_t sequenceCounter) {
+    double range = SPEED_OF_LIGHT_MM / (2.0 * modulationFrequency);
+    uint16_t *data = (uint16_t *)malloc(PX_COUNT * sizeof(uint16_t));
+    for (int xy = 0; xy < PX_COUNT; xy++) {
+        data[xy] = distances[xy] < 10 ? (uint16_t)distances[xy] : (uint16_t)(fmod(distances[xy], range) + 0.5);
+    }
+    CHECK(BTAinsertChannelIntoFrame2(frame, BTA_ChannelIdDistance, PX_COUNT, 1, BTA_DataFormatUInt16, BTA_UnitMillimeter, 0, modulationFrequency, (uint8_t *)data, PX_COUNT * sizeof(uint16_t),
+                                     0, 0, 0, 0, sequenceCounter, 0) == BTA_StatusOk);
+}
+
+
+static BTA_Channel *findChannel(BTA_Frame *frame, BTA_ChannelId id) {
+    for (int chInd = 0; chInd < frame->channelsLen; chInd++) {
+        if (frame->channels[chInd]->id == id) {
+            return frame->channels[chInd];
+        }
+    }
+    return 0;
+}
+
+
+// Pixels looking straight ahead: z equals the distance
+static BTA_CalcXYZInst *initCalcXYZ() {
+    BTA_CalcXYZInst *inst;
+    CHECK(BTAcalcXYZInit(&inst, 0) == BTA_StatusOk);
+    BTA_LensVectors *lensVectors = (BTA_LensVectors *)calloc(1, sizeof(BTA_LensVectors));
+    lensVectors->xRes = PX_COUNT;
+    lensVectors->yRes = 1;
+    lensVectors->vectorsX = (float *)calloc(PX_COUNT, sizeof(float));
+    lensVectors->vectorsY = (float *)calloc(PX_COUNT, sizeof(float));
+    lensVectors->vectorsZ = (float *)malloc(PX_COUNT * sizeof(float));
+    for (int xy = 0; xy < PX_COUNT; xy++) {
+        lensVectors->vectorsZ[xy] = 1;
+    }
+    inst->lensVectorsList = (BTA_LensVectors **)malloc(sizeof(BTA_LensVectors *));
+    inst->lensVectorsList[0] = lensVectors;
+    inst->lensVectorsListLen = 1;
+    return inst;
+}
+
+
+// 20 and 18 MHz combine to 75 m, beyond UInt16 millimeters. The UInt32 result must be accepted by calcXYZ
+static void checkUnwrappingWithCalcXYZ(uint8_t float32Output) {
+    BTA_Frame *frame = (BTA_Frame *)calloc(1, sizeof(BTA_Frame));
+    insertWrapped(frame, 20000000, 0);
+    insertWrapped(frame, 18000000, 1);
+    CHECK(BTAunwrapDistances(frame) == BTA_StatusOk);
+    CHECK(frame->channelsLen == 1);
+    BTA_Channel *distance = findChannel(frame, BTA_ChannelIdDistance);
+    CHECK(distance && distance->dataFormat == BTA_DataFormatUInt32 && distance->modulationFrequency == 2000000);
+    if (!distance || distance->dataFormat != BTA_DataFormatUInt32) {
+        BTAfreeFrame(&frame);
+        return;
+    }
+    for (int xy = 0; xy < PX_COUNT; xy++) {
+        uint32_t d = ((uint32_t *)distance->data)[xy];
+        CHECK(distances[xy] < 10 ? d == distances[xy] : (d + 2 >= distances[xy] && d <= distances[xy] + 2));
+    }
+
+    BTA_CalcXYZInst *inst = initCalcXYZ();
+    CHECK(BTAcalcXYZApply(inst, 0, frame, 0, float32Output, 0) == BTA_StatusOk);
+    BTA_Channel *z = findChannel(frame, BTA_ChannelIdZ);
+    CHECK(z != 0);
+    if (z && float32Output) {
+        float *dataZ = (float *)z->data;
+        CHECK(z->dataFormat == BTA_DataFormatFloat32);
+        CHECK(fabsf(dataZ[0] - 70000) <= 2);
+        CHECK(fabsf(dataZ[1] - 1000) <= 2);
+        CHECK(isnan(dataZ[2]));
+        CHECK(fabsf(dataZ[3] - 40000) <= 2);
+    }
+    else if (z) {
+        int16_t *dataZ = (int16_t *)z->data;
+        CHECK(z->dataFormat == BTA_DataFormatSInt16);
+        CHECK(dataZ[0] == INT16_MAX);
+        CHECK(dataZ[1] >= 998 && dataZ[1] <= 1002);
+        CHECK(dataZ[2] == INT16_MIN);
+        CHECK(dataZ[3] == INT16_MAX);
+    }
+    BTAcalcXYZClose(&inst);
+    BTAfreeFrame(&frame);
+}
+
+
+// The offset is in millimeters, also for Float32 distances in meters
+static void checkCalcXYZOffset(uint8_t float32Output) {
+    BTA_Frame *frame = (BTA_Frame *)calloc(1, sizeof(BTA_Frame));
+    float *data = (float *)malloc(PX_COUNT * sizeof(float));
+    for (int xy = 0; xy < PX_COUNT; xy++) {
+        data[xy] = 1.5f;
+    }
+    data[2] = NAN;
+    CHECK(BTAinsertChannelIntoFrame2(frame, BTA_ChannelIdDistance, PX_COUNT, 1, BTA_DataFormatFloat32, BTA_UnitMeter, 0, 0, (uint8_t *)data, PX_COUNT * sizeof(float),
+                                     0, 0, 0, 0, 0, 0) == BTA_StatusOk);
+    BTA_CalcXYZInst *inst = initCalcXYZ();
+    CHECK(BTAcalcXYZApply(inst, 0, frame, 100, float32Output, 0) == BTA_StatusOk);
+    BTA_Channel *z = findChannel(frame, BTA_ChannelIdZ);
+    CHECK(z != 0);
+    if (z && float32Output) {
+        float *dataZ = (float *)z->data;
+        CHECK(z->unit == BTA_UnitMeter);
+        CHECK(fabsf(dataZ[0] - 1.6f) < 0.0001f);
+        CHECK(isnan(dataZ[2]));
+    }
+    else if (z) {
+        int16_t *dataZ = (int16_t *)z->data;
+        CHECK(z->unit == BTA_UnitMillimeter);
+        CHECK(dataZ[0] == 1600);
+        CHECK(dataZ[2] == INT16_MIN);
+    }
+    BTAcalcXYZClose(&inst);
+    BTAfreeFrame(&frame);
+}
+
+
+// A retained frame is read by other holders, so it must not get channels added or removed
+static void checkSharedFrameIsReadOnly() {
+    BTA_Frame *frame = (BTA_Frame *)calloc(1, sizeof(BTA_Frame));
+    insertWrapped(frame, 20000000, 0);
+    insertWrapped(frame, 18000000, 1);
+    BTA_Frame *frameShared = frame;
+    CHECK(BTAretainFrame(frameShared) == BTA_StatusOk);
+    uint16_t *data = (uint16_t *)calloc(PX_COUNT, sizeof(uint16_t));
+    CHECK(BTAinsertChannelIntoFrame2(frame, BTA_ChannelIdAmplitude, PX_COUNT, 1, BTA_DataFormatUInt16, BTA_UnitUnitLess, 0, 0, (uint8_t *)data, PX_COUNT * sizeof(uint16_t), 0, 0, 0, 0, 0, 0) == BTA_StatusIllegalOperation);
+    free(data);
+    CHECK(BTAremoveChannelFromFrame(frame, frame->channels[1]) == BTA_StatusIllegalOperation);
+    CHECK(BTAunwrapDistances(frame) == BTA_StatusIllegalOperation);
+    CHECK(frame->channelsLen == 2);
+    BTAfreeFrame(&frameShared);
+    // Back to one holder
+    CHECK(BTAunwrapDistances(frame) == BTA_StatusOk);
+    CHECK(frame->channelsLen == 1);
+    BTAfreeFrame(&frame);
+}
+
+
+int main() {
+    checkSharedFrameIsReadOnly();
+    checkCalcXYZOffset(0);
+    checkCalcXYZOffset(1);
+    checkUnwrappingWithCalcXYZ(0);
+    checkUnwrappingWithCalcXYZ(1);
+    if (failedCount) {
+        printf("%d checks failed\n", failedCount);
+        return 1;
+    }
+    return 0;
+}